@@ -0,0 +1,469 @@
+/*
+ * Run cblogcgi() in-process on synthetic requests, the output being
+ * counted and discarded, over databases of 1k, 10k and 100k posts (or -n
+ * posts only). For the root, tag, date archive, post, feed, search and
+ * suggest routes and for posts which do not exist it prints the time, the
+ * allocations and the database lookups per request, so that a listing
+ * page starting to scale with the number of posts shows.
+ *
+ * Templates are read from samples/templates unless -t is given.
+ *
+ * usage: bench-cgi [-S] [-b backend] [-n posts] [-r requests] [-t templates]
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cgi/cblog_cgi.h"
+#include "cblog_related.h"
+#include "cblog_archives.h"
+#include "cblog_search.h"
+#include "cblog_bloom.h"
+
+#define NTAGS	50
+
+struct route {
+	const char	*name;
+	void		(*uri)(char *, size_t, int, int, time_t);
+};
+
+/* environment of the request being run, read back by ClearSilver */
+static const char	*env_keys[] = {
+	"REQUEST_METHOD", "REQUEST_URI", "QUERY_STRING", "SCRIPT_NAME",
+	"SERVER_NAME", "HTTP_HOST", "REMOTE_ADDR", NULL
+};
+static char			env_uri[256];
+static char			*env_query;
+
+static size_t		out_bytes;
+
+static unsigned long	nallocs;
+static unsigned long long	alloc_bytes;
+
+/*
+ * malloc, calloc and realloc are interposed to count the allocations of
+ * the requests, ClearSilver's included, unless cblog.cgi is built with
+ * ALLOC_STATS which does it already. dlsym may allocate before the real
+ * functions are known, that memory comes from a static pool.
+ */
+#ifdef ALLOC_STATS
+static void
+counting_start(void)
+{
+	alloc_begin();
+}
+
+static void
+counting_stop(void)
+{
+	struct alloc_stats	stats;
+
+	alloc_end(&stats);
+	nallocs = stats.count;
+	alloc_bytes = stats.bytes;
+}
+#else
+static bool			counting;
+static void			*(*real_malloc)(size_t);
+static void			*(*real_calloc)(size_t, size_t);
+static void			*(*real_realloc)(void *, size_t);
+static void			(*real_free)(void *);
+static char			pool[4096];
+static size_t		pool_used;
+
+static void *
+pool_alloc(size_t size)
+{
+	void	*p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (pool_used + size > sizeof(pool))
+		return NULL;
+	p = pool + pool_used;
+	pool_used += size;
+
+	return p;
+}
+
+static void
+alloc_init(void)
+{
+	static bool	initializing;
+
+	if (initializing)
+		return;
+	initializing = true;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	initializing = false;
+}
+
+void *
+malloc(size_t size)
+{
+	if (real_malloc == NULL)
+		alloc_init();
+	if (real_malloc == NULL)
+		return pool_alloc(size);
+	if (counting) {
+		nallocs++;
+		alloc_bytes += size;
+	}
+	return real_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (real_calloc == NULL)
+		alloc_init();
+	if (real_calloc == NULL)
+		return pool_alloc(n * size);	/* static, already zeroed */
+	if (counting) {
+		nallocs++;
+		alloc_bytes += n * size;
+	}
+	return real_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	if (real_realloc == NULL)
+		alloc_init();
+	if (counting) {
+		nallocs++;
+		alloc_bytes += size;
+	}
+	return real_realloc(p, size);
+}
+
+void
+free(void *p)
+{
+	if ((char *)p >= pool && (char *)p < pool + sizeof(pool))
+		return;
+	if (real_free == NULL)
+		alloc_init();
+	real_free(p);
+}
+
+static void
+counting_start(void)
+{
+	nallocs = 0;
+	alloc_bytes = 0;
+	counting = true;
+}
+
+static void
+counting_stop(void)
+{
+	counting = false;
+}
+#endif	/* def ALLOC_STATS */
+
+static int
+read_cb(void *data, char *buf, int size)
+{
+	return 0;
+}
+
+static int
+writef_cb(void *data, const char *fmt, va_list ap)
+{
+	int	n;
+
+	if ((n = vsnprintf(NULL, 0, fmt, ap)) > 0)
+		out_bytes += n;
+	return 0;
+}
+
+static int
+write_cb(void *data, const char *buf, int size)
+{
+	out_bytes += size;
+	return size;
+}
+
+static const char *
+env_value(const char *key)
+{
+	if (strcmp(key, "REQUEST_METHOD") == 0)
+		return "GET";
+	if (strcmp(key, "REQUEST_URI") == 0)
+		return env_uri;
+	if (strcmp(key, "QUERY_STRING") == 0)
+		return env_query != NULL ? env_query + 1 : "";
+	if (strcmp(key, "SCRIPT_NAME") == 0)
+		return "/";
+	if (strcmp(key, "SERVER_NAME") == 0 || strcmp(key, "HTTP_HOST") == 0)
+		return "localhost";
+	if (strcmp(key, "REMOTE_ADDR") == 0)
+		return "127.0.0.1";
+
+	return NULL;
+}
+
+static char *
+getenv_cb(void *data, const char *key)
+{
+	const char	*value = env_value(key);
+
+	return value != NULL ? strdup(value) : NULL;
+}
+
+static int
+putenv_cb(void *data, const char *key, const char *value)
+{
+	return 0;
+}
+
+static int
+iterenv_cb(void *data, int i, char **key, char **value)
+{
+	*key = NULL;
+	*value = NULL;
+	if (i < 0 || i >= (int)(sizeof(env_keys) / sizeof(env_keys[0])) - 1)
+		return 0;
+	*key = strdup(env_keys[i]);
+	*value = strdup(env_value(env_keys[i]));
+
+	return 0;
+}
+
+static void
+uri_root(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, i % 4 ? "/?page=%d" : "/", i % 4 + 1);
+}
+
+static void
+uri_tag(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, "/tag/tag%d", i % NTAGS);
+}
+
+static void
+uri_date(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	struct tm	tm;
+	time_t		t = base - (time_t)(i % nposts) * 86400;
+
+	localtime_r(&t, &tm);
+	snprintf(buf, len, "/%04d/%02d", tm.tm_year + 1900, tm.tm_mon + 1);
+}
+
+static void
+uri_post(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, "/post/post-%06d", (i * 7919) % nposts);
+}
+
+static void
+uri_feed(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, "/index.atom");
+}
+
+static void
+uri_search(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, "/search?q=synthetic+tag%d", i % NTAGS);
+}
+
+static void
+uri_suggest(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, "/suggest?q=title+of+the+synthetic+post+number+%d", i % 100);
+}
+
+static void
+uri_missing(char *buf, size_t len, int i, int nposts, time_t base)
+{
+	snprintf(buf, len, i % 2 ? "/post/wp-login-%d.php" : "/tag/probe%d", i);
+}
+
+static const struct route	routes[] = {
+	{ "root", uri_root },
+	{ "tag", uri_tag },
+	{ "date", uri_date },
+	{ "post", uri_post },
+	{ "feed", uri_feed },
+	{ "search", uri_search },
+	{ "suggest", uri_suggest },
+	{ "missing", uri_missing },
+};
+
+/* posts about one day apart with 3 of NTAGS tags, published like cblogctl */
+static void
+make_db(const char *path, int nposts, time_t base)
+{
+	struct store		st;
+	struct store_batch	batch;
+	struct store_overlay	ov;
+	char				name[64], val[256];
+	int					i;
+
+	if (store_create(&store_cdb, path, false) != 0 ||
+	    store_open(&st, &store_cdb, path) != 0)
+		errx(1, "unable to create %s", path);
+	store_batch_init(&batch);
+	for (i = 0; i < nposts; i++) {
+		snprintf(name, sizeof(name), "post-%06d", i);
+		snprintf(val, sizeof(val), "%lld", (long long)(base - i * 86400 - i % 3600));
+		store_batch_put(&batch, name, "ctime", val);
+		snprintf(val, sizeof(val), "Title of the synthetic post number %d", i);
+		store_batch_put(&batch, name, "title", val);
+		snprintf(val, sizeof(val), "tag%d, tag%d, tag%d", i % NTAGS,
+		    (i * 7 + 1) % NTAGS, (i * 13 + 2) % NTAGS);
+		store_batch_put(&batch, name, "tags", val);
+		store_batch_put(&batch, name, "source", "A *short* synthetic body.");
+		store_batch_put(&batch, name, "html", "<p>A <em>short</em> synthetic body.</p>");
+	}
+	if (store_overlay(&ov, &st, &batch) < 0 ||
+	    related_update(&st, &ov, &batch) < 0 ||
+	    archives_update(&st, &ov, &batch) < 0 ||
+	    search_update(&st, &ov, &batch) < 0 ||
+	    bloom_update(&st, &ov, &batch) < 0 || store_commit(&st, &batch) != 0)
+		errx(1, "unable to write %s", path);
+	store_overlay_free(&ov);
+	store_batch_free(&batch);
+	store_close(&st);
+}
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void
+run_suite(HDF *conf, int nposts, int nrequests, time_t base)
+{
+	struct store_stats	stats;
+	struct timespec		t0, t1;
+	unsigned long		probes;
+	size_t				r;
+	int					j;
+
+	for (r = 0; r < sizeof(routes) / sizeof(routes[0]); r++) {
+		/* one request untimed, for the caches filled on first use */
+		routes[r].uri(env_uri, sizeof(env_uri), 0, nposts, base);
+		env_query = strchr(env_uri, '?');
+		cblogcgi(conf);
+
+		out_bytes = 0;
+		stats = store_stats;
+		counting_start();
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (j = 0; j < nrequests; j++) {
+			routes[r].uri(env_uri, sizeof(env_uri), j, nposts, base);
+			env_query = strchr(env_uri, '?');
+			cblogcgi(conf);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		counting_stop();
+
+		probes = store_stats.finds - stats.finds + store_stats.gets - stats.gets +
+		    store_stats.metas - stats.metas;
+		printf("%-7d %-5s %12.0f %10.1f %12.0f %10.1f %10.1f %10.1f %10.0f\n",
+		    nposts, routes[r].name, elapsed_ns(&t0, &t1) / nrequests,
+		    (double)nallocs / nrequests, (double)alloc_bytes / nrequests,
+		    (double)probes / nrequests,
+		    (double)(store_stats.scans - stats.scans) / nrequests,
+		    (double)(store_stats.scanned - stats.scanned) / nrequests,
+		    (double)out_bytes / nrequests);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	HDF			*conf;
+	const char	*backend = "cdb", *templates = "samples/templates";
+	char		dir[] = "/tmp/cblog-bench.XXXXXX";
+	char		path[MAXPATHLEN], comments[MAXPATHLEN];
+	time_t		base = time(NULL) - 3600;
+	bool		snapshot = true;
+	int			sizes[] = { 1000, 10000, 100000 }, nsizes = 3;
+	int			ch, i, nrequests = 200;
+
+	while ((ch = getopt(argc, argv, "Sb:n:r:t:")) != -1) {
+		switch (ch) {
+		case 'S':
+			snapshot = false;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'n':
+			sizes[0] = atoi(optarg);
+			nsizes = 1;
+			break;
+		case 'r':
+			nrequests = atoi(optarg);
+			break;
+		case 't':
+			templates = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-S] [-b backend] [-n posts] "
+			    "[-r requests] [-t templates]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sizes[0] <= 0 || nrequests <= 0)
+		errx(1, "posts and requests must be positive");
+	if (store_backend(backend) == NULL)
+		errx(1, "unknown backend: %s", backend);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/cblog.cdb", dir);
+	snprintf(comments, sizeof(comments), "%s/comments", dir);
+
+	hdf_init(&conf);
+	hdf_set_value(conf, "title", "Benchmark");
+	hdf_set_value(conf, "url", "http://localhost");
+	hdf_set_value(conf, "dateformat", "%d/%m/%Y");
+	hdf_set_value(conf, "hdf.loadpaths.tpl", templates);
+	hdf_set_value(conf, "db_path", path);
+	hdf_set_value(conf, "db_backend", backend);
+	hdf_set_value(conf, "comments_path", comments);
+	hdf_set_value(conf, "theme", "default.cs");
+	hdf_set_value(conf, "posts_per_pages", "10");
+	hdf_set_value(conf, "snapshot", snapshot ? "1" : "0");
+
+	cgiwrap_init_emu(NULL, read_cb, writef_cb, write_cb, getenv_cb,
+	    putenv_cb, iterenv_cb);
+
+	printf("backend: %s, snapshot: %s, %d requests per route\n", backend,
+	    snapshot ? "yes" : "no", nrequests);
+	printf("%-7s %-5s %12s %10s %12s %10s %10s %10s %10s\n", "posts", "route",
+	    "ns/req", "allocs", "alloc bytes", "probes", "scans", "scanned",
+	    "out bytes");
+	for (i = 0; i < nsizes; i++) {
+		make_db(path, sizes[i], base);
+		sites_init(conf);
+		run_suite(conf, sizes[i], nrequests, base);
+		fflush(stdout);
+	}
+	logger_flush();
+
+	unlink(path);
+	rmdir(dir);
+	hdf_destroy(&conf);
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Time the cblogctl commands on databases of 1k, 10k and 100k synthetic
+ * posts (or -n posts only), flat or sharded with -s. Each command is run
+ * -r times in-process, as cli/main.c would run it, and one line of
+ * key=value fields is printed per command:
+ *
+ *   layout=flat posts=1000 op=add runs=10 ns=... bytes=... writes=...
+ *   fsyncs=... renames=...
+ *
+ * with the time, the bytes written by write(2) and the write, fsync and
+ * rename calls per run. add creates new posts from markdown files, set
+ * changes a title, del removes the added posts, and list, info and get
+ * read the database, their output being discarded.
+ *
+ * usage: bench-cli [-s] [-n posts] [-r runs]
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../cli/cblogctl.h"
+#include "cblog_store.h"
+#include "cblog_related.h"
+#include "cblog_archives.h"
+#include "cblog_search.h"
+#include "cblog_bloom.h"
+
+#define NTAGS	50
+
+struct io_stats {
+	unsigned long		writes;
+	unsigned long long	bytes;
+	unsigned long		fsyncs;
+	unsigned long		renames;
+};
+
+static struct io_stats	io;
+static bool				counting;
+
+static const char	*words[] = {
+	"cblog", "database", "post", "static", "fastcgi", "template", "shard",
+	"index", "archive", "feed", "comment", "render", "markdown", "tag",
+	"snapshot", "cache", "request", "publish", "writer", "reader"
+};
+
+/* write(2), fsync(2) and rename(2) are interposed to count the file writes */
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+	static ssize_t	(*real_write)(int, const void *, size_t);
+	ssize_t			n;
+
+	if (real_write == NULL)
+		real_write = dlsym(RTLD_NEXT, "write");
+	n = real_write(fd, buf, len);
+	if (counting && fd > 2 && n > 0) {
+		io.writes++;
+		io.bytes += n;
+	}
+
+	return n;
+}
+
+int
+fsync(int fd)
+{
+	static int	(*real_fsync)(int);
+
+	if (real_fsync == NULL)
+		real_fsync = dlsym(RTLD_NEXT, "fsync");
+	if (counting)
+		io.fsyncs++;
+
+	return real_fsync(fd);
+}
+
+int
+fdatasync(int fd)
+{
+	static int	(*real_fdatasync)(int);
+
+	if (real_fdatasync == NULL)
+		real_fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+	if (counting)
+		io.fsyncs++;
+
+	return real_fdatasync(fd);
+}
+
+int
+rename(const char *from, const char *to)
+{
+	static int	(*real_rename)(const char *, const char *);
+
+	if (real_rename == NULL)
+		real_rename = dlsym(RTLD_NEXT, "rename");
+	if (counting)
+		io.renames++;
+
+	return real_rename(from, to);
+}
+
+/* a few paragraphs of markdown, about 1.5KB */
+static void
+make_body(char *buf, size_t len, int seed)
+{
+	size_t	off = 0;
+	int		i;
+
+	for (i = 0; i < 200 && off + 16 < len; i++) {
+		off += snprintf(buf + off, len - off, "%s%s",
+		    words[(seed * 31 + i * 7) % (sizeof(words) / sizeof(words[0]))],
+		    i % 40 == 39 ? "\n\n" : i % 13 == 5 ? " *emphasis* " : " ");
+	}
+}
+
+/* posts 3 hours apart with 3 of NTAGS tags, published like cblogctl */
+static void
+make_db(const char *path, bool sharded, int nposts, time_t base)
+{
+	struct store		st;
+	struct store_batch	batch;
+	struct store_overlay	ov;
+	char				name[64], val[256], body[2048], html[2560];
+	int					i;
+
+	if (store_create(&store_cdb, path, sharded) != 0 ||
+	    store_open(&st, &store_cdb, path) != 0)
+		errx(1, "unable to create %s", path);
+	store_batch_init(&batch);
+	for (i = 0; i < nposts; i++) {
+		snprintf(name, sizeof(name), "post-%06d", i);
+		snprintf(val, sizeof(val), "%lld", (long long)(base - i * 10800));
+		store_batch_put(&batch, name, "ctime", val);
+		snprintf(val, sizeof(val), "Title of the synthetic post number %d", i);
+		store_batch_put(&batch, name, "title", val);
+		snprintf(val, sizeof(val), "tag%d, tag%d, tag%d", i % NTAGS,
+		    (i * 7 + 1) % NTAGS, (i * 13 + 2) % NTAGS);
+		store_batch_put(&batch, name, "tags", val);
+		make_body(body, sizeof(body), i);
+		store_batch_put(&batch, name, "source", body);
+		snprintf(html, sizeof(html), "<p>%s</p>", body);
+		store_batch_put(&batch, name, "html", html);
+	}
+	if (store_overlay(&ov, &st, &batch) < 0 ||
+	    related_update(&st, &ov, &batch) < 0 ||
+	    archives_update(&st, &ov, &batch) < 0 ||
+	    search_update(&st, &ov, &batch) < 0 ||
+	    bloom_update(&st, &ov, &batch) < 0 || store_commit(&st, &batch) != 0)
+		errx(1, "unable to write %s", path);
+	store_overlay_free(&ov);
+	store_batch_free(&batch);
+	store_close(&st);
+}
+
+/* markdown files of the posts added by the add runs */
+static void
+make_posts(int nruns)
+{
+	FILE	*f;
+	char	name[64], body[2048];
+	int		i;
+
+	for (i = 0; i < nruns; i++) {
+		snprintf(name, sizeof(name), "new-%04d", i);
+		if ((f = fopen(name, "w")) == NULL)
+			err(1, "%s", name);
+		make_body(body, sizeof(body), i);
+		fprintf(f, "Title: New post %d\nTags: tag%d, new\n\n%s\n", i,
+		    i % NTAGS, body);
+		fclose(f);
+	}
+}
+
+static void
+run_op(const char *op, int i, int nposts)
+{
+	char	name[64], set[128];
+
+	if (strcmp(op, "add") == 0 || strcmp(op, "del") == 0) {
+		snprintf(name, sizeof(name), "new-%04d", i);
+		if (op[0] == 'a')
+			cblogctl_add(name);
+		else
+			cblogctl_del(name);
+		return;
+	}
+
+	snprintf(name, sizeof(name), "post-%06d", (i * 7919) % nposts);
+	if (strcmp(op, "set") == 0) {
+		snprintf(set, sizeof(set), "title=Title changed by run %d", i);
+		cblogctl_set(name, set);
+	} else if (strcmp(op, "list") == 0) {
+		cblogctl_list();
+	} else if (strcmp(op, "info") == 0) {
+		cblogctl_info(name);
+	} else if (strcmp(op, "get") == 0) {
+		cblogctl_get(name);
+	}
+}
+
+static void
+run_suite(const char *layout, int nposts, int nruns)
+{
+	static const char	*ops[] = { "add", "set", "list", "info", "get", "del" };
+	struct timespec		t0, t1;
+	double				ns;
+	size_t				o;
+	int					i, out, devnull;
+
+	if ((devnull = open("/dev/null", O_WRONLY)) < 0)
+		err(1, "/dev/null");
+
+	for (o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+		fflush(stdout);
+		out = dup(STDOUT_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+
+		memset(&io, 0, sizeof(struct io_stats));
+		counting = true;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < nruns; i++)
+			run_op(ops[o], i, nposts);
+		fflush(stdout);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		counting = false;
+
+		dup2(out, STDOUT_FILENO);
+		close(out);
+
+		ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+		printf("layout=%s posts=%d op=%s runs=%d ns=%.0f bytes=%.0f writes=%.1f "
+		    "fsyncs=%.1f renames=%.1f\n", layout, nposts, ops[o], nruns,
+		    ns / nruns, (double)io.bytes / nruns, (double)io.writes / nruns,
+		    (double)io.fsyncs / nruns, (double)io.renames / nruns);
+		fflush(stdout);
+	}
+	close(devnull);
+}
+
+static void
+clean_dir(const char *dir)
+{
+	DIR				*d;
+	struct dirent	*ent;
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.')
+			unlink(ent->d_name);
+	}
+	closedir(d);
+}
+
+int
+main(int argc, char **argv)
+{
+	char	dir[] = "/tmp/cblog-bench.XXXXXX";
+	time_t	base = time(NULL) - 3600;
+	bool	sharded = false;
+	int		sizes[] = { 1000, 10000, 100000 }, nsizes = 3;
+	int		ch, i, nruns = 10;
+
+	while ((ch = getopt(argc, argv, "sn:r:")) != -1) {
+		switch (ch) {
+		case 's':
+			sharded = true;
+			break;
+		case 'n':
+			sizes[0] = atoi(optarg);
+			nsizes = 1;
+			break;
+		case 'r':
+			nruns = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s] [-n posts] [-r runs]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sizes[0] <= 0 || nruns <= 0 || nruns > 10000)
+		errx(1, "posts must be positive and runs between 1 and 10000");
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	if (chdir(dir) != 0)
+		err(1, "%s", dir);
+	snprintf(cblog_cdb, PATH_MAX, "%s/cblog.cdb", dir);
+
+	for (i = 0; i < nsizes; i++) {
+		make_db(cblog_cdb, sharded, sizes[i], base);
+		make_posts(nruns);
+		run_suite(sharded ? "sharded" : "flat", sizes[i], nruns);
+		clean_dir(dir);
+	}
+	rmdir(dir);
+
+	return 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Replay the requests of an nginx access log (combined format) against a
+ * cblog.cgi listening on a FastCGI socket, as given to cblog.cgi:
+ * unix:/path or tcp:host:port. Requests are sent at their original pace
+ * divided by speed, or as fast as possible with -s 0, over a number of
+ * concurrent connections, then the throughput and the latency percentiles
+ * of each route are printed.
+ *
+ * POST requests are sent without their body, which was not logged, so
+ * replaying comment posts renders the post without adding a comment.
+ * Requests whose URI does not fit in a FastCGI params record of PARAMS_MAX
+ * bytes are skipped and counted, user agents of 1024 bytes or more are
+ * left out. The host given with -H must be shorter than HOST_MAX bytes.
+ *
+ * usage: replay [-c connections] [-s speed] [-n requests] [-H host]
+ *            socket logfile
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <err.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FCGI_VERSION_1			1
+#define FCGI_BEGIN_REQUEST		1
+#define FCGI_END_REQUEST		3
+#define FCGI_PARAMS				4
+#define FCGI_STDIN				5
+#define FCGI_STDOUT				6
+#define FCGI_RESPONDER			1
+
+/* bytes of the params record of a request */
+#define PARAMS_MAX				8192
+/* bytes of -H host, sent twice in the params */
+#define HOST_MAX				256
+
+struct request {
+	double		at;			/* seconds after the first request */
+	char		*method;
+	char		*uri;
+	char		*agent;
+	int			route;
+	double		latency;	/* seconds, -1 on error */
+	int			status;
+};
+
+/* the routes of the cblog.cgi access log, POST requests being comments */
+enum {
+	ROUTE_ROOT,
+	ROUTE_POST,
+	ROUTE_COMMENT,
+	ROUTE_TAG,
+	ROUTE_FEED,
+	ROUTE_YEAR,
+	ROUTE_MONTH,
+	ROUTE_DAY,
+	ROUTE_SITEMAP,
+	ROUTE_ARCHIVES,
+	ROUTE_SEARCH,
+	ROUTE_SUGGEST,
+	ROUTE_OTHER,
+	NROUTES
+};
+
+static const char	*route_names[NROUTES] = {
+	"root", "post", "comment", "tag", "feed", "year", "month", "day",
+	"sitemap", "archives", "search", "suggest", "other"
+};
+
+static struct request	*requests;
+static int				nrequests;
+static int				nskipped;
+static int				next_request;
+static pthread_mutex_t	next_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec	start;
+static double			speed = 1;
+static const char		*socket_url;
+static const char		*host = "localhost";
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: replay [-c connections] [-s speed] [-n requests] "
+	    "[-H host] socket logfile\n");
+	exit(1);
+}
+
+static double
+elapsed(void)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static int
+route_of(const char *method, const char *uri)
+{
+	const char	*query = strchr(uri, '?');
+	int			y, m, d;
+
+	if (strcasecmp(method, "POST") == 0)
+		return ROUTE_COMMENT;
+	if (strncmp(uri, "/index.rss", 10) == 0 || strncmp(uri, "/index.atom", 11) == 0 ||
+	    (query != NULL && strstr(query, "feed=") != NULL))
+		return ROUTE_FEED;
+	if (strncmp(uri, "/post", 5) == 0)
+		return ROUTE_POST;
+	if (strncmp(uri, "/tag", 4) == 0)
+		return ROUTE_TAG;
+	if (strncmp(uri, "/sitemap", 8) == 0)
+		return ROUTE_SITEMAP;
+	if (strncmp(uri, "/archives", 9) == 0)
+		return ROUTE_ARCHIVES;
+	if (strncmp(uri, "/search", 7) == 0)
+		return ROUTE_SEARCH;
+	if (strncmp(uri, "/suggest", 8) == 0)
+		return ROUTE_SUGGEST;
+	switch (sscanf(uri, "/%4d/%2d/%2d", &y, &m, &d)) {
+	case 3:
+		return ROUTE_DAY;
+	case 2:
+		return ROUTE_MONTH;
+	case 1:
+		return ROUTE_YEAR;
+	}
+	if (uri[1] == '\0' || uri[1] == '?')
+		return ROUTE_ROOT;
+
+	return ROUTE_OTHER;
+}
+
+/* the date of a [10/Oct/2000:13:55:36 -0700] field in seconds */
+static time_t
+parse_date(const char *s)
+{
+	static const char	*months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	struct tm			tm;
+	char				mon[4];
+	const char			*m;
+	int					off = 0;
+
+	memset(&tm, 0, sizeof(struct tm));
+	if (sscanf(s, "%2d/%3s/%4d:%2d:%2d:%2d %5d", &tm.tm_mday, mon, &tm.tm_year,
+	    &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &off) < 6 ||
+	    (m = strstr(months, mon)) == NULL)
+		return -1;
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+
+	return timegm(&tm) - (off / 100 * 3600 + off % 100 * 60);
+}
+
+/* next "quoted" field of line after *p, NULL if none */
+static char *
+next_quoted(char **p)
+{
+	char	*begin, *end;
+
+	if ((begin = strchr(*p, '"')) == NULL)
+		return NULL;
+	begin++;
+	for (end = begin; *end != '\0' && *end != '"'; end++) {
+		if (*end == '\\' && end[1] != '\0')
+			end++;
+	}
+	if (*end == '\0')
+		return NULL;
+	*end = '\0';
+	*p = end + 1;
+
+	return begin;
+}
+
+static void
+read_log(FILE *f, int max)
+{
+	struct request	*r;
+	char			line[8192], *p, *req, *agent, *method, *uri;
+	time_t			t, first = -1;
+	int				asize = 0;
+
+	while (fgets(line, sizeof(line), f) != NULL && (max <= 0 || nrequests < max)) {
+		if ((p = strchr(line, '[')) == NULL || (t = parse_date(p + 1)) < 0)
+			continue;
+		if ((req = next_quoted(&p)) == NULL)
+			continue;
+		/* referer, then user agent */
+		agent = NULL;
+		if (next_quoted(&p) != NULL)
+			agent = next_quoted(&p);
+
+		method = strtok(req, " ");
+		uri = strtok(NULL, " ");
+		if (method == NULL || uri == NULL || uri[0] != '/')
+			continue;
+		/*
+		 * the URI and the host are sent twice, the agent and the other
+		 * params take < 2048 bytes
+		 */
+		if (2 * strlen(uri) + 2 * strlen(host) + strlen(method) + 2048 >
+		    PARAMS_MAX) {
+			nskipped++;
+			continue;
+		}
+
+		if (nrequests == asize) {
+			asize = asize ? asize * 2 : 1024;
+			if ((requests = realloc(requests, asize * sizeof(struct request))) == NULL)
+				err(1, "realloc");
+		}
+		if (first < 0)
+			first = t;
+		r = &requests[nrequests++];
+		r->at = difftime(t, first);
+		r->method = strdup(method);
+		r->uri = strdup(uri);
+		r->agent = strdup(agent ? agent : "-");
+		r->route = route_of(method, uri);
+		r->latency = -1;
+		r->status = 0;
+	}
+}
+
+static int
+connect_socket(void)
+{
+	struct sockaddr_un	un;
+	struct addrinfo		hints, *ai;
+	char				addr[256], *port;
+	int					fd;
+
+	if (strncmp(socket_url, "unix:", 5) == 0) {
+		memset(&un, 0, sizeof(struct sockaddr_un));
+		un.sun_family = AF_UNIX;
+		snprintf(un.sun_path, sizeof(un.sun_path), "%s", socket_url + 5);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&un, sizeof(struct sockaddr_un)) == -1) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	snprintf(addr, sizeof(addr), "%s", socket_url + 4);
+	if ((port = strrchr(addr, ':')) == NULL)
+		return -1;
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr, port, &hints, &ai) != 0)
+		return -1;
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1 &&
+	    connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+
+	return fd;
+}
+
+static size_t
+fcgi_header(unsigned char *buf, int type, size_t len)
+{
+	buf[0] = FCGI_VERSION_1;
+	buf[1] = type;
+	buf[2] = 0;
+	buf[3] = 1;			/* request id */
+	buf[4] = (len >> 8) & 0xff;
+	buf[5] = len & 0xff;
+	buf[6] = 0;			/* padding */
+	buf[7] = 0;
+
+	return 8;
+}
+
+static size_t
+fcgi_param(unsigned char *buf, const char *name, const char *value)
+{
+	size_t	nlen = strlen(name), vlen = strlen(value), len = 0, i;
+	size_t	lens[2] = { nlen, vlen };
+
+	for (i = 0; i < 2; i++) {
+		if (lens[i] < 128) {
+			buf[len++] = lens[i];
+		} else {
+			buf[len++] = ((lens[i] >> 24) & 0x7f) | 0x80;
+			buf[len++] = (lens[i] >> 16) & 0xff;
+			buf[len++] = (lens[i] >> 8) & 0xff;
+			buf[len++] = lens[i] & 0xff;
+		}
+	}
+	memcpy(buf + len, name, nlen);
+	memcpy(buf + len + nlen, value, vlen);
+
+	return len + nlen + vlen;
+}
+
+static bool
+write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+read_all(int fd, unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+
+	while (len > 0) {
+		if ((n = read(fd, buf, len)) <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/* read a record content of len bytes, only its first sizeof(buf) kept */
+static bool
+read_record(int fd, unsigned char *buf, size_t size, size_t len)
+{
+	unsigned char	discard[4096];
+	size_t			n;
+
+	n = len < size ? len : size;
+	if (!read_all(fd, buf, n))
+		return false;
+	for (len -= n; len > 0; len -= n) {
+		n = len < sizeof(discard) ? len : sizeof(discard);
+		if (!read_all(fd, discard, n))
+			return false;
+	}
+
+	return true;
+}
+
+/* send r on a new connection and read the whole response, returns its status */
+static int
+fcgi_request(struct request *r)
+{
+	unsigned char	buf[16384], params[PARAMS_MAX];
+	char			*query;
+	size_t			len = 0, plen = 0, clen;
+	int				fd, status = 0, type;
+	bool			first = true;
+
+	if ((fd = connect_socket()) == -1)
+		return -1;
+
+	query = strchr(r->uri, '?');
+	plen += fcgi_param(params + plen, "GATEWAY_INTERFACE", "CGI/1.1");
+	plen += fcgi_param(params + plen, "SERVER_PROTOCOL", "HTTP/1.1");
+	plen += fcgi_param(params + plen, "REQUEST_METHOD", r->method);
+	plen += fcgi_param(params + plen, "REQUEST_URI", r->uri);
+	plen += fcgi_param(params + plen, "QUERY_STRING", query ? query + 1 : "");
+	plen += fcgi_param(params + plen, "SCRIPT_NAME", "/");
+	plen += fcgi_param(params + plen, "SERVER_NAME", host);
+	plen += fcgi_param(params + plen, "HTTP_HOST", host);
+	plen += fcgi_param(params + plen, "REMOTE_ADDR", "127.0.0.1");
+	plen += fcgi_param(params + plen, "CONTENT_LENGTH", "0");
+	if (strlen(r->agent) < 1024)
+		plen += fcgi_param(params + plen, "HTTP_USER_AGENT", r->agent);
+
+	len += fcgi_header(buf + len, FCGI_BEGIN_REQUEST, 8);
+	memset(buf + len, 0, 8);
+	buf[len + 1] = FCGI_RESPONDER;
+	len += 8;
+	len += fcgi_header(buf + len, FCGI_PARAMS, plen);
+	memcpy(buf + len, params, plen);
+	len += plen;
+	len += fcgi_header(buf + len, FCGI_PARAMS, 0);
+	len += fcgi_header(buf + len, FCGI_STDIN, 0);
+
+	if (!write_all(fd, buf, len)) {
+		close(fd);
+		return -1;
+	}
+
+	for (;;) {
+		if (!read_all(fd, buf, 8)) {
+			status = -1;
+			break;
+		}
+		type = buf[1];
+		clen = (buf[4] << 8 | buf[5]) + buf[6];
+		if (!read_record(fd, buf, sizeof(buf) - 1, clen)) {
+			status = -1;
+			break;
+		}
+		if (type == FCGI_END_REQUEST)
+			break;
+		if (type == FCGI_STDOUT && first && clen > 0) {
+			buf[clen < sizeof(buf) - 1 ? clen : sizeof(buf) - 1] = '\0';
+			status = 200;
+			if (strncasecmp((char *)buf, "Status:", 7) == 0)
+				status = atoi((char *)buf + 7);
+			first = false;
+		}
+	}
+	close(fd);
+
+	return status;
+}
+
+static void *
+worker(void *arg)
+{
+	struct request	*r;
+	struct timespec	ts;
+	double			begin, wait;
+	int				i;
+
+	for (;;) {
+		pthread_mutex_lock(&next_lock);
+		i = next_request++;
+		pthread_mutex_unlock(&next_lock);
+		if (i >= nrequests)
+			break;
+
+		r = &requests[i];
+		if (speed > 0 && (wait = r->at / speed - elapsed()) > 0) {
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+			nanosleep(&ts, NULL);
+		}
+
+		begin = elapsed();
+		r->status = fcgi_request(r);
+		if (r->status > 0)
+			r->latency = elapsed() - begin;
+	}
+
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double	da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static double
+percentile(double *v, int n, double p)
+{
+	int	i = (int)(p * (n - 1) + 0.5);
+
+	return v[i] * 1000;
+}
+
+static void
+report(double total)
+{
+	double	*lat;
+	int		route, i, n, errors = 0, notfound = 0;
+
+	if ((lat = malloc((nrequests ? nrequests : 1) * sizeof(double))) == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < nrequests; i++) {
+		if (requests[i].status < 0)
+			errors++;
+		else if (requests[i].status == 404)
+			notfound++;
+	}
+
+	printf("requests:   %d in %.2f s, %.1f req/s\n", nrequests, total,
+	    total > 0 ? nrequests / total : 0);
+	printf("errors:     %d, 404: %d, skipped: %d\n", errors, notfound, nskipped);
+	printf("%-8s %8s %9s %9s %9s %9s\n", "route", "count", "p50 ms",
+	    "p90 ms", "p99 ms", "max ms");
+
+	for (route = 0; route < NROUTES; route++) {
+		for (i = n = 0; i < nrequests; i++) {
+			if (requests[i].route == route && requests[i].latency >= 0)
+				lat[n++] = requests[i].latency;
+		}
+		if (n == 0)
+			continue;
+		qsort(lat, n, sizeof(double), cmp_double);
+		printf("%-8s %8d %9.2f %9.2f %9.2f %9.2f\n", route_names[route], n,
+		    percentile(lat, n, 0.5), percentile(lat, n, 0.9),
+		    percentile(lat, n, 0.99), lat[n - 1] * 1000);
+	}
+	free(lat);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE		*f;
+	pthread_t	*threads;
+	int			ch, i, nconns = 1, max = 0;
+
+	while ((ch = getopt(argc, argv, "c:s:n:H:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'n':
+			max = atoi(optarg);
+			break;
+		case 'H':
+			if (strlen(optarg) >= HOST_MAX)
+				errx(1, "-H host is %d bytes at most", HOST_MAX - 1);
+			host = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2 || nconns <= 0 ||
+	    (strncmp(argv[0], "unix:", 5) != 0 && strncmp(argv[0], "tcp:", 4) != 0))
+		usage();
+	socket_url = argv[0];
+
+	if (strcmp(argv[1], "-") == 0)
+		f = stdin;
+	else if ((f = fopen(argv[1], "r")) == NULL)
+		err(1, "%s", argv[1]);
+	read_log(f, max);
+	if (f != stdin)
+		fclose(f);
+	if (nrequests == 0)
+		errx(1, "%s: no request found", argv[1]);
+
+	if ((threads = calloc(nconns, sizeof(pthread_t))) == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nconns; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			err(1, "pthread_create");
+	}
+	for (i = 0; i < nconns; i++)
+		pthread_join(threads[i], NULL);
+
+	report(elapsed());
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Compare the listing page selection of cblog.cgi done by scanning the
+ * store, as build_index does without a snapshot, with the same selection
+ * done on a snapshot.
+ *
+ * usage: bench-snapshot [-b backend] [-n posts] [-q queries]
+ */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_snapshot.h"
+
+#define PAGE_SIZE	10
+#define NTAGS		50
+
+struct posts {
+	int					nposts;
+	int					asize;
+	struct store_post	*posts;
+};
+
+static int
+add_post(struct store_post *post, void *arg)
+{
+	struct posts	*posts = arg;
+
+	if (posts->nposts == posts->asize) {
+		posts->asize = posts->asize ? posts->asize * 2 : 64;
+		posts->posts = realloc(posts->posts, posts->asize * sizeof(struct store_post));
+		if (posts->posts == NULL)
+			return -1;
+	}
+	posts->posts[posts->nposts] = *post;
+	posts->posts[posts->nposts++].name = strdup(post->name);
+
+	return 0;
+}
+
+static int
+sort_by_ctime(const void *a, const void *b)
+{
+	const struct store_post	*pa = a;
+	const struct store_post	*pb = b;
+
+	if (pa->ctime == pb->ctime)
+		return 0;
+
+	return pa->ctime < pb->ctime ? 1 : -1;
+}
+
+/* same work as build_index_store minus the HDF */
+static int
+select_store(struct store *st, struct snapshot_query *q, const char *tag,
+    int offset, int *sum)
+{
+	struct posts	posts;
+	char			*title;
+	int				i;
+
+	memset(&posts, 0, sizeof(struct posts));
+	if (tag != NULL)
+		store_tagged(st, tag, add_post, &posts);
+	else if (q->bounded)
+		store_range(st, q->start, q->end, add_post, &posts);
+	else
+		store_posts(st, add_post, &posts);
+
+	if (posts.nposts > 0)
+		qsort(posts.posts, posts.nposts, sizeof(struct store_post), sort_by_ctime);
+
+	for (i = 0; i < posts.nposts; i++) {
+		if (i >= offset && i < offset + PAGE_SIZE) {
+			if ((title = store_get(st, &posts.posts[i], "title")) != NULL) {
+				*sum += title[0];
+				free(title);
+			}
+		}
+		free((char *)posts.posts[i].name);
+	}
+	free(posts.posts);
+
+	return posts.nposts;
+}
+
+static int
+select_snapshot(struct store *st, struct snapshot *snap, struct snapshot_query *q,
+    int offset, int *sum)
+{
+	struct store_post	post;
+	char				*title;
+	int					out[PAGE_SIZE], total, i;
+
+	total = snapshot_select(snap, q, offset, PAGE_SIZE, out);
+	for (i = 0; i < PAGE_SIZE && offset + i < total; i++) {
+		post.name = snapshot_name(snap, out[i]);
+		post.ctime = snap->ctime[out[i]];
+		post.part = snap->part[out[i]];
+		if ((title = store_get(st, &post, "title")) != NULL) {
+			*sum += title[0];
+			free(title);
+		}
+	}
+
+	return total;
+}
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* the i-th query of the run: index pages, tag pages and month pages */
+static void
+make_query(struct snapshot *snap, int i, int nposts, time_t base,
+    struct snapshot_query *q, const char **tag, char *tagbuf, size_t len)
+{
+	struct tm	tm;
+
+	memset(q, 0, sizeof(struct snapshot_query));
+	q->tag = -1;
+	q->until = base + 3600;
+	*tag = NULL;
+
+	switch (i % 3) {
+	case 1:
+		snprintf(tagbuf, len, "tag%d", i % NTAGS);
+		*tag = tagbuf;
+		q->tag = snapshot_find_tag(snap, tagbuf);
+		break;
+	case 2:
+		gmtime_r(&base, &tm);
+		tm.tm_mday = 1;
+		tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+		tm.tm_mon -= i % (nposts / 30 + 1);
+		q->bounded = true;
+		q->start = timegm(&tm);
+		tm.tm_mon++;
+		q->end = timegm(&tm) - 1;
+		break;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct store_ops	*ops;
+	struct store			st;
+	struct store_batch		batch;
+	struct snapshot			*snap;
+	struct snapshot_query	q;
+	struct timespec			t0, t1;
+	const char				*backend = "cdb", *tag;
+	char					dir[] = "/tmp/cblog-bench.XXXXXX";
+	char					path[MAXPATHLEN], name[64], val[256], tagbuf[32];
+	time_t					base = 1300000000;
+	double					scan_ns, snap_ns, build_ns;
+	int						ch, i, nposts = 10000, nqueries = 300;
+	int						sum = 0, total_scan = 0, total_snap = 0;
+
+	while ((ch = getopt(argc, argv, "b:n:q:")) != -1) {
+		switch (ch) {
+		case 'b':
+			backend = optarg;
+			break;
+		case 'n':
+			nposts = atoi(optarg);
+			break;
+		case 'q':
+			nqueries = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b backend] [-n posts] [-q queries]\n",
+			    argv[0]);
+			return 1;
+		}
+	}
+	if (nposts <= 0 || nqueries <= 0)
+		errx(1, "posts and queries must be positive");
+	if ((ops = store_backend(backend)) == NULL)
+		errx(1, "unknown backend: %s", backend);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/cblog.cdb", dir);
+
+	/* posts about one day apart with 3 of NTAGS tags, built as cdb */
+	if (store_create(&store_cdb, path, false) != 0 ||
+	    store_open(&st, &store_cdb, path) != 0)
+		errx(1, "unable to create %s", path);
+	store_batch_init(&batch);
+	for (i = 0; i < nposts; i++) {
+		snprintf(name, sizeof(name), "post-%06d", i);
+		snprintf(val, sizeof(val), "%lld", (long long)(base - i * 86400 + i % 3600));
+		store_batch_put(&batch, name, "ctime", val);
+		snprintf(val, sizeof(val), "Title of the synthetic post number %d", i);
+		store_batch_put(&batch, name, "title", val);
+		snprintf(val, sizeof(val), "tag%d, tag%d, tag%d", i % NTAGS,
+		    (i * 7 + 1) % NTAGS, (i * 13 + 2) % NTAGS);
+		store_batch_put(&batch, name, "tags", val);
+		store_batch_put(&batch, name, "html", "<p>body</p>");
+	}
+	if (store_commit(&st, &batch) != 0)
+		errx(1, "unable to write %s", path);
+	store_batch_free(&batch);
+	store_close(&st);
+
+	if (store_open(&st, ops, path) != 0)
+		errx(1, "unable to open %s", path);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((snap = snapshot_build(&st)) == NULL)
+		errx(1, "unable to build the snapshot");
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	build_ns = elapsed_ns(&t0, &t1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nqueries; i++) {
+		make_query(snap, i, nposts, base, &q, &tag, tagbuf, sizeof(tagbuf));
+		total_scan += select_store(&st, &q, tag, (i % 4) * PAGE_SIZE, &sum);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	scan_ns = elapsed_ns(&t0, &t1) / nqueries;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nqueries; i++) {
+		make_query(snap, i, nposts, base, &q, &tag, tagbuf, sizeof(tagbuf));
+		total_snap += select_snapshot(&st, snap, &q, (i % 4) * PAGE_SIZE, &sum);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	snap_ns = elapsed_ns(&t0, &t1) / nqueries;
+
+	if (total_scan != total_snap)
+		errx(1, "selections differ: %d posts scanned, %d selected",
+		    total_scan, total_snap);
+
+	printf("backend:        %s\n", st.ops->name);
+	printf("posts:          %d, %d tags\n", nposts, snap->ntags);
+	printf("snapshot build: %.0f us\n", build_ns / 1000);
+	printf("snapshot size:  %zu bytes, %.0f bytes per 10k posts\n",
+	    snapshot_size(snap), (double)snapshot_size(snap) * 10000 / nposts);
+	printf("store scan:     %.0f ns/query\n", scan_ns);
+	printf("snapshot:       %.0f ns/query (%.1fx)\n", snap_ns,
+	    snap_ns > 0 ? scan_ns / snap_ns : 0);
+
+	snapshot_free(snap);
+	store_close(&st);
+	unlink(path);
+	rmdir(dir);
+
+	return sum == -1;
+}
@@ -0,0 +1,176 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cblog_cgi.h"
+
+/* longest line of the access log */
+#define ACCESS_LINE		1024
+
+struct access_entry	access_entry;
+
+static int		access_fd = -1;
+static char		*access_buf;
+static size_t	access_len;
+static size_t	access_size;
+static int		access_interval;
+static time_t	access_flushed;
+
+static const char	*routes[] = {
+	"post",
+	"tag",
+	"feed",
+	"root",
+	"error",
+	"year",
+	"month",
+	"day",
+	"sitemap",
+	"archives",
+	"search",
+	"suggest",
+};
+
+/*
+ * Open the access log set by access_log in conf. Lines are kept in a
+ * buffer of access_log_buffer bytes, written when it is full or when a
+ * request ends access_log_flush seconds after the last write.
+ */
+int
+access_open(HDF *conf)
+{
+	const char	*path;
+
+	if ((path = hdf_get_value(conf, "access_log", NULL)) == NULL)
+		return 0;
+
+	access_size = hdf_get_int_value(conf, "access_log_buffer", DEFAULT_ACCESS_BUFFER);
+	if (access_size < ACCESS_LINE)
+		access_size = ACCESS_LINE;
+	access_interval = hdf_get_int_value(conf, "access_log_flush", DEFAULT_ACCESS_FLUSH);
+
+	if ((access_buf = malloc(access_size)) == NULL)
+		return -1;
+
+	if ((access_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640)) == -1) {
+		free(access_buf);
+		access_buf = NULL;
+		return -1;
+	}
+	access_flushed = time(NULL);
+	atexit(access_flush);
+
+	return 0;
+}
+
+void
+access_begin(void)
+{
+	if (access_fd == -1)
+		return;
+
+	memset(&access_entry, 0, sizeof(struct access_entry));
+	alloc_begin();
+	access_entry.status = 200;
+	access_entry.posts = -1;
+	clock_gettime(CLOCK_MONOTONIC, &access_entry.start);
+}
+
+/* str between quotes, quotes and control characters escaped */
+static size_t
+access_quote(char *buf, size_t size, const char *str)
+{
+	size_t	len = 0;
+
+	if (str == NULL)
+		str = "";
+
+	buf[len++] = '"';
+	for (; *str != '\0' && len + 5 < size; str++) {
+		if (*str == '"' || *str == '\\' || (unsigned char)*str < 0x20)
+			len += snprintf(buf + len, size - len, "\\x%02x", (unsigned char)*str);
+		else
+			buf[len++] = *str;
+	}
+	buf[len++] = '"';
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* add the line of the request that ends to the buffer */
+void
+access_end(HDF *hdf, int type)
+{
+	struct timespec	now;
+	struct tm		tm;
+	char			uri[ACCESS_LINE / 2], criteria[ACCESS_LINE / 4];
+	time_t			t = time(NULL);
+	long long		us;
+	int				n;
+
+	if (access_fd == -1)
+		return;
+
+	alloc_end(&access_entry.alloc);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - access_entry.start.tv_sec) * 1000000LL +
+	    (now.tv_nsec - access_entry.start.tv_nsec) / 1000;
+	if (type == CBLOG_ERR)
+		access_entry.status = 404;
+
+	access_quote(uri, sizeof(uri), get_cgi_str(hdf, "RequestURI"));
+	access_quote(criteria, sizeof(criteria), access_entry.criteria);
+	gmtime_r(&t, &tm);
+
+	if (access_len + ACCESS_LINE > access_size)
+		access_flush();
+
+	n = snprintf(access_buf + access_len, access_size - access_len,
+	    "time=%04d-%02d-%02dT%02d:%02d:%02dZ method=%s uri=%s route=%s "
+	    "criteria=%s status=%d bytes=%zu cache=%s posts=%d us=%lld"
+#ifdef ALLOC_STATS
+	    " allocs=%lu alloc_bytes=%llu alloc_peak=%zu"
+#endif
+	    "\n",
+	    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+	    tm.tm_sec, hdf_get_value(hdf, "CGI.RequestMethod", "-"), uri,
+	    type >= 0 && type < (int)(sizeof(routes) / sizeof(routes[0])) ?
+	    routes[type] : "-",
+	    criteria,
+	    access_entry.status, access_entry.bytes,
+	    access_entry.cache ? access_entry.cache : "-", access_entry.posts, us
+#ifdef ALLOC_STATS
+	    , access_entry.alloc.count, access_entry.alloc.bytes,
+	    access_entry.alloc.peak
+#endif
+	    );
+	if (n > 0 && (size_t)n < access_size - access_len)
+		access_len += n;
+
+	if (t - access_flushed >= access_interval)
+		access_flush();
+}
+
+void
+access_flush(void)
+{
+	ssize_t	n;
+	size_t	off = 0;
+
+	while (access_fd != -1 && off < access_len) {
+		if ((n = write(access_fd, access_buf + off, access_len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+	access_len = 0;
+	access_flushed = time(NULL);
+}
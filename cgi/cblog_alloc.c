@@ -0,0 +1,247 @@
+/*
+ * Allocation accounting of the requests, built with -DALLOC_STATS (see
+ * config.mk): malloc, calloc, realloc and free are interposed to count
+ * the allocations made by the thread serving the requests, ClearSilver's
+ * included, and the most memory they held at once. The sizes are the
+ * usable sizes reported by the allocator. Only the blocks allocated by
+ * the request are taken off when freed, those it frees from the caches of
+ * earlier requests are not, so the peak is what the request itself held;
+ * a block of an earlier request it reallocates counts as a new one.
+ */
+#ifdef ALLOC_STATS
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __FreeBSD__
+#include <malloc_np.h>
+#else
+#include <malloc.h>
+#endif
+
+#include "cblog_cgi.h"
+
+static void		*(*real_malloc)(size_t);
+static void		*(*real_calloc)(size_t, size_t);
+static void		*(*real_realloc)(void *, size_t);
+static void		(*real_free)(void *);
+
+/* set on the thread serving the requests only */
+static __thread bool	alloc_counted;
+
+static struct alloc_stats	alloc_cur;
+static long long			alloc_live;		/* bytes held since alloc_begin */
+
+/* blocks allocated since alloc_begin, an open addressing set */
+#define ALLOC_FREED	((void *)1)
+static void		**alloc_blocks;
+static size_t	alloc_nslots;		/* a power of 2 */
+static size_t	alloc_used;			/* slots filled, freed ones included */
+static size_t	alloc_nlive;		/* blocks in the set */
+
+/* dlsym may allocate before the real functions are known */
+static char		alloc_pool[4096];
+static size_t	alloc_pool_used;
+
+static void *
+alloc_pool_get(size_t size)
+{
+	void	*p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (alloc_pool_used + size > sizeof(alloc_pool))
+		return NULL;
+	p = alloc_pool + alloc_pool_used;
+	alloc_pool_used += size;
+
+	return p;
+}
+
+static bool
+alloc_init(void)
+{
+	static bool	initializing;
+
+	if (real_free != NULL)
+		return true;
+	if (initializing)
+		return false;
+
+	initializing = true;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	initializing = false;
+
+	return real_free != NULL;
+}
+
+static size_t
+alloc_hash(void *p)
+{
+	return (size_t)(((uintptr_t)p >> 4) * 0x9e3779b1U) & (alloc_nslots - 1);
+}
+
+/* slot of p, or the first empty one met looking for it */
+static void **
+alloc_slot(void *p)
+{
+	size_t	i, mask = alloc_nslots - 1;
+
+	for (i = alloc_hash(p); alloc_blocks[i] != NULL; i = (i + 1) & mask) {
+		if (alloc_blocks[i] == p)
+			break;
+	}
+
+	return &alloc_blocks[i];
+}
+
+/* record a block of the request, dropping the freed slots when growing */
+static void
+alloc_track(void *p)
+{
+	void	**old = alloc_blocks, **slot;
+	size_t	i, nslots = alloc_nslots;
+
+	if ((alloc_used + 1) * 2 > alloc_nslots) {
+		if (nslots == 0)
+			alloc_nslots = 1024;
+		else if ((alloc_nlive + 1) * 4 > nslots)
+			alloc_nslots = nslots * 2;
+		alloc_blocks = real_calloc(alloc_nslots, sizeof(void *));
+		if (alloc_blocks == NULL) {
+			/* untracked blocks are never taken off, the peak is then high */
+			alloc_blocks = old;
+			alloc_nslots = nslots;
+			return;
+		}
+		alloc_used = 0;
+		for (i = 0; i < nslots; i++) {
+			if (old[i] != NULL && old[i] != ALLOC_FREED) {
+				*alloc_slot(old[i]) = old[i];
+				alloc_used++;
+			}
+		}
+		real_free(old);
+	}
+
+	if (*(slot = alloc_slot(p)) == NULL) {
+		*slot = p;
+		alloc_used++;
+		alloc_nlive++;
+	}
+}
+
+/* forget a block, true if the request allocated it */
+static bool
+alloc_untrack(void *p)
+{
+	void	**slot;
+
+	if (alloc_nslots == 0 || *(slot = alloc_slot(p)) == NULL)
+		return false;
+	*slot = ALLOC_FREED;
+	alloc_nlive--;
+
+	return true;
+}
+
+static void
+alloc_add(void *p, size_t held)
+{
+	if (!alloc_counted || p == NULL)
+		return;
+
+	alloc_track(p);
+	alloc_cur.count++;
+	alloc_cur.bytes += malloc_usable_size(p);
+	alloc_live += (long long)malloc_usable_size(p) - (long long)held;
+	if (alloc_live > (long long)alloc_cur.peak)
+		alloc_cur.peak = alloc_live;
+}
+
+void *
+malloc(size_t size)
+{
+	void	*p;
+
+	if (!alloc_init())
+		return alloc_pool_get(size);
+
+	p = real_malloc(size);
+	alloc_add(p, 0);
+
+	return p;
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	void	*p;
+
+	/* the pool is static, hence zeroed */
+	if (!alloc_init())
+		return n == 0 || size <= SIZE_MAX / n ? alloc_pool_get(n * size) : NULL;
+
+	p = real_calloc(n, size);
+	alloc_add(p, 0);
+
+	return p;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	size_t	held;
+	void	*p;
+
+	if (!alloc_init())
+		return NULL;
+
+	held = ptr != NULL && alloc_counted ? malloc_usable_size(ptr) : 0;
+	if (held > 0 && !alloc_untrack(ptr))
+		held = 0;
+	if ((p = real_realloc(ptr, size)) != NULL)
+		alloc_add(p, held);
+	else if (size == 0)
+		alloc_live -= held;
+	else if (held > 0)
+		alloc_track(ptr);	/* left as it was */
+
+	return p;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL ||
+	    ((char *)ptr >= alloc_pool && (char *)ptr < alloc_pool + sizeof(alloc_pool)))
+		return;
+
+	if (alloc_counted && alloc_untrack(ptr))
+		alloc_live -= malloc_usable_size(ptr);
+	real_free(ptr);
+}
+
+/* start counting the allocations of the request the calling thread serves */
+void
+alloc_begin(void)
+{
+	alloc_counted = true;
+	memset(&alloc_cur, 0, sizeof(struct alloc_stats));
+	alloc_live = 0;
+	if (alloc_nslots > 0)
+		memset(alloc_blocks, 0, alloc_nslots * sizeof(void *));
+	alloc_used = alloc_nlive = 0;
+}
+
+/* allocations made since alloc_begin */
+void
+alloc_end(struct alloc_stats *stats)
+{
+	*stats = alloc_cur;
+}
+#endif	/* def ALLOC_STATS */
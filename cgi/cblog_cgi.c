@@ -1,7 +1,6 @@
 #include <fcntl.h>
 #include <locale.h>
 #include <unistd.h>
-#include <cdb.h>
 #include <time.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -10,7 +9,9 @@
 #include <sys/queue.h>
 
 #include "cblog_utils.h"
+#include "cblog_store.h"
 #include "cblog_common.h"
+#include "cblog_archives.h"
 #include "cblog_cgi.h"
 
 /*extern int errno;*/
@@ -24,19 +25,28 @@ static struct pages {
 	{ "/tag", CBLOG_TAG },
 	{ "/index.rss", CBLOG_ATOM },
 	{ "/index.atom", CBLOG_ATOM },
+	{ "/sitemap", CBLOG_SITEMAP },
+	{ "/archives", CBLOG_ARCHIVES },
+	{ "/search", CBLOG_SEARCH },
+	{ "/suggest", CBLOG_SUGGEST },
 	{ NULL, -1 },
 };
 
 struct posts {
-	char	*name;
-	time_t	ctime;
-	SLIST_ENTRY(posts) next;
+	int					nposts;
+	int					asize;
+	struct store_post	*posts;		/* names are copies */
+	struct store		*st;		/* to leave the drafts out */
+	time_t				until;		/* posts dated later are not live yet */
 };
 
 struct tags {
-	char	*name;
-	int		count;
-	SLIST_ENTRY(tags) next;
+	int		ntags;
+	int		asize;
+	struct	tag {
+		char	*name;
+		int		count;
+	} *tags;
 };
 
 struct criteria {
@@ -47,88 +57,99 @@ struct criteria {
 	time_t	end;
 };
 
-static int
-sort_by_name(const void *a, const void *b)
-{
-	struct tags *ta = *((struct tags **)a);
-	struct tags *tb = *((struct tags **)b);
-
-	return strcasecmp(ta->name, tb->name);
-}
-
 
 static int
 sort_by_ctime(const void *a, const void *b)
 {
-	struct posts *post_a = *((struct posts **)a);
-	struct posts *post_b = *((struct posts **)b);
-
-	return post_b->ctime - post_a->ctime;
-}
+	const struct store_post *post_a = a;
+	const struct store_post *post_b = b;
 
-static char *
-trimspace(char *str)
-{
-	char *line = str;
+	if (post_a->ctime == post_b->ctime)
+		return 0;
 
-	/* remove spaces at the beginning */
-	while (true) {
-		if (isspace(line[0]))
-			line++;
-		else
-			break;
-	}
-	/* remove spaces at the end */
-	while (true) {
-		if (isspace(line[strlen(line) - 1]))
-			line[strlen(line) - 1] = '\0';
-		else
-			break;
-	}
-	return line;
+	return post_a->ctime < post_b->ctime ? 1 : -1;
 }
 
+/* log an error, then exit with eval unless it is negative */
 void
 cblog_err(int eval, const char * message, ...)
 {
 	va_list		args;
 
 	va_start(args, message);
-	vsyslog(LOG_ERR, message, args);
+	logger_vpush(LOG_ERR, message, args);
+	va_end(args);
+
+	if (eval >= 0) {
+		logger_flush();
+		exit(eval);
+	}
 }
 
-static int
-db_open(HDF *hdf, struct cdb *cdb, int flags)
+struct store *
+db_open(HDF *hdf, struct store *st)
 {
-	int fd, db;
-
-	fd = db = open(get_cblog_db(hdf), flags);
+	struct store			*ret = st;
+	const struct store_ops	*backend;
 
-	if (fd >= 0 && (db = cdb_init(cdb, fd)) < 0)
-		close(fd);
+	if (current_site != NULL)
+		ret = site_db(current_site, get_cblog_db(hdf));
+	else if ((backend = store_backend(get_db_backend(hdf))) == NULL ||
+	    store_open(st, backend, get_cblog_db(hdf)) < 0)
+		ret = NULL;
 
-	if (db < 0) {
+	if (ret == NULL) {
 		cblog_err(-1, "%s: %s", get_cblog_db(hdf), strerror(errno));
 		hdf_set_value(hdf, "err_msg", strerror(errno));
 	}
 
-	return db;
+	return ret;
 }
 
+/* snapshot of the database when it is the one of the current site */
+static struct snapshot *
+db_snapshot(struct store *st)
+{
+	if (current_site == NULL || st != &current_site->db)
+		return NULL;
+
+	return site_snapshot(current_site);
+}
+
+/* site databases stay open between requests, only close private handles */
 void
-add_post_to_hdf(HDF *hdf, struct cdb *cdb, char *name, int pos)
+db_close(struct store *st)
 {
-	int		i, j;
-	char	key[BUFSIZ];
-	char	*val;
+	if (current_site != NULL && st == &current_site->db)
+		return;
 
-	hdf_set_valuef(hdf, "Posts.%i.filename=%s", pos, name);
+	store_close(st);
+}
+
+void
+add_post_to_hdf(HDF *hdf, struct store *st, struct store_post *post, int pos,
+    int nb_comments)
+{
+	int				i, j;
+	char			*val;
+	struct views	*views;
+	bool			source;
+
+	/* the source is only read, and decompressed, for the pages showing it */
+	source = hdf_get_int_value(hdf, "post_source", 0) ||
+	    get_query_str(hdf, "source") != NULL;
+
+	hdf_set_valuef(hdf, "Posts.%i.filename=%s", pos, post->name);
 	for (i=0; field[i] != NULL; i++) {
 		char *val_to_free;
 
-		snprintf(key, BUFSIZ, "%s_%s", name, field[i]);
-		cdb_find(cdb, key, strlen(key));
-		val = db_get(cdb);
+		if (!source && EQUALS(field[i], "source"))
+			continue;
+		/* only the sitemap reads it */
+		if (EQUALS(field[i], "mtime"))
+			continue;
+		if ((val = store_get(st, post, field[i])) == NULL)
+			continue;
 		val_to_free = val;
 
 		if (EQUALS(field[i], "tags")) {
@@ -141,6 +162,34 @@ add_post_to_hdf(HDF *hdf, struct cdb *cdb, char *name, int pos)
 				hdf_set_valuef(hdf, "Posts.%i.tags.%i.name=%s", pos, j, valtrimed);
 				val += next + 1;
 			}
+		} else if (EQUALS(field[i], "related")) {
+			int nbel = splitchr(val, '\n');
+			int	k = 0;
+
+			for (j=0; j <= nbel && *val != '\0'; j++) {
+				size_t	next = strlen(val);
+				char	*title = strchr(val, '\t');
+
+				if (title != NULL)
+					*title++ = '\0';
+				/* posts going live later are not linked yet */
+				if (current_site == NULL || !site_scheduled(current_site, val)) {
+					hdf_set_valuef(hdf, "Posts.%i.related.%i.name=%s", pos, k, val);
+					hdf_set_valuef(hdf, "Posts.%i.related.%i.title=%s", pos, k++,
+					    title ? title : "");
+				}
+				val += next + 1;
+			}
+		} else if (EQUALS(field[i], "prev") || EQUALS(field[i], "next")) {
+			char	*title = strchr(val, '\t');
+
+			if (title != NULL)
+				*title++ = '\0';
+			if (title != NULL && (current_site == NULL ||
+			    !site_scheduled(current_site, val))) {
+				hdf_set_valuef(hdf, "Posts.%i.%s.name=%s", pos, field[i], val);
+				hdf_set_valuef(hdf, "Posts.%i.%s.title=%s", pos, field[i], title);
+			}
 		} else if (EQUALS(field[i], "ctime")) {
 			set_post_date(hdf, pos, val);
 		} else
@@ -148,305 +197,616 @@ add_post_to_hdf(HDF *hdf, struct cdb *cdb, char *name, int pos)
 
 		free(val_to_free);
 	}
-	hdf_set_valuef(hdf, "Posts.%i.nb_comments=%i", pos, get_comments_count(name));
+	if (current_site != NULL && (views = site_views(current_site)) != NULL)
+		hdf_set_valuef(hdf, "Posts.%i.views=%llu", pos,
+		    (unsigned long long)views_count(views, post->name));
+	if (nb_comments < 0)
+		nb_comments = get_comments_count(hdf, (char *)post->name);
+	hdf_set_valuef(hdf, "Posts.%i.nb_comments=%i", pos, nb_comments);
 }
 
-void
-set_tags(HDF *hdf)
+static int
+add_tag(const char *name, int count, void *arg)
 {
-	int					i, nbtags = 0, nbel;
-	struct cdb			cdb;
-	struct cdb_find		cdbf;
-	char				key[BUFSIZ];
-	char				*val;
-	bool				found;
-	struct tags			**taglist = NULL;
-	struct tags			*tag;
-	char				*tagcmp, *val_to_free;
-	size_t				next;
-
-	SLIST_HEAD(, tags) tagshead;
-	SLIST_INIT(&tagshead);
-
-	if (db_open(hdf, &cdb, O_RDONLY) < 0)
+	struct tags	*tags = arg;
+
+	if (tags->ntags == tags->asize) {
+		tags->asize = tags->asize ? tags->asize * 2 : 64;
+		tags->tags = realloc(tags->tags, tags->asize * sizeof(struct tag));
+		if (tags->tags == NULL)
+			return -1;
+	}
+	tags->tags[tags->ntags].name = strdup(name);
+	tags->tags[tags->ntags++].count = count;
+
+	return 0;
+}
+
+/*
+ * Count the published posts of every tag and set them in Tags.N, sorted
+ * by name: drafts are counted by neither the snapshot nor store_tags, the
+ * scheduled posts, newest in the snapshot, are taken off both counts
+ */
+static void
+set_tag_counts(HDF *hdf, struct store *st)
+{
+	int				i, j, n, first;
+	uint32_t		*counts;
+	struct tags		tags;
+	struct snapshot	*snap;
+	time_t			now = time(NULL);
+
+	/* tags of a snapshot are already sorted by name */
+	if ((snap = db_snapshot(st)) != NULL) {
+		for (first = 0; first < snap->nposts && snap->ctime[first] > now; first++)
+			;
+		counts = snap->tag_count;
+		if (first > 0) {
+			if ((counts = malloc((snap->ntags + 1) * sizeof(uint32_t))) == NULL)
+				return;
+			memcpy(counts, snap->tag_count, snap->ntags * sizeof(uint32_t));
+			for (j = snap->tags[0]; j < (int)snap->tags[first]; j++)
+				counts[snap->tag_ids[j]]--;
+		}
+		for (i = n = 0; i < snap->ntags; i++) {
+			if (counts[i] == 0)
+				continue;
+			set_tag_name(hdf, n, snapshot_tag_name(snap, i));
+			set_tag_count(hdf, n++, counts[i]);
+		}
+		if (counts != snap->tag_count)
+			free(counts);
 		return;
+	}
 
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-	while (cdb_findnext(&cdbf) > 0) {
-		val = db_get(&cdb);
-		snprintf(key, BUFSIZ, "%s_tags", val);
-		free(val);
+	memset(&tags, 0, sizeof(struct tags));
+	site_tags(current_site, st, now, add_tag, &tags);
 
-		cdb_find(&cdb, key, strlen(key));
-		val = db_get(&cdb);
+	for (i=0; i<tags.ntags; i++) {
+		set_tag_name(hdf, i, tags.tags[i].name);
+		set_tag_count(hdf, i, tags.tags[i].count);
+		free(tags.tags[i].name);
+	}
+	free(tags.tags);
+}
 
-		val_to_free = val;
-		nbel = splitchr(val, ',');
-		for (i=0; i <= nbel; i++) {
-			next = strlen(val);
-			tagcmp = trimspace(val);
+/* set the most viewed posts in Popular.N, read again every views_flush seconds */
+static void
+set_popular(HDF *hdf, struct store *st)
+{
+	struct views		*views;
+	struct popular		*popular;
+	struct store_post	post;
+	char				*published;
+	bool				draft;
+	int					i, n;
+
+	if (current_site == NULL || (views = site_views(current_site)) == NULL)
+		return;
 
-			found = false;
+	popular = &current_site->popular;
+	if (popular->posts == NULL || time(NULL) - popular->at >=
+	    hdf_get_int_value(hdf, "views_flush", DEFAULT_VIEWS_FLUSH)) {
+		for (i=0; i < popular->nposts; i++)
+			free(popular->titles[i]);
+		popular->nposts = 0;
+		n = hdf_get_int_value(hdf, "views_popular", DEFAULT_VIEWS_POPULAR);
+		if (n <= 0)
+			return;
+		popular->posts = realloc(popular->posts, n * sizeof(struct views_entry));
+		popular->titles = realloc(popular->titles, n * sizeof(char *));
+		if (popular->posts == NULL || popular->titles == NULL) {
+			free(popular->posts);
+			free(popular->titles);
+			memset(popular, 0, sizeof(struct popular));
+			return;
+		}
 
-			SLIST_FOREACH(tag, &tagshead, next) {
-				if (EQUALS(tagcmp, tag->name)) {
-					found = true;
-					tag->count++;
-					break;
-				}
-			}
-			if (!found) {
-				nbtags++;
-				tag = malloc(sizeof(struct tags));
-				tag->name = strdup(tagcmp);
+		/* deleted, draft and scheduled posts keep their counter, skip them */
+		n = views_top(views, popular->posts, n);
+		for (i=0, popular->nposts=0; i < n; i++) {
+			if (store_find(st, popular->posts[i].name, &post) < 0 ||
+			    site_scheduled(current_site, popular->posts[i].name))
+				continue;
+			published = store_get(st, &post, "published");
+			draft = store_post_draft(published);
+			free(published);
+			if (draft)
+				continue;
+			popular->posts[popular->nposts] = popular->posts[i];
+			popular->titles[popular->nposts++] = store_get(st, &post, "title");
+		}
+		popular->at = time(NULL);
+	}
 
-				tag->count = 1;
-				SLIST_INSERT_HEAD(&tagshead, tag, next);
-			}
-			val+= next + 1;
+	for (i=0; i < popular->nposts; i++) {
+		hdf_set_valuef(hdf, "Popular.%i.name=%s", i, popular->posts[i].name);
+		hdf_set_valuef(hdf, "Popular.%i.title=%s", i,
+		    popular->titles[i] ? popular->titles[i] : "");
+		hdf_set_valuef(hdf, "Popular.%i.views=%llu", i,
+		    (unsigned long long)popular->posts[i].count);
+	}
+}
+
+/*
+ * Set the posts per year and month in Archives.N, from the histogram kept
+ * by cblogctl, read once per database of a site
+ */
+static void
+set_archives(HDF *hdf, struct store *st)
+{
+	struct store_overlay	ov;
+	struct archive_month	*months;
+	struct tm				tm;
+	char					*val;
+	time_t					now = time(NULL);
+	int						i, j, n, y = -1, m = 0, count = 0;
+
+	if (current_site != NULL && st == &current_site->db &&
+	    current_site->archives != NULL) {
+		val = current_site->archives;
+	} else {
+		/* databases written before the histogram existed */
+		if ((val = store_meta(st, ARCHIVES_KEY)) == NULL) {
+			val = store_overlay(&ov, st, NULL) == 0 ?
+			    archives_histogram(&ov) : NULL;
+			store_overlay_free(&ov);
+			if (val == NULL)
+				return;
 		}
-		free(val_to_free);
+		if (current_site != NULL && st == &current_site->db)
+			current_site->archives = val;
 	}
 
-	taglist = malloc(nbtags * sizeof(struct tags *));
+	n = archives_parse(val, &months);
+	if (current_site == NULL || val != current_site->archives)
+		free(val);
 
-	i = 0;
-	SLIST_FOREACH(tag, &tagshead, next) {
-		taglist[i] = tag;
-		i++;
+	/* the histogram counts the posts going live later */
+	for (i=0; current_site != NULL && i < current_site->schedule.nposts; i++) {
+		if (current_site->schedule.posts[i].at <= now)
+			continue;
+		localtime_r(&current_site->schedule.posts[i].at, &tm);
+		for (j=0; j < n; j++) {
+			if (months[j].year == tm.tm_year + 1900 &&
+			    months[j].month == tm.tm_mon + 1)
+				months[j].count--;
+		}
+	}
+	for (i=0, j=0; i < n; i++) {
+		if (months[i].count > 0)
+			months[j++] = months[i];
 	}
+	n = j;
+
+	for (i=0; i < n; i++) {
+		if (i == 0 || months[i].year != months[i - 1].year) {
+			if (y >= 0)
+				hdf_set_valuef(hdf, "Archives.%i.count=%i", y, count);
+			y++;
+			m = 0;
+			count = 0;
+			hdf_set_valuef(hdf, "Archives.%i.year=%04d", y, months[i].year);
+		}
+		hdf_set_valuef(hdf, "Archives.%i.months.%i.month=%02d", y, m,
+		    months[i].month);
+		hdf_set_valuef(hdf, "Archives.%i.months.%i.count=%i", y, m++,
+		    months[i].count);
+		count += months[i].count;
+	}
+	if (y >= 0)
+		hdf_set_valuef(hdf, "Archives.%i.count=%i", y, count);
+	free(months);
+}
+
+void
+set_tags(HDF *hdf)
+{
+	struct store	sts, *st;
+
+	if ((st = db_open(hdf, &sts)) == NULL)
+		return;
 
-	qsort(taglist, nbtags, sizeof(struct tags *), sort_by_name);
+	set_tag_counts(hdf, st);
+	set_popular(hdf, st);
+	set_archives(hdf, st);
 
-	for (i=0; i<nbtags; i++) {
-		set_tag_name(hdf, i, taglist[i]->name);
-		set_tag_count(hdf, i, taglist[i]->count);
-		free(taglist[i]->name);
-		free(taglist[i]);
+	db_close(st);
+}
+
+/*
+ * Is name surely not a post of the current site, or a tag if tag is set,
+ * as told by the filter cblogctl keeps: only the database file is checked
+ * for a replacement, the filter being read once per database
+ */
+static bool
+db_absent(HDF *hdf, const char *name, bool tag)
+{
+	if (current_site == NULL ||
+	    site_db(current_site, get_cblog_db(hdf)) == NULL)
+		return false;
+
+	if (!current_site->names_read) {
+		current_site->names = bloom_load(&current_site->db);
+		current_site->names_read = true;
 	}
-	free(taglist);
+	if (current_site->names == NULL)
+		return false;
 
-	close(cdb_fileno(&cdb));
-	cdb_free(&cdb);
+	return tag ? !bloom_tag(current_site->names, name) :
+	    !bloom_post(current_site->names, name);
+}
+
+static NEOERR *
+render_string(void *ctx, char *str)
+{
+	return string_append(ctx, str);
+}
+
+/*
+ * Send a page of the site which does not depend on the request: the 404
+ * page of the posts and tags db_absent rules out, with err_msg "Not
+ * found", or /archives. It is rendered once per database then kept by the
+ * site, and rendered again when the popular posts it lists are read again.
+ * Being served to every request, it is rendered without what the one
+ * rendering it was asked with.
+ */
+static NEOERR *
+display_page(CGI *cgi, int n)
+{
+	struct site_page	*cached = &current_site->pages[n];
+	CSPARSE				*cs = NULL;
+	STRING				page;
+	NEOERR				*neoerr = STATUS_OK;
+	char				*uri;
+
+	if (cached->buf != NULL && current_site->views != NULL &&
+	    time(NULL) - current_site->popular.at >=
+	    hdf_get_int_value(cgi->hdf, "views_flush", DEFAULT_VIEWS_FLUSH)) {
+		free(cached->buf);
+		cached->buf = NULL;
+		cached->len = 0;
+	}
+
+	access_entry.cache = "hit";
+	if (cached->buf == NULL) {
+		access_entry.cache = "miss";
+		if (n == PAGE_NOTFOUND)
+			hdf_set_value(cgi->hdf, "err_msg", "Not found");
+		set_tags(cgi->hdf);
+		/* the access log still needs the URI */
+		if ((uri = get_cgi_str(cgi->hdf, "RequestURI")) != NULL)
+			uri = strdup(uri);
+		hdf_remove_tree(cgi->hdf, "Query");
+		hdf_remove_tree(cgi->hdf, "Cookie");
+		hdf_remove_tree(cgi->hdf, "CGI.RequestURI");
+		hdf_remove_tree(cgi->hdf, "CGI.QueryString");
+		hdf_remove_tree(cgi->hdf, "CGI.PathInfo");
+
+		string_init(&page);
+		if ((neoerr = cs_init(&cs, cgi->hdf)) == STATUS_OK &&
+		    (neoerr = cgi_register_strfuncs(cs)) == STATUS_OK &&
+		    (neoerr = cs_parse_file(cs, get_cgi_theme(cgi->hdf))) == STATUS_OK)
+			neoerr = cs_render(cs, &page, render_string);
+		cs_destroy(&cs);
+		if (uri != NULL) {
+			hdf_set_value(cgi->hdf, "CGI.RequestURI", uri);
+			free(uri);
+		}
+		if (neoerr != STATUS_OK || page.buf == NULL) {
+			string_clear(&page);
+			return neoerr;
+		}
+		cached->buf = page.buf;
+		cached->len = page.len;
+	}
+
+	string_init(&page);
+	string_appendn(&page, cached->buf, cached->len);
+	neoerr = cgi_output(cgi, &page);
+	string_clear(&page);
+
+	return neoerr;
 }
 
 int
 build_post(HDF *hdf, char *postname)
 {
-	int			ret = 0;
-	struct cdb	cdb;
-	char		key[BUFSIZ];
-	char		*submit;
+	int					ret = 0;
+	struct store		sts, *st;
+	struct store_post	post;
+	struct views		*views;
+	char				*submit;
 
 	submit = get_query_str(hdf, "submit");
 	if (submit != NULL && EQUALS(submit, "Post"))
 			set_comment(hdf, postname);
 
-	if (db_open(hdf, &cdb, O_RDONLY) < 0)
+	if ((st = db_open(hdf, &sts)) == NULL)
 		return 0;
 
-	snprintf(key, BUFSIZ, "%s_title", postname);
-
-	if (cdb_find(&cdb, key, strlen(key)) > 0) {
-		add_post_to_hdf(hdf, &cdb, postname, 0);
+	if (store_find(st, postname, &post) == 0) {
+		if (current_site != NULL && (views = site_views(current_site)) != NULL)
+			views_hit(views, postname);
+		add_post_to_hdf(hdf, st, &post, 0, get_comments(hdf, postname));
 		ret++;
 	}
 
-	get_comments(hdf, postname);
-
-	close(cdb_fileno(&cdb));
-	cdb_free(&cdb);
+	db_close(st);
 	return ret;
 }
 
-int
-build_index(HDF *hdf, struct criteria *criteria)
+static int
+add_post(struct store_post *post, void *arg)
 {
-	int					first_post = 0, nb_posts = 0, max_post, total_posts = 0;
-	int					nb_pages = 0, page, nbel, nbtags = 0;
-	int					i, j = 0, k;
-	struct cdb			cdb;
-	struct cdb_find		cdbf;
-	char				*val, *tag, *tagcmp, *valtrimed, *val_to_free;
-	struct tags			**taglist = NULL, *tags;
-	char				key[BUFSIZ];
-	struct posts		**posts = NULL;
-	struct posts		*post;
-	size_t				next;
-	bool				found;
-
-	max_post = hdf_get_int_value(hdf, "posts_per_pages", DEFAULT_POSTS_PER_PAGES);
-	page = hdf_get_int_value(hdf, "Query.page", 1);
-	if (page <= 0)
-		page = 1;
-	
-	first_post = (page * max_post) - max_post;
+	struct posts	*posts = arg;
+	char			*published;
+	bool			draft;
 
-	if (db_open(hdf, &cdb, O_RDONLY) < 0)
+	if (post->ctime > posts->until)
 		return 0;
 
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-
-	SLIST_HEAD(, posts) postshead;
-	SLIST_INIT(&postshead);
-
-	SLIST_HEAD(, tags) tagshead;
+	published = store_get(posts->st, post, "published");
+	draft = store_post_draft(published);
+	free(published);
+	if (draft)
+		return 0;
 
-	if (!criteria->feed) {
-		SLIST_INIT(&tagshead);
+	if (posts->nposts == posts->asize) {
+		posts->asize = posts->asize ? posts->asize * 2 : 64;
+		posts->posts = realloc(posts->posts, posts->asize * sizeof(struct store_post));
+		if (posts->posts == NULL)
+			return -1;
 	}
+	posts->posts[posts->nposts] = *post;
+	posts->posts[posts->nposts++].name = strdup(post->name);
 
-	while (cdb_findnext(&cdbf) > 0) {
-
-		total_posts++;
-
-		post = malloc(sizeof(struct posts));
+	return 0;
+}
 
-		/* fetch the post key name */
-		post->name = db_get(&cdb);
+/* select the posts of the page on the snapshot, returns the matching ones */
+static int
+build_index_snapshot(HDF *hdf, struct store *st, struct snapshot *snap,
+    struct criteria *criteria, int first_post, int max_post, int *nb_posts)
+{
+	struct snapshot_query	query;
+	struct store_post		post;
+	struct comments_count	*cc;
+	int						*shown;
+	int						i, n, total = 0;
+
+	query.bounded = (criteria->type == CRITERIA_TIME_T);
+	query.start = criteria->start;
+	query.end = criteria->end;
+	query.tag = -1;
+	query.until = time(NULL);
+
+	if (criteria->type == CRITERIA_TAGNAME &&
+	    (query.tag = snapshot_find_tag(snap, criteria->tagname)) < 0)
+		return 0;
 
-		snprintf(key, BUFSIZ, "%s_ctime", post->name);
-		if (cdb_find(&cdb, key, strlen(key)) > 0){
-			val = db_get(&cdb);
-			post->ctime = (time_t)strtol(val, NULL, 10);
-			free(val);
-		} else
-			post->ctime = time(NULL);
-
-		SLIST_INSERT_HEAD(&postshead, post, next);
-
-		if (!criteria->feed) {
-			/* while here work on the tags to prevent another userless loop */
-			snprintf(key, BUFSIZ, "%s_tags", post->name);
-			cdb_find(&cdb, key, strlen(key));
-			val = db_get(&cdb);
-
-			val_to_free = val;
-			nbel = splitchr(val, ',');
-			for (i=0; i <= nbel; i++) {
-				next = strlen(val);
-				valtrimed = trimspace(val);
-				found = false;
-				SLIST_FOREACH(tags, &tagshead, next) {
-					if (EQUALS(valtrimed, tags->name)) {
-						found = true;
-						tags->count++;
-						break;
-					}
-				}
-				if (!found) {
-					nbtags++;
-					tags = malloc(sizeof(struct tags));
-					tags->name = strdup(valtrimed);
-					tags->count = 1;
-					SLIST_INSERT_HEAD(&tagshead, tags, next);
-				}
-				val += next + 1;
-			}
-			free(val_to_free);
-		}
+	shown = malloc(max_post * sizeof(int));
+	cc = malloc(max_post * sizeof(struct comments_count));
+	if (shown == NULL || cc == NULL) {
+		free(shown);
+		free(cc);
+		return 0;
 	}
 
-	if (!criteria->feed) {
-		/* process tags */
-		taglist = malloc(nbtags * sizeof(struct tags *));
-
-		i = 0;
-		SLIST_FOREACH(tags, &tagshead, next) {
-			taglist[i] = tags;
-			i++;
-		}
-
-		qsort(taglist, nbtags, sizeof(struct tags *), sort_by_name);
+	total = snapshot_select(snap, &query, first_post, max_post, shown);
 
-		for (i=0; i < nbtags; i++) {
-			set_tag_name(hdf, i, taglist[i]->name);
-			set_tag_count(hdf, i, taglist[i]->count);
-			free(taglist[i]->name);
-			free(taglist[i]);
-		}
-		free(taglist);
+	/* the comments of the page are counted in one batch */
+	for (n=0; n < total - first_post && n < max_post; n++) {
+		cc[n].postname = snapshot_name(snap, shown[n]);
+		cc[n].count = &snap->comments[shown[n]];
+		cc[n].size = &snap->comments_size[shown[n]];
 	}
-
-	/* going back to posts processing */
-	posts = malloc(total_posts * sizeof(struct posts *));
-
-	i = 0;
-	SLIST_FOREACH(post, &postshead, next) {
-		posts[i] = post;
-		i++;
+	get_comments_counts(hdf, cc, n);
+
+	for (i=0; i < n; i++) {
+		post.name = snapshot_name(snap, shown[i]);
+		post.ctime = snap->ctime[shown[i]];
+		post.part = snap->part[shown[i]];
+		add_post_to_hdf(hdf, st, &post, first_post + i, *cc[i].count);
+		(*nb_posts)++;
 	}
+	free(shown);
+	free(cc);
 
-	qsort(posts, total_posts, sizeof(struct posts *), sort_by_ctime);
+	return total;
+}
 
+/* same thing reading every post of the store */
+static int
+build_index_store(HDF *hdf, struct store *st, struct criteria *criteria,
+    int first_post, int max_post, int *nb_posts)
+{
+	struct posts			posts;
+	struct comments_count	*cc;
+	int32_t					*counts;
+	int64_t					*sizes;
+	int						i, n = 0;
+
+	memset(&posts, 0, sizeof(struct posts));
+	posts.st = st;
+	posts.until = time(NULL);
 	switch (criteria->type) {
 		case CRITERIA_TAGNAME:
-			for (i=0; i < total_posts; i++) {
-				snprintf(key, BUFSIZ, "%s_tags", posts[i]->name);
-
-				if (cdb_find(&cdb, key, strlen(key)) > 0) {
-					val = db_get(&cdb);
-					tag = val;
-					nbel = splitchr(val, ',');
-					for (k=0; k <= nbel; k++) {
-						next = strlen(val);
-						tagcmp = trimspace(val);
-
-						if (EQUALS(criteria->tagname, tagcmp)) {
-							j++;
-							if ((j >= first_post) && (nb_posts < max_post)) {
-								add_post_to_hdf(hdf, &cdb, posts[i]->name, j);
-								nb_posts++;
-								break;
-							}
-						}
-						val += next + 1;
-					}
-					free(tag);
-				}
-				free(posts[i]->name);
-				free(posts[i]);
-			}
+			store_tagged(st, criteria->tagname, add_post, &posts);
 			break;
 		case CRITERIA_TIME_T:
-			for (i=0; i < total_posts; i++) {
-				if (posts[i]->ctime >= criteria->start && posts[i]->ctime <= criteria->end) {
-					j++;
-					if ((j >= first_post) && (nb_posts < max_post)) {
-						add_post_to_hdf(hdf, &cdb, posts[i]->name, i);
-						nb_posts++;
-					}
-				}
-				free(posts[i]->name);
-				free(posts[i]);
-			}
+			store_range(st, criteria->start, criteria->end, add_post, &posts);
 			break;
 		default:
-			for (i=first_post; i < total_posts; i++) {
-				if ((i >= first_post) && (nb_posts < max_post)) {
-					add_post_to_hdf(hdf, &cdb, posts[i]->name, i);
-					nb_posts++;
-				}
-				free(posts[i]->name);
-				free(posts[i]);
-			}
-			j = total_posts;
+			store_posts(st, add_post, &posts);
 	}
 
-	free(posts);
+	if (posts.nposts > 0)
+		qsort(posts.posts, posts.nposts, sizeof(struct store_post), sort_by_ctime);
+
+	cc = malloc(max_post * sizeof(struct comments_count));
+	counts = malloc(max_post * sizeof(int32_t));
+	sizes = malloc(max_post * sizeof(int64_t));
+	if (cc != NULL && counts != NULL && sizes != NULL) {
+		for (i=first_post; i < posts.nposts && n < max_post; i++, n++) {
+			counts[n] = -1;
+			cc[n].postname = posts.posts[i].name;
+			cc[n].count = &counts[n];
+			cc[n].size = &sizes[n];
+		}
+		get_comments_counts(hdf, cc, n);
+	}
+
+	for (i=0; i < posts.nposts; i++) {
+		if ((i >= first_post) && (*nb_posts < n)) {
+			add_post_to_hdf(hdf, st, &posts.posts[i], i, counts[*nb_posts]);
+			(*nb_posts)++;
+		}
+		free((char *)posts.posts[i].name);
+	}
+	free(posts.posts);
+	free(cc);
+	free(counts);
+	free(sizes);
+
+	return posts.nposts;
+}
+
+int
+build_index(HDF *hdf, struct criteria *criteria)
+{
+	int					first_post = 0, nb_posts = 0, max_post;
+	int					nb_pages = 0, page, total;
+	struct store		sts, *st;
+	struct snapshot		*snap;
+
+	max_post = hdf_get_int_value(hdf, "posts_per_pages", DEFAULT_POSTS_PER_PAGES);
+	if (max_post <= 0)
+		max_post = DEFAULT_POSTS_PER_PAGES;
+	page = hdf_get_int_value(hdf, "Query.page", 1);
+	if (page <= 0)
+		page = 1;
+	
+	first_post = (page * max_post) - max_post;
+
+	if ((st = db_open(hdf, &sts)) == NULL)
+		return 0;
 
-	nb_pages = j / max_post;
-	if (j % max_post > 0)
+	if (!criteria->feed) {
+		set_tag_counts(hdf, st);
+		set_popular(hdf, st);
+		set_archives(hdf, st);
+	}
+
+	if ((snap = db_snapshot(st)) != NULL)
+		total = build_index_snapshot(hdf, st, snap, criteria, first_post,
+		    max_post, &nb_posts);
+	else
+		total = build_index_store(hdf, st, criteria, first_post, max_post,
+		    &nb_posts);
+	access_entry.cache = snap != NULL ? "snapshot" : "scan";
+	access_entry.posts = total;
+
+	nb_pages = total / max_post;
+	if (total % max_post > 0)
 		nb_pages++;
 
 	set_nb_pages(hdf, nb_pages);
 
-	close(cdb_fileno(&cdb));
-	cdb_free(&cdb);
+	db_close(st);
 
 	return nb_posts;
 }
 
+/*
+ * List the posts holding every word of Query.q, best first, from the
+ * search index kept by cblogctl; the posts themselves are never scanned
+ */
+int
+build_search(HDF *hdf)
+{
+	struct store			sts, *st;
+	struct store_post		post;
+	struct search_docs		*docs;
+	struct search_hit		*hits;
+	struct comments_count	*cc;
+	int32_t					*counts;
+	int64_t					*sizes;
+	int						first_post, max_post, page, nhits, total;
+	int						i, n = 0, nb_pages;
+
+	max_post = hdf_get_int_value(hdf, "posts_per_pages", DEFAULT_POSTS_PER_PAGES);
+	if (max_post <= 0)
+		max_post = DEFAULT_POSTS_PER_PAGES;
+	page = hdf_get_int_value(hdf, "Query.page", 1);
+	if (page <= 0)
+		page = 1;
+	first_post = (page * max_post) - max_post;
+
+	if ((st = db_open(hdf, &sts)) == NULL)
+		return 0;
+
+	set_tag_counts(hdf, st);
+	set_popular(hdf, st);
+	set_archives(hdf, st);
+
+	if (current_site != NULL && st == &current_site->db) {
+		if (current_site->search == NULL)
+			current_site->search = search_docs(st);
+		docs = current_site->search;
+	} else
+		docs = search_docs(st);
+
+	/* only the first SEARCH_MAX_RESULTS posts are ranked */
+	nhits = first_post < SEARCH_MAX_RESULTS ? first_post + max_post : 0;
+	if (nhits > SEARCH_MAX_RESULTS)
+		nhits = SEARCH_MAX_RESULTS;
+	hits = malloc((nhits ? nhits : 1) * sizeof(struct search_hit));
+	cc = malloc(max_post * sizeof(struct comments_count));
+	counts = malloc(max_post * sizeof(int32_t));
+	sizes = malloc(max_post * sizeof(int64_t));
+	total = 0;
+	if (hits != NULL && cc != NULL && counts != NULL && sizes != NULL) {
+		nhits = search_query(st, docs, get_query_str(hdf, "q"), time(NULL),
+		    hits, nhits, &total);
+
+		for (i=first_post; i < nhits; i++, n++) {
+			counts[n] = -1;
+			cc[n].postname = docs->docs[hits[i].doc].name;
+			cc[n].count = &counts[n];
+			cc[n].size = &sizes[n];
+		}
+		get_comments_counts(hdf, cc, n);
+
+		for (i=0; i < n; i++) {
+			post.name = docs->docs[hits[first_post + i].doc].name;
+			post.ctime = docs->docs[hits[first_post + i].doc].ctime;
+			post.part = -1;
+			add_post_to_hdf(hdf, st, &post, first_post + i, counts[i]);
+		}
+	}
+	access_entry.cache = docs != NULL ? "index" : "none";
+	access_entry.posts = total;
+
+	hdf_set_valuef(hdf, "Search.count=%i", total);
+	if (total > SEARCH_MAX_RESULTS)
+		total = SEARCH_MAX_RESULTS;
+	nb_pages = total / max_post;
+	if (total % max_post > 0)
+		nb_pages++;
+	set_nb_pages(hdf, nb_pages);
+
+	if (current_site == NULL || docs != current_site->search)
+		search_docs_free(docs);
+	free(hits);
+	free(cc);
+	free(counts);
+	free(sizes);
+	db_close(st);
+
+	return n;
+}
+
 void
 cblogcgi(HDF *conf)
 {
@@ -457,11 +817,14 @@ cblogcgi(HDF *conf)
 	char				*requesturi, *method, *date_format;
 	int					type, i, nb_posts;
 	time_t				gentime, posttime;
-	int					yyyy, mm, dd, datenum;
+	int					yyyy = 0, mm = 0, dd = 0, datenum;
 	struct criteria		criteria;
 	struct tm			calc_time, *date;
 	char				buf[BUFSIZ];
 	const char			*typefeed;
+	bool				absent = false;
+
+	access_begin();
 
 	/* read the configuration file */
 
@@ -481,6 +844,12 @@ cblogcgi(HDF *conf)
 			nerr_ignore(&neoerr);
 	}
 
+	/* pick the blog serving this virtual host */
+	current_site = site_find(hdf_get_value(cgi->hdf, "HTTP.Host",
+				get_cgi_str(cgi->hdf, "ServerName")));
+	if (current_site != NULL)
+		conf = current_site->conf;
+
 	neoerr = hdf_copy(cgi->hdf, "", conf);
 	nerr_ignore(&neoerr);
 
@@ -529,6 +898,9 @@ cblogcgi(HDF *conf)
 		}
 	}
 
+	memset(&calc_time, 0, sizeof(struct tm));
+	calc_time.tm_isdst = -1;
+
 	switch (type) {
 		case CBLOG_POST:
 			requesturi++;
@@ -536,6 +908,11 @@ cblogcgi(HDF *conf)
 				requesturi++;
 			requesturi++;
 
+			if (db_absent(cgi->hdf, requesturi, false)) {
+				absent = true;
+				type = CBLOG_ERR;
+				break;
+			}
 			nb_posts = build_post(cgi->hdf, requesturi);
 			if (nb_posts == 0) {
 				hdf_set_valuef(cgi->hdf, "err_msg=Unknown post: %s", requesturi);
@@ -550,6 +927,11 @@ cblogcgi(HDF *conf)
 			requesturi++;
 			criteria.type = CRITERIA_TAGNAME;
 			criteria.tagname = requesturi;
+			if (db_absent(cgi->hdf, requesturi, true)) {
+				absent = true;
+				type = CBLOG_ERR;
+				break;
+			}
 			nb_posts = build_index(cgi->hdf, &criteria);
 			if (nb_posts == 0) {
 				hdf_set_valuef(cgi->hdf, "err_msg=Unknown tag: %s", requesturi);
@@ -560,6 +942,21 @@ cblogcgi(HDF *conf)
 			criteria.feed = true;
 			build_index(cgi->hdf, &criteria);
 			break;
+		case CBLOG_ARCHIVES:
+			hdf_set_value(cgi->hdf, "archives_page", "1");
+			break;
+		case CBLOG_SITEMAP:
+			if (build_sitemap(cgi->hdf, requesturi) == -1) {
+				hdf_set_valuef(cgi->hdf, "err_msg=Unknown request: %s", requesturi);
+				type = CBLOG_ERR;
+			}
+			break;
+		case CBLOG_SEARCH:
+			build_search(cgi->hdf);
+			break;
+		case CBLOG_SUGGEST:
+			build_suggest(cgi->hdf);
+			break;
 		case CBLOG_ROOT:
 			build_index(cgi->hdf, &criteria);
 			break;
@@ -628,13 +1025,25 @@ cblogcgi(HDF *conf)
 			hdf_set_valuef(cgi->hdf, "cgiout.ContentType=application/atom+xml");
 			neoerr = cgi_display(cgi, hdf_get_value(cgi->hdf, "feed.atom", "atom.cs"));
 			break;
+		case CBLOG_SITEMAP:
+		case CBLOG_SUGGEST:
+			break;
 		case CBLOG_ERR:
 			cgiwrap_writef("Status: 404\n");
+			if (absent) {
+				neoerr = display_page(cgi, PAGE_NOTFOUND);
+				break;
+			}
 			set_tags(cgi->hdf);
 			neoerr = cgi_display(cgi, get_cgi_theme(cgi->hdf));
 			break;
 		default:
-			if (type == CBLOG_POST)
+			/* the archives of a site are the same for every request */
+			if (type == CBLOG_ARCHIVES && current_site != NULL) {
+				neoerr = display_page(cgi, PAGE_ARCHIVES);
+				break;
+			}
+			if (type == CBLOG_POST || type == CBLOG_ARCHIVES)
 				set_tags(cgi->hdf);
 
 			date_format = get_dateformat(cgi->hdf);
@@ -655,6 +1064,34 @@ cblogcgi(HDF *conf)
 		string_clear(&neoerr_str);
 	}*/
 	nerr_ignore(&neoerr);
+
+	/* what was asked, for the access log */
+	if (type == CBLOG_POST) {
+		snprintf(access_entry.criteria, sizeof(access_entry.criteria), "%s",
+		    requesturi);
+	} else if (type == CBLOG_SUGGEST) {
+		snprintf(access_entry.criteria, sizeof(access_entry.criteria), "%s",
+		    hdf_get_value(cgi->hdf, "Query.q", ""));
+	} else if (type != CBLOG_ERR && type != CBLOG_SITEMAP && type != CBLOG_ARCHIVES) {
+		i = 0;
+		if (type == CBLOG_SEARCH)
+			i = snprintf(buf, BUFSIZ, "%s ",
+			    hdf_get_value(cgi->hdf, "Query.q", ""));
+		else if (criteria.type == CRITERIA_TAGNAME)
+			i = snprintf(buf, BUFSIZ, "%s ", criteria.tagname);
+		else if (criteria.type == CRITERIA_TIME_T && dd > 0)
+			i = snprintf(buf, BUFSIZ, "%04d/%02d/%02d ", yyyy, mm, dd);
+		else if (criteria.type == CRITERIA_TIME_T && mm > 0)
+			i = snprintf(buf, BUFSIZ, "%04d/%02d ", yyyy, mm);
+		else if (criteria.type == CRITERIA_TIME_T)
+			i = snprintf(buf, BUFSIZ, "%04d ", yyyy);
+		snprintf(access_entry.criteria, sizeof(access_entry.criteria),
+		    "%.*spage=%d", i, buf, hdf_get_int_value(cgi->hdf, "Query.page", 1));
+	}
+	access_end(cgi->hdf, type);
 	cgi_destroy(&cgi);
+
+	if (current_site != NULL)
+		site_trim(current_site);
 }
 /* vim: set sw=4 sts=4 ts=4 : */
@@ -1,9 +1,22 @@
 #ifndef	CBLOG_CGI_CBLOG_CGI_H
 #define	CBLOG_CGI_CBLOG_CGI_H
 
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <stdbool.h>
+#include <time.h>
 #include <fcgi_stdio.h>
 #include <ClearSilver.h>
 
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_snapshot.h"
+#include "cblog_search.h"
+#include "cblog_bloom.h"
+#include "cblog_views.h"
+#include "cblog_logger.h"
+
 #define CBLOG_POST 0
 #define CBLOG_TAG 1
 #define CBLOG_ATOM 2
@@ -12,6 +25,10 @@
 #define CBLOG_YYYY 5
 #define CBLOG_YYYY_MM 6
 #define CBLOG_YYYY_MM_DD 7
+#define CBLOG_SITEMAP 8
+#define CBLOG_ARCHIVES 9
+#define CBLOG_SEARCH 10
+#define CBLOG_SUGGEST 11
 
 #define CRITERIA_TAGNAME 1
 #define CRITERIA_TIME_T 2
@@ -20,6 +37,13 @@
 #define DEFAULT_POSTS_PER_PAGES 10
 #define DEFAULT_THEME "default"
 #define DEFAULT_DB CDB_PATH"/cblog.cdb"
+#define DEFAULT_VIEWS_SLOTS 8192
+#define DEFAULT_VIEWS_FLUSH 60
+#define DEFAULT_VIEWS_POPULAR 5
+#define DEFAULT_ACCESS_BUFFER 65536
+#define DEFAULT_ACCESS_FLUSH 5
+#define SEARCH_MAX_RESULTS 1000
+#define DEFAULT_SUGGEST_COUNT 10
 
 #define DATE_FEED "%a, %d %b %Y %H:%M:%S %z"
 
@@ -28,6 +52,8 @@
 #define get_cgi_theme(hdf) hdf_get_value(hdf, "theme", DEFAULT_THEME)
 #define get_dateformat(hdf)  hdf_get_value(hdf, "dateformat", "%d/%m/%Y")
 #define get_cblog_db(hdf) hdf_get_value(hdf, "db_path", DEFAULT_DB)
+#define get_db_backend(hdf) hdf_get_value(hdf, "db_backend", NULL)
+#define get_comments_dir(hdf) hdf_get_value(hdf, "comments_path", CDB_PATH"/comments")
 
 #define set_post_date(hdf, pos, date) hdf_set_valuef(hdf, "Posts.%i.date=%s", pos, date)
 #define set_nb_pages(hdf, pages) hdf_set_valuef(hdf, "nbpages=%i", pages)
@@ -35,16 +61,139 @@
 #define set_tag_count(hdf, pos, count) hdf_set_valuef(hdf, "Tags.%i.count=%i", pos, count)
 
 #define CONFFILE ETCDIR"/cblog.conf"
+#define CONFDIR ETCDIR"/cblog.d"
 
 #define HDF_FOREACH(var, hdf, node)		    \
     for ((var) = hdf_get_child((hdf), node);	    \
 	    (var);				    \
 	    (var) = hdf_obj_next((var)))
 
+/* most viewed posts of a site, refreshed every views_flush seconds */
+struct popular {
+	time_t				at;
+	int					nposts;
+	struct views_entry	*posts;
+	char				**titles;
+};
+
+/* sitemap.xml of a site, parts[0] indexes the others past 50000 URLs */
+struct sitemap {
+	int		nparts;
+	struct	sitemap_part {
+		char	*xml;
+		size_t	len;
+		char	*gz;		/* NULL if compression failed */
+		size_t	gzlen;
+	} *parts;
+};
+
+/* pages rendered once for a site and served to every request asking them */
+#define PAGE_NOTFOUND	0	/* 404 page of what names rules out */
+#define PAGE_ARCHIVES	1
+#define PAGES			2
+
+struct site_page {
+	char	*buf;		/* NULL until first rendered */
+	size_t	len;
+};
+
+/* posts of a site dated in the future, the soonest first */
+struct schedule {
+	int		nposts;
+	struct	scheduled {
+		time_t	at;
+		char	*name;
+	} *posts;
+};
+
+/* one blog served by the daemon, selected by its "host" config value */
+struct site {
+	HDF			*conf;
+	bool		owned;		/* conf is freed with the site */
+	bool		db_opened;	/* db is kept open between requests */
+	struct store	db;
+	struct snapshot	*snap;	/* metadata of db, NULL if disabled */
+	bool		snap_read;	/* snap was built, or failed to be */
+	char		db_path[MAXPATHLEN];
+	dev_t		db_dev;
+	ino_t		db_ino;
+	time_t		db_mtime;
+	struct views	*views;		/* NULL unless "views" is set */
+	bool		views_opened;
+	struct popular	popular;
+	struct sitemap	*sitemap;	/* built on the first request */
+	char		*archives;	/* histogram of db, NULL until read */
+	struct search_docs	*search;	/* posts of the search index, NULL until read */
+	struct search_suggest	*suggest;	/* completions, NULL until read */
+	struct bloom	*names;		/* posts and tags filter, NULL if none */
+	bool		names_read;
+	struct site_page	pages[PAGES];	/* rendered on first request */
+	struct schedule	schedule;	/* read when db is opened */
+	unsigned	cache_held;	/* caches found by the last site_trim */
+	unsigned	cache_logged;	/* caches site_trim already logged */
+	SLIST_ENTRY(site) next;
+};
+
+/* comments of a listed post, count and size cache them between requests */
+struct comments_count {
+	const char	*postname;
+	int32_t		*count;		/* -1 until counted */
+	int64_t		*size;		/* of the comment file when counted */
+};
+
+/* allocations of a request, counted when built with ALLOC_STATS */
+struct alloc_stats {
+	unsigned long		count;
+	unsigned long long	bytes;
+	size_t				peak;	/* most bytes held at once */
+};
+
+/* what the current request did, for the access log */
+struct access_entry {
+	struct timespec	start;
+	char		criteria[128];	/* post, tag or date asked, and page */
+	int			status;
+	size_t		bytes;		/* sent, headers included */
+	const char	*cache;		/* how the posts were found, NULL if not listed */
+	int			posts;		/* posts matching a listing, -1 if none */
+	struct alloc_stats	alloc;
+};
+
+extern struct site	*current_site;
+extern struct access_entry	access_entry;
+extern char			*mandatory_config[];
+
 void	cblogcgi(HDF *conf);
-int		get_comments_count(char *postname);
-void	get_comments(HDF *hdf, char *postname);
+int		check_conf(HDF *conf);
+int		sites_init(HDF *conf);
+struct site	*site_find(const char *hostname);
+struct store	*site_db(struct site *site, const char *path);
+struct views	*site_views(struct site *site);
+bool	site_scheduled(struct site *site, const char *name);
+struct snapshot	*site_snapshot(struct site *site);
+int		site_tags(struct site *site, struct store *st, time_t until,
+		    store_tag_cb cb, void *arg);
+void	site_trim(struct site *site);
+struct store	*db_open(HDF *hdf, struct store *st);
+void	db_close(struct store *st);
+int		build_sitemap(HDF *hdf, const char *requesturi);
+void	sitemap_free(struct sitemap *sitemap);
+int		build_suggest(HDF *hdf);
+int		get_comments_count(HDF *hdf, char *postname);
+void	get_comments_counts(HDF *hdf, struct comments_count *cc, int n);
+int		get_comments(HDF *hdf, char *postname);
 void	set_comment(HDF *hdf, char *postname);
 void	cblog_err(int eval, const char * message, ...);
+int		access_open(HDF *conf);
+void	access_begin(void);
+void	access_end(HDF *hdf, int type);
+void	access_flush(void);
+#ifdef ALLOC_STATS
+void	alloc_begin(void);
+void	alloc_end(struct alloc_stats *stats);
+#else
+#define alloc_begin()
+#define alloc_end(stats)
+#endif
 
 #endif	/* ndef CBLOG_CGI_CBLOG_CGI_H */
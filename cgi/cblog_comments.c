@@ -6,107 +6,133 @@
 #include <fcntl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <stdint.h>
 
 #include "cblog_cgi.h"
 #include "cblog_utils.h"
+#include "cblog_io.h"
 #include <syslog.h>
 
-int
-get_comments_count(char *postname)
+/* number of comments in the content of a comment file, which is modified */
+static int
+count_comments(char *buffer)
 {
-	char		comment_file[MAXPATHLEN];
-	int			commentfd;
 	int			count = 0, j = 0, nbel = 0;
-	struct stat	comment_stat;
 	size_t		next;
-	char		*buffer = NULL, *bufstart;
-
-	snprintf(comment_file, MAXPATHLEN, CDB_PATH"/comments/%s", postname);
-
-	if (stat(comment_file, &comment_stat) == -1)
-		return count;
-
-	if ((buffer = malloc((comment_stat.st_size + 1) * sizeof(char))) == NULL)
-		return count;
-
-	if ((commentfd = open(comment_file, O_RDONLY)) == -1 ) {
-		free(buffer);
-		return count;
-	}
-
-	if (read(commentfd, buffer, comment_stat.st_size) != comment_stat.st_size) {
-		free(buffer);
-		return count;
-	}
-
-	buffer[comment_stat.st_size] = '\0';
-
-	if (close(commentfd) == -1) {
-		free(buffer);
-		return count;
-	}
 
-	bufstart = buffer;
 	nbel = splitchr(buffer, '\n');
-	next = strlen(buffer);
 
 	for (j=0; j <= nbel; j++) {
+		next = strlen(buffer);
 		if (STARTS_WITH(buffer, "--"))
 			count++;
 
 		buffer += next + 1;
-		next = strlen(buffer);
 	}
 
-	free(buffer);
-
 	return count;
 }
 
-void
-get_comments(HDF *hdf, char *postname)
+int
+get_comments_count(HDF *hdf, char *postname)
 {
-	char		comment_file[MAXPATHLEN];
-	int			commentfd;
-	char		*date_format;
-	time_t		comment_date;
-	char		date[256];
-	int			count = 0;
-	int			nbel = 0, j = 0;
-	char		*buffer = NULL, *bufstart;
-	struct stat	comment_stat;
-	size_t		next;
+	struct comments_count	cc;
+	int32_t					count = -1;
+	int64_t					size = -1;
 
-	date_format = get_dateformat(hdf);
-
-	snprintf(comment_file, MAXPATHLEN, CDB_PATH"/comments/%s", postname);
-	if (stat(comment_file, &comment_stat) == -1)
-		return;
+	cc.postname = postname;
+	cc.count = &count;
+	cc.size = &size;
+	get_comments_counts(hdf, &cc, 1);
 
-	if ((buffer = malloc((comment_stat.st_size + 1) * sizeof(char))) == NULL)
-		return;
+	return count;
+}
 
-	if ((commentfd = open(comment_file, O_RDONLY)) == -1 ) {
-		free(buffer);
+/*
+ * Count the comments of n posts, reading their comment files as one
+ * batch. A file is only read again when its size is not the one it had
+ * when its count was computed.
+ */
+void
+get_comments_counts(HDF *hdf, struct comments_count *cc, int n)
+{
+	char			(*paths)[MAXPATHLEN];
+	struct io_file	*files;
+	int				*stale;
+	int				i, nstale = 0;
+
+	paths = malloc(n * sizeof(*paths));
+	files = calloc(n, sizeof(struct io_file));
+	stale = calloc(n, sizeof(int));
+	if (paths == NULL || files == NULL || stale == NULL) {
+		for (i=0; i<n; i++)
+			*cc[i].count = 0;
+		free(paths);
+		free(files);
+		free(stale);
 		return;
 	}
 
-	if (read(commentfd, buffer, comment_stat.st_size) != comment_stat.st_size) {
-		free(buffer);
-		return;
+	for (i=0; i<n; i++) {
+		snprintf(paths[i], MAXPATHLEN, "%s/%s", get_comments_dir(hdf), cc[i].postname);
+		io_file_init(&files[i], paths[i]);
+	}
+	io_stat(files, n);
+
+	/* move the files to read first */
+	for (i=0; i<n; i++) {
+		if (files[i].error != 0) {
+			*cc[i].count = 0;
+			*cc[i].size = -1;
+		} else if (*cc[i].count < 0 || *cc[i].size != files[i].size) {
+			*cc[i].size = files[i].size;
+			files[nstale] = files[i];
+			stale[nstale++] = i;
+		}
+	}
+	io_read(files, nstale);
+
+	for (i=0; i<nstale; i++) {
+		if (files[i].data == NULL) {
+			*cc[stale[i]].count = 0;
+			*cc[stale[i]].size = -1;
+			continue;
+		}
+		*cc[stale[i]].count = count_comments(files[i].data);
+		free(files[i].data);
 	}
 
-	buffer[comment_stat.st_size] = '\0';
+	free(paths);
+	free(files);
+	free(stale);
+}
 
-	if (close(commentfd) == -1) {
-		free(buffer);
-		return;
-	}
+/* set the comments of postname in Posts.0.comments, returns their number */
+int
+get_comments(HDF *hdf, char *postname)
+{
+	char			comment_file[MAXPATHLEN];
+	char			*date_format;
+	time_t			comment_date;
+	char			date[256];
+	int				count = 0;
+	int				nbel = 0, j = 0;
+	char			*buffer;
+	struct io_file	file;
+	size_t			next;
+
+	date_format = get_dateformat(hdf);
 
-	bufstart = buffer;
+	snprintf(comment_file, MAXPATHLEN, "%s/%s", get_comments_dir(hdf), postname);
+	io_file_init(&file, comment_file);
+	io_read(&file, 1);
+	if (file.data == NULL)
+		return 0;
+
+	buffer = file.data;
 	nbel = splitchr(buffer, '\n');
-	next = strlen(buffer);
 	while (j <= nbel) {
+		next = strlen(buffer);
 		if (STARTS_WITH(buffer, "comment: "))
 			hdf_set_valuef(hdf, "Posts.0.comments.%i.content=%s", count, cgi_url_unescape(buffer + 9));
 
@@ -126,10 +152,11 @@ get_comments(HDF *hdf, char *postname)
 
 		buffer += next + 1;
 		j++;
-		next = strlen(buffer);
 	}
 	
-	free(bufstart);
+	free(file.data);
+
+	return count;
 }
 
 void
@@ -159,7 +186,7 @@ set_comment(HDF *hdf, char *postname)
 	if (strlen(get_query_str(hdf, "name")) == 0 || strlen(get_query_str(hdf, "comment")) == 0)
 		return;
 
-	snprintf(comment_file, MAXPATHLEN, CDB_PATH"/comments/%s", postname);
+	snprintf(comment_file, MAXPATHLEN, "%s/%s", get_comments_dir(hdf), postname);
 
 	comment_fd = fopen(comment_file, "a");
 
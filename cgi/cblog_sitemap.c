@@ -0,0 +1,358 @@
+#include <sys/types.h>
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "cblog_cgi.h"
+
+/* most URLs a sitemap file may list */
+#define SITEMAP_MAX_URLS	50000
+
+#define SITEMAP_HEADER	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+#define SITEMAP_NS		"http://www.sitemaps.org/schemas/sitemap/0.9"
+
+struct sitemap_url {
+	char	*loc;		/* path below the blog url, already escaped */
+	time_t	lastmod;	/* 0 if unknown */
+};
+
+struct sitemap_urls {
+	int					nurls;
+	int					asize;
+	struct sitemap_url	*urls;
+	int					nposts;
+	int					psize;
+	struct store_post	*posts;		/* names are copies */
+	struct store		*st;
+	time_t				until;		/* posts dated later are not live yet */
+};
+
+static void
+sitemap_add(struct sitemap_urls *urls, const char *prefix, const char *name,
+    time_t lastmod)
+{
+	static const char	hex[] = "0123456789ABCDEF";
+	STRING				loc;
+	char				c[3];
+
+	if (urls->nurls == urls->asize) {
+		urls->asize = urls->asize ? urls->asize * 2 : 256;
+		urls->urls = realloc(urls->urls, urls->asize * sizeof(struct sitemap_url));
+		if (urls->urls == NULL)
+			errx(1, "Unable to allocate memory");
+	}
+
+	/* names are percent encoded, which leaves nothing to escape for XML */
+	string_init(&loc);
+	string_append(&loc, prefix);
+	for (; name != NULL && *name != '\0'; name++) {
+		if (isalnum((unsigned char)*name) || strchr("-_.~", *name) != NULL) {
+			string_appendn(&loc, name, 1);
+		} else {
+			c[0] = '%';
+			c[1] = hex[(unsigned char)*name >> 4];
+			c[2] = hex[(unsigned char)*name & 0xf];
+			string_appendn(&loc, c, 3);
+		}
+	}
+
+	urls->urls[urls->nurls].loc = loc.buf;
+	urls->urls[urls->nurls++].lastmod = lastmod;
+}
+
+static int
+sitemap_add_post(struct store_post *post, void *arg)
+{
+	struct sitemap_urls	*urls = arg;
+	char				*published;
+	bool				draft;
+
+	if (post->ctime > urls->until)
+		return 0;
+
+	published = store_get(urls->st, post, "published");
+	draft = store_post_draft(published);
+	free(published);
+	if (draft)
+		return 0;
+
+	if (urls->nposts == urls->psize) {
+		urls->psize = urls->psize ? urls->psize * 2 : 64;
+		urls->posts = realloc(urls->posts, urls->psize * sizeof(struct store_post));
+		if (urls->posts == NULL)
+			return -1;
+	}
+	urls->posts[urls->nposts] = *post;
+	urls->posts[urls->nposts++].name = strdup(post->name);
+
+	return 0;
+}
+
+/* last change of a post, its date if it has not been changed since */
+static time_t
+sitemap_lastmod(struct store *st, struct store_post *post)
+{
+	char	*val;
+	time_t	mtime = 0;
+
+	if ((val = store_get(st, post, "mtime")) != NULL) {
+		mtime = (time_t)strtoll(val, NULL, 10);
+		free(val);
+	}
+
+	return mtime > post->ctime ? mtime : post->ctime;
+}
+
+static int
+sitemap_cmp_ctime(const void *a, const void *b)
+{
+	const struct store_post	*pa = a;
+	const struct store_post	*pb = b;
+
+	if (pa->ctime == pb->ctime)
+		return 0;
+
+	return pa->ctime < pb->ctime ? 1 : -1;
+}
+
+static int
+sitemap_add_tag(const char *name, int count, void *arg)
+{
+	sitemap_add(arg, "/tag/", name, 0);
+
+	return 0;
+}
+
+static void
+sitemap_append_url(STRING *out, const char *tag, const char *base,
+    struct sitemap_url *url)
+{
+	struct tm	tm;
+	char		date[32];
+
+	string_appendf(out, "<%s><loc>", tag);
+	for (; *base != '\0'; base++) {
+		if (*base == '&')
+			string_append(out, "&amp;");
+		else if (*base == '<')
+			string_append(out, "&lt;");
+		else if (*base == '>')
+			string_append(out, "&gt;");
+		else
+			string_appendn(out, base, 1);
+	}
+	string_append(out, url->loc);
+	string_append(out, "</loc>");
+	if (url->lastmod > 0) {
+		gmtime_r(&url->lastmod, &tm);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		string_appendf(out, "<lastmod>%s</lastmod>", date);
+	}
+	string_appendf(out, "</%s>\n", tag);
+}
+
+/* keep the text and the gzip version of a sitemap file */
+static void
+sitemap_part(struct sitemap_part *part, STRING *xml)
+{
+	z_stream	zs;
+
+	part->xml = xml->buf;
+	part->len = xml->len;
+	part->gz = NULL;
+	part->gzlen = 0;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+
+	part->gzlen = deflateBound(&zs, xml->len);
+	if ((part->gz = malloc(part->gzlen)) != NULL) {
+		zs.next_in = (Bytef *)xml->buf;
+		zs.avail_in = xml->len;
+		zs.next_out = (Bytef *)part->gz;
+		zs.avail_out = part->gzlen;
+		if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+			part->gzlen = zs.total_out;
+		} else {
+			free(part->gz);
+			part->gz = NULL;
+		}
+	}
+	deflateEnd(&zs);
+}
+
+/*
+ * List the root, the archives, every live post, tag, year and month. Past
+ * SITEMAP_MAX_URLS URLs, /sitemap.xml becomes an index of /sitemap-N.xml.
+ */
+static struct sitemap *
+sitemap_build(HDF *hdf, struct store *st)
+{
+	struct sitemap		*sitemap;
+	struct sitemap_urls	urls;
+	struct store_post	*posts;
+	struct sitemap_url	index;
+	struct tm			tm;
+	STRING				xml;
+	char				path[32], base[BUFSIZ];
+	char				*url;
+	int					i, j, month = -1, year = -1, nfiles;
+	size_t				len;
+
+	if ((sitemap = calloc(1, sizeof(struct sitemap))) == NULL)
+		return NULL;
+
+	memset(&urls, 0, sizeof(struct sitemap_urls));
+	urls.st = st;
+	urls.until = time(NULL);
+	store_posts(st, sitemap_add_post, &urls);
+	posts = urls.posts;
+	if (urls.nposts > 0)
+		qsort(posts, urls.nposts, sizeof(struct store_post), sitemap_cmp_ctime);
+
+	sitemap_add(&urls, "/", NULL, urls.nposts > 0 ? posts[0].ctime : 0);
+	sitemap_add(&urls, "/archives", NULL, urls.nposts > 0 ? posts[0].ctime : 0);
+	for (i=0; i < urls.nposts; i++)
+		sitemap_add(&urls, "/post/", posts[i].name,
+		    sitemap_lastmod(st, &posts[i]));
+	site_tags(current_site, st, urls.until, sitemap_add_tag, &urls);
+
+	/* archives, the first post met being the newest of its month */
+	for (i=0; i < urls.nposts; i++) {
+		localtime_r(&posts[i].ctime, &tm);
+		if (tm.tm_year != year) {
+			year = tm.tm_year;
+			snprintf(path, sizeof(path), "/%04d", year + 1900);
+			sitemap_add(&urls, path, NULL, posts[i].ctime);
+			month = -1;
+		}
+		if (tm.tm_mon != month) {
+			month = tm.tm_mon;
+			snprintf(path, sizeof(path), "/%04d/%02d", year + 1900, month + 1);
+			sitemap_add(&urls, path, NULL, posts[i].ctime);
+		}
+		free((char *)posts[i].name);
+	}
+	free(posts);
+
+	url = hdf_get_value(hdf, "url", "");
+	len = strlen(url);
+	while (len > 0 && url[len - 1] == '/')
+		len--;
+	snprintf(base, sizeof(base), "%.*s", (int)len, url);
+
+	nfiles = (urls.nurls + SITEMAP_MAX_URLS - 1) / SITEMAP_MAX_URLS;
+	sitemap->nparts = nfiles > 1 ? nfiles + 1 : 1;
+	sitemap->parts = calloc(sitemap->nparts, sizeof(struct sitemap_part));
+	if (sitemap->parts == NULL)
+		errx(1, "Unable to allocate memory");
+
+	if (nfiles > 1) {
+		string_init(&xml);
+		string_append(&xml, SITEMAP_HEADER "<sitemapindex xmlns=\"" SITEMAP_NS "\">\n");
+		for (i=0; i < nfiles; i++) {
+			index.lastmod = 0;
+			for (j=i * SITEMAP_MAX_URLS; j < urls.nurls && j < (i + 1) * SITEMAP_MAX_URLS; j++) {
+				if (urls.urls[j].lastmod > index.lastmod)
+					index.lastmod = urls.urls[j].lastmod;
+			}
+			snprintf(path, sizeof(path), "/sitemap-%d.xml", i + 1);
+			index.loc = path;
+			sitemap_append_url(&xml, "sitemap", base, &index);
+		}
+		string_append(&xml, "</sitemapindex>\n");
+		sitemap_part(&sitemap->parts[0], &xml);
+	}
+
+	for (i=0; i < nfiles || i == 0; i++) {
+		string_init(&xml);
+		string_append(&xml, SITEMAP_HEADER "<urlset xmlns=\"" SITEMAP_NS "\">\n");
+		for (j=i * SITEMAP_MAX_URLS; j < urls.nurls && j < (i + 1) * SITEMAP_MAX_URLS; j++)
+			sitemap_append_url(&xml, "url", base, &urls.urls[j]);
+		string_append(&xml, "</urlset>\n");
+		sitemap_part(&sitemap->parts[nfiles > 1 ? i + 1 : 0], &xml);
+	}
+
+	for (i=0; i < urls.nurls; i++)
+		free(urls.urls[i].loc);
+	free(urls.urls);
+
+	return sitemap;
+}
+
+void
+sitemap_free(struct sitemap *sitemap)
+{
+	int	i;
+
+	if (sitemap == NULL)
+		return;
+
+	for (i=0; i < sitemap->nparts; i++) {
+		free(sitemap->parts[i].xml);
+		free(sitemap->parts[i].gz);
+	}
+	free(sitemap->parts);
+	free(sitemap);
+}
+
+/*
+ * Send /sitemap.xml or /sitemap-N.xml, built on the first request after
+ * the database changed. Returns -1 if there is no such file.
+ */
+int
+build_sitemap(HDF *hdf, const char *requesturi)
+{
+	struct store		sts, *st;
+	struct sitemap		*sitemap = NULL;
+	struct sitemap_part	*part;
+	char				*encodings, *method;
+	int					n = 0, ret = 0;
+	bool				gzip;
+
+	if (!EQUALS(requesturi, "/sitemap.xml") &&
+	    (sscanf(requesturi, "/sitemap-%d.xml", &n) != 1 || n <= 0))
+		return -1;
+
+	if ((st = db_open(hdf, &sts)) == NULL)
+		return -1;
+
+	access_entry.cache = "miss";
+	if (current_site != NULL && st == &current_site->db) {
+		if (current_site->sitemap == NULL)
+			current_site->sitemap = sitemap_build(hdf, st);
+		else
+			access_entry.cache = "hit";
+		sitemap = current_site->sitemap;
+	} else
+		sitemap = sitemap_build(hdf, st);
+
+	if (sitemap == NULL || n >= sitemap->nparts) {
+		ret = -1;
+	} else {
+		part = &sitemap->parts[n];
+		encodings = hdf_get_value(hdf, "HTTP.AcceptEncoding", NULL);
+		gzip = part->gz != NULL && encodings != NULL && strstr(encodings, "gzip") != NULL;
+		method = get_cgi_str(hdf, "RequestMethod");
+
+		cgiwrap_writef("Content-Type: application/xml; charset=utf-8\n");
+		cgiwrap_writef("Vary: Accept-Encoding\n");
+		if (gzip)
+			cgiwrap_writef("Content-Encoding: gzip\n");
+		cgiwrap_writef("Content-Length: %zu\n\n", gzip ? part->gzlen : part->len);
+		if (method == NULL || !EQUALS(method, "HEAD"))
+			cgiwrap_write(gzip ? part->gz : part->xml, gzip ? part->gzlen : part->len);
+	}
+
+	if (current_site == NULL || sitemap != current_site->sitemap)
+		sitemap_free(sitemap);
+	db_close(st);
+
+	return ret;
+}
@@ -0,0 +1,755 @@
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cblog_utils.h"
+#include "cblog_cgi.h"
+
+static SLIST_HEAD(, site) siteshead = SLIST_HEAD_INITIALIZER(siteshead);
+static struct site *default_site = NULL;
+struct site *current_site = NULL;
+
+char *mandatory_config[] = {
+	"title",
+	"url",
+	"dateformat",
+	"hdf.loadpaths.tpl",
+	"db_path",
+	"theme",
+	"posts_per_pages",
+	NULL,
+};
+
+int
+check_conf(HDF *conf)
+{
+	int i = 0;
+	while (mandatory_config[i]) {
+		if (! hdf_get_obj(conf, mandatory_config[i]))
+			return i;
+		i++;
+	}
+	return -1;
+}
+
+static struct site *
+site_new(HDF *conf, bool owned)
+{
+	struct site *site;
+
+	if ((site = calloc(1, sizeof(struct site))) == NULL)
+		return NULL;
+
+	site->conf = conf;
+	site->owned = owned;
+
+	return site;
+}
+
+static void
+site_free_popular(struct site *site)
+{
+	int	i;
+
+	for (i = 0; i < site->popular.nposts; i++)
+		free(site->popular.titles[i]);
+	free(site->popular.titles);
+	free(site->popular.posts);
+	memset(&site->popular, 0, sizeof(struct popular));
+}
+
+static void
+site_free_schedule(struct site *site)
+{
+	int	i;
+
+	for (i = 0; i < site->schedule.nposts; i++)
+		free(site->schedule.posts[i].name);
+	free(site->schedule.posts);
+	memset(&site->schedule, 0, sizeof(struct schedule));
+}
+
+/* the caches of a site, read again when next needed */
+#define SITE_POPULAR	0
+#define SITE_SITEMAP	1
+#define SITE_ARCHIVES	2
+#define SITE_SEARCH		3
+#define SITE_SUGGEST	4
+#define SITE_NAMES		5
+#define SITE_NOTFOUND	6
+#define SITE_ARCHIVES_PAGE	7
+#define SITE_SNAPSHOT	8
+#define SITE_CACHES		9
+
+static const char *site_caches[SITE_CACHES] = {
+	"popular posts",
+	"sitemap",
+	"archives",
+	"search index",
+	"completions",
+	"names filter",
+	"404 page",
+	"archives page",
+	"snapshot",
+};
+
+/* bytes held by a cache of the site */
+static size_t
+site_cache_size(struct site *site, int cache)
+{
+	size_t	size = 0;
+	int		i;
+
+	switch (cache) {
+	case SITE_POPULAR:
+		if (site->popular.posts == NULL)
+			break;
+		size = hdf_get_int_value(site->conf, "views_popular",
+		    DEFAULT_VIEWS_POPULAR) *
+		    (sizeof(struct views_entry) + sizeof(char *));
+		for (i = 0; i < site->popular.nposts; i++) {
+			if (site->popular.titles[i] != NULL)
+				size += strlen(site->popular.titles[i]) + 1;
+		}
+		break;
+	case SITE_SITEMAP:
+		if (site->sitemap == NULL)
+			break;
+		size = sizeof(struct sitemap) +
+		    site->sitemap->nparts * sizeof(struct sitemap_part);
+		for (i = 0; i < site->sitemap->nparts; i++)
+			size += site->sitemap->parts[i].len +
+			    site->sitemap->parts[i].gzlen;
+		break;
+	case SITE_ARCHIVES:
+		if (site->archives != NULL)
+			size = strlen(site->archives) + 1;
+		break;
+	case SITE_SEARCH:
+		if (site->search != NULL)
+			size = site->search->size;
+		break;
+	case SITE_SUGGEST:
+		if (site->suggest != NULL)
+			size = site->suggest->size;
+		break;
+	case SITE_NAMES:
+		if (site->names != NULL)
+			size = sizeof(struct bloom) + site->names->nbits / 8;
+		break;
+	case SITE_NOTFOUND:
+		size = site->pages[PAGE_NOTFOUND].len;
+		break;
+	case SITE_ARCHIVES_PAGE:
+		size = site->pages[PAGE_ARCHIVES].len;
+		break;
+	case SITE_SNAPSHOT:
+		if (site->snap != NULL)
+			size = snapshot_size(site->snap);
+		break;
+	}
+
+	return size;
+}
+
+static void
+site_drop_page(struct site *site, int page)
+{
+	free(site->pages[page].buf);
+	site->pages[page].buf = NULL;
+	site->pages[page].len = 0;
+}
+
+static void
+site_drop_cache(struct site *site, int cache)
+{
+	/* built again, it is a new cache for site_trim */
+	site->cache_held &= ~(1U << cache);
+
+	switch (cache) {
+	case SITE_POPULAR:
+		site_free_popular(site);
+		break;
+	case SITE_SITEMAP:
+		sitemap_free(site->sitemap);
+		site->sitemap = NULL;
+		break;
+	case SITE_ARCHIVES:
+		free(site->archives);
+		site->archives = NULL;
+		break;
+	case SITE_SEARCH:
+		search_docs_free(site->search);
+		site->search = NULL;
+		break;
+	case SITE_SUGGEST:
+		search_suggest_free(site->suggest);
+		site->suggest = NULL;
+		break;
+	case SITE_NAMES:
+		bloom_free(site->names);
+		site->names = NULL;
+		site->names_read = false;
+		break;
+	case SITE_NOTFOUND:
+		site_drop_page(site, PAGE_NOTFOUND);
+		break;
+	case SITE_ARCHIVES_PAGE:
+		site_drop_page(site, PAGE_ARCHIVES);
+		break;
+	case SITE_SNAPSHOT:
+		snapshot_free(site->snap);
+		site->snap = NULL;
+		site->snap_read = false;
+		break;
+	}
+}
+
+static void
+site_close_db(struct site *site)
+{
+	int	i;
+
+	/* titles may have changed with the database */
+	for (i = 0; i < SITE_SNAPSHOT; i++)
+		site_drop_cache(site, i);
+	site_free_schedule(site);
+	site->cache_logged = 0;
+
+	if (!site->db_opened)
+		return;
+
+	store_close(&site->db);
+	site_drop_cache(site, SITE_SNAPSHOT);
+	site->db_opened = false;
+}
+
+static void
+site_free(struct site *site)
+{
+	site_close_db(site);
+	if (site->owned)
+		hdf_destroy(&site->conf);
+	free(site);
+}
+
+/* does one of the comma separated names in "host" match hostname */
+static bool
+site_match(struct site *site, const char *hostname, size_t len)
+{
+	char	*hosts, *host;
+	size_t	hlen;
+
+	if ((hosts = hdf_get_value(site->conf, "host", NULL)) == NULL)
+		return false;
+
+	while (*hosts != '\0') {
+		while (*hosts == ',' || *hosts == ' ')
+			hosts++;
+		host = hosts;
+		while (*hosts != '\0' && *hosts != ',' && *hosts != ' ')
+			hosts++;
+		hlen = hosts - host;
+		if (hlen == len && strncasecmp(host, hostname, len) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static struct site *
+site_load(const char *path)
+{
+	HDF		*hdf;
+	NEOERR	*neoerr;
+	int		ret;
+
+	neoerr = hdf_init(&hdf);
+	if (neoerr != STATUS_OK) {
+		nerr_ignore(&neoerr);
+		return NULL;
+	}
+
+	neoerr = hdf_read_file(hdf, path);
+	if (neoerr != STATUS_OK) {
+		cblog_err(-1, "%s: hdf_read_file error", path);
+		nerr_ignore(&neoerr);
+		hdf_destroy(&hdf);
+		return NULL;
+	}
+
+	if ((ret = check_conf(hdf)) != -1) {
+		cblog_err(-1, "%s: %s is mandatory", path, mandatory_config[ret]);
+		hdf_destroy(&hdf);
+		return NULL;
+	}
+
+	if (hdf_get_value(hdf, "host", NULL) == NULL) {
+		cblog_err(-1, "%s: host is mandatory in a site configuration", path);
+		hdf_destroy(&hdf);
+		return NULL;
+	}
+
+	return site_new(hdf, true);
+}
+
+/*
+ * Register the main configuration as the default site, then load every
+ * .conf file of CONFDIR as an additional site selected by its "host" value.
+ * Calling it again drops the previously loaded sites.
+ */
+int
+sites_init(HDF *conf)
+{
+	DIR				*dir;
+	struct dirent	*ent;
+	struct site		*site;
+	char			path[MAXPATHLEN];
+	size_t			len;
+	int				nb_sites = 0;
+
+	while (!SLIST_EMPTY(&siteshead)) {
+		site = SLIST_FIRST(&siteshead);
+		SLIST_REMOVE_HEAD(&siteshead, next);
+		site_free(site);
+	}
+	if (default_site != NULL)
+		site_free(default_site);
+	current_site = NULL;
+
+	default_site = site_new(conf, false);
+	site_db(default_site, get_cblog_db(conf));
+
+	if ((dir = opendir(CONFDIR)) == NULL)
+		return nb_sites;
+
+	while ((ent = readdir(dir)) != NULL) {
+		len = strlen(ent->d_name);
+		if (ent->d_name[0] == '.' || len < 6 ||
+		    !EQUALS(ent->d_name + len - 5, ".conf"))
+			continue;
+
+		snprintf(path, MAXPATHLEN, "%s/%s", CONFDIR, ent->d_name);
+		if ((site = site_load(path)) == NULL)
+			continue;
+
+		SLIST_INSERT_HEAD(&siteshead, site, next);
+		nb_sites++;
+	}
+	closedir(dir);
+
+	/* open the databases and build their snapshots before any request */
+	SLIST_FOREACH(site, &siteshead, next)
+		site_db(site, get_cblog_db(site->conf));
+
+	return nb_sites;
+}
+
+/*
+ * Find the site serving hostname (HTTP_HOST, an optional :port is
+ * ignored), falling back to the default site
+ */
+struct site *
+site_find(const char *hostname)
+{
+	struct site	*site;
+	const char	*port;
+	size_t		len;
+
+	if (hostname == NULL)
+		return default_site;
+
+	if ((port = strchr(hostname, ':')) != NULL)
+		len = port - hostname;
+	else
+		len = strlen(hostname);
+
+	SLIST_FOREACH(site, &siteshead, next) {
+		if (site_match(site, hostname, len))
+			return site;
+	}
+
+	return default_site;
+}
+
+struct schedule_load {
+	struct schedule	*schedule;
+	struct store	*st;
+	time_t			now;
+};
+
+static void
+schedule_add(struct schedule *schedule, time_t at, const char *name)
+{
+	struct scheduled	*posts;
+
+	posts = realloc(schedule->posts,
+	    (schedule->nposts + 1) * sizeof(struct scheduled));
+	if (posts == NULL)
+		return;
+	schedule->posts = posts;
+	posts[schedule->nposts].at = at;
+	posts[schedule->nposts++].name = strdup(name);
+}
+
+static int
+schedule_add_post(struct store_post *post, void *arg)
+{
+	struct schedule_load	*load = arg;
+	char					*published;
+
+	if (post->ctime <= load->now)
+		return 0;
+
+	published = store_get(load->st, post, "published");
+	if (!store_post_draft(published))
+		schedule_add(load->schedule, post->ctime, post->name);
+	free(published);
+
+	return 0;
+}
+
+static int
+schedule_cmp(const void *a, const void *b)
+{
+	const struct scheduled	*sa = a;
+	const struct scheduled	*sb = b;
+
+	if (sa->at == sb->at)
+		return 0;
+
+	return sa->at < sb->at ? -1 : 1;
+}
+
+/* list the posts of the database going live later */
+static void
+site_load_schedule(struct site *site)
+{
+	struct schedule_load	load;
+	int						i;
+
+	load.schedule = &site->schedule;
+	load.st = &site->db;
+	load.now = time(NULL);
+
+	/* the snapshot is sorted newest first and has no draft */
+	if (site->snap != NULL) {
+		for (i = 0; i < site->snap->nposts && site->snap->ctime[i] > load.now; i++)
+			schedule_add(&site->schedule, site->snap->ctime[i],
+			    snapshot_name(site->snap, i));
+	} else
+		store_posts(&site->db, schedule_add_post, &load);
+
+	if (site->schedule.nposts > 0)
+		qsort(site->schedule.posts, site->schedule.nposts,
+		    sizeof(struct scheduled), schedule_cmp);
+}
+
+/* drop what is cached of the listings once a scheduled post is live */
+static void
+site_roll_schedule(struct site *site)
+{
+	struct schedule	*schedule = &site->schedule;
+	time_t			now = time(NULL);
+	int				i, n;
+
+	for (n = 0; n < schedule->nposts && schedule->posts[n].at <= now; n++)
+		free(schedule->posts[n].name);
+	if (n == 0)
+		return;
+
+	for (i = n; i < schedule->nposts; i++)
+		schedule->posts[i - n] = schedule->posts[i];
+	schedule->nposts -= n;
+
+	site_drop_cache(site, SITE_POPULAR);
+	site_drop_cache(site, SITE_SITEMAP);
+	site_drop_cache(site, SITE_NOTFOUND);
+	site_drop_cache(site, SITE_ARCHIVES_PAGE);
+}
+
+/* is name a post of the site not live yet */
+bool
+site_scheduled(struct site *site, const char *name)
+{
+	time_t	now;
+	int		i;
+
+	if (site->schedule.nposts == 0)
+		return false;
+
+	now = time(NULL);
+	for (i = 0; i < site->schedule.nposts; i++) {
+		if (site->schedule.posts[i].at > now &&
+		    strcmp(site->schedule.posts[i].name, name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* tags counted by site_tags */
+struct site_tags {
+	int		ntags;
+	int		asize;
+	struct	site_tag {
+		char	*name;
+		int		count;
+	} *tags;
+};
+
+static int
+site_add_tag(const char *name, int count, void *arg)
+{
+	struct site_tags	*tags = arg;
+	struct site_tag		*grown;
+	int					asize;
+
+	if (tags->ntags == tags->asize) {
+		asize = tags->asize ? tags->asize * 2 : 64;
+		grown = realloc(tags->tags, asize * sizeof(struct site_tag));
+		if (grown == NULL)
+			return -1;
+		tags->tags = grown;
+		tags->asize = asize;
+	}
+	tags->tags[tags->ntags].name = strdup(name);
+	tags->tags[tags->ntags++].count = count;
+
+	return 0;
+}
+
+static int
+site_tag_cmp(const void *a, const void *b)
+{
+	const struct site_tag	*ta = a;
+	const struct site_tag	*tb = b;
+
+	return strcasecmp(ta->name, tb->name);
+}
+
+/* take the tags of a scheduled post off the counts */
+static void
+site_untag(struct site_tags *tags, struct store *st, const char *name)
+{
+	struct store_post	post;
+	struct site_tag		key, *tag;
+	char				*list, *val;
+	int					i, nbel;
+	size_t				next;
+
+	if (tags->ntags == 0 || store_find(st, name, &post) < 0 ||
+	    (list = store_get(st, &post, "tags")) == NULL)
+		return;
+
+	val = list;
+	nbel = splitchr(val, ',');
+	for (i = 0; i <= nbel; i++) {
+		next = strlen(val);
+		key.name = trimspace(val);
+		if (*key.name != '\0' && (tag = bsearch(&key, tags->tags, tags->ntags,
+		    sizeof(struct site_tag), site_tag_cmp)) != NULL && tag->count > 0)
+			tag->count--;
+		val += next + 1;
+	}
+	free(list);
+}
+
+/*
+ * Count the tags of the posts of st live at until through cb, sorted by
+ * name without case: store_tags leaves the drafts out and, when st is the
+ * database of the site, the tags of its scheduled posts are taken off
+ */
+int
+site_tags(struct site *site, struct store *st, time_t until, store_tag_cb cb,
+    void *arg)
+{
+	struct site_tags	tags;
+	int					i, n, ret;
+
+	memset(&tags, 0, sizeof(struct site_tags));
+	ret = store_tags(st, site_add_tag, &tags);
+
+	/* spellings of a tag differing by their case are counted together */
+	if (tags.ntags > 0)
+		qsort(tags.tags, tags.ntags, sizeof(struct site_tag), site_tag_cmp);
+	for (i = n = 0; i < tags.ntags; i++) {
+		if (n > 0 &&
+		    strcasecmp(tags.tags[n - 1].name, tags.tags[i].name) == 0) {
+			tags.tags[n - 1].count += tags.tags[i].count;
+			free(tags.tags[i].name);
+		} else
+			tags.tags[n++] = tags.tags[i];
+	}
+	tags.ntags = n;
+
+	if (site != NULL && st == &site->db) {
+		for (i = 0; i < site->schedule.nposts; i++) {
+			if (site->schedule.posts[i].at > until)
+				site_untag(&tags, st, site->schedule.posts[i].name);
+		}
+	}
+
+	for (i = 0; i < tags.ntags; i++) {
+		if (ret == 0 && tags.tags[i].count > 0)
+			ret = cb(tags.tags[i].name, tags.tags[i].count, arg);
+		free(tags.tags[i].name);
+	}
+	free(tags.tags);
+
+	return ret;
+}
+
+/*
+ * Return the database of the site, reusing the handles kept open since a
+ * previous request as long as the file has not been replaced (cblogctl
+ * renames a new database, or a new shard manifest, over the old one)
+ */
+struct store *
+site_db(struct site *site, const char *path)
+{
+	const struct store_ops	*backend;
+	struct stat				st;
+
+	if (stat(path, &st) < 0) {
+		site_close_db(site);
+		return NULL;
+	}
+
+	if (site->db_opened && site->db_ino == st.st_ino &&
+	    site->db_dev == st.st_dev && site->db_mtime == st.st_mtime &&
+	    EQUALS(site->db_path, path)) {
+		site_roll_schedule(site);
+		return &site->db;
+	}
+
+	site_close_db(site);
+
+	if ((backend = store_backend(get_db_backend(site->conf))) == NULL) {
+		cblog_err(-1, "%s: unknown db_backend", get_db_backend(site->conf));
+		return NULL;
+	}
+
+	if (store_open(&site->db, backend, path) < 0)
+		return NULL;
+
+	snprintf(site->db_path, sizeof(site->db_path), "%s", path);
+	site->db_opened = true;
+	site_snapshot(site);
+	site_load_schedule(site);
+
+	site->db_ino = st.st_ino;
+	site->db_dev = st.st_dev;
+	site->db_mtime = st.st_mtime;
+
+	return &site->db;
+}
+
+/* snapshot of the opened database, built again after site_trim dropped it */
+struct snapshot *
+site_snapshot(struct site *site)
+{
+	if (site->snap_read || !site->db_opened)
+		return site->snap;
+
+	site->snap_read = true;
+	if (hdf_get_int_value(site->conf, "snapshot", 1) &&
+	    (site->snap = snapshot_build(&site->db)) == NULL)
+		cblog_err(-1, "%s: unable to build the snapshot", site->db_path);
+
+	return site->snap;
+}
+
+/*
+ * Drop the largest caches of the site until they hold no more than its
+ * max_cache_kb, if set; they are built again on the next request needing
+ * them. A cache built by the request which just ended is kept, so is one
+ * over max_cache_kb alone, which every request would build again. Each
+ * cache is logged once per database, the first time it is dropped or kept.
+ */
+void
+site_trim(struct site *site)
+{
+	const char	*host;
+	size_t		sizes[SITE_CACHES], total = 0, max;
+	unsigned	fresh = 0;
+	int			i, largest, kb;
+
+	if ((kb = hdf_get_int_value(site->conf, "max_cache_kb", 0)) <= 0)
+		return;
+	max = (size_t)kb * 1024;
+	host = hdf_get_value(site->conf, "host", "default site");
+
+	for (i = 0; i < SITE_CACHES; i++) {
+		total += sizes[i] = site_cache_size(site, i);
+		if (sizes[i] > 0 && (site->cache_held & (1U << i)) == 0)
+			fresh |= 1U << i;
+	}
+
+	while (total > max) {
+		for (largest = -1, i = 0; i < SITE_CACHES; i++) {
+			if (sizes[i] == 0 || sizes[i] > max || (fresh & (1U << i)))
+				continue;
+			if (largest < 0 || sizes[i] > sizes[largest])
+				largest = i;
+		}
+		if (largest < 0)
+			break;
+		if ((site->cache_logged & (1U << largest)) == 0)
+			cblog_err(-1, "%s: caches over max_cache_kb, dropping the %s "
+			    "(%zu bytes)", host, site_caches[largest], sizes[largest]);
+		site->cache_logged |= 1U << largest;
+		site_drop_cache(site, largest);
+		total -= sizes[largest];
+		sizes[largest] = 0;
+	}
+
+	site->cache_held = 0;
+	for (i = 0; i < SITE_CACHES; i++) {
+		if (sizes[i] == 0)
+			continue;
+		site->cache_held |= 1U << i;
+		if (sizes[i] > max && (site->cache_logged & (1U << i)) == 0) {
+			cblog_err(-1, "%s: the %s alone is over max_cache_kb, keeping it "
+			    "(%zu bytes)", host, site_caches[i], sizes[i]);
+			site->cache_logged |= 1U << i;
+		}
+	}
+}
+
+/*
+ * Map the view counters of the site on first use, after cblog.cgi went to
+ * the background since the counters are saved by a thread
+ */
+struct views *
+site_views(struct site *site)
+{
+	char	path[MAXPATHLEN];
+	char	*views_path;
+
+	if (site->views_opened)
+		return site->views;
+	site->views_opened = true;
+
+	if (!hdf_get_int_value(site->conf, "views", 0))
+		return NULL;
+
+	if ((views_path = hdf_get_value(site->conf, "views_path", NULL)) != NULL)
+		snprintf(path, MAXPATHLEN, "%s", views_path);
+	else
+		snprintf(path, MAXPATHLEN, "%s.views", get_cblog_db(site->conf));
+
+	site->views = views_open(path,
+	    hdf_get_int_value(site->conf, "views_slots", DEFAULT_VIEWS_SLOTS),
+	    hdf_get_int_value(site->conf, "views_flush", DEFAULT_VIEWS_FLUSH));
+	if (site->views == NULL)
+		cblog_err(-1, "%s: unable to map the view counters", path);
+
+	return site->views;
+}
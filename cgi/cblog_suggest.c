@@ -0,0 +1,99 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cblog_cgi.h"
+
+/* most completions a request may ask for */
+#define SUGGEST_MAX_COUNT	100
+
+/* str as a JSON string */
+static void
+suggest_append_string(STRING *out, const char *str)
+{
+	char	c[8];
+
+	string_append(out, "\"");
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\' || (unsigned char)*str < 0x20) {
+			snprintf(c, sizeof(c), "\\u%04x", (unsigned char)*str);
+			string_append(out, c);
+		} else
+			string_appendn(out, str, 1);
+	}
+	string_append(out, "\"");
+}
+
+/*
+ * Answer /suggest?q=prefix with the tags and post titles starting with
+ * prefix as a JSON array, from the completions kept by cblogctl along the
+ * search index: {"type":"tag","name":...,"count":...} objects, the tags
+ * having the most posts first, then {"type":"post","name":...,"title":...,
+ * "date":...} objects, the newest first. At most suggest_count of them
+ * (default 10) are sent, q being taken as a prefix once normalized like
+ * the titles.
+ */
+int
+build_suggest(HDF *hdf)
+{
+	struct store					sts, *st;
+	struct search_suggest			*sugg;
+	const struct search_completion	**out;
+	STRING							json;
+	char							*method;
+	int								i, n;
+
+	if ((st = db_open(hdf, &sts)) == NULL)
+		return -1;
+
+	access_entry.cache = "miss";
+	if (current_site != NULL && st == &current_site->db) {
+		if (current_site->suggest == NULL)
+			current_site->suggest = search_suggest(st);
+		else
+			access_entry.cache = "hit";
+		sugg = current_site->suggest;
+	} else
+		sugg = search_suggest(st);
+
+	n = hdf_get_int_value(hdf, "suggest_count", DEFAULT_SUGGEST_COUNT);
+	if (n <= 0 || n > SUGGEST_MAX_COUNT)
+		n = DEFAULT_SUGGEST_COUNT;
+	if ((out = malloc(n * sizeof(struct search_completion *))) == NULL)
+		n = 0;
+	n = search_complete(sugg, get_query_str(hdf, "q"), time(NULL), out, n);
+	access_entry.posts = n;
+
+	string_init(&json);
+	string_append(&json, "[");
+	for (i = 0; i < n; i++) {
+		string_append(&json, i ? ",{\"type\":" : "{\"type\":");
+		string_append(&json, out[i]->tag ? "\"tag\",\"name\":" :
+		    "\"post\",\"name\":");
+		suggest_append_string(&json, out[i]->name);
+		if (out[i]->tag) {
+			string_appendf(&json, ",\"count\":%lld}", out[i]->rank);
+			continue;
+		}
+		string_append(&json, ",\"title\":");
+		suggest_append_string(&json, out[i]->title);
+		string_appendf(&json, ",\"date\":%lld}", out[i]->rank);
+	}
+	string_append(&json, "]\n");
+
+	method = get_cgi_str(hdf, "RequestMethod");
+	cgiwrap_writef("Content-Type: application/json; charset=utf-8\n");
+	cgiwrap_writef("Content-Length: %d\n\n", json.len);
+	if (method == NULL || !EQUALS(method, "HEAD"))
+		cgiwrap_write(json.buf, json.len);
+
+	string_clear(&json);
+	free(out);
+	if (current_site == NULL || sugg != current_site->suggest)
+		search_suggest_free(sugg);
+	db_close(st);
+
+	return n;
+}
@@ -1,13 +1,23 @@
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <fcgi_stdio.h>
 #include <syslog.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netdb.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
 
 #include "cblog_cgi.h"
 
@@ -18,29 +28,15 @@
 HDF *conf;
 int fd;
 char *unix_sock_path = NULL;
+static volatile sig_atomic_t conf_reload = 0;
 
-static char *mandatory_config[] = {
-	"title",
-	"url",
-	"dateformat",
-	"hdf.loadpaths.tpl",
-	"db_path",
-	"theme",
-	"posts_per_pages",
-	NULL,
-};
+/* set in the environment of a cblog.cgi started again on its own socket */
+#define RECYCLED_ENV "CBLOG_RECYCLED"
 
-int
-check_conf(HDF *conf)
-{
-	int i = 0;
-	while (mandatory_config[i]) {
-		if (! hdf_get_obj(conf, mandatory_config[i]))
-			return i;
-		i++;
-	}
-	return -1;
-}
+/* the worker exits once past either limit, 0 for none */
+static long max_rss;		/* kB resident */
+static unsigned long max_requests;
+static char self[PATH_MAX];	/* executed again when bound by itself */
 
 void
 read_conf(int signal /* unused */)
@@ -56,25 +52,36 @@ read_conf(int signal /* unused */)
 	neoerr = hdf_init(&hdf);
 	if (neoerr != STATUS_OK) {
 		cblog_err(-1, "%s: hdf_init hdf", CONFFILE);
+		nerr_ignore(&neoerr);
+		return;
 	}
-	nerr_ignore(&neoerr);
 
 	neoerr = hdf_read_file(hdf, CONFFILE);
 	if (neoerr != STATUS_OK) {
 		cblog_err(-1, "%s: hdf_read_file error", CONFFILE);
+		nerr_ignore(&neoerr);
+		hdf_destroy(&hdf);
 		return;
 	}
-	nerr_ignore(&neoerr);
 
 	if ((ret = check_conf(hdf)) != -1) {
 		cblog_err(-1, "%s: %s is mandatory", CONFFILE, mandatory_config[ret]);
+		hdf_destroy(&hdf);
 		return;
 	}
 	neoerr = hdf_copy(conf, "", hdf);
 	if (neoerr != STATUS_OK) {
 		cblog_err(-1, "%s: hdf_copy error", CONFFILE);
-		return;
+		nerr_ignore(&neoerr);
 	}
+	hdf_destroy(&hdf);
+}
+
+/* configuration is reloaded between two requests, not from the handler */
+static void
+reload_conf(int signal /* unused */)
+{
+	conf_reload = 1;
 }
 
 /* this are wrappers to have clearsilver to work in fastcgi */
@@ -87,14 +94,21 @@ read_cb(void *ptr, char *data, int size)
 int
 writef_cb(void *ptr, const char *format, va_list ap)
 {
-	FCGI_vprintf(format, ap);
+	int	n;
+
+	if ((n = FCGI_vprintf(format, ap)) > 0)
+		access_entry.bytes += n;
 	return 0;
 }
 
 int
 write_cb(void *ptr, const char *data, int size)
 {
-	return FCGI_fwrite((void *)data, sizeof(char), size, FCGI_stdout);
+	int	n;
+
+	if ((n = FCGI_fwrite((void *)data, sizeof(char), size, FCGI_stdout)) > 0)
+		access_entry.bytes += n;
+	return n;
 }
 
 static void
@@ -182,15 +196,169 @@ bind_socket(char *url) {
 	return 0;
 }
 
+/* the socket of url is stdin already, as left by recycle() */
+static int
+rebind_socket(char *url) {
+	fd = 0;
+	if (!strncmp(url, "unix:", sizeof("unix:") - 1))
+		unix_sock_path = url + sizeof("unix:") - 1;
+
+	signal(SIGINT, close_socket);
+	signal(SIGKILL, close_socket);
+	signal(SIGQUIT, close_socket);
+	signal(SIGTERM, close_socket);
+
+	return 0;
+}
+
 /* end of fcgi wrappers */
 
+/* resident set size in kB, -1 if it cannot be read */
+static long
+proc_rss(void)
+{
+#if defined(__linux__)
+	static int statm = -1;
+	char buf[64];
+	ssize_t n;
+	long pages;
+
+	/* kept open, a proc file is read again from its start */
+	if (statm < 0 && (statm = open("/proc/self/statm", O_RDONLY)) < 0)
+		return -1;
+	if ((n = pread(statm, buf, sizeof(buf) - 1, 0)) <= 0)
+		return -1;
+	buf[n] = '\0';
+	if (sscanf(buf, "%*d %ld", &pages) != 1)
+		return -1;
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+#elif defined(__FreeBSD__)
+	struct kinfo_proc kp;
+	size_t len = sizeof(kp);
+	int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid() };
+
+	if (sysctl(mib, 4, &kp, &len, NULL, 0) < 0)
+		return -1;
+
+	return kp.ki_rssize * (getpagesize() / 1024);
+#else
+	struct rusage ru;
+
+	/* the peak size, where the current one is not cheap to read */
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return -1;
+
+	return ru.ru_maxrss;
+#endif
+}
+
+/*
+ * Limits of the worker, from the main configuration file. At start, a
+ * max_rss the worker already exceeds before serving anything would have
+ * it recycled on every request, so it is ignored; on a reload, the worker
+ * has grown past it and is recycled.
+ */
+static void
+read_limits(bool start)
+{
+	long rss;
+
+	max_rss = hdf_get_int_value(conf, "max_rss", 0);
+	max_requests = hdf_get_int_value(conf, "max_requests", 0);
+	if (start && max_rss > 0 && (rss = proc_rss()) >= max_rss) {
+		cblog_err(-1, "max_rss %ld kB is below the %ld kB used at start, ignored",
+		    max_rss, rss);
+		max_rss = 0;
+	}
+}
+
+/* has the worker served enough, logging why */
+static bool
+worn_out(unsigned long requests)
+{
+	long rss;
+
+	if (max_requests > 0 && requests >= max_requests) {
+		cblog_err(-1, "recycling after %lu requests", requests);
+		return true;
+	}
+	if (max_rss > 0 && (rss = proc_rss()) > max_rss) {
+		cblog_err(-1, "recycling after %lu requests: %ld kB resident, "
+		    "max_rss is %ld kB", requests, rss, max_rss);
+		return true;
+	}
+
+	return false;
+}
+
+/* absolute path of the running cblog.cgi in self, false if it is unknown */
+static bool
+self_path(const char *argv0)
+{
+#if defined(__linux__)
+	ssize_t n;
+	char *deleted;
+
+	if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) > 0) {
+		self[n] = '\0';
+		/* replaced by an upgrade, the new one is run */
+		if ((deleted = strstr(self, " (deleted)")) != NULL &&
+		    deleted[sizeof(" (deleted)") - 1] == '\0')
+			*deleted = '\0';
+		return true;
+	}
+#elif defined(__FreeBSD__)
+	size_t len = sizeof(self);
+	int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, -1 };
+
+	if (sysctl(mib, 4, self, &len, NULL, 0) == 0)
+		return true;
+#endif
+	/* from the directory it was started in, the daemon runs from / */
+	if (strchr(argv0, '/') != NULL && realpath(argv0, self) != NULL)
+		return true;
+
+	self[0] = '\0';
+	return false;
+}
+
+/*
+ * Start cblog.cgi again on the socket it bound itself, which nothing else
+ * would restart: the socket stays as stdin and every other file is closed.
+ * It only exits when its own path is unknown.
+ */
+static void
+recycle(char **argv)
+{
+	long i, maxfd;
+
+	if (self[0] == '\0' && !self_path(argv[0])) {
+		cblog_err(-1, "%s: path unknown, exiting instead of recycling",
+		    argv[0]);
+		logger_flush();
+		return;
+	}
+
+	if ((maxfd = sysconf(_SC_OPEN_MAX)) < 0)
+		maxfd = 1024;
+	for (i = STDERR_FILENO + 1; i < maxfd; i++)
+		close(i);
+
+	setenv(RECYCLED_ENV, "1", 1);
+	execv(self, argv);
+	cblog_err(1, "%s: %s", self, strerror(errno));
+}
+
 int
 main(int argc, char **argv, char **envp)
 {
 	NEOERR *neoerr;
+	unsigned long requests = 0;
+	bool recycling = false;
 	int ret;
 
-	signal(SIGHUP, read_conf);
+	signal(SIGHUP, reload_conf);
 	signal(SIGPIPE, SIG_IGN);
 
 	if (access(CONFFILE, R_OK) != 0)
@@ -213,22 +381,55 @@ main(int argc, char **argv, char **envp)
 	}
 
 	openlog("CBlog", LOG_CONS|LOG_ERR, LOG_DAEMON);
+	if (logger_open(hdf_get_value(conf, "log_file", NULL)) < 0)
+		warn("%s", hdf_get_value(conf, "log_file", NULL));
+	if (access_open(conf) < 0)
+		warn("%s", hdf_get_value(conf, "access_log", NULL));
+	sites_init(conf);
 	cgiwrap_init_emu(NULL, &read_cb, &writef_cb, &write_cb,
 		NULL, NULL, NULL);
 	cgiwrap_init_std(argc, argv, envp);
 	if (argc == 2) {
-		daemon(0,0);
-		bind_socket(argv[1]);
+		/* while argv[0] can still be resolved, if it is to be run again */
+		if (hdf_get_int_value(conf, "max_rss", 0) > 0 ||
+		    hdf_get_int_value(conf, "max_requests", 0) > 0)
+			self_path(argv[0]);
+		if (getenv(RECYCLED_ENV) != NULL) {
+			unsetenv(RECYCLED_ENV);
+			rebind_socket(argv[1]);
+		} else {
+			daemon(0,0);
+			bind_socket(argv[1]);
+		}
 	}
+	logger_start();
+	read_limits(true);
 
 	while (FCGI_Accept() >= 0) {
+		if (conf_reload) {
+			conf_reload = 0;
+			read_conf(0);
+			sites_init(conf);
+			read_limits(false);
+		}
 		/*	cgi_init(&cgi, NULL);
 		cgi_parse(cgi); */
 		cblogcgi(conf);
 		/*	cgi_destroy(&cgi);
 		syslog(LOG_ERR, "coucou"); */
+
+		/* the request is sent before the worker leaves its place */
+		if (worn_out(++requests)) {
+			FCGI_Finish();
+			recycling = true;
+			break;
+		}
 	}
+	access_flush();
+	logger_flush();
 	closelog();
+	if (recycling && argc == 2)
+		recycle(argv);
 	return EXIT_SUCCESS;
 }
 /* vim: set sw=4 sts=4 ts=4 : */
@@ -20,7 +20,7 @@
  * COMPILE TIME OPTIONS
  *
  * BUFFER_STATS • if defined, stats are kept about memory usage
- * TRACK_BUFFERS • if defined, buffers are tracked in a struct parray
+ * TRACK_BUFFERS • if defined, live buffers are tracked in a hash table
  */
 #define BUFFER_STATS
 
@@ -31,16 +31,53 @@
 #include "buffer.h"
 
 #ifdef TRACK_BUFFER_DEBUG
-#undef TRACK_BUFFERS
+#ifndef TRACK_BUFFERS
+#define TRACK_BUFFERS
 #endif
-
-#if (defined TRACK_BUFFERS) || (defined TRACK_BUFFER_DEBUG)
-#include "array.h"
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+
+
+/***************
+ * LOCAL TYPES *
+ ***************/
+
+#ifdef BUFFER_PROFILE
+/* buf_site • allocation totals of one bufnew/bufdup call site */
+struct buf_site {
+	const char *	file;
+	int		line;
+	long		nb;		/* buffers created */
+	long		live;		/* buffers not released yet */
+	size_t		bytes;		/* cumulated allocated bytes */
+	size_t		live_bytes;	/* bytes held by live buffers */
+	size_t		peak_bytes; };	/* maximum of live_bytes */
+#endif
+
+#ifdef TRACK_BUFFERS
+/* buf_slot • entry of the live buffer table */
+struct buf_slot {
+	struct buf *		buf;	/* 0 for an empty slot */
+#ifdef TRACK_BUFFER_DEBUG
+	struct buf_debug_data	debug;
+#endif
+#ifdef BUFFER_PROFILE
+	struct buf_site *	site;
+#endif
+	};
+
+
+/* buf_table • open-addressing (linear probing) table of live buffers */
+struct buf_table {
+	struct buf_slot *	slot;
+	size_t			size;	/* number of live buffers */
+	size_t			asize; };	/* number of slots, power of 2 */
+#endif
 
 
 /********************
@@ -52,12 +89,19 @@ long buffer_stat_nb = 0;
 size_t buffer_stat_alloc_bytes = 0;
 #endif
 #ifdef TRACK_BUFFERS
-struct parray all_buffers = { 0, 0, 0 };
+struct buf_table all_buffers = { 0, 0, 0 };
 #endif
-#ifdef TRACK_BUFFER_DEBUG
-struct array all_buffers = { 0, 0, 0, sizeof (struct buf_debug_data) };
+#ifdef BUFFER_PROFILE
+static struct buf_site **buf_sites = 0;	/* hash table of call sites */
+static size_t buf_nsites = 0, buf_asites = 0;
+static long buf_live_nb = 0, buf_peak_nb = 0;
+static size_t buf_live_bytes = 0, buf_peak_bytes = 0;
 #endif
 
+/* buf_freelist • released buffers (with their inline storage) for reuse */
+static struct buf *buf_freelist[BUFFER_FREELIST_MAX];
+static int buf_nfree = 0;
+
 
 /***************************
  * STATIC HELPER FUNCTIONS *
@@ -69,6 +113,219 @@ lower(char c) {
 	return (c >= 'A' && c <= 'Z') ? (c - 'A' + 'a') : c; }
 
 
+#ifdef TRACK_BUFFERS
+/* buf_hash • hashes a pointer into a table of asize slots */
+static size_t
+buf_hash(const void *ptr, size_t asize) {
+	uintptr_t h = (uintptr_t)ptr >> 4;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h & (asize - 1); }
+
+
+/* buf_lookup • returns the slot of buf, or the empty slot ending its probe */
+static struct buf_slot *
+buf_lookup(struct buf_table *t, const struct buf *buf) {
+	size_t i = buf_hash(buf, t->asize);
+	while (t->slot[i].buf && t->slot[i].buf != buf)
+		i = (i + 1) & (t->asize - 1);
+	return t->slot + i; }
+
+
+/* buf_table_grow • doubles the number of slots and rehashes the table */
+static int
+buf_table_grow(struct buf_table *t) {
+	struct buf_slot *old = t->slot;
+	size_t i, oldsize = t->asize;
+	t->asize = oldsize ? oldsize * 2 : 256;
+	t->slot = calloc(t->asize, sizeof (struct buf_slot));
+	if (!t->slot) {
+		t->slot = old;
+		t->asize = oldsize;
+		return 0; }
+	for (i = 0; i < oldsize; i += 1)
+		if (old[i].buf) *buf_lookup(t, old[i].buf) = old[i];
+	free(old);
+	return 1; }
+
+
+/* buf_track • registers a live buffer and returns its slot */
+static struct buf_slot *
+buf_track(struct buf *buf) {
+	struct buf_slot *slot;
+	if ((all_buffers.size + 1) * 4 > all_buffers.asize * 3
+	&& !buf_table_grow(&all_buffers))
+		return 0;
+	slot = buf_lookup(&all_buffers, buf);
+	if (!slot->buf) all_buffers.size += 1;
+	memset(slot, 0, sizeof (struct buf_slot));
+	slot->buf = buf;
+	return slot; }
+#endif
+
+
+#ifdef BUFFER_PROFILE
+/* buf_profile_atexit • dumps the profile when the program terminates */
+static void
+buf_profile_atexit(void) {
+	bufprofile(stderr); }
+
+
+/* buf_site_lookup • index of the call site slot, or of the empty slot */
+static size_t
+buf_site_lookup(const char *file, int line) {
+	size_t mask = buf_asites - 1;
+	size_t i = (buf_hash(file, buf_asites) ^ (size_t)line) & mask;
+	while (buf_sites[i]
+	&& (buf_sites[i]->file != file || buf_sites[i]->line != line))
+		i = (i + 1) & mask;
+	return i; }
+
+
+/* buf_site_get • returns the totals of a call site, creating them */
+static struct buf_site *
+buf_site_get(const char *file, int line) {
+	struct buf_site **old;
+	size_t i, oldsize;
+	if ((buf_nsites + 1) * 2 > buf_asites) {
+		old = buf_sites;
+		oldsize = buf_asites;
+		buf_asites = oldsize ? oldsize * 2 : 64;
+		buf_sites = calloc(buf_asites, sizeof (struct buf_site *));
+		if (!buf_sites) {
+			buf_sites = old;
+			buf_asites = oldsize;
+			return 0; }
+		for (i = 0; i < oldsize; i += 1)
+			if (old[i]) buf_sites[buf_site_lookup(old[i]->file,
+						old[i]->line)] = old[i];
+		free(old);
+		if (!oldsize) atexit(buf_profile_atexit); }
+	i = buf_site_lookup(file, line);
+	if (!buf_sites[i]) {
+		buf_sites[i] = calloc(1, sizeof (struct buf_site));
+		if (!buf_sites[i]) return 0;
+		buf_sites[i]->file = file;
+		buf_sites[i]->line = line;
+		buf_nsites += 1; }
+	return buf_sites[i]; }
+
+
+/* buf_account • accounts a new allocated size for a tracked buffer */
+static void
+buf_account(struct buf_slot *slot, size_t asize) {
+	struct buf_site *site = slot->site;
+	size_t old = slot->debug.asize;
+	slot->debug.asize = asize;
+	if (!site) return;
+	if (asize > old) {
+		site->bytes += asize - old;
+		site->live_bytes += asize - old;
+		buf_live_bytes += asize - old; }
+	else {
+		site->live_bytes -= old - asize;
+		buf_live_bytes -= old - asize; }
+	if (site->live_bytes > site->peak_bytes)
+		site->peak_bytes = site->live_bytes;
+	if (buf_live_bytes > buf_peak_bytes)
+		buf_peak_bytes = buf_live_bytes; }
+
+
+/* cmp_site_bytes • sorts call sites by decreasing cumulated bytes */
+static int
+cmp_site_bytes(const void *a, const void *b) {
+	const struct buf_site *sa = *(struct buf_site * const *)a;
+	const struct buf_site *sb = *(struct buf_site * const *)b;
+	if (sa->bytes != sb->bytes) return sa->bytes < sb->bytes ? 1 : -1;
+	return sb->nb < sa->nb ? -1 : sb->nb > sa->nb; }
+#endif
+
+
+#ifdef TRACK_BUFFERS
+/* buf_register • starts tracking a newly created buffer */
+static void
+#ifdef TRACK_BUFFER_DEBUG
+buf_register(struct buf *buf, int dupped, const char *file, int line) {
+#else
+buf_register(struct buf *buf) {
+#endif
+	struct buf_slot *slot = buf_track(buf);
+	if (!slot) return;
+#ifdef TRACK_BUFFER_DEBUG
+	slot->debug.buf = buf;
+	slot->debug.dupped = dupped;
+	slot->debug.ctime = time(0);
+	slot->debug.file = file;
+	slot->debug.line = line;
+#endif
+#ifdef BUFFER_PROFILE
+	slot->site = buf_site_get(file, line);
+	if (slot->site) {
+		slot->site->nb += 1;
+		slot->site->live += 1; }
+	buf_live_nb += 1;
+	if (buf_live_nb > buf_peak_nb) buf_peak_nb = buf_live_nb;
+	buf_account(slot, buf->asize);
+#endif
+	}
+
+
+/* buf_untrack • removes a buffer from the table (backward-shift delete) */
+static void
+buf_untrack(struct buf *buf) {
+	struct buf_table *t = &all_buffers;
+	struct buf_slot *slot;
+	size_t i, j, k, mask;
+	if (!t->asize) return;
+	slot = buf_lookup(t, buf);
+	if (!slot->buf) return;
+#ifdef BUFFER_PROFILE
+	buf_account(slot, 0);
+	if (slot->site) slot->site->live -= 1;
+	buf_live_nb -= 1;
+#endif
+	t->size -= 1;
+	mask = t->asize - 1;
+	i = j = slot - t->slot;
+	for (;;) {
+		t->slot[i].buf = 0;
+		/* find an entry whose home slot does not lie in ]i, j] */
+		do {
+			j = (j + 1) & mask;
+			if (!t->slot[j].buf) return;
+			k = buf_hash(t->slot[j].buf, t->asize);
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		t->slot[i] = t->slot[j];
+		i = j; } }
+#endif
+
+
+/* buf_alloc • returns an empty buffer using its inline storage */
+/*   the struct and BUFFER_INLINE_SIZE bytes come from a single malloc */
+/*   or from the free-list of previously released buffers */
+static struct buf *
+buf_alloc(size_t unit) {
+	struct buf *ret;
+	if (buf_nfree > 0) ret = buf_freelist[--buf_nfree];
+	else ret = malloc(sizeof (struct buf) + BUFFER_INLINE_SIZE);
+	if (!ret) return 0;
+	ret->data = (char *)(ret + 1);
+	ret->size = 0;
+	ret->asize = BUFFER_INLINE_SIZE;
+	ret->unit = unit;
+	ret->ref = 1;
+	return ret; }
+
+
+/* buf_recycle • gives a released buffer back to the free-list */
+static void
+buf_recycle(struct buf *buf) {
+	if (!BUF_INLINE(buf)) free(buf->data);
+	if (buf_nfree < BUFFER_FREELIST_MAX) buf_freelist[buf_nfree++] = buf;
+	else free(buf); }
+
+
 
 /********************
  * BUFFER FUNCTIONS *
@@ -127,48 +384,32 @@ struct buf *
 bufdup(const struct buf *src, size_t dupunit) {
 #else
 bufdup_(const struct buf *src, size_t dupunit, const char *file, int line) {
-	struct buf_debug_data *bdd;
 #endif
 	size_t blocks;
 	struct buf *ret;
 	if (src == 0) return 0;
-	ret = malloc(sizeof (struct buf));
+	ret = buf_alloc(dupunit);
 	if (ret == 0) return 0;
-	ret->unit = dupunit;
 	ret->size = src->size;
-	ret->ref = 1;
-	if (!src->size) {
-#ifdef BUFFER_STATS
-		buffer_stat_nb += 1;
-#endif
-		ret->asize = 0;
-		ret->data = 0;
-		return ret; }
-	blocks = (src->size + dupunit - 1) / dupunit;
-	ret->asize = blocks * dupunit;
-	ret->data = malloc(ret->asize);
-	if (ret->data == 0) {
-		free(ret);
-		return 0; }
-	memcpy(ret->data, src->data, src->size);
+	if (src->size > BUFFER_INLINE_SIZE) {
+		blocks = (src->size + dupunit - 1) / dupunit;
+		ret->asize = blocks * dupunit;
+		ret->data = malloc(ret->asize);
+		if (ret->data == 0) {
+			ret->data = (char *)(ret + 1);
+			buf_recycle(ret);
+			return 0; } }
+	if (src->size) memcpy(ret->data, src->data, src->size);
 #ifdef BUFFER_STATS
 	buffer_stat_nb += 1;
 	buffer_stat_alloc_bytes += ret->asize;
 #endif
-#ifdef TRACK_BUFFERS
-	parr_push(&all_buffers, ret);
-#endif
 #ifdef TRACK_BUFFER_DEBUG
-	bdd = arr_item(&all_buffers, arr_newitem(&all_buffers));
-	bdd->buf = ret;
-	bdd->dupped = 1;
-	bdd->ctime = time(0);
-	bdd->file = file;
-	bdd->line = line;
-	return ret; }
-#else
-	return ret; }
+	buf_register(ret, 1, file, line);
+#elif defined TRACK_BUFFERS
+	buf_register(ret);
 #endif
+	return ret; }
 
 
 /* bufgrow • increasing the allocated size to the given value */
@@ -180,10 +421,19 @@ bufgrow(struct buf *buf, size_t neosz) {
 	if (buf->asize >= neosz) return 1;
 	neoasz = buf->asize + buf->unit;
 	while (neoasz < neosz) neoasz += buf->unit;
-	neodata = realloc(buf->data, neoasz);
-	if (!neodata) return 0;
+	if (BUF_INLINE(buf)) {
+		/* leaving the inline storage for the heap */
+		neodata = malloc(neoasz);
+		if (!neodata) return 0;
+		memcpy(neodata, buf->data, buf->size); }
+	else {
+		neodata = realloc(buf->data, neoasz);
+		if (!neodata) return 0; }
 #ifdef BUFFER_STATS
 	buffer_stat_alloc_bytes += (neoasz - buf->asize);
+#endif
+#ifdef BUFFER_PROFILE
+	buf_account(buf_lookup(&all_buffers, buf), neoasz);
 #endif
 	buf->data = neodata;
 	buf->asize = neoasz;
@@ -196,33 +446,20 @@ struct buf *
 bufnew(size_t unit) {
 #else
 bufnew_(size_t unit, const char *file, int line) {
-	struct buf_debug_data *bdd;
 #endif
 	struct buf *ret;
-	ret = malloc(sizeof (struct buf));
-	if (ret) {
+	ret = buf_alloc(unit);
 #ifdef BUFFER_STATS
+	if (ret) {
 		buffer_stat_nb += 1;
+		buffer_stat_alloc_bytes += ret->asize; }
 #endif
-#ifdef TRACK_BUFFERS
-		parr_push(&all_buffers, ret);
-#endif
-		ret->data = 0;
-		ret->size = ret->asize = 0;
-		ret->ref = 1;
-		ret->unit = unit; }
 #ifdef TRACK_BUFFER_DEBUG
-	if (ret) {
-		bdd = arr_item(&all_buffers, arr_newitem(&all_buffers));
-		bdd->buf = ret;
-		bdd->dupped = 0;
-		bdd->ctime = time(0);
-		bdd->file = file;
-		bdd->line = line; }
-	return ret; }
-#else
-	return ret; }
+	if (ret) buf_register(ret, 0, file, line);
+#elif defined TRACK_BUFFERS
+	if (ret) buf_register(ret);
 #endif
+	return ret; }
 
 
 /* bufnullterm • NUL-termination of the string array (making a C-string) */
@@ -234,6 +471,13 @@ bufnullterm(struct buf *buf) {
 		buf->data[buf->size] = 0; }
 
 
+/* bufpurge • frees the buffers kept on the recycling free-list */
+void
+bufpurge(void) {
+	while (buf_nfree > 0)
+		free(buf_freelist[--buf_nfree]); }
+
+
 /* bufprintf • formatted printing to a buffer */
 void
 bufprintf(struct buf *buf, const char *fmt, ...) {
@@ -244,6 +488,32 @@ bufprintf(struct buf *buf, const char *fmt, ...) {
 	va_end(ap); }
 
 
+#ifdef BUFFER_PROFILE
+/* bufprofile • prints per call-site allocation totals to the stream */
+void
+bufprofile(FILE *out) {
+	struct buf_site **list;
+	size_t i, n = 0;
+	fprintf(out, "buffer profile: %ld live (peak %ld), "
+			"%zu bytes live (peak %zu)\n",
+			buf_live_nb, buf_peak_nb,
+			buf_live_bytes, buf_peak_bytes);
+	if (!buf_nsites) return;
+	list = malloc(buf_nsites * sizeof (struct buf_site *));
+	if (!list) return;
+	for (i = 0; i < buf_asites; i += 1)
+		if (buf_sites[i]) list[n++] = buf_sites[i];
+	qsort(list, n, sizeof (struct buf_site *), cmp_site_bytes);
+	fprintf(out, "%10s %8s %12s %12s  %s\n",
+			"created", "live", "bytes", "peak", "call site");
+	for (i = 0; i < n; i += 1)
+		fprintf(out, "%10ld %8ld %12zu %12zu  %s:%d\n",
+			list[i]->nb, list[i]->live, list[i]->bytes,
+			list[i]->peak_bytes, list[i]->file, list[i]->line);
+	free(list); }
+#endif
+
+
 /* bufput • appends raw data to a buffer */
 void
 bufput(struct buf *buf, const void *data, size_t len) {
@@ -273,38 +543,31 @@ bufrelease(struct buf *buf) {
 	buf->ref -= 1;
 	if (buf->ref == 0) {
 #ifdef TRACK_BUFFERS
-		int i = 0;
-		while (i < all_buffers.size)
-			if (all_buffers.item[i] == buf)
-				parr_remove(&all_buffers, i);
-			else i += 1;
-#endif
-#ifdef TRACK_BUFFER_DEBUG
-		int i = 0;
-		struct buf_debug_data *bdd = all_buffers.base;
-		while (i < all_buffers.size)
-			if (bdd[i].buf == buf)
-				arr_remove(&all_buffers, i);
-			else i += 1;
+		buf_untrack(buf);
 #endif
 #ifdef BUFFER_STATS
 		buffer_stat_nb -= 1;
 		buffer_stat_alloc_bytes -= buf->asize;
 #endif
-		free(buf->data);
-		free(buf); } }
+		buf_recycle(buf); } }
 
 
 /* bufreset • frees internal data of the buffer */
+/*   heap data is released, the buffer falls back to its inline storage */
 void
 bufreset(struct buf *buf) {
 	if (!buf || !buf->unit || !buf->asize) return;
+	buf->size = 0;
+	if (BUF_INLINE(buf)) return;
 #ifdef BUFFER_STATS
-	buffer_stat_alloc_bytes -= buf->asize;
+	buffer_stat_alloc_bytes -= buf->asize - BUFFER_INLINE_SIZE;
+#endif
+#ifdef BUFFER_PROFILE
+	buf_account(buf_lookup(&all_buffers, buf), BUFFER_INLINE_SIZE);
 #endif
 	free(buf->data);
-	buf->data = 0;
-	buf->size = buf->asize = 0; }
+	buf->data = (char *)(buf + 1);
+	buf->asize = BUFFER_INLINE_SIZE; }
 
 
 /* bufset • safely assigns a buffer to another */
@@ -23,6 +23,13 @@
  *	includes <stdarg.h> and declareds vbufprintf()
  * TRACK_BUFFER_DEBUG
  *	activates additional debug information into buffers
+ * BUFFER_PROFILE
+ *	implies TRACK_BUFFER_DEBUG, keeps per call-site allocation totals
+ *	and peak usage, and dumps a report on stderr at exit
+ * BUFFER_INLINE_SIZE
+ *	bytes of storage allocated along with each struct buf (default 48)
+ * BUFFER_FREELIST_MAX
+ *	maximum number of released buffers kept for reuse (default 64)
  */
 
 #ifndef LITHIUM_BUFFER_H
@@ -30,10 +37,26 @@
 
 #include <stddef.h>
 
+#if (defined BUFFER_PROFILE) && !(defined TRACK_BUFFER_DEBUG)
+#define TRACK_BUFFER_DEBUG
+#endif
+
 #ifdef TRACK_BUFFER_DEBUG
 #include <time.h>
 #endif
 
+#ifdef BUFFER_PROFILE
+#include <stdio.h>
+#endif
+
+#ifndef BUFFER_INLINE_SIZE
+#define BUFFER_INLINE_SIZE 48
+#endif
+
+#ifndef BUFFER_FREELIST_MAX
+#define BUFFER_FREELIST_MAX 64
+#endif
+
 
 /********************
  * TYPE DEFINITIONS *
@@ -55,7 +78,8 @@ struct buf_debug_data {
 	int		dupped;
 	time_t		ctime;
 	const char *	file;
-	int		line; };
+	int		line;
+	size_t		asize; };	/* allocated size last accounted */
 #endif
 
 
@@ -74,6 +98,21 @@ struct buf_debug_data {
 	struct buf name = { strname, strlen(strname) }
 
 
+/* VOLATILE_BUFN • volatile buffer viewing len bytes of existing data */
+#define VOLATILE_BUFN(name, ptr, len) \
+	struct buf name = { (ptr), (len), 0, 0, 0 }
+
+
+/* BUFVIEW • points an existing volatile buffer to len bytes of data */
+#define BUFVIEW(name, ptr, len) \
+	((name).data = (ptr), (name).size = (len))
+
+
+/* BUF_INLINE • true when the buffer data lives in its inline storage */
+#define BUF_INLINE(buf) \
+	((buf)->data == (char *)((buf) + 1))
+
+
 /* BUFPUTSL • optimized bufputs of a string litteral */
 #define BUFPUTSL(output, litteral) \
 	bufput(output, litteral, sizeof litteral - 1)
@@ -129,6 +168,10 @@ bufnew(size_t)
 void
 bufnullterm(struct buf *);
 
+/* bufpurge • frees the buffers kept on the recycling free-list */
+void
+bufpurge(void);
+
 /* bufprintf • formatted printing to a buffer */
 void
 bufprintf(struct buf *, const char *, ...)
@@ -168,6 +211,16 @@ buftoi(struct buf *, size_t, size_t *);
 
 
 
+#ifdef BUFFER_PROFILE
+
+/* bufprofile • prints per call-site allocation totals to the stream */
+void
+bufprofile(FILE *);
+
+#endif /* def BUFFER_PROFILE */
+
+
+
 #ifdef BUFFER_STDARG
 #include <stdarg.h>
 
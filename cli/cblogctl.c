@@ -9,38 +9,66 @@
 #include <stdlib.h>
 #include <err.h>
 #include <limits.h>
-#include <cdb.h>
+#include <time.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include "cblogctl.h"
 #include "cblog_common.h"
 #include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_related.h"
+#include "cblog_archives.h"
+#include "cblog_search.h"
+#include "cblog_bloom.h"
+#include "cblog_compress.h"
 
 /* path the the CDB database file */
 char	cblog_cdb[PATH_MAX];
-char	cblog_cdb_tmp[PATH_MAX];
 
-void
-cblogctl_list(void)
+static void
+db_open_all(struct store *st)
 {
-	int					db;
-	struct cdb			cdb;
-	struct cdb_find		cdbf;
-	char				*val;
+	if (store_open(st, &store_cdb, cblog_cdb) < 0)
+		err(1, "%s", cblog_cdb);
+}
 
-	if ((db = open(cblog_cdb, O_RDONLY)) < 0)
+/*
+ * commit batch along with the related posts, archives, search index and
+ * names filter it changes
+ */
+static void
+db_commit(struct store *st, struct store_batch *batch)
+{
+	struct store_overlay	ov;
+
+	/* the posts are read once for every derived key */
+	if (store_overlay(&ov, st, batch) < 0 ||
+	    related_update(st, &ov, batch) < 0 ||
+	    archives_update(st, &ov, batch) < 0 ||
+	    search_update(st, &ov, batch) < 0 ||
+	    bloom_update(st, &ov, batch) < 0 || store_commit(st, batch) < 0)
 		err(1, "%s", cblog_cdb);
-	cdb_init(&cdb, db);
 
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-	while (cdb_findnext(&cdbf) > 0) {
-		val=db_get(&cdb);
-		puts(val);
-		free(val);
-	}
+	store_overlay_free(&ov);
+	store_batch_free(batch);
+	store_close(st);
+}
+
+static int
+print_post(struct store_post *post, void *arg)
+{
+	puts(post->name);
+
+	return 0;
+}
+
+void
+cblogctl_list(void)
+{
+	struct store	st;
 
-	cdb_free(&cdb);
-	close(db);
+	db_open_all(&st);
+	store_posts(&st, print_post, NULL);
+	store_close(&st);
 }
 
 int
@@ -62,136 +90,103 @@ trimcr(char *str)
 void
 cblogctl_info(const char *post_name)
 {
-	int			i;
-	int			db;
-	char		key[BUFSIZ];
-	char		*val;
-	struct cdb	cdb;
+	int					i;
+	char				date[BUFSIZ];
+	char				*val, *line;
+	struct store		st;
+	struct store_post	post;
+	bool				found;
 
-	if ((db = open(cblog_cdb, O_RDONLY)) < 0)
-		err(1, "%s", cblog_cdb);
-	cdb_init(&cdb, db);
+	db_open_all(&st);
+	found = (store_find(&st, post_name, &post) == 0);
 
 	printf("Informations about %s\n", post_name);
-	for (i=0; field[i] != NULL; i++) {
+	for (i=0; found && field[i] != NULL; i++) {
 		if (EQUALS(field[i], "source") || EQUALS(field[i], "html"))
 			continue;
 
-		snprintf(key, BUFSIZ, "%s_%s", post_name, field[i]);
-		if (cdb_find(&cdb, key, strlen(key)) > 0) {
-			val = db_get(&cdb);
-			if (EQUALS(field[i], "ctime")) {
-				time_to_str((time_t)strtoll(val, NULL, 10), "%Y/%m/%d %T", key, BUFSIZ);
-				printf("- %s: %s\n", field[i], key);
-			} else 
+		if ((val = store_get(&st, &post, field[i])) != NULL) {
+			if (EQUALS(field[i], "ctime") || EQUALS(field[i], "mtime")) {
+				time_to_str((time_t)strtoll(val, NULL, 10), "%Y/%m/%d %T", date, BUFSIZ);
+				printf("- %s: %s\n", field[i], date);
+			} else if (EQUALS(field[i], "related") ||
+			    EQUALS(field[i], "prev") || EQUALS(field[i], "next")) {
+				printf("- %s:", field[i]);
+				for (line = strtok(val, "\n"); line != NULL; line = strtok(NULL, "\n"))
+					printf(" %.*s", (int)strcspn(line, "\t"), line);
+				printf("\n");
+			} else
 				printf("- %s: %s\n", field[i], val);
 			free(val);
 		}
 	}
 	printf("\n");
-	cdb_free(&cdb);
-	close(db);
+	store_close(&st);
 }
 
 void
 cblogctl_get(const char *post_name)
 {
-	int			db;
-	FILE		*out;
-	char		key[BUFSIZ];
-	char		*val;
-	struct cdb	cdb;
-
-	if ((db = open(cblog_cdb, O_RDONLY)) < 0)
-		err(1, "%s", cblog_cdb);
-	cdb_init(&cdb, db);
+	FILE				*out;
+	char				*val;
+	struct store		st;
+	struct store_post	post;
 
-	out = fopen(post_name, "w");
+	db_open_all(&st);
 
-	snprintf(key, BUFSIZ, "%s_%s", post_name, "title");
-	if (cdb_find(&cdb, key, strlen(key)) > 0) {
-		val = db_get(&cdb);
-		fprintf(out, "Title: %s\n", val);
-	} else {
+	if (store_find(&st, post_name, &post) < 0 ||
+	    (val = store_get(&st, &post, "title")) == NULL) {
 		warnx("post %s not found", post_name);
+		store_close(&st);
 		return;
 	}
 
-	snprintf(key, BUFSIZ, "%s_%s", post_name, "tags");
-	if (cdb_find(&cdb, key, strlen(key)) > 0) {
-		val=db_get(&cdb);
+	out = fopen(post_name, "w");
+
+	fprintf(out, "Title: %s\n", val);
+	free(val);
+
+	if ((val = store_get(&st, &post, "tags")) != NULL) {
 		fprintf(out, "Tags: %s\n", val);
 		free(val);
 	}
 
 	fprintf(out, "\n");
 
-	snprintf(key, BUFSIZ, "%s_%s", post_name,"source");
-	if (cdb_find(&cdb, key, strlen(key)) > 0) {
-		val = db_get(&cdb);
+	if ((val = store_get(&st, &post, "source")) != NULL) {
 		fprintf(out, "%s\n", val);
 		free(val);
 	}
 
 	fclose(out);
-	cdb_free(&cdb);
-	close(db);
+	store_close(&st);
 }
 
 void
 cblogctl_add(const char *post_path)
 {
-	int					olddb, db, i;
 	FILE				*post;
-	char				key[BUFSIZ], date[11];
-	char				*val, *valkey, *post_name;
-	bool				found = false;
-	struct cdb			cdb;
-	struct cdb_make		cdb_make;
-	struct cdb_find		cdbf;
+	char				*post_name, *ppath;
+	char				date[32];
+	char				*val;
+	struct store		st;
+	struct store_post	found;
+	struct store_batch	batch;
 	struct buf			*ib, *ob;
 	char				filebuf[LINE_MAX];
 	bool				headers = true;
 	struct stat			filestat;
-	char				*ppath;
 
 	ppath = strdup(post_path);
 	post_name = basename(ppath);
+
 	post = fopen(post_path, "r");
 
 	if (post == NULL)
 		errx(EXIT_FAILURE, "Unable to open %s", post_name);
 
-	if ((olddb = open(cblog_cdb, O_RDONLY)) < 0)
-		err(1, "%s", cblog_cdb);
-	if ((db = open(cblog_cdb_tmp, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0)
-		err(1, "%s", cblog_cdb);
-
-	cdb_init(&cdb, olddb);
-	cdb_make_start(&cdb_make, db);
-
-	/* First recopy the whole "posts" entry and determine if the post already exist or not */
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-	while (cdb_findnext(&cdbf) > 0) {
-		valkey = db_get(&cdb);
-
-		cdb_make_add(&cdb_make, "posts", 5, valkey, strlen(valkey));
-
-		if (EQUALS(post_name, valkey))
-			found = true;
-
-		for (i=0; field[i] != NULL; i++) {
-			snprintf(key, BUFSIZ, "%s_%s", valkey, field[i]);
-			if (cdb_find(&cdb, key, strlen(key)) > 0) {
-				val = db_get(&cdb);
-				cdb_make_add(&cdb_make, key, strlen(key), val, strlen(val));
-				free(val);
-			}
-		}
-		free(valkey);
-	}
-	if (!found)
-		cdb_make_add(&cdb_make, "posts", 5, post_name, strlen(post_name));
+	db_open_all(&st);
+	store_batch_init(&batch);
 
 	ib = bufnew(BUFSIZ);
 
@@ -207,133 +202,69 @@ cblogctl_add(const char *post_path)
 				while (isspace(filebuf[strlen(filebuf) - 1]))
 					filebuf[strlen(filebuf) - 1] = '\0';
 
-				snprintf(key, BUFSIZ, "%s_title", post_name);
 				val = filebuf + strlen("Title: ");
-				cdb_make_put(&cdb_make, key, strlen(key), val, strlen(val), CDB_PUT_REPLACE);
+				store_batch_put(&batch, post_name, "title", val);
 
 			} else if (STARTS_WITH(filebuf, "Tags")) {
 				while (isspace(filebuf[strlen(filebuf) - 1]))
 					filebuf[strlen(filebuf) - 1] = '\0';
 
 				val = filebuf + strlen("Tags: ");
-				snprintf(key, BUFSIZ, "%s_tags", post_name);
-				cdb_make_put(&cdb_make, key, strlen(key), val, strlen(val), CDB_PUT_REPLACE);
+				store_batch_put(&batch, post_name, "tags", val);
 			}
 		} else
 			bufputs(ib, filebuf);
 	}
 	fclose(post);
 
-	stat(post_path, &filestat);
-	snprintf(date, 11, "%lld", (long long int)filestat.st_mtime);
-	snprintf(key, BUFSIZ, "%s_ctime", post_name);
-	cdb_make_put(&cdb_make, key, strlen(key), date, strlen(date), CDB_PUT_INSERT);
+	/* a post keeps the date it has been added first */
+	if (store_find(&st, post_name, &found) < 0) {
+		stat(post_path, &filestat);
+		snprintf(date, sizeof(date), "%lld", (long long int)filestat.st_mtime);
+		store_batch_put(&batch, post_name, "ctime", date);
+	}
+	snprintf(date, sizeof(date), "%lld", (long long int)time(NULL));
+	store_batch_put(&batch, post_name, "mtime", date);
 
 	ob = bufnew(BUFSIZ);
 	markdown(ob, ib, &mkd_xhtml);
 	bufnullterm(ob);
 	bufnullterm(ib);
 
-	snprintf(key, BUFSIZ, "%s_source", post_name);
-	cdb_make_put(&cdb_make, key, strlen(key), ib->data, strlen(ib->data), CDB_PUT_REPLACE);
+	store_batch_put(&batch, post_name, "source", ib->data);
 	bufrelease(ib);
 
-	snprintf(key, BUFSIZ, "%s_html", post_name);
-	cdb_make_put(&cdb_make, key, strlen(key), ob->data, strlen(ob->data), CDB_PUT_REPLACE);
+	store_batch_put(&batch, post_name, "html", ob->data);
 	bufrelease(ob);
+	bufpurge();
 
-	cdb_make_finish(&cdb_make);
-	close(olddb);
-	cdb_free(&cdb);
-	close(db);
-	if (rename(cblog_cdb_tmp, cblog_cdb) < 0)
-		err(1, "%s", cblog_cdb);
-
+	db_commit(&st, &batch);
 	free(ppath);
 }
 
 void
 cblogctl_del(const char *post_name)
 {
-	int					olddb, db, i;
-	struct cdb			cdb;
-	struct cdb_make		cdb_make;
-	struct cdb_find		cdbf;
-	char				*val, *valkey;
-	char				key[BUFSIZ];
-
-	if ((olddb = open(cblog_cdb, O_RDONLY)) < 0)
-		err(1, "%s", cblog_cdb);
-	if ((db = open(cblog_cdb_tmp, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0)
-		err(1, "%s", cblog_cdb);
-
-	cdb_init(&cdb, olddb);
-	cdb_make_start(&cdb_make, db);
-
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-	while (cdb_findnext(&cdbf) > 0) {
-		valkey = db_get(&cdb);
+	struct store		st;
+	struct store_batch	batch;
 
-		if (EQUALS(post_name, valkey))
-			continue;
-		cdb_make_add(&cdb_make, "posts", 5, valkey, strlen(valkey));
-
-		for (i=0; field[i] != NULL; i++) {
-			snprintf(key, BUFSIZ, "%s_%s", valkey, field[i]);
-			if (cdb_find(&cdb, key, strlen(key)) > 0) {
-				val = db_get(&cdb);
-				cdb_make_add(&cdb_make, key, strlen(key), val, strlen(val));
-				free(val);
-			}
-		}
-		free(valkey);
-	}
-	cdb_make_finish(&cdb_make);
-	close(olddb);
-	cdb_free(&cdb);
-	close(db);
-	if (rename(cblog_cdb_tmp, cblog_cdb) < 0)
-		err(1, "%s", cblog_cdb);
+	db_open_all(&st);
+	store_batch_init(&batch);
+	store_batch_del(&batch, post_name);
+	db_commit(&st, &batch);
 }
 
 void
 cblogctl_set(const char *post_name, char *to_be_set)
 {
-	int					olddb, db, i;
-	char				key[BUFSIZ];
-	char				*val, *newkey, *valkey;
-	struct cdb			cdb;
-	struct cdb_make		cdb_make;
-	struct cdb_find		cdbf;
-	bool				found = false;
-
-	if ((olddb = open(cblog_cdb, O_RDONLY)) < 0)
-		err(1, "%s", cblog_cdb);
-	if ((db = open(cblog_cdb_tmp, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0)
-		err(1, "%s", cblog_cdb);
-
-	cdb_init(&cdb, olddb);
-	cdb_make_start(&cdb_make, db);
-
-	cdb_findinit(&cdbf, &cdb, "posts", 5);
-	while (cdb_findnext(&cdbf) > 0) {
-		valkey = db_get(&cdb);
-		cdb_make_add(&cdb_make, "posts", 5, valkey, strlen(valkey));
-
-		if (EQUALS(post_name, valkey))
-			found = true;
-
-		for (i=0; field[i] != NULL; i++) {
-			snprintf(key, BUFSIZ, "%s_%s", valkey, field[i]);
-			if (cdb_find(&cdb, key, strlen(key)) > 0) {
-				val = db_get(&cdb);
-				cdb_make_add(&cdb_make, key, strlen(key), val, strlen(val));
-				free(val);
-			}
-		}
-		free(valkey);
-	}
-	if (!found)
+	char				*newkey;
+	char				date[32];
+	struct store		st;
+	struct store_post	post;
+	struct store_batch	batch;
+
+	db_open_all(&st);
+	if (store_find(&st, post_name, &post) < 0)
 		errx(EXIT_FAILURE, "%s: No such post", post_name);
 
 	newkey = to_be_set;
@@ -343,33 +274,100 @@ cblogctl_set(const char *post_name, char *to_be_set)
 	to_be_set[0] = '\0';
 	to_be_set++;
 
-	snprintf(key, BUFSIZ, "%s_%s", post_name, newkey);
+	store_batch_init(&batch);
+	store_batch_put(&batch, post_name, newkey, to_be_set);
+	if (!EQUALS(newkey, "mtime")) {
+		snprintf(date, sizeof(date), "%lld", (long long int)time(NULL));
+		store_batch_put(&batch, post_name, "mtime", date);
+	}
+	db_commit(&st, &batch);
+}
+
+struct compress_load {
+	struct store		*st;
+	struct store_batch	*batch;
+	const char			*fields;
+	int					nsamples;
+	int					asize;
+	char				**samples;
+};
+
+/* write the compressible fields of post again, keeping those to train on */
+static int
+compress_post(struct store_post *post, void *arg)
+{
+	struct compress_load	*load = arg;
+	const char				*fields[] = { "source", "html", NULL };
+	char					*val;
+	int						i;
 
-	cdb_make_put(&cdb_make, key, strlen(key), to_be_set, strlen(to_be_set), CDB_PUT_REPLACE);
+	for (i = 0; fields[i] != NULL; i++) {
+		if ((val = store_get(load->st, post, fields[i])) == NULL)
+			continue;
+		store_batch_put(load->batch, post->name, fields[i], val);
+		if (!compress_field(load->fields, fields[i])) {
+			free(val);
+			continue;
+		}
 
-	cdb_make_finish(&cdb_make);
-	cdb_free(&cdb);
-	close(db);
-	close(olddb);
+		if (load->nsamples == load->asize) {
+			load->asize = load->asize ? load->asize * 2 : 256;
+			load->samples = realloc(load->samples, load->asize * sizeof(char *));
+			if (load->samples == NULL)
+				errx(1, "Unable to allocate memory");
+		}
+		load->samples[load->nsamples++] = val;
+	}
 
-	if (rename(cblog_cdb_tmp, cblog_cdb) < 0)
-		err(1, "%s", cblog_cdb);
+	return 0;
 }
 
+/*
+ * Compress the fields of every post listed in fields, "" for none, with a
+ * dictionary trained on them, the next posts being compressed the same way
+ */
 void
-cblogctl_create(void)
+cblogctl_compress(const char *fields)
 {
-	int					db;
-	struct cdb_make		cdb_make;
+	struct store			st;
+	struct store_batch		batch;
+	struct compress_load	load;
+	char					*dict = NULL;
+	int						i;
+
+	db_open_all(&st);
+	store_batch_init(&batch);
+
+	memset(&load, 0, sizeof(struct compress_load));
+	load.st = &st;
+	load.batch = &batch;
+	load.fields = fields;
+	if (store_posts(&st, compress_post, &load) != 0)
+		err(1, "%s", cblog_cdb);
+
+	if (*fields != '\0')
+		dict = compress_train(load.samples, load.nsamples);
+	for (i = 0; i < load.nsamples; i++)
+		free(load.samples[i]);
+	free(load.samples);
+
+	store_batch_meta(&batch, COMPRESS_KEY, fields);
+	store_batch_meta(&batch, COMPRESS_DICT_KEY, dict != NULL ? dict : "");
+	printf("%d values of %s, dictionary of %zu bytes\n", load.nsamples,
+	    *fields != '\0' ? fields : "no field", dict != NULL ? strlen(dict) : 0);
+	free(dict);
+
+	db_commit(&st, &batch);
+}
 
+void
+cblogctl_create(bool sharded)
+{
 	if (access(cblog_cdb, F_OK) == 0)
 		errx(1, "%s already exists", cblog_cdb);
-	if ((db = open(cblog_cdb, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0)
-		err(1, "%s", cblog_cdb);
 
-	cdb_make_start(&cdb_make, db);
-	cdb_make_finish(&cdb_make);
-	close(db);
+	if (store_create(&store_cdb, cblog_cdb, sharded) < 0)
+		err(1, "%s", cblog_cdb);
 }
 
 void
@@ -1,6 +1,7 @@
 #ifndef	CBLOG_CLI_CBLOGCTL_H
 #define	CBLOG_CLI_CBLOGCTL_H
 
+#include <stdbool.h>
 #include <string.h>
 
 #define CBLOG_LIST_CMD 0
@@ -12,8 +13,10 @@
 #define CBLOG_VERSION_CMD 6
 #define CBLOG_PATH_CMD 7
 #define CBLOG_DEL_CMD 8
+#define CBLOG_EXPORT_CMD 9
+#define CBLOG_COMPRESS_CMD 10
 
-void cblogctl_create(void);
+void cblogctl_create(bool);
 void cblogctl_list(void);
 void cblogctl_info(const char *);
 void cblogctl_get(const char *);
@@ -22,10 +25,11 @@ void cblogctl_del(const char *);
 void cblogctl_set(const char *, char *);
 void cblogctl_version(void);
 void cblogctl_path(void);
+void cblogctl_export_search(const char *);
+void cblogctl_compress(const char *);
 
 /* path the the CDB database file */
 extern char	cblog_cdb[];
-extern char	cblog_cdb_tmp[];
 
 #endif	/* ndef CBLOG_CLI_CBLOGCTL_H */
 /* vim: set sw=4 sts=4 ts=4 : */
@@ -0,0 +1,384 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "buffer.h"
+#include "cblogctl.h"
+#include "cblog_common.h"
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_search.h"
+
+/* version of the files layout, bumped when a loader has to change */
+#define EXPORT_VERSION	1
+/* bytes of a word naming its shard */
+#define EXPORT_PREFIX	2
+/* a generation is named by 8 hexadecimal digits */
+#define EXPORT_GEN_LEN	8
+
+struct export {
+	const char	*dir;
+	char		tmp[PATH_MAX];		/* generation being written */
+	uint32_t	hash;				/* of everything written in tmp */
+	struct buf	*shards;			/* JSON array of the shard names */
+	int			nshards;
+	int			ndocs;				/* live posts, the oldest ones */
+	double		avglength;			/* of the live posts */
+};
+
+/* str as a JSON string */
+static void
+export_string(struct buf *ob, const char *str)
+{
+	bufputc(ob, '"');
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\' || (unsigned char)*str < 0x20)
+			bufprintf(ob, "\\u%04x", (unsigned char)*str);
+		else
+			bufputc(ob, *str);
+	}
+	bufputc(ob, '"');
+}
+
+/*
+ * Shard of word in name, which holds EXPORT_PREFIX * 3 + 1 bytes: its
+ * first bytes, ASCII letters and digits as is and the others as _ and two
+ * hexadecimal digits, so that every name is safe in a path and an URL.
+ */
+static void
+export_shard(const char *word, char *name)
+{
+	const unsigned char	*p = (const unsigned char *)word;
+	int					i;
+
+	for (i = 0; i < EXPORT_PREFIX && p[i] != '\0'; i++) {
+		if (p[i] < 0x80 && isalnum(p[i]))
+			*name++ = p[i];
+		else
+			name += sprintf(name, "_%02x", p[i]);
+	}
+	*name = '\0';
+}
+
+/* write ob as dir/name and its gzip version as dir/name.gz, both atomically */
+static void
+export_write(struct export *ex, const char *dir, const char *name,
+    struct buf *ob)
+{
+	FILE	*f;
+	gzFile	gz;
+	char	path[PATH_MAX], tmp[PATH_MAX];
+	size_t	i;
+
+	for (i = 0; i < ob->size; i++)
+		ex->hash = (ex->hash ^ (unsigned char)ob->data[i]) * 16777619;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL ||
+	    fwrite(ob->data, 1, ob->size, f) != ob->size || fclose(f) != 0 ||
+	    rename(tmp, path) < 0)
+		err(1, "%s", path);
+
+	snprintf(path, sizeof(path), "%s/%s.gz", dir, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((gz = gzopen(tmp, "wb9")) == NULL ||
+	    (ob->size > 0 && gzwrite(gz, ob->data, ob->size) != (int)ob->size) ||
+	    gzclose(gz) != Z_OK || rename(tmp, path) < 0)
+		err(1, "%s", path);
+}
+
+/* write the terms of shard name as {"word":"postings",...} */
+static void
+export_flush(struct export *ex, const char *name, struct buf *ob)
+{
+	char	file[NAME_MAX];
+
+	if (ob->size == 0)
+		return;
+
+	bufputs(ob, "}\n");
+	snprintf(file, sizeof(file), "%s.json", name);
+	export_write(ex, ex->tmp, file, ob);
+	bufreset(ob);
+
+	bufputs(ex->shards, ex->nshards++ ? "," : "");
+	export_string(ex->shards, name);
+}
+
+/* live docs of the index as [name, title, ctime, length] by number */
+static void
+export_docs(struct export *ex, struct store *st, struct search_docs *docs)
+{
+	struct store_post	post;
+	struct buf			*ob;
+	char				*title;
+	int					i;
+
+	ob = bufnew(BUFSIZ);
+	bufputc(ob, '[');
+	for (i = 0; i < ex->ndocs; i++) {
+		title = NULL;
+		if (store_find(st, docs->docs[i].name, &post) == 0)
+			title = store_get(st, &post, "title");
+
+		bufputs(ob, i ? ",\n[" : "\n[");
+		export_string(ob, docs->docs[i].name);
+		bufputc(ob, ',');
+		export_string(ob, title != NULL ? title : docs->docs[i].name);
+		bufprintf(ob, ",%lld,%u]", (long long)docs->docs[i].ctime,
+		    docs->docs[i].length);
+		free(title);
+	}
+	bufputs(ob, "\n]\n");
+
+	export_write(ex, ex->tmp, "docs.json", ob);
+	bufrelease(ob);
+}
+
+/*
+ * Cut the "delta[:weight]" entries of postings from the first one of a
+ * post which is not live, returns the length left
+ */
+static size_t
+export_live(struct export *ex, char *postings)
+{
+	char		*entry = postings, *end;
+	uint32_t	doc = 0;
+
+	while (*entry != '\0') {
+		doc += strtoul(entry, &end, 10);
+		if (end == entry || doc >= (uint32_t)ex->ndocs)
+			break;
+		for (entry = end; *entry != '\0' && *entry != ' '; entry++)
+			;
+		if (*entry == ' ')
+			entry++;
+	}
+	while (entry > postings && entry[-1] == ' ')
+		entry--;
+	*entry = '\0';
+
+	return entry - postings;
+}
+
+/* the posting lists of the terms, one file per shard */
+static void
+export_terms(struct export *ex, struct store *st)
+{
+	struct buf	*ob;
+	char		*terms, *word, *next, *val;
+	char		key[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char		shard[EXPORT_PREFIX * 3 + 1], cur[EXPORT_PREFIX * 3 + 1];
+
+	if ((terms = store_meta(st, SEARCH_TERMS_KEY)) == NULL)
+		return;
+
+	ob = bufnew(BUFSIZ);
+	cur[0] = '\0';
+	/* the terms are sorted, so that those of a shard follow each other */
+	for (word = terms; *word != '\0'; word = next) {
+		if ((next = strchr(word, '\n')) != NULL)
+			*next++ = '\0';
+		else
+			next = word + strlen(word);
+
+		snprintf(key, sizeof(key), SEARCH_TERM_PREFIX"%s", word);
+		if (*word == '\0' || (val = store_meta(st, key)) == NULL)
+			continue;
+		if (export_live(ex, val) == 0) {
+			free(val);
+			continue;
+		}
+
+		export_shard(word, shard);
+		if (!EQUALS(shard, cur)) {
+			export_flush(ex, cur, ob);
+			strcpy(cur, shard);
+		}
+		bufputs(ob, ob->size ? ",\n" : "{\n");
+		export_string(ob, word);
+		bufputc(ob, ':');
+		export_string(ob, val);
+		free(val);
+	}
+	export_flush(ex, cur, ob);
+
+	bufrelease(ob);
+	free(terms);
+}
+
+/* generation the current index.json of dir names, "" if none */
+static void
+export_current(const char *dir, char *gen)
+{
+	FILE	*f;
+	char	path[PATH_MAX], line[LINE_MAX];
+	char	*p;
+
+	gen[0] = '\0';
+	snprintf(path, sizeof(path), "%s/index.json", dir);
+	if ((f = fopen(path, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((p = strstr(line, "\"generation\":\"")) == NULL)
+			continue;
+		p += strlen("\"generation\":\"");
+		if (strspn(p, "0123456789abcdef") == EXPORT_GEN_LEN)
+			snprintf(gen, EXPORT_GEN_LEN + 1, "%s", p);
+		break;
+	}
+	fclose(f);
+}
+
+static void
+export_rmdir(const char *path)
+{
+	DIR				*d;
+	struct dirent	*de;
+	char			file[PATH_MAX];
+
+	if ((d = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+		    EQUALS(de->d_name, "..")))
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+		if (unlink(file) < 0)
+			warn("%s", file);
+	}
+	closedir(d);
+
+	if (rmdir(path) < 0)
+		warn("%s", path);
+}
+
+/*
+ * Remove the generations of dir but the new one and the one it replaces,
+ * still read by the browsers which loaded the previous index.json.
+ */
+static void
+export_prune(const char *dir, const char *gen, const char *prev)
+{
+	DIR				*d;
+	struct dirent	*de;
+	char			path[PATH_MAX];
+
+	if ((d = opendir(dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (strlen(de->d_name) != EXPORT_GEN_LEN ||
+		    strspn(de->d_name, "0123456789abcdef") != EXPORT_GEN_LEN ||
+		    EQUALS(de->d_name, gen) || EQUALS(de->d_name, prev))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		export_rmdir(path);
+	}
+	closedir(d);
+}
+
+/*
+ * Write the search index to dir for the blogs served as static files,
+ * searched by the browsers:
+ *
+ *   index.json			how to load and score the index
+ *   GEN/docs.json		the posts as [name, title, ctime, length] by number
+ *   GEN/SHARD.json		{"word":"postings",...} for the words of a shard
+ *
+ * along with a .gz version of each. GEN is named after the content of the
+ * files, so they can be cached forever: only index.json, written last,
+ * changes in place. The posts dated in the future, the newest of the
+ * index, are left out until an export made once they are live.
+ */
+void
+cblogctl_export_search(const char *dir)
+{
+	struct export		ex;
+	struct store		st;
+	struct search_docs	*docs;
+	struct buf			*ob;
+	char				gen[EXPORT_GEN_LEN + 1], prev[EXPORT_GEN_LEN + 1];
+	char				path[PATH_MAX];
+	time_t				now = time(NULL);
+	double				total = 0;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		err(1, "%s", dir);
+
+	if (store_open(&st, &store_cdb, cblog_cdb) < 0)
+		err(1, "%s", cblog_cdb);
+	if ((docs = search_docs(&st)) == NULL)
+		errx(1, "%s: no search index, rewrite the database with cblogctl "
+		    "set on any post first", cblog_cdb);
+
+	memset(&ex, 0, sizeof(ex));
+	ex.dir = dir;
+	ex.hash = 2166136261U;
+	ex.shards = bufnew(BUFSIZ);
+	/* the posts are numbered oldest first */
+	for (; ex.ndocs < docs->ndocs && docs->docs[ex.ndocs].ctime <= now;
+	    ex.ndocs++)
+		total += docs->docs[ex.ndocs].length;
+	ex.avglength = ex.ndocs > 0 && total > 0 ? total / ex.ndocs : 1;
+	snprintf(ex.tmp, sizeof(ex.tmp), "%s/.export.%ld", dir, (long)getpid());
+	if (mkdir(ex.tmp, 0755) < 0)
+		err(1, "%s", ex.tmp);
+
+	export_docs(&ex, &st, docs);
+	export_terms(&ex, &st);
+
+	/* an unchanged index has been exported already, keep its files */
+	snprintf(gen, sizeof(gen), "%08x", ex.hash);
+	snprintf(path, sizeof(path), "%s/%s", dir, gen);
+	if (rename(ex.tmp, path) < 0) {
+		if (errno != EEXIST && errno != ENOTEMPTY)
+			err(1, "%s", path);
+		export_rmdir(ex.tmp);
+	}
+
+	ob = bufnew(BUFSIZ);
+	bufprintf(ob, "{\"version\":%d,\"generation\":\"%s\",\n", EXPORT_VERSION,
+	    gen);
+	bufprintf(ob, "\"docs\":\"%s/docs.json\",\"terms\":\"%s/{shard}.json\",\n",
+	    gen, gen);
+	bufprintf(ob, "\"shard\":{\"prefix\":%d,\"escape\":\"_%%02x\"},\n",
+	    EXPORT_PREFIX);
+	bufprintf(ob, "\"shards\":[%.*s],\n", (int)ex.shards->size,
+	    ex.shards->data);
+	bufprintf(ob, "\"ndocs\":%d,\"avglength\":%.3f,\n", ex.ndocs,
+	    ex.avglength);
+	bufprintf(ob, "\"words\":{\"min\":2,\"max\":%d,\"query\":%d},\n",
+	    SEARCH_WORD_MAX, SEARCH_QUERY_WORDS);
+	bufprintf(ob, "\"weights\":{\"title\":%d,\"tags\":%d,\"source\":1},\n",
+	    SEARCH_WEIGHT_TITLE, SEARCH_WEIGHT_TAGS);
+	bufprintf(ob, "\"bm25\":{\"k1\":%g,\"b\":%g},\n", SEARCH_BM25_K1,
+	    SEARCH_BM25_B);
+	bufputs(ob, "\"postings\":\"delta[:weight]\"}\n");
+
+	export_current(dir, prev);
+	export_write(&ex, dir, "index.json", ob);
+	export_prune(dir, gen, prev);
+
+	printf("%s: %d posts, %d shards, generation %s\n", dir, ex.ndocs,
+	    ex.nshards, gen);
+
+	bufrelease(ob);
+	bufrelease(ex.shards);
+	bufpurge();
+	search_docs_free(docs);
+	store_close(&st);
+}
+/* vim: set sw=4 sts=4 ts=4 : */
@@ -5,6 +5,7 @@
 #include <limits.h>
 #include "cblogctl.h"
 #include "cblog_utils.h"
+#include "cblog_compress.h"
 
 static struct command {
 	const char *name;
@@ -21,6 +22,8 @@ static struct command {
 	{ "create", "c", "Create database", CBLOG_CREATE_CMD},
 	{ "version", "v", "Version of CBlog", CBLOG_VERSION_CMD},
 	{ "path", "p", "Print cblog.cdb path", CBLOG_PATH_CMD},
+	{ "export-search", "e", "Export the search index as static files", CBLOG_EXPORT_CMD},
+	{ "compress", "z", "Compress the post bodies", CBLOG_COMPRESS_CMD},
 	{ NULL, NULL, NULL, 0},
 };
 
@@ -29,13 +32,15 @@ usage(const char *s)
 {
 	printf("Usage: %s cmd [option]\n\n\
 			Example:\n\
-			create\n\
+			create [sharded]\n\
 			add file_post\n\
 			del file_post\n\
 			get file_post1 file_post2 ... file_postN\n\
 			set file_post key=value\n\
 			info file_post1 file_post2 ... file_postN\n\
 			list\n\
+			export-search directory\n\
+			compress [none | source | html ...]\n\
 			path\n\
 			version\n", s);
 
@@ -47,6 +52,8 @@ main(int argc, char *argv[])
 {
 	int i;
 	int type = -1;
+	char fields[64];
+	size_t len;
 
 	if (argc == 1) 
 		usage(argv[0]);
@@ -71,9 +78,8 @@ main(int argc, char *argv[])
 	slen = strlen(s);
 	if ((slen + 4) >= PATH_MAX) /* keep 4 char for .tmp */
 		err(-1, "database path is too long.");
-	/* setup cblog_cdb and cblog_cdb_tmp variable */
+	/* setup cblog_cdb variable */
 	(void)memcpy(cblog_cdb, s, slen + 1);
-	(void)sprintf(cblog_cdb_tmp, "%s.tmp", cblog_cdb);
 
 	if (type != CBLOG_CREATE_CMD && type != CBLOG_VERSION_CMD && type != CBLOG_PATH_CMD) {
 	    if (access(cblog_cdb, F_OK) != 0)
@@ -82,7 +88,10 @@ main(int argc, char *argv[])
 
 	switch(type) {
 		case CBLOG_CREATE_CMD:
-			cblogctl_create();
+			if (argc > 3 || (argc == 3 && !EQUALS(argv[2], "sharded")))
+				usage(argv[0]);
+
+			cblogctl_create(argc == 3);
 			break;
 		case CBLOG_LIST_CMD:
 			cblogctl_list();
@@ -120,6 +129,27 @@ main(int argc, char *argv[])
 			for (i=2; i < argc; i++)
 				cblogctl_info(argv[i]);
 
+			break;
+		case CBLOG_EXPORT_CMD:
+			if (argc != 3)
+				usage(argv[0]);
+
+			cblogctl_export_search(argv[2]);
+			break;
+		case CBLOG_COMPRESS_CMD:
+			len = 0;
+			fields[0] = '\0';
+			for (i = 2; i < argc; i++) {
+				if (EQUALS(argv[i], "none") && argc == 3)
+					break;
+				if (!compress_field(COMPRESS_FIELDS, argv[i]) ||
+				    len + strlen(argv[i]) + 2 > sizeof(fields))
+					usage(argv[0]);
+				len += snprintf(fields + len, sizeof(fields) - len, "%s%s",
+				    i > 2 ? " " : "", argv[i]);
+			}
+
+			cblogctl_compress(argc == 2 ? COMPRESS_FIELDS : fields);
 			break;
 		case CBLOG_VERSION_CMD:
 			cblogctl_version();
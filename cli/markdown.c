@@ -35,10 +35,11 @@
  ***************/
 
 /* link_ref • reference to a link */
+/*   the buffers are volatile views into the input buffer */
 struct link_ref {
-	struct buf *	id;
-	struct buf *	link;
-	struct buf *	title; };
+	struct buf	id;
+	struct buf	link;
+	struct buf	title; };
 
 
 /* char_trigger • function pointer to render active chars */
@@ -108,7 +109,7 @@ static struct html_tag block_tags[] = {
 static int
 cmp_link_ref(void *array_entry, void *key) {
 	struct link_ref *lr = array_entry;
-	return bufcasecmp(lr->id, key); }
+	return bufcasecmp(&lr->id, key); }
 
 
 /* cmp_html_tag • comparison function for bsearch() (stolen from discount) */
@@ -120,6 +121,32 @@ cmp_html_tag(const void *a, const void *b) {
 	return strncasecmp(hta->text, htb->text, hta->size); }
 
 
+/* work_buffer • returns an emptied working buffer from the render stack */
+/*   callers give it back by decrementing rndr->work.size; when tracking */
+/*   buffers, a new one is registered at the call site of work_buffer */
+#ifdef TRACK_BUFFER_DEBUG
+#define work_buffer(rndr) \
+	work_buffer_(rndr, __FILE__, __LINE__)
+static struct buf *
+work_buffer_(struct render *rndr, const char *file, int line) {
+#else
+static struct buf *
+work_buffer(struct render *rndr) {
+#endif
+	struct buf *work;
+	if (rndr->work.size < rndr->work.asize) {
+		work = rndr->work.item[rndr->work.size ++];
+		work->size = 0; }
+	else {
+#ifdef TRACK_BUFFER_DEBUG
+		work = bufnew_(WORK_UNIT, file, line);
+#else
+		work = bufnew(WORK_UNIT);
+#endif
+		parr_push(&rndr->work, work); }
+	return work; }
+
+
 /* find_block_tag • returns the current block tag */
 static struct html_tag *
 find_block_tag(char *data, size_t size) {
@@ -319,12 +346,7 @@ parse_emph1(struct buf *ob, struct render *rndr,
 			continue; }
 		if (data[i] == c && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
-			if (rndr->work.size < rndr->work.asize) {
-				work = rndr->work.item[rndr->work.size ++];
-				work->size = 0; }
-			else {
-				work = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, work); }
+			work = work_buffer(rndr);
 			parse_inline(work, rndr, data, i);
 			r = rndr->make.emphasis(ob, work, c, rndr->make.opaque);
 			rndr->work.size -= 1;
@@ -349,12 +371,7 @@ parse_emph2(struct buf *ob, struct render *rndr,
 		if (i + 1 < size && data[i] == c && data[i + 1] == c
 		&& i && data[i - 1] != ' '
 		&& data[i - 1] != '\t' && data[i - 1] != '\n') {
-			if (rndr->work.size < rndr->work.asize) {
-				work = rndr->work.item[rndr->work.size ++];
-				work->size = 0; }
-			else {
-				work = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, work); }
+			work = work_buffer(rndr);
 			parse_inline(work, rndr, data, i);
 			r = rndr->make.double_emphasis(ob, work, c,
 				rndr->make.opaque);
@@ -386,12 +403,7 @@ parse_emph3(struct buf *ob, struct render *rndr,
 		&& rndr->make.triple_emphasis) {
 			/* triple symbol found */
 			struct buf *work = 0;
-			if (rndr->work.size < rndr->work.asize) {
-				work = rndr->work.item[rndr->work.size ++];
-				work->size = 0; }
-			else {
-				work = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, work); }
+			work = work_buffer(rndr);
 			parse_inline(work, rndr, data, i);
 			r = rndr->make.triple_emphasis(ob, work, c,
 							rndr->make.opaque);
@@ -551,6 +563,9 @@ char_link(struct buf *ob, struct render *rndr,
 	struct buf *content = 0;
 	struct buf *link = 0;
 	struct buf *title = 0;
+	VOLATILE_BUFN(link_view, 0, 0);
+	VOLATILE_BUFN(title_view, 0, 0);
+	VOLATILE_BUFN(alt_view, 0, 0);
 	size_t org_work_size = rndr->work.size;
 	int text_has_nl = 0, ret;
 
@@ -618,29 +633,19 @@ char_link(struct buf *ob, struct render *rndr,
 		if (data[link_b] == '<') link_b += 1;
 		if (data[link_e - 1] == '>') link_e -= 1;
 
-		/* building escaped link and title */
+		/* link and title are volatile views into the input */
 		if (link_e > link_b) {
-			if (rndr->work.size < rndr->work.asize) {
-				link = rndr->work.item[rndr->work.size ++];
-				link->size = 0; }
-			else {
-				link = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, link); }
-			bufput(link, data + link_b, link_e - link_b); }
+			BUFVIEW(link_view, data + link_b, link_e - link_b);
+			link = &link_view; }
 		if (title_e > title_b) {
-			if (rndr->work.size < rndr->work.asize) {
-				title = rndr->work.item[rndr->work.size ++];
-				title->size = 0; }
-			else {
-				title = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, title); }
-			bufput(title, data + title_b, title_e - title_b);}
+			BUFVIEW(title_view, data + title_b, title_e - title_b);
+			title = &title_view; }
 
 		i += 1; }
 
 	/* reference style link */
 	else if (i < size && data[i] == '[') {
-		struct buf id = { 0, 0, 0, 0, 0 };
+		VOLATILE_BUFN(id, 0, 0);
 		struct link_ref *lr;
 
 		/* looking for the id */
@@ -655,12 +660,7 @@ char_link(struct buf *ob, struct render *rndr,
 			if (text_has_nl) {
 				struct buf *b = 0;
 				size_t j;
-				if (rndr->work.size < rndr->work.asize) {
-					b = rndr->work.item[rndr->work.size ++];
-					b->size = 0; }
-				else {
-					b = bufnew(WORK_UNIT);
-					parr_push(&rndr->work, b); }
+				b = work_buffer(rndr);
 				for (j = 1; j < txt_e; j += 1)
 					if (data[j] != '\n')
 						bufputc(b, data[j]);
@@ -678,25 +678,20 @@ char_link(struct buf *ob, struct render *rndr,
 		if (!lr) return 0;
 
 		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
+		link = &lr->link;
+		title = lr->title.size ? &lr->title : 0;
 		i += 1; }
 
 	/* shortcut reference style link */
 	else {
-		struct buf id = { 0, 0, 0, 0, 0 };
+		VOLATILE_BUFN(id, 0, 0);
 		struct link_ref *lr;
 
 		/* crafting the id */
 		if (text_has_nl) {
 			struct buf *b = 0;
 			size_t j;
-			if (rndr->work.size < rndr->work.asize) {
-				b = rndr->work.item[rndr->work.size ++];
-				b->size = 0; }
-			else {
-				b = bufnew(WORK_UNIT);
-				parr_push(&rndr->work, b); }
+			b = work_buffer(rndr);
 			for (j = 1; j < txt_e; j += 1)
 				if (data[j] != '\n')
 					bufputc(b, data[j]);
@@ -713,22 +708,20 @@ char_link(struct buf *ob, struct render *rndr,
 		if (!lr) return 0;
 
 		/* keeping link and title from link_ref */
-		link = lr->link;
-		title = lr->title;
+		link = &lr->link;
+		title = lr->title.size ? &lr->title : 0;
 
 		/* rewinding the whitespace */
 		i = txt_e + 1; }
 
 	/* building content: img alt is escaped, link content is parsed */
 	if (txt_e > 1) {
-		if (rndr->work.size < rndr->work.asize) {
-			content = rndr->work.item[rndr->work.size ++];
-			content->size = 0; }
+		if (is_img) {
+			BUFVIEW(alt_view, data + 1, txt_e - 1);
+			content = &alt_view; }
 		else {
-			content = bufnew(WORK_UNIT);
-			parr_push(&rndr->work, content); }
-		if (is_img) bufput(content, data + 1, txt_e - 1);
-		else parse_inline(content, rndr, data + 1, txt_e - 1); }
+			content = work_buffer(rndr);
+			parse_inline(content, rndr, data + 1, txt_e - 1); } }
 
 	/* calling the relevant rendering function */
 	ret = 0;
@@ -868,12 +861,7 @@ parse_blockquote(struct buf *ob, struct render *rndr,
 	char *work_data = 0;
 	struct buf *out = 0;
 
-	if (rndr->work.size < rndr->work.asize) {
-		out = rndr->work.item[rndr->work.size ++];
-		out->size = 0; }
-	else {
-		out = bufnew(WORK_UNIT);
-		parr_push(&rndr->work, out); }
+	out = work_buffer(rndr);
 
 	beg = 0;
 	while (beg < size) {
@@ -928,12 +916,7 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 		work.size -= 1;
 	if (!level) {
 		struct buf *tmp = 0;
-		if (rndr->work.size < rndr->work.asize) {
-			tmp = rndr->work.item[rndr->work.size ++];
-			tmp->size = 0; }
-		else {
-			tmp = bufnew(WORK_UNIT);
-			parr_push(&rndr->work, tmp); }
+		tmp = work_buffer(rndr);
 		parse_inline(tmp, rndr, work.data, work.size);
 		if (rndr->make.paragraph)
 			rndr->make.paragraph(ob, tmp, rndr->make.opaque);
@@ -950,12 +933,7 @@ parse_paragraph(struct buf *ob, struct render *rndr,
 				work.size -= 1;
 			if (work.size) {
 				struct buf *tmp = 0;
-				if (rndr->work.size < rndr->work.asize) {
-					tmp=rndr->work.item[rndr->work.size++];
-					tmp->size = 0; }
-				else {
-					tmp = bufnew(WORK_UNIT);
-					parr_push(&rndr->work, tmp); }
+				tmp = work_buffer(rndr);
 				parse_inline(tmp, rndr, work.data, work.size);
 				if (rndr->make.paragraph)
 					rndr->make.paragraph(ob, tmp,
@@ -976,12 +954,7 @@ parse_blockcode(struct buf *ob, struct render *rndr,
 	size_t beg, end, pre;
 	struct buf *work = 0;
 
-	if (rndr->work.size < rndr->work.asize) {
-		work = rndr->work.item[rndr->work.size ++];
-		work->size = 0; }
-	else {
-		work = bufnew(WORK_UNIT);
-		parr_push(&rndr->work, work); }
+	work = work_buffer(rndr);
 
 	beg = 0;
 	while (beg < size) {
@@ -1030,18 +1003,8 @@ parse_listitem(struct buf *ob, struct render *rndr,
 	while (end < size && data[end - 1] != '\n') end += 1;
 
 	/* getting working buffers */
-	if (rndr->work.size < rndr->work.asize) {
-		work = rndr->work.item[rndr->work.size ++];
-		work->size = 0; }
-	else {
-		work = bufnew(WORK_UNIT);
-		parr_push(&rndr->work, work); }
-	if (rndr->work.size < rndr->work.asize) {
-		inter = rndr->work.item[rndr->work.size ++];
-		inter->size = 0; }
-	else {
-		inter = bufnew(WORK_UNIT);
-		parr_push(&rndr->work, inter); }
+	work = work_buffer(rndr);
+	inter = work_buffer(rndr);
 
 	/* putting the first line into the working buffer */
 	bufput(work, data + beg, end - beg);
@@ -1122,12 +1085,7 @@ parse_list(struct buf *ob, struct render *rndr,
 	struct buf *work = 0;
 	size_t i = 0, j;
 
-	if (rndr->work.size < rndr->work.asize) {
-		work = rndr->work.item[rndr->work.size ++];
-		work->size = 0; }
-	else {
-		work = bufnew(WORK_UNIT);
-		parr_push(&rndr->work, work); }
+	work = work_buffer(rndr);
 
 	while (i < size) {
 		j = parse_listitem(work, rndr, data + i, size - i, &flags);
@@ -1335,7 +1293,7 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 	size_t title_offset, title_end;
 	size_t line_end;
 	struct link_ref *lr;
-	struct buf id = { 0, 0, 0, 0, 0 }; /* volatile buf for id search */
+	VOLATILE_BUFN(id, 0, 0); /* volatile buf for id search */
 
 	/* up to 3 optional leading spaces */
 	if (beg + 3 >= end) return 0;
@@ -1418,15 +1376,12 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 	id.size = id_end - id_offset;
 	n = arr_sorted_find_i(refs, &id, cmp_link_ref);
 	if (arr_insert(refs, 1, n) && (lr = arr_item(refs, n)) != 0) {
-		lr->id = bufnew(id_end - id_offset);
-		bufput(lr->id, data + id_offset, id_end - id_offset);
-		lr->link = bufnew(link_end - link_offset);
-		bufput(lr->link, data + link_offset, link_end - link_offset);
-		if (title_end > title_offset) {
-			lr->title = bufnew(title_end - title_offset);
-			bufput(lr->title, data + title_offset,
-						title_end - title_offset); }
-		else lr->title = 0; }
+		lr->id = lr->link = lr->title = id;
+		BUFVIEW(lr->link, data + link_offset, link_end - link_offset);
+		if (title_end > title_offset)
+			BUFVIEW(lr->title, data + title_offset,
+						title_end - title_offset);
+		else	BUFVIEW(lr->title, 0, 0); }
 	return 1; }
 
 
@@ -1438,7 +1393,6 @@ is_ref(char *data, size_t beg, size_t end, size_t *last, struct array *refs) {
 /* markdown • parses the input buffer and renders it into the output buffer */
 void
 markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndrer) {
-	struct link_ref *lr;
 	struct buf *text = bufnew(TEXT_UNIT);
 	size_t i, beg, end;
 	struct render rndr;
@@ -1496,11 +1450,6 @@ markdown(struct buf *ob, struct buf *ib, const struct mkd_renderer *rndrer) {
 
 	/* clean-up */
 	bufrelease(text);
-	lr = rndr.refs.base;
-	for (i = 0; i < rndr.refs.size; i += 1) {
-		bufrelease(lr[i].id);
-		bufrelease(lr[i].link);
-		bufrelease(lr[i].title); }
 	arr_free(&rndr.refs);
 	assert(rndr.work.size == 0);
 	for (i = 0; i < rndr.work.asize; i += 1)
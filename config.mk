@@ -28,3 +28,16 @@ SYSCONFDIR=		${PREFIX}/etc
 CC?=	gcc
 AR?=	ar
 RANLIB?=	ranlib
+
+# Uncomment to profile cblogctl buffer allocations: live buffers are
+# tracked per call site and a report is printed on stderr at exit
+#CFLAGS+=	-DBUFFER_PROFILE
+
+# Uncomment to read the comment files with the blocking calls instead of
+# io_uring on Linux
+#CFLAGS+=	-DNO_IO_URING
+
+# Uncomment both to count the allocations of each request of cblog.cgi in
+# its access log (allocs, alloc_bytes and alloc_peak fields)
+#CFLAGS+=	-DALLOC_STATS
+#ALLOCLIBS=	-ldl
@@ -0,0 +1,120 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "cblog_utils.h"
+#include "cblog_archives.h"
+
+static int
+arch_cmp_month(const void *a, const void *b)
+{
+	const struct archive_month	*ma = a;
+	const struct archive_month	*mb = b;
+
+	if (ma->year != mb->year)
+		return mb->year - ma->year;
+
+	return mb->month - ma->month;
+}
+
+/*
+ * Histogram of the posts of ov but the drafts. Returns the value of
+ * ARCHIVES_KEY, to be freed by the caller.
+ */
+char *
+archives_histogram(struct store_overlay *ov)
+{
+	struct store_overlay_post	*p;
+	struct archive_month		*months;
+	struct tm					tm;
+	char						*val;
+	size_t						len = 0;
+	int							i, n = 0;
+
+	months = malloc((ov->nposts ? ov->nposts : 1) *
+	    sizeof(struct archive_month));
+	if (months == NULL)
+		errx(1, "Unable to allocate memory");
+
+	for (i = 0; i < ov->nposts; i++) {
+		p = STORE_OVERLAY_POST(ov, i);
+		if (!p->deleted && !p->draft && p->ctime >= 0) {
+			localtime_r(&p->ctime, &tm);
+			months[n].year = tm.tm_year + 1900;
+			months[n].month = tm.tm_mon + 1;
+			months[n++].count = 1;
+		}
+	}
+
+	if (n > 0)
+		qsort(months, n, sizeof(struct archive_month), arch_cmp_month);
+
+	/* "YYYY-MM count\n" is at most 20 bytes */
+	if ((val = malloc(n * 20 + 1)) == NULL)
+		errx(1, "Unable to allocate memory");
+	val[0] = '\0';
+
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n && arch_cmp_month(&months[i], &months[i + 1]) == 0) {
+			months[i + 1].count += months[i].count;
+			continue;
+		}
+		len += snprintf(val + len, n * 20 + 1 - len, "%04d-%02d %d\n",
+		    months[i].year, months[i].month, months[i].count);
+	}
+	free(months);
+
+	return val;
+}
+
+/*
+ * Add the new ARCHIVES_KEY value to batch if it changes once committed, ov
+ * holding the posts of st as batch leaves them
+ */
+int
+archives_update(struct store *st, struct store_overlay *ov,
+    struct store_batch *batch)
+{
+	char	*val, *old;
+
+	val = archives_histogram(ov);
+	old = store_meta(st, ARCHIVES_KEY);
+	if (old == NULL || strcmp(old, val) != 0)
+		store_batch_meta(batch, ARCHIVES_KEY, val);
+
+	free(old);
+	free(val);
+
+	return 0;
+}
+
+/* months of an ARCHIVES_KEY value in *months, returns their number */
+int
+archives_parse(const char *val, struct archive_month **months)
+{
+	struct archive_month	m;
+	const char				*line;
+	int						n = 0, asize = 0;
+
+	*months = NULL;
+	for (line = val; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (sscanf(line, "%4d-%2d %d", &m.year, &m.month, &m.count) != 3 ||
+		    m.month < 1 || m.month > 12 || m.count <= 0)
+			continue;
+
+		if (n == asize) {
+			asize = asize ? asize * 2 : 64;
+			*months = realloc(*months, asize * sizeof(struct archive_month));
+			if (*months == NULL)
+				errx(1, "Unable to allocate memory");
+		}
+		(*months)[n++] = m;
+	}
+
+	return n;
+}
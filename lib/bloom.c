@@ -0,0 +1,218 @@
+#include <ctype.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cblog_utils.h"
+#include "cblog_bloom.h"
+
+/* FNV-1a of kind then the len bytes of str, ASCII letters folded if fold */
+static uint64_t
+blm_hash(char kind, const char *str, size_t len, bool fold)
+{
+	uint64_t	h = 14695981039346656037ULL;
+	size_t		i;
+
+	h = (h ^ (unsigned char)kind) * 1099511628211ULL;
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)(fold ? tolower((unsigned char)str[i]) :
+		    str[i])) * 1099511628211ULL;
+
+	return h;
+}
+
+/* set or test the bits of hash h, the halves of h being combined */
+static bool
+blm_bits(uint8_t *bits, uint32_t nbits, int nhashes, uint64_t h, bool set)
+{
+	uint32_t	h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, bit;
+	int			i;
+
+	for (i = 0; i < nhashes; i++) {
+		bit = (h1 + (uint32_t)i * h2) % nbits;
+		if (set)
+			bits[bit / 8] |= 1 << (bit % 8);
+		else if ((bits[bit / 8] & (1 << (bit % 8))) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* hash of each tag of tags in *hashes, returns their number */
+static int
+blm_tags(const char *tags, uint64_t **hashes, int *asize, int n)
+{
+	const char	*end;
+	size_t		len;
+
+	while (tags != NULL && *tags != '\0') {
+		while (*tags == ',' || isspace((unsigned char)*tags))
+			tags++;
+		if ((end = strchr(tags, ',')) == NULL)
+			end = tags + strlen(tags);
+		for (len = end - tags; len > 0 && isspace((unsigned char)tags[len - 1]); len--)
+			;
+		if (len > 0) {
+			if (n == *asize) {
+				*asize = *asize ? *asize * 2 : 256;
+				if ((*hashes = realloc(*hashes, *asize * sizeof(uint64_t))) == NULL)
+					errx(1, "Unable to allocate memory");
+			}
+			(*hashes)[n++] = blm_hash('t', tags, len, true);
+		}
+		tags = end;
+	}
+
+	return n;
+}
+
+/*
+ * Add the new BLOOM_KEY value to batch if it changes once committed, ov
+ * holding the posts of st as batch leaves them
+ */
+int
+bloom_update(struct store *st, struct store_overlay *ov,
+    struct store_batch *batch)
+{
+	struct store_overlay_post	*p;
+	uint64_t					*hashes = NULL;
+	uint8_t						*bits;
+	uint32_t					nbits;
+	char						*val, *old;
+	size_t						len;
+	int							i, n = 0, asize = 0;
+
+	for (i = 0; i < ov->nposts; i++) {
+		p = STORE_OVERLAY_POST(ov, i);
+		if (p->deleted)
+			continue;
+		n = blm_tags(p->tags, &hashes, &asize, n);
+		if (n == asize) {
+			asize = asize ? asize * 2 : 256;
+			if ((hashes = realloc(hashes, asize * sizeof(uint64_t))) == NULL)
+				errx(1, "Unable to allocate memory");
+		}
+		hashes[n++] = blm_hash('p', p->name, strlen(p->name), false);
+	}
+
+	/* whole bytes, so that the filter is written as hexadecimal digits */
+	nbits = n * BLOOM_BITS_PER_KEY;
+	nbits = nbits < 64 ? 64 : (nbits + 7) & ~7U;
+	if ((bits = calloc(nbits / 8, 1)) == NULL ||
+	    (val = malloc(nbits / 4 + 32)) == NULL)
+		errx(1, "Unable to allocate memory");
+	for (i = 0; i < n; i++)
+		blm_bits(bits, nbits, BLOOM_HASHES, hashes[i], true);
+	free(hashes);
+
+	len = snprintf(val, 32, "%d %u ", BLOOM_HASHES, nbits);
+	for (i = 0; i < (int)(nbits / 8); i++)
+		len += snprintf(val + len, 3, "%02x", bits[i]);
+	free(bits);
+
+	old = store_meta(st, BLOOM_KEY);
+	if (old == NULL || strcmp(old, val) != 0)
+		store_batch_meta(batch, BLOOM_KEY, val);
+
+	free(old);
+	free(val);
+
+	return 0;
+}
+
+/* copy the filter of src to dst, as the memory backend loads it */
+int
+bloom_copy(struct store *dst, struct store *src)
+{
+	struct store_batch	batch;
+	char				*val;
+	int					ret;
+
+	if ((val = store_meta(src, BLOOM_KEY)) == NULL)
+		return 0;
+
+	store_batch_init(&batch);
+	store_batch_meta(&batch, BLOOM_KEY, val);
+	free(val);
+	ret = store_commit(dst, &batch);
+	store_batch_free(&batch);
+
+	return ret;
+}
+
+/* filter of st, NULL if the database has none or it is malformed */
+struct bloom *
+bloom_load(struct store *st)
+{
+	struct bloom	*b;
+	char			*val, *hex;
+	unsigned int	byte;
+	uint32_t		i;
+
+	if ((val = store_meta(st, BLOOM_KEY)) == NULL)
+		return NULL;
+	if ((b = calloc(1, sizeof(struct bloom))) == NULL) {
+		free(val);
+		return NULL;
+	}
+
+	b->nhashes = strtol(val, &hex, 10);
+	b->nbits = strtoul(hex, &hex, 10);
+	if (*hex == ' ')
+		hex++;
+	if (b->nhashes <= 0 || b->nbits == 0 || b->nbits % 8 != 0 ||
+	    strlen(hex) != b->nbits / 4 ||
+	    (b->bits = malloc(b->nbits / 8)) == NULL) {
+		free(val);
+		bloom_free(b);
+		return NULL;
+	}
+
+	for (i = 0; i < b->nbits / 8; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+			free(val);
+			bloom_free(b);
+			return NULL;
+		}
+		b->bits[i] = byte;
+	}
+	free(val);
+
+	return b;
+}
+
+void
+bloom_free(struct bloom *b)
+{
+	if (b == NULL)
+		return;
+
+	free(b->bits);
+	free(b);
+}
+
+/* may name be a post, false only if it surely is not */
+bool
+bloom_post(struct bloom *b, const char *name)
+{
+	return blm_bits(b->bits, b->nbits, b->nhashes,
+	    blm_hash('p', name, strlen(name), false), false);
+}
+
+/* may tag be the tag of a post, false only if it surely is not */
+bool
+bloom_tag(struct bloom *b, const char *tag)
+{
+	size_t	len;
+
+	/* trailing spaces are ignored and an empty tag matches every post */
+	for (len = strlen(tag); len > 0 && isspace((unsigned char)tag[len - 1]); len--)
+		;
+	if (len == 0)
+		return true;
+
+	return blm_bits(b->bits, b->nbits, b->nhashes,
+	    blm_hash('t', tag, len, true), false);
+}
@@ -0,0 +1,23 @@
+#ifndef	CBLOG_LIB_CBLOG_ARCHIVES_H
+#define	CBLOG_LIB_CBLOG_ARCHIVES_H
+
+#include "cblog_store.h"
+
+/*
+ * Number of posts of each month, kept by cblogctl in a database wide key
+ * as "YYYY-MM count" lines, newest month first, so that the archive pages
+ * are listed without reading the posts.
+ */
+#define ARCHIVES_KEY	"archives"
+
+struct archive_month {
+	int		year;
+	int		month;		/* 1 to 12 */
+	int		count;
+};
+
+char	*archives_histogram(struct store_overlay *);
+int		archives_update(struct store *, struct store_overlay *, struct store_batch *);
+int		archives_parse(const char *, struct archive_month **);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_ARCHIVES_H */
@@ -0,0 +1,33 @@
+#ifndef	CBLOG_LIB_CBLOG_BLOOM_H
+#define	CBLOG_LIB_CBLOG_BLOOM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cblog_store.h"
+
+/*
+ * Bloom filter of the post names and of the tags, drafts included, kept
+ * by cblogctl in a database wide key as "hashes bits hexadecimal-bits", so
+ * that cblog.cgi answers the posts and tags which surely do not exist
+ * without reading the database. Tags are folded to lower case and trimmed
+ * as store_post_has_tag compares them.
+ */
+#define BLOOM_KEY		"names_filter"
+#define BLOOM_BITS_PER_KEY	10	/* about 1% of false positives */
+#define BLOOM_HASHES	7
+
+struct bloom {
+	int			nhashes;
+	uint32_t	nbits;
+	uint8_t		*bits;
+};
+
+int		bloom_update(struct store *, struct store_overlay *, struct store_batch *);
+int		bloom_copy(struct store *, struct store *);
+struct bloom	*bloom_load(struct store *);
+void	bloom_free(struct bloom *);
+bool	bloom_post(struct bloom *, const char *);
+bool	bloom_tag(struct bloom *, const char *);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_BLOOM_H */
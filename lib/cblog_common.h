@@ -10,8 +10,12 @@ static char *field[] = {
 	"source",
 	"html",
 	"ctime",
+	"mtime",
 	"published",
 	"comments",
+	"related",
+	"prev",
+	"next",
 	NULL
 };
 
@@ -0,0 +1,31 @@
+#ifndef	CBLOG_LIB_CBLOG_COMPRESS_H
+#define	CBLOG_LIB_CBLOG_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Post fields stored compressed by the cdb backend, listed space separated
+ * in the database wide COMPRESS_KEY and set by cblogctl compress. A value
+ * starting with COMPRESS_DEFLATE is the length of the text on 4 bytes, big
+ * endian, then the text as a zlib stream, deflated with the dictionary of
+ * COMPRESS_DICT_KEY when the stream says so. COMPRESS_RAW starts a text
+ * kept as is which starts with one of these bytes itself; any other value
+ * is the text, as written before compression existed.
+ */
+#define COMPRESS_KEY		"compress"
+#define COMPRESS_DICT_KEY	"compress_dict"
+#define COMPRESS_FIELDS		"source html"	/* the fields which can be */
+
+#define COMPRESS_RAW		0x01
+#define COMPRESS_DEFLATE	0x02
+
+#define COMPRESS_MIN		64		/* shorter texts are kept as is */
+#define COMPRESS_DICT_MAX	32768	/* the window of deflate */
+
+bool	compress_field(const char *, const char *);
+char	*compress_encode(const char *, bool, const char *, size_t, size_t *);
+char	*compress_decode(const char *, size_t, const char *, size_t);
+char	*compress_train(char **, int);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_COMPRESS_H */
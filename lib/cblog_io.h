@@ -0,0 +1,23 @@
+#ifndef	CBLOG_LIB_CBLOG_IO_H
+#define	CBLOG_LIB_CBLOG_IO_H
+
+#include <sys/types.h>
+
+/*
+ * Whole files read in batches. On Linux the stat, open, read and close of
+ * every file of a batch go through one io_uring, so a batch costs a few
+ * system calls whatever its size; elsewhere, or when io_uring is not
+ * available, each file is read with the usual blocking calls.
+ */
+struct io_file {
+	const char	*path;
+	off_t		size;		/* -1 until known */
+	char		*data;		/* NUL terminated, freed by the caller */
+	int			error;		/* errno of the failed step, 0 if none */
+};
+
+void	io_file_init(struct io_file *, const char *);
+void	io_stat(struct io_file *, int);
+void	io_read(struct io_file *, int);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_IO_H */
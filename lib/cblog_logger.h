@@ -0,0 +1,27 @@
+#ifndef	CBLOG_LIB_CBLOG_LOGGER_H
+#define	CBLOG_LIB_CBLOG_LOGGER_H
+
+#include <stdarg.h>
+
+/* longest message kept, longer ones are truncated */
+#define LOGGER_MSG_MAX		240
+
+/* records queued before new ones are dropped */
+#define LOGGER_RECORDS		256
+
+/* a message repeated within this many seconds is only counted */
+#define LOGGER_REPEAT		10
+
+/*
+ * Error log of a cblog.cgi process: messages are copied into a ring of
+ * records without lock nor system call, and a thread writes them to
+ * syslog or to a file. Repeated messages are counted instead of queued,
+ * and the records lost when the ring is full or a write fails are
+ * reported with the next records written.
+ */
+int		logger_open(const char *);
+void	logger_start(void);
+void	logger_vpush(int, const char *, va_list);
+void	logger_flush(void);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_LOGGER_H */
@@ -0,0 +1,14 @@
+#ifndef	CBLOG_LIB_CBLOG_RELATED_H
+#define	CBLOG_LIB_CBLOG_RELATED_H
+
+#include "cblog_store.h"
+
+/* number of related posts kept for each post */
+#define RELATED_POSTS		5
+
+/* posts of a tag looked at when searching the posts related to a post */
+#define RELATED_CANDIDATES	256
+
+int		related_update(struct store *, struct store_overlay *, struct store_batch *);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_RELATED_H */
@@ -0,0 +1,83 @@
+#ifndef	CBLOG_LIB_CBLOG_SEARCH_H
+#define	CBLOG_LIB_CBLOG_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cblog_store.h"
+
+/*
+ * Inverted index of the titles, tags and sources of the posts but the
+ * drafts, kept by cblogctl in database wide keys:
+ *
+ *   search_docs	"ctime length name" lines, the posts numbered oldest first
+ *   search_terms	the indexed words, one per line, sorted
+ *   search:WORD	the posts holding WORD, as space separated "delta[:weight]"
+ *				from the number of the previous one, weight 1 if omitted
+ *
+ * A word found in a title weighs SEARCH_WEIGHT_TITLE, in the tags
+ * SEARCH_WEIGHT_TAGS and in the source 1.
+ *
+ * The titles and tags completed by the search box are kept along, in
+ * search_suggest (see search.c).
+ */
+#define SEARCH_DOCS_KEY		"search_docs"
+#define SEARCH_TERMS_KEY	"search_terms"
+#define SEARCH_TERM_PREFIX	"search:"
+#define SEARCH_SUGGEST_KEY	"search_suggest"
+
+#define SEARCH_WORD_MAX		32	/* longer words are cut */
+#define SEARCH_QUERY_WORDS	8	/* words of a query looked up */
+#define SEARCH_WEIGHT_TITLE	3
+#define SEARCH_WEIGHT_TAGS	2
+#define SEARCH_SUGGEST_MAX	128	/* longer titles are cut */
+#define SEARCH_BM25_K1		1.2
+#define SEARCH_BM25_B		0.75
+
+/* the posts of an index, numbered as in the posting lists */
+struct search_docs {
+	int			ndocs;
+	double		avglength;	/* of the posts, in weighted words */
+	struct	search_doc {
+		const char	*name;
+		time_t		ctime;
+		uint32_t	length;
+	} *docs;
+	char		*buf;		/* holding the names */
+	size_t		size;		/* bytes held, this struct included */
+};
+
+/* titles and tags by normalized text, decoded from SEARCH_SUGGEST_KEY */
+struct search_suggest {
+	int		n;
+	struct	search_completion {
+		const char	*key;
+		bool		tag;
+		long long	rank;		/* posts of a tag, date of a post */
+		const char	*name;		/* of the tag or the post */
+		const char	*title;		/* of a post, NULL for a tag */
+	} *completions;
+	char	*buf;
+	char	*keys;
+	size_t	size;		/* bytes held, this struct included */
+};
+
+struct search_hit {
+	int		doc;
+	double	score;
+};
+
+size_t	search_word(const char **, char *);
+size_t	search_normalize(const char *, char *);
+int		search_update(struct store *, struct store_overlay *, struct store_batch *);
+int		search_copy(struct store *, struct store *);
+struct search_docs	*search_docs(struct store *);
+void	search_docs_free(struct search_docs *);
+int		search_query(struct store *, struct search_docs *, const char *, time_t,
+		    struct search_hit *, int, int *);
+struct search_suggest	*search_suggest(struct store *);
+void	search_suggest_free(struct search_suggest *);
+int		search_complete(struct search_suggest *, const char *, time_t,
+		    const struct search_completion **, int);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_SEARCH_H */
@@ -0,0 +1,131 @@
+#ifndef	CBLOG_LIB_CBLOG_STORE_H
+#define	CBLOG_LIB_CBLOG_STORE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Storage of the posts, independent of the database layout: request code
+ * and cblogctl only go through these functions, each backend (CDB files,
+ * memory) implementing them with its own struct store_ops.
+ */
+
+/* a post as found or iterated, name is only valid during the callback */
+struct store_post {
+	const char	*name;
+	time_t		ctime;
+	int			part;		/* backend location of the post, -1 if unknown */
+};
+
+/* return non zero to stop the iteration */
+typedef int (*store_post_cb)(struct store_post *, void *);
+typedef int (*store_tag_cb)(const char *, int, void *);
+
+#define STORE_PUT	0	/* set a field of a post, creating the post */
+#define STORE_DEL	1	/* remove a post and its fields */
+#define STORE_META	2	/* set a database wide key */
+
+struct store_op {
+	int		type;
+	char	*post;
+	char	*field;		/* key for STORE_META */
+	char	*value;
+};
+
+/* changes applied at once by store_commit, deletions before puts */
+struct store_batch {
+	int				nops;
+	int				asize;
+	struct store_op	*ops;
+};
+
+struct store;
+
+struct store_ops {
+	const char	*name;
+	int		(*create)(const char *, bool);
+	int		(*open)(struct store *, const char *);
+	void	(*close)(struct store *);
+	int		(*find)(struct store *, const char *, struct store_post *);
+	char	*(*get)(struct store *, struct store_post *, const char *);
+	char	*(*meta)(struct store *, const char *);
+	int		(*each)(struct store *, store_post_cb, void *);
+	int		(*range)(struct store *, time_t, time_t, store_post_cb, void *);
+	int		(*tagged)(struct store *, const char *, store_post_cb, void *);
+	int		(*tags)(struct store *, store_tag_cb, void *);
+	int		(*commit)(struct store *, struct store_batch *);
+};
+
+struct store {
+	const struct store_ops	*ops;
+	void					*priv;
+};
+
+/* fields of a struct store_overlay_post whose value is the batch one */
+#define STORE_OVERLAY_TITLE		0x1
+#define STORE_OVERLAY_TAGS		0x2
+#define STORE_OVERLAY_SOURCE	0x4
+
+/*
+ * A post of a store as it will be once a batch is committed, loaded by
+ * store_overlay with the fields the updaters computing derived keys share.
+ */
+struct store_overlay_post {
+	char	*name;
+	time_t	ctime;		/* -1 for a post the batch adds without a date */
+	int		part;		/* -1 for a post the batch adds */
+	bool	deleted;
+	bool	draft;
+	int		changed;
+	char	*title;		/* NULL if none */
+	char	*tags;
+	char	*source;	/* set only if changed by the batch */
+};
+
+/* every post of a store, sorted by name */
+struct store_overlay {
+	int							nposts;
+	int							asize;
+	struct store_overlay_post	*posts;
+};
+
+#define STORE_OVERLAY_POST(ov, i)	(&(ov)->posts[(i)])
+
+/* lookups made through the functions below, read by the benchmarks */
+struct store_stats {
+	unsigned long	finds;
+	unsigned long	gets;
+	unsigned long	metas;
+	unsigned long	scans;		/* store_posts, store_range and store_tagged */
+	unsigned long	scanned;	/* posts those went through */
+};
+
+extern struct store_stats	store_stats;
+extern const struct store_ops	store_cdb;
+extern const struct store_ops	store_mem;
+
+const struct store_ops	*store_backend(const char *);
+int		store_create(const struct store_ops *, const char *, bool);
+int		store_open(struct store *, const struct store_ops *, const char *);
+void	store_close(struct store *);
+int		store_find(struct store *, const char *, struct store_post *);
+char	*store_get(struct store *, struct store_post *, const char *);
+char	*store_meta(struct store *, const char *);
+int		store_posts(struct store *, store_post_cb, void *);
+int		store_range(struct store *, time_t, time_t, store_post_cb, void *);
+int		store_tagged(struct store *, const char *, store_post_cb, void *);
+int		store_tags(struct store *, store_tag_cb, void *);
+int		store_commit(struct store *, struct store_batch *);
+int		store_copy(struct store *, struct store *);
+bool	store_post_has_tag(const char *, const char *);
+bool	store_post_draft(const char *);
+int		store_overlay(struct store_overlay *, struct store *, struct store_batch *);
+void	store_overlay_free(struct store_overlay *);
+
+void	store_batch_init(struct store_batch *);
+void	store_batch_put(struct store_batch *, const char *, const char *, const char *);
+void	store_batch_del(struct store_batch *, const char *);
+void	store_batch_meta(struct store_batch *, const char *, const char *);
+void	store_batch_free(struct store_batch *);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_STORE_H */
@@ -1,14 +1,50 @@
 #ifndef	CBLOG_LIB_CBLOG_UTILS_H
 #define	CBLOG_LIB_CBLOG_UTILS_H
 
+#include <limits.h>
+#include <stdbool.h>
 #include <time.h>
 #include <cdb.h>
 
 #define EQUALS(string, needle) (strcasecmp(string, needle) == 0)
 #define STARTS_WITH(string, needle) (strncasecmp(string, needle, strlen(needle)) == 0)
 
+/* one year of posts in a sharded database */
+struct db_shard {
+	char		name[16];
+	int			fd;			/* -1 until first used */
+	struct cdb	cdb;
+	bool		summary;	/* first, last, count and tags are known */
+	time_t		first;
+	time_t		last;
+	int			count;
+	char		*tags;		/* name:count,name:count */
+};
+
+/* a plain database or a manifest and its shards */
+struct cblogdb {
+	char			path[PATH_MAX];
+	int				fd;
+	struct cdb		cdb;
+	bool			sharded;
+	int				nshards;
+	struct db_shard	*shards;
+	char			*dict;		/* of the compressed fields, read on first use */
+	size_t			dictlen;
+	bool			dict_read;
+};
+
 char	*db_get(struct cdb *);
+char	*db_find_get(struct cdb *, const char *);
+void	db_shard_path(const char *, const char *, char *, size_t);
+int		cblogdb_open(struct cblogdb *, const char *);
+void	cblogdb_close(struct cblogdb *);
+struct cdb	*cblogdb_shard(struct cblogdb *, int);
+int		cblogdb_post_shard(struct cblogdb *, const char *);
+bool	cblogdb_shard_in_range(struct cblogdb *, int, time_t, time_t);
+bool	cblogdb_shard_has_tag(struct cblogdb *, int, const char *);
 int		splitchr(char *, char);
+char	*trimspace(char *);
 void	time_to_str(time_t, const char *, char *, size_t);
 void	send_mail(const char *, const char *, const char *, 
 		const char *, const char *, const char *, const char *);
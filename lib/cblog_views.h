@@ -0,0 +1,30 @@
+#ifndef	CBLOG_LIB_CBLOG_VIEWS_H
+#define	CBLOG_LIB_CBLOG_VIEWS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* longest post name counted, including the final NUL */
+#define VIEWS_NAME_MAX	108
+
+/*
+ * View counters of the posts of a blog, in a POSIX shared memory table
+ * mapped by every cblog.cgi process: a post is counted with one atomic
+ * increment, without lock nor disk write. A thread of each process saves
+ * the table to a side file every few seconds, only one process writing
+ * it each time, and the counts are read back from that file when the
+ * table is created.
+ */
+struct views;
+
+struct views_entry {
+	char		name[VIEWS_NAME_MAX];
+	uint64_t	count;
+};
+
+struct views	*views_open(const char *, int, int);
+void		views_hit(struct views *, const char *);
+uint64_t	views_count(struct views *, const char *);
+int			views_top(struct views *, struct views_entry *, int);
+
+#endif	/* ndef CBLOG_LIB_CBLOG_VIEWS_H */
@@ -0,0 +1,278 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "cblog_compress.h"
+
+/* dictionary training: bytes hashed together, bytes of a segment */
+#define CMP_DMER		8
+#define CMP_SEGMENT		256
+#define CMP_HASH_BITS	20
+#define CMP_SAMPLES_MAX	(8 << 20)	/* bytes of the posts trained on */
+#define CMP_USED		UINT32_MAX
+
+/* samples holding a dmer, counted once per sample */
+struct cmp_count {
+	uint32_t	count;
+	uint32_t	sample;		/* last sample seen + 1, CMP_USED once in the dictionary */
+};
+
+/* best segment of an epoch of the samples */
+struct cmp_segment {
+	uint64_t	score;
+	const char	*start;
+	size_t		len;
+};
+
+/* is field listed in the space separated fields */
+bool
+compress_field(const char *fields, const char *field)
+{
+	size_t	len = strlen(field);
+
+	while (fields != NULL && *fields != '\0') {
+		fields += strspn(fields, " ");
+		if (strncasecmp(fields, field, len) == 0 &&
+		    (fields[len] == ' ' || fields[len] == '\0'))
+			return true;
+		fields += strcspn(fields, " ");
+	}
+
+	return false;
+}
+
+/*
+ * text as stored in a field of COMPRESS_FIELDS, deflated if pack is set and
+ * it is worth it, dict being NULL when the database has no dictionary.
+ * Sets *len to the length of the value.
+ */
+char *
+compress_encode(const char *text, bool pack, const char *dict,
+    size_t dictlen, size_t *len)
+{
+	z_stream	zs;
+	char		*val;
+	size_t		tlen = strlen(text), bound;
+	int			ret;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (pack && tlen >= COMPRESS_MIN && tlen <= UINT32_MAX &&
+	    deflateInit(&zs, Z_BEST_COMPRESSION) == Z_OK) {
+		bound = deflateBound(&zs, tlen);
+		if ((val = malloc(bound + 5)) == NULL)
+			errx(1, "Unable to allocate memory");
+
+		zs.next_in = (Bytef *)text;
+		zs.avail_in = tlen;
+		zs.next_out = (Bytef *)val + 5;
+		zs.avail_out = bound;
+		ret = dict == NULL ? Z_OK :
+		    deflateSetDictionary(&zs, (const Bytef *)dict, dictlen);
+		if (ret == Z_OK && deflate(&zs, Z_FINISH) == Z_STREAM_END &&
+		    zs.total_out + 5 < tlen) {
+			val[0] = COMPRESS_DEFLATE;
+			val[1] = tlen >> 24;
+			val[2] = tlen >> 16;
+			val[3] = tlen >> 8;
+			val[4] = tlen;
+			*len = zs.total_out + 5;
+			deflateEnd(&zs);
+			return val;
+		}
+		deflateEnd(&zs);
+		free(val);
+	}
+
+	/* not worth it, a text starting like a compressed value is flagged */
+	*len = tlen;
+	if (text[0] == COMPRESS_RAW || text[0] == COMPRESS_DEFLATE)
+		(*len)++;
+	if ((val = malloc(*len + 1)) == NULL)
+		errx(1, "Unable to allocate memory");
+	val[0] = COMPRESS_RAW;
+	memcpy(val + *len - tlen, text, tlen + 1);
+
+	return val;
+}
+
+/* text of the len bytes of val, NULL if they cannot be decompressed */
+char *
+compress_decode(const char *val, size_t len, const char *dict, size_t dictlen)
+{
+	z_stream	zs;
+	char		*text;
+	size_t		tlen;
+	int			ret;
+
+	if (len == 0 || val[0] != COMPRESS_DEFLATE) {
+		/* the text follows the flag as is, whatever its own first byte */
+		if (len > 0 && val[0] == COMPRESS_RAW) {
+			val++;
+			len--;
+		}
+		if ((text = malloc(len + 1)) == NULL)
+			errx(1, "Unable to allocate memory");
+		memcpy(text, val, len);
+		text[len] = '\0';
+		return text;
+	}
+
+	if (len < 5)
+		return NULL;
+	tlen = (uint32_t)(unsigned char)val[1] << 24 | (unsigned char)val[2] << 16 |
+	    (unsigned char)val[3] << 8 | (unsigned char)val[4];
+	if ((text = malloc(tlen + 1)) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (inflateInit(&zs) != Z_OK) {
+		free(text);
+		return NULL;
+	}
+	zs.next_in = (Bytef *)val + 5;
+	zs.avail_in = len - 5;
+	zs.next_out = (Bytef *)text;
+	zs.avail_out = tlen;
+	if ((ret = inflate(&zs, Z_FINISH)) == Z_NEED_DICT && dict != NULL &&
+	    inflateSetDictionary(&zs, (const Bytef *)dict, dictlen) == Z_OK)
+		ret = inflate(&zs, Z_FINISH);
+	if (ret != Z_STREAM_END || zs.total_out != tlen) {
+		inflateEnd(&zs);
+		free(text);
+		return NULL;
+	}
+	inflateEnd(&zs);
+	text[tlen] = '\0';
+
+	return text;
+}
+
+static uint32_t
+cmp_dmer(const char *p)
+{
+	uint32_t	h = 2166136261U;
+	int			i;
+
+	for (i = 0; i < CMP_DMER; i++)
+		h = (h ^ (unsigned char)p[i]) * 16777619;
+
+	return h >> (32 - CMP_HASH_BITS);
+}
+
+static int
+cmp_cmp_score(const void *a, const void *b)
+{
+	const struct cmp_segment	*sa = a;
+	const struct cmp_segment	*sb = b;
+
+	if (sa->score != sb->score)
+		return sa->score < sb->score ? 1 : -1;
+
+	return 0;
+}
+
+/*
+ * Dictionary for the texts of samples, NULL if they are too few: the
+ * samples are cut in epochs, the segment of each epoch whose dmers are
+ * found in the most samples is kept, the best ones last since deflate
+ * reaches the end of the dictionary at the lowest cost.
+ */
+char *
+compress_train(char **samples, int n)
+{
+	struct cmp_count	*counts;
+	struct cmp_segment	*best, *seg;
+	char				*dict;
+	size_t				total = 0, all = 0, off = 0, dictsize, epoch, len, slen;
+	size_t				pos, i, used, dictlen;
+	uint64_t			score;
+	uint32_t			h;
+	int					s, stride, nseg, e;
+
+	for (s = 0; s < n; s++)
+		all += strlen(samples[s]);
+	stride = all / CMP_SAMPLES_MAX + 1;
+	for (s = 0; s < n; s += stride)
+		total += strlen(samples[s]);
+
+	dictsize = total / 16 < COMPRESS_DICT_MAX ? total / 16 : COMPRESS_DICT_MAX;
+	if (dictsize < 4 * CMP_SEGMENT)
+		return NULL;
+	nseg = dictsize / CMP_SEGMENT;
+	epoch = total / nseg + 1;
+
+	counts = calloc(1 << CMP_HASH_BITS, sizeof(struct cmp_count));
+	best = calloc(nseg, sizeof(struct cmp_segment));
+	if (counts == NULL || best == NULL || (dict = malloc(dictsize + 1)) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	for (s = 0; s < n; s += stride) {
+		slen = strlen(samples[s]);
+		for (pos = 0; pos + CMP_DMER <= slen; pos++) {
+			h = cmp_dmer(samples[s] + pos);
+			if (counts[h].sample != (uint32_t)s + 1) {
+				counts[h].sample = s + 1;
+				counts[h].count++;
+			}
+		}
+	}
+
+	/* slide a segment over each sample, the dmers of a single post not counting */
+	for (s = 0; s < n; off += slen, s += stride) {
+		slen = strlen(samples[s]);
+		len = slen < CMP_SEGMENT ? slen : CMP_SEGMENT;
+		if (len < CMP_DMER)
+			continue;
+
+		for (score = 0, i = 0; i + CMP_DMER <= len; i++) {
+			h = cmp_dmer(samples[s] + i);
+			score += counts[h].count > 1 ? counts[h].count : 0;
+		}
+		for (pos = 0; ; pos++) {
+			e = (off + pos) / epoch;
+			if (e < nseg && score > best[e].score) {
+				best[e].score = score;
+				best[e].start = samples[s] + pos;
+				best[e].len = len;
+			}
+			if (pos + len >= slen)
+				break;
+			h = cmp_dmer(samples[s] + pos);
+			score -= counts[h].count > 1 ? counts[h].count : 0;
+			h = cmp_dmer(samples[s] + pos + len + 1 - CMP_DMER);
+			score += counts[h].count > 1 ? counts[h].count : 0;
+		}
+	}
+
+	/* the best segments first, skipping those mostly in the dictionary already */
+	qsort(best, nseg, sizeof(struct cmp_segment), cmp_cmp_score);
+	dictlen = 0;
+	for (e = 0; e < nseg && best[e].score > 0; e++) {
+		seg = &best[e];
+		for (used = 0, i = 0; i + CMP_DMER <= seg->len; i++)
+			used += counts[cmp_dmer(seg->start + i)].sample == CMP_USED;
+		if (used * 2 > seg->len - CMP_DMER + 1 || dictlen + seg->len > dictsize)
+			continue;
+		for (i = 0; i + CMP_DMER <= seg->len; i++)
+			counts[cmp_dmer(seg->start + i)].sample = CMP_USED;
+
+		/* filled from the end, so that the best segment is the last */
+		memcpy(dict + dictsize - dictlen - seg->len, seg->start, seg->len);
+		dictlen += seg->len;
+	}
+	free(counts);
+	free(best);
+
+	if (dictlen < CMP_SEGMENT) {
+		free(dict);
+		return NULL;
+	}
+	memmove(dict, dict + dictsize - dictlen, dictlen);
+	dict[dictlen] = '\0';
+
+	return dict;
+}
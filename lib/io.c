@@ -0,0 +1,439 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cblog_io.h"
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(STATX_SIZE)
+#define USE_IO_URING
+#endif
+#endif
+
+void
+io_file_init(struct io_file *file, const char *path)
+{
+	file->path = path;
+	file->size = -1;
+	file->data = NULL;
+	file->error = 0;
+}
+
+static void
+blocking_stat(struct io_file *file)
+{
+	struct stat	st;
+
+	if (stat(file->path, &st) == -1)
+		file->error = errno;
+	else
+		file->size = st.st_size;
+}
+
+static void
+blocking_read(struct io_file *file)
+{
+	ssize_t	len;
+	int		fd;
+
+	if ((file->data = malloc(file->size + 1)) == NULL) {
+		file->error = ENOMEM;
+		return;
+	}
+
+	if ((fd = open(file->path, O_RDONLY)) == -1) {
+		file->error = errno;
+	} else {
+		if ((len = read(fd, file->data, file->size)) == -1)
+			file->error = errno;
+		else
+			file->size = len;
+		close(fd);
+	}
+
+	if (file->error != 0) {
+		free(file->data);
+		file->data = NULL;
+		return;
+	}
+	file->data[file->size] = '\0';
+}
+
+#ifdef USE_IO_URING
+
+#define IO_RING_ENTRIES	64
+
+#define IO_STAT		0
+#define IO_OPEN		1
+#define IO_READ		2
+#define IO_CLOSE	3
+
+struct io_ring {
+	int					fd;
+	unsigned			entries;
+	unsigned			queued;
+	unsigned			*sq_tail;
+	unsigned			*sq_mask;
+	unsigned			*sq_array;
+	unsigned			*cq_head;
+	unsigned			*cq_tail;
+	unsigned			*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+};
+
+/* one ring per process, set up on first use and kept until exit */
+static struct io_ring	ring;
+static int				ring_state;		/* 1 ready, -1 unavailable */
+
+/* the kernel does not know this operation, use the blocking calls */
+#define unsupported(res) ((res) == -EINVAL || (res) == -EOPNOTSUPP)
+
+static bool
+ring_setup(void)
+{
+	struct io_uring_params	p;
+	char					*sq, *cq;
+	size_t					sqlen, cqlen;
+
+	if (ring_state != 0)
+		return ring_state > 0;
+	ring_state = -1;
+
+	memset(&p, 0, sizeof(struct io_uring_params));
+	if ((ring.fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p)) < 0)
+		return false;
+
+	/* statx, openat, read and close came with this feature, in 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring.fd);
+		return false;
+	}
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqlen > sqlen)
+		sqlen = cqlen;
+
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(ring.fd);
+		return false;
+	}
+
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			munmap(sq, sqlen);
+			close(ring.fd);
+			return false;
+		}
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		if (cq != sq)
+			munmap(cq, cqlen);
+		munmap(sq, sqlen);
+		close(ring.fd);
+		return false;
+	}
+
+	ring.entries = p.sq_entries;
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring_state = 1;
+
+	return true;
+}
+
+/* queue an operation on the i-th file of the batch */
+static struct io_uring_sqe *
+ring_sqe(int op, int i)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned			idx;
+
+	idx = (*ring.sq_tail + ring.queued++) & *ring.sq_mask;
+	ring.sq_array[idx] = idx;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op == IO_STAT ? IORING_OP_STATX :
+	    op == IO_OPEN ? IORING_OP_OPENAT :
+	    op == IO_READ ? IORING_OP_READ : IORING_OP_CLOSE;
+	sqe->user_data = (uint64_t)i << 2 | op;
+
+	return sqe;
+}
+
+static int
+ring_enter(unsigned submit, unsigned wait)
+{
+	int	ret;
+
+	while ((ret = syscall(__NR_io_uring_enter, ring.fd, submit, wait,
+	    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Submit the queued operations with one system call and wait for all of
+ * them, calling done on each completion. A broken ring is not used again.
+ */
+static int
+ring_run(void (*done)(int, int, int, void *), void *arg)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned			n = ring.queued, submitted = 0, reaped = 0, head, tail;
+	int					ret;
+
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + n, __ATOMIC_RELEASE);
+	ring.queued = 0;
+
+	while (submitted < n) {
+		if ((ret = ring_enter(n - submitted, n - submitted)) <= 0) {
+			close(ring.fd);
+			ring_state = -1;
+			return -1;
+		}
+		submitted += ret;
+	}
+
+	while (reaped < n) {
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (ring_enter(0, 1) < 0) {
+				close(ring.fd);
+				ring_state = -1;
+				return -1;
+			}
+			continue;
+		}
+		for (; head != tail && reaped < n; head++, reaped++) {
+			cqe = &ring.cqes[head & *ring.cq_mask];
+			done(cqe->user_data >> 2, cqe->user_data & 3, cqe->res, arg);
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+struct ring_batch {
+	struct io_file	*files;
+	struct statx	*stx;		/* indexed by file */
+	int				*fds;
+	bool			*blocking;	/* to be done with the blocking calls */
+};
+
+static void
+ring_done(int i, int op, int res, void *arg)
+{
+	struct ring_batch	*batch = arg;
+	struct io_file		*file = &batch->files[i];
+
+	switch (op) {
+	case IO_STAT:
+		if (unsupported(res))
+			batch->blocking[i] = true;
+		else if (res < 0)
+			file->error = -res;
+		else
+			file->size = batch->stx[i].stx_size;
+		break;
+	case IO_OPEN:
+		if (unsupported(res))
+			batch->blocking[i] = true;
+		else if (res < 0)
+			file->error = -res;
+		else
+			batch->fds[i] = res;
+		break;
+	case IO_READ:
+		if (unsupported(res))
+			batch->blocking[i] = true;
+		else if (res < 0)
+			file->error = -res;
+		else {
+			file->size = res;
+			file->data[res] = '\0';
+		}
+		break;
+	case IO_CLOSE:
+		/* cancelled after a failed or short read */
+		if (res < 0)
+			close(batch->fds[i]);
+		batch->fds[i] = -1;
+		break;
+	}
+}
+
+static int
+ring_stat(struct io_file *files, int n)
+{
+	struct ring_batch	batch;
+	struct io_uring_sqe	*sqe;
+	int					i, ret = 0;
+
+	memset(&batch, 0, sizeof(struct ring_batch));
+	batch.files = files;
+	batch.stx = calloc(n, sizeof(struct statx));
+	batch.blocking = calloc(n, sizeof(bool));
+	if (batch.stx == NULL || batch.blocking == NULL)
+		ret = -1;
+
+	for (i = 0; ret == 0 && i < n; i++) {
+		if (files[i].size >= 0 || files[i].error != 0)
+			continue;
+		sqe = ring_sqe(IO_STAT, i);
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)files[i].path;
+		sqe->len = STATX_SIZE;
+		sqe->off = (uintptr_t)&batch.stx[i];
+		if (ring.queued == ring.entries)
+			ret = ring_run(ring_done, &batch);
+	}
+	if (ret == 0 && ring.queued > 0)
+		ret = ring_run(ring_done, &batch);
+
+	for (i = 0; ret == 0 && i < n; i++) {
+		if (batch.blocking[i])
+			blocking_stat(&files[i]);
+	}
+	free(batch.stx);
+	free(batch.blocking);
+
+	return ret;
+}
+
+/* open every file in a first submission, then read and close them */
+static int
+ring_read(struct io_file *files, int n)
+{
+	struct ring_batch	batch;
+	struct io_uring_sqe	*sqe;
+	int					i, ret = 0;
+
+	memset(&batch, 0, sizeof(struct ring_batch));
+	batch.files = files;
+	batch.fds = malloc(n * sizeof(int));
+	batch.blocking = calloc(n, sizeof(bool));
+	if (batch.fds == NULL || batch.blocking == NULL)
+		ret = -1;
+
+	for (i = 0; ret == 0 && i < n; i++) {
+		batch.fds[i] = -1;
+		if (files[i].data != NULL || files[i].error != 0)
+			continue;
+		if ((files[i].data = malloc(files[i].size + 1)) == NULL) {
+			files[i].error = ENOMEM;
+			continue;
+		}
+		sqe = ring_sqe(IO_OPEN, i);
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)files[i].path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		if (ring.queued == ring.entries)
+			ret = ring_run(ring_done, &batch);
+	}
+	if (ret == 0 && ring.queued > 0)
+		ret = ring_run(ring_done, &batch);
+
+	for (i = 0; ret == 0 && i < n; i++) {
+		if (batch.fds[i] < 0)
+			continue;
+		sqe = ring_sqe(IO_READ, i);
+		sqe->fd = batch.fds[i];
+		sqe->addr = (uintptr_t)files[i].data;
+		sqe->len = files[i].size;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = ring_sqe(IO_CLOSE, i);
+		sqe->fd = batch.fds[i];
+		if (ring.queued + 2 > ring.entries)
+			ret = ring_run(ring_done, &batch);
+	}
+	if (ret == 0 && ring.queued > 0)
+		ret = ring_run(ring_done, &batch);
+
+	for (i = 0; i < n; i++) {
+		if (batch.fds != NULL && batch.fds[i] >= 0)
+			close(batch.fds[i]);
+		if (files[i].data == NULL)
+			continue;
+		if (ret != 0 || files[i].error != 0 || batch.blocking[i]) {
+			free(files[i].data);
+			files[i].data = NULL;
+		}
+		if (ret == 0 && batch.blocking[i])
+			blocking_read(&files[i]);
+	}
+	free(batch.fds);
+	free(batch.blocking);
+
+	return ret;
+}
+
+#endif	/* USE_IO_URING */
+
+/* set the size of the files of unknown size */
+void
+io_stat(struct io_file *files, int n)
+{
+	int	i;
+
+#ifdef USE_IO_URING
+	if (ring_setup() && ring_stat(files, n) == 0)
+		return;
+#endif
+
+	for (i = 0; i < n; i++) {
+		if (files[i].size < 0 && files[i].error == 0)
+			blocking_stat(&files[i]);
+	}
+}
+
+/* read the files not read yet, a file that failed has its error set */
+void
+io_read(struct io_file *files, int n)
+{
+	int	i;
+
+	io_stat(files, n);
+
+#ifdef USE_IO_URING
+	if (ring_setup() && ring_read(files, n) == 0)
+		return;
+#endif
+
+	for (i = 0; i < n; i++) {
+		if (files[i].data == NULL && files[i].error == 0)
+			blocking_read(&files[i]);
+	}
+}
@@ -0,0 +1,265 @@
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cblog_logger.h"
+
+/* bytes of formatted records written to the file at once */
+#define LOGGER_WRITE		8192
+
+/* longest formatted record */
+#define LOGGER_LINE			(LOGGER_MSG_MAX + 64)
+
+struct log_record {
+	time_t	at;
+	int		priority;
+	char	msg[LOGGER_MSG_MAX];
+};
+
+/* one producer, the request loop, moves head; the drainer moves tail */
+static struct log_record	ring[LOGGER_RECORDS];
+static uint32_t				head;
+static uint32_t				tail;
+static uint64_t				dropped;	/* ring full or write failed */
+
+/* last message pushed, to count its repetitions */
+static char					last_msg[LOGGER_MSG_MAX];
+static int					last_priority;
+static time_t				last_at;
+static uint32_t				repeats;
+
+static int					logfd = -1;	/* -1 for syslog */
+static pthread_mutex_t		drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool					started;
+
+static const char *
+logger_level(int priority)
+{
+	switch (priority) {
+	case LOG_EMERG:
+	case LOG_ALERT:
+	case LOG_CRIT:
+		return "crit";
+	case LOG_ERR:
+		return "err";
+	case LOG_WARNING:
+		return "warning";
+	case LOG_NOTICE:
+		return "notice";
+	case LOG_INFO:
+		return "info";
+	default:
+		return "debug";
+	}
+}
+
+static void
+logger_enqueue(time_t at, int priority, const char *msg)
+{
+	struct log_record	*r;
+	uint32_t			h;
+
+	h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOGGER_RECORDS) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	r = &ring[h % LOGGER_RECORDS];
+	r->at = at;
+	r->priority = priority;
+	snprintf(r->msg, LOGGER_MSG_MAX, "%s", msg);
+	__atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* the repetitions of the last message, if it has been repeated */
+static void
+logger_repeats(time_t now)
+{
+	char	msg[64];
+
+	if (repeats == 0)
+		return;
+
+	snprintf(msg, sizeof(msg), "last message repeated %u times", repeats);
+	logger_enqueue(now, last_priority, msg);
+	repeats = 0;
+}
+
+/* write buf out, the records it could not write are counted as dropped */
+static void
+logger_write(const char *buf, size_t len)
+{
+	ssize_t		n;
+	size_t		off = 0;
+	uint64_t	lost = 0;
+
+	while (off < len) {
+		if ((n = write(logfd, buf + off, len - off)) == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += n;
+	}
+
+	for (; off < len; off++) {
+		if (buf[off] == '\n')
+			lost++;
+	}
+	if (lost > 0)
+		__atomic_fetch_add(&dropped, lost, __ATOMIC_RELAXED);
+}
+
+/* format r at the end of buf, writing buf out first if r may not fit */
+static void
+logger_append(char *buf, size_t *len, struct log_record *r)
+{
+	struct tm	tm;
+	int			n;
+
+	if (*len + LOGGER_LINE > LOGGER_WRITE) {
+		logger_write(buf, *len);
+		*len = 0;
+	}
+
+	gmtime_r(&r->at, &tm);
+	n = snprintf(buf + *len, LOGGER_WRITE - *len,
+	    "%04d-%02d-%02dT%02d:%02d:%02dZ cblog[%d]: %s: %s\n",
+	    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+	    tm.tm_sec, (int)getpid(), logger_level(r->priority), r->msg);
+	if (n > 0 && (size_t)n < LOGGER_WRITE - *len)
+		*len += n;
+}
+
+/* write the queued records, returns their number */
+static int
+logger_drain(void)
+{
+	struct log_record	lost, *r;
+	char				buf[LOGGER_WRITE];
+	size_t				len = 0;
+	uint32_t			t, h;
+	uint64_t			n;
+	int					count = 0;
+
+	pthread_mutex_lock(&drain_lock);
+	t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+	for (; t != h; t++, count++) {
+		r = &ring[t % LOGGER_RECORDS];
+		if (logfd == -1)
+			syslog(r->priority, "%s", r->msg);
+		else
+			logger_append(buf, &len, r);
+	}
+	__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+
+	if ((n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) > 0) {
+		lost.at = time(NULL);
+		lost.priority = LOG_WARNING;
+		snprintf(lost.msg, LOGGER_MSG_MAX, "%llu log records dropped",
+		    (unsigned long long)n);
+		if (logfd == -1)
+			syslog(lost.priority, "%s", lost.msg);
+		else
+			logger_append(buf, &len, &lost);
+	}
+
+	if (len > 0)
+		logger_write(buf, len);
+	pthread_mutex_unlock(&drain_lock);
+
+	return count;
+}
+
+static void *
+logger_thread(void *arg)
+{
+	struct timespec	ts = { 0, 50 * 1000 * 1000 };
+
+	for (;;) {
+		if (logger_drain() == 0)
+			nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Write the records to the file at path, appending, or to syslog if path
+ * is NULL or can not be opened. Returns -1 in the latter case.
+ */
+int
+logger_open(const char *path)
+{
+	int	fd;
+
+	if (path == NULL)
+		return 0;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640)) == -1)
+		return -1;
+
+	pthread_mutex_lock(&drain_lock);
+	if (logfd != -1)
+		close(logfd);
+	logfd = fd;
+	pthread_mutex_unlock(&drain_lock);
+
+	return 0;
+}
+
+/* start the writing thread, once the process went to the background */
+void
+logger_start(void)
+{
+	pthread_t	thread;
+
+	if (started)
+		return;
+
+	if (pthread_create(&thread, NULL, logger_thread, NULL) == 0) {
+		pthread_detach(thread);
+		started = true;
+	}
+	atexit(logger_flush);
+}
+
+void
+logger_vpush(int priority, const char *fmt, va_list ap)
+{
+	char	msg[LOGGER_MSG_MAX];
+	time_t	now = time(NULL);
+
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+
+	if (priority == last_priority && now - last_at < LOGGER_REPEAT &&
+	    strcmp(msg, last_msg) == 0) {
+		repeats++;
+		return;
+	}
+
+	logger_repeats(now);
+	logger_enqueue(now, priority, msg);
+	memcpy(last_msg, msg, sizeof(msg));
+	last_priority = priority;
+	last_at = now;
+}
+
+/* write the queued records now */
+void
+logger_flush(void)
+{
+	logger_repeats(time(NULL));
+	logger_drain();
+}
@@ -0,0 +1,362 @@
+#include <ctype.h>
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cblog_utils.h"
+#include "cblog_related.h"
+
+/* a live post as it will be once the batch is committed */
+struct rel_post {
+	struct store_overlay_post	*post;
+	char		*tags;		/* post->tags, split by rel_index */
+	char		*related;	/* values in the store */
+	char		*prev;
+	char		*next;
+	uint32_t	first;		/* tag ids in rel.post_tags, sorted */
+	uint32_t	ntags;
+	double		weight;		/* sum of the idf of its tags */
+};
+
+struct rel_posting {
+	char		*tag;
+	uint32_t	id;
+	int			post;
+};
+
+struct rel {
+	int					nposts;
+	struct rel_post		*posts;
+	int					ntags;
+	double				*idf;
+	uint32_t			*tag_first;	/* posts of tag t in tag_posts, ntags + 1 */
+	int					*tag_posts;	/* newest first */
+	uint32_t			*post_tags;
+};
+
+struct rel_score {
+	int		post;
+	double	score;
+};
+
+static void *
+rel_alloc(void *ptr, size_t nmemb, size_t size)
+{
+	if ((ptr = realloc(ptr, (nmemb ? nmemb : 1) * size)) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	return ptr;
+}
+
+/* the values of op in the store, a post the batch adds having none */
+static void
+rel_load(struct store *st, struct rel_post *p, struct store_overlay_post *op)
+{
+	struct store_post	post;
+
+	memset(p, 0, sizeof(struct rel_post));
+	p->post = op;
+	if (op->tags != NULL)
+		p->tags = strdup(op->tags);
+
+	post.name = op->name;
+	post.ctime = op->ctime;
+	post.part = op->part;
+	p->related = store_get(st, &post, "related");
+	p->prev = store_get(st, &post, "prev");
+	p->next = store_get(st, &post, "next");
+}
+
+static int
+rel_cmp_ctime(const void *a, const void *b)
+{
+	const struct rel_post	*pa = a;
+	const struct rel_post	*pb = b;
+
+	if (pa->post->ctime != pb->post->ctime)
+		return pa->post->ctime < pb->post->ctime ? 1 : -1;
+
+	return strcmp(pa->post->name, pb->post->name);
+}
+
+static int
+rel_cmp_posting(const void *a, const void *b)
+{
+	const struct rel_posting	*pa = a;
+	const struct rel_posting	*pb = b;
+	int							ret;
+
+	if ((ret = strcasecmp(pa->tag, pb->tag)) != 0)
+		return ret;
+
+	return pa->post - pb->post;
+}
+
+static int
+rel_cmp_post_tag(const void *a, const void *b)
+{
+	const struct rel_posting	*pa = a;
+	const struct rel_posting	*pb = b;
+
+	if (pa->post != pb->post)
+		return pa->post - pb->post;
+
+	return (int)pa->id - (int)pb->id;
+}
+
+static void
+rel_free_post(struct rel_post *p)
+{
+	free(p->tags);
+	free(p->related);
+	free(p->prev);
+	free(p->next);
+}
+
+/* number the tags and build the lists of posts of each tag */
+static void
+rel_index(struct rel *rel)
+{
+	struct rel_posting	*postings = NULL;
+	char				*tag;
+	size_t				next;
+	int					i, j, k, n = 0, nbel;
+
+	for (i = 0; i < rel->nposts; i++) {
+		if ((tag = rel->posts[i].tags) == NULL)
+			continue;
+
+		nbel = splitchr(tag, ',');
+		for (j = 0; j <= nbel; j++) {
+			next = strlen(tag);
+			if (*trimspace(tag) != '\0') {
+				postings = rel_alloc(postings, n + 1, sizeof(struct rel_posting));
+				postings[n].tag = trimspace(tag);
+				postings[n++].post = i;
+			}
+			tag += next + 1;
+		}
+	}
+
+	if (n > 0)
+		qsort(postings, n, sizeof(struct rel_posting), rel_cmp_posting);
+
+	/* a tag listed twice by a post counts once */
+	for (i = k = 0; i < n; i++) {
+		if (k > 0 && postings[i].post == postings[k - 1].post &&
+		    strcasecmp(postings[i].tag, postings[k - 1].tag) == 0)
+			continue;
+		postings[k++] = postings[i];
+	}
+	n = k;
+
+	rel->tag_first = rel_alloc(NULL, n + 1, sizeof(uint32_t));
+	rel->tag_posts = rel_alloc(NULL, n, sizeof(int));
+	rel->idf = rel_alloc(NULL, n, sizeof(double));
+	for (i = 0; i < n; i = j) {
+		rel->tag_first[rel->ntags] = i;
+		for (j = i; j < n && strcasecmp(postings[i].tag, postings[j].tag) == 0; j++) {
+			postings[j].id = rel->ntags;
+			rel->tag_posts[j] = postings[j].post;
+		}
+		rel->idf[rel->ntags++] = log((double)rel->nposts / (j - i));
+	}
+	rel->tag_first[rel->ntags] = n;
+
+	if (n > 0)
+		qsort(postings, n, sizeof(struct rel_posting), rel_cmp_post_tag);
+
+	rel->post_tags = rel_alloc(NULL, n, sizeof(uint32_t));
+	for (i = j = 0; i < rel->nposts; i++) {
+		rel->posts[i].first = j;
+		for (; j < n && postings[j].post == i; j++) {
+			rel->post_tags[j] = postings[j].id;
+			rel->posts[i].weight += rel->idf[postings[j].id];
+		}
+		rel->posts[i].ntags = j - rel->posts[i].first;
+	}
+	free(postings);
+}
+
+/* idf weighted Jaccard index of the tags of two posts */
+static double
+rel_similarity(struct rel *rel, struct rel_post *a, struct rel_post *b)
+{
+	uint32_t	*ta = rel->post_tags + a->first, *tb = rel->post_tags + b->first;
+	uint32_t	i = 0, j = 0;
+	double		inter = 0;
+
+	while (i < a->ntags && j < b->ntags) {
+		if (ta[i] == tb[j]) {
+			inter += rel->idf[ta[i]];
+			i++;
+			j++;
+		} else if (ta[i] < tb[j])
+			i++;
+		else
+			j++;
+	}
+
+	if (inter <= 0)
+		return 0;
+
+	return inter / (a->weight + b->weight - inter);
+}
+
+/*
+ * Best posts related to post p, the candidates being the newest posts of
+ * each of its tags. Returns their number.
+ */
+static int
+rel_best(struct rel *rel, int p, bool *seen, int *touched, struct rel_score *best)
+{
+	struct rel_post	*post = &rel->posts[p];
+	struct rel_score	cur;
+	uint32_t		i, t, end;
+	int				j, q, ntouched = 0, nbest = 0;
+
+	for (i = post->first; i < post->first + post->ntags; i++) {
+		t = rel->post_tags[i];
+		if (rel->idf[t] <= 0)
+			continue;
+
+		end = rel->tag_first[t + 1];
+		if (end - rel->tag_first[t] > RELATED_CANDIDATES)
+			end = rel->tag_first[t] + RELATED_CANDIDATES;
+		for (j = rel->tag_first[t]; j < (int)end; j++) {
+			q = rel->tag_posts[j];
+			if (q != p && !seen[q]) {
+				seen[q] = true;
+				touched[ntouched++] = q;
+			}
+		}
+	}
+
+	/* posts are numbered newest first, ties go to the newest */
+	for (j = 0; j < ntouched; j++) {
+		seen[touched[j]] = false;
+		cur.post = touched[j];
+		cur.score = rel_similarity(rel, post, &rel->posts[cur.post]);
+		if (cur.score <= 0)
+			continue;
+
+		for (q = nbest; q > 0 && (best[q - 1].score < cur.score ||
+		    (best[q - 1].score == cur.score && best[q - 1].post > cur.post)); q--) {
+			if (q < RELATED_POSTS)
+				best[q] = best[q - 1];
+		}
+		if (q < RELATED_POSTS) {
+			best[q] = cur;
+			if (nbest < RELATED_POSTS)
+				nbest++;
+		}
+	}
+
+	return nbest;
+}
+
+/* put field of post p if its neighbour q, as "name\ttitle", changes */
+static void
+rel_neighbour(struct store_batch *batch, struct rel_post *p, const char *field,
+    char *cur, struct rel_post *q)
+{
+	char	*val;
+	size_t	len;
+
+	if (q == NULL) {
+		if (cur != NULL && *cur != '\0')
+			store_batch_put(batch, p->post->name, field, "");
+		return;
+	}
+
+	len = strlen(q->post->name) +
+	    (q->post->title ? strlen(q->post->title) : 0) + 2;
+	val = rel_alloc(NULL, len, 1);
+	snprintf(val, len, "%s\t%s", q->post->name,
+	    q->post->title ? q->post->title : "");
+	if (cur == NULL || strcmp(cur, val) != 0)
+		store_batch_put(batch, p->post->name, field, val);
+	free(val);
+}
+
+/*
+ * Add to batch the new "related", "prev" and "next" values of every post
+ * whose ones change once batch is committed: the RELATED_POSTS posts sharing
+ * the most tags with it, rare tags weighting more, as "name\ttitle" lines,
+ * and the posts published just before and after it. ov holds the posts of
+ * st as batch leaves them.
+ */
+int
+related_update(struct store *st, struct store_overlay *ov,
+    struct store_batch *batch)
+{
+	struct rel					rel;
+	struct rel_score			best[RELATED_POSTS];
+	struct store_overlay_post	*op;
+	struct rel_post				*p;
+	bool						*seen;
+	int							*touched;
+	char						*val;
+	size_t						len, vlen;
+	int							i, j, n;
+
+	memset(&rel, 0, sizeof(struct rel));
+	rel.posts = rel_alloc(NULL, ov->nposts, sizeof(struct rel_post));
+
+	/* drafts keep their values until published */
+	for (i = 0; i < ov->nposts; i++) {
+		op = STORE_OVERLAY_POST(ov, i);
+		if (!op->deleted && !op->draft)
+			rel_load(st, &rel.posts[rel.nposts++], op);
+	}
+	if (rel.nposts > 0)
+		qsort(rel.posts, rel.nposts, sizeof(struct rel_post), rel_cmp_ctime);
+
+	rel_index(&rel);
+
+	seen = rel_alloc(NULL, rel.nposts, sizeof(bool));
+	memset(seen, 0, rel.nposts * sizeof(bool));
+	touched = rel_alloc(NULL, rel.nposts, sizeof(int));
+
+	for (i = 0; i < rel.nposts; i++) {
+		n = rel_best(&rel, i, seen, touched, best);
+
+		for (len = 1, j = 0; j < n; j++) {
+			op = rel.posts[best[j].post].post;
+			len += strlen(op->name) + (op->title ? strlen(op->title) : 0) + 2;
+		}
+		val = rel_alloc(NULL, len, 1);
+		val[0] = '\0';
+		for (vlen = 0, j = 0; j < n; j++) {
+			op = rel.posts[best[j].post].post;
+			vlen += snprintf(val + vlen, len - vlen, "%s%s\t%s", j ? "\n" : "",
+			    op->name, op->title ? op->title : "");
+		}
+
+		p = &rel.posts[i];
+		if (p->related == NULL ? n > 0 : strcmp(p->related, val) != 0)
+			store_batch_put(batch, p->post->name, "related", val);
+		free(val);
+
+		/* posts are sorted newest first */
+		rel_neighbour(batch, p, "prev", p->prev,
+		    i + 1 < rel.nposts ? &rel.posts[i + 1] : NULL);
+		rel_neighbour(batch, p, "next", p->next, i > 0 ? &rel.posts[i - 1] : NULL);
+	}
+
+	free(seen);
+	free(touched);
+	for (i = 0; i < rel.nposts; i++)
+		rel_free_post(&rel.posts[i]);
+	free(rel.posts);
+	free(rel.tag_first);
+	free(rel.tag_posts);
+	free(rel.idf);
+	free(rel.post_tags);
+
+	return 0;
+}
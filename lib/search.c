@@ -0,0 +1,1115 @@
+#include <ctype.h>
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cblog_utils.h"
+#include "cblog_search.h"
+
+/* fields of a post its words are indexed from */
+#define SRCH_INDEXED	(STORE_OVERLAY_TITLE | STORE_OVERLAY_TAGS | \
+	STORE_OVERLAY_SOURCE)
+
+/* a live post as it will be once the batch is committed */
+struct srch_post {
+	struct store_overlay_post	*post;
+	int		old;		/* number in the index of the store, -1 if none */
+	char	*title;		/* copies, cleaned and split by srch_suggest */
+	char	*tags;
+};
+
+struct srch_term {
+	char		*word;
+	int			nposts;
+	int			asize;
+	uint32_t	*posts;		/* post and weight pairs, by post */
+	char		*old;		/* postings in the store if read, else NULL */
+};
+
+/* a post of the index of the store, by name */
+struct srch_old {
+	const char	*name;
+	int			doc;
+};
+
+struct srch {
+	int					nposts;
+	struct srch_post	*posts;
+	uint32_t			*lengths;
+	int					nterms;
+	int					tsize;
+	struct srch_term	*terms;
+	int					hsize;
+	int					*hash;		/* terms index + 1, 0 if free */
+	struct store		*st;
+};
+
+/* a completion while building SEARCH_SUGGEST_KEY */
+struct srch_completion {
+	char		*key;
+	bool		tag;
+	long long	rank;
+	int			post;
+	const char	*name;
+	const char	*title;
+};
+
+/* posting list of a word of a query */
+struct srch_list {
+	int			n;
+	int			pos;
+	uint32_t	*posts;		/* post and weight pairs */
+	double		idf;
+};
+
+static void *
+srch_alloc(void *ptr, size_t nmemb, size_t size)
+{
+	if ((ptr = realloc(ptr, (nmemb ? nmemb : 1) * size)) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	return ptr;
+}
+
+/* length of the len bytes of word but a last character they cut */
+static size_t
+srch_cut(const char *word, size_t len)
+{
+	size_t	start, need;
+
+	for (start = len; start > 0 &&
+	    ((unsigned char)word[start - 1] & 0xc0) == 0x80; start--)
+		;
+	if (start == 0 || (unsigned char)word[start - 1] < 0xc0)
+		return len;
+
+	start--;
+	need = (unsigned char)word[start] >= 0xf0 ? 4 :
+	    (unsigned char)word[start] >= 0xe0 ? 3 : 2;
+
+	return len - start < need ? start : len;
+}
+
+/*
+ * Next word of *text in word, which holds SEARCH_WORD_MAX + 1 bytes, and
+ * *text moved past it. Words are runs of ASCII letters and digits and of
+ * non ASCII characters, of two bytes at least; ASCII letters are folded
+ * to lower case and long words cut on a character boundary. Returns the
+ * length of word, 0 once text is exhausted.
+ */
+size_t
+search_word(const char **text, char *word)
+{
+	const unsigned char	*p = (const unsigned char *)*text;
+	size_t				len = 0;
+	bool				cut;
+
+	while (len < 2) {
+		while (*p != '\0' && *p < 0x80 && !isalnum(*p))
+			p++;
+		if (*p == '\0') {
+			len = 0;
+			break;
+		}
+
+		for (len = 0, cut = false; *p >= 0x80 || isalnum(*p); p++) {
+			if (len < SEARCH_WORD_MAX)
+				word[len++] = *p >= 'A' && *p <= 'Z' ? *p + 'a' - 'A' : *p;
+			else
+				cut = true;
+		}
+
+		if (cut)
+			len = srch_cut(word, len);
+	}
+	word[len] = '\0';
+	*text = (const char *)p;
+
+	return len;
+}
+
+/*
+ * text folded in key, which holds SEARCH_SUGGEST_MAX + 1 bytes, as the
+ * completions are matched: ASCII letters in lower case, runs of the other
+ * ASCII characters but digits as single spaces, trimmed, long texts cut
+ * on a character boundary. Returns the length of key.
+ */
+size_t
+search_normalize(const char *text, char *key)
+{
+	const unsigned char	*p = (const unsigned char *)text;
+	size_t				len = 0;
+	bool				space = false, cut = false;
+
+	for (; *p != '\0'; p++) {
+		if (*p < 0x80 && !isalnum(*p)) {
+			space = len > 0;
+			continue;
+		}
+		if (len + space >= SEARCH_SUGGEST_MAX) {
+			cut = true;
+			break;
+		}
+		if (space)
+			key[len++] = ' ';
+		space = false;
+		key[len++] = *p >= 'A' && *p <= 'Z' ? *p + 'a' - 'A' : *p;
+	}
+	if (cut)
+		len = srch_cut(key, len);
+	while (len > 0 && key[len - 1] == ' ')
+		len--;
+	key[len] = '\0';
+
+	return len;
+}
+
+static void
+srch_free_post(struct srch_post *p)
+{
+	free(p->title);
+	free(p->tags);
+}
+
+static int
+srch_cmp_ctime(const void *a, const void *b)
+{
+	const struct srch_post	*pa = a;
+	const struct srch_post	*pb = b;
+
+	if (pa->post->ctime != pb->post->ctime)
+		return pa->post->ctime < pb->post->ctime ? -1 : 1;
+
+	return strcmp(pa->post->name, pb->post->name);
+}
+
+static int
+srch_cmp_old(const void *a, const void *b)
+{
+	return strcmp(((const struct srch_old *)a)->name,
+	    ((const struct srch_old *)b)->name);
+}
+
+static int
+srch_cmp_posting(const void *a, const void *b)
+{
+	const uint32_t	*pa = a;
+	const uint32_t	*pb = b;
+
+	if (pa[0] == pb[0])
+		return 0;
+
+	return pa[0] < pb[0] ? -1 : 1;
+}
+
+static int
+srch_cmp_word(const void *a, const void *b)
+{
+	return strcmp(((const struct srch_term *)a)->word,
+	    ((const struct srch_term *)b)->word);
+}
+
+static int
+srch_cmp_list(const void *a, const void *b)
+{
+	return ((const struct srch_list *)a)->n - ((const struct srch_list *)b)->n;
+}
+
+/* FNV-1a */
+static uint32_t
+srch_hash(const char *word)
+{
+	uint32_t	h = 2166136261U;
+
+	for (; *word != '\0'; word++) {
+		h ^= (unsigned char)*word;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void
+srch_rehash(struct srch *s)
+{
+	uint32_t	h;
+	int			i;
+
+	s->hsize = s->hsize ? s->hsize * 2 : 4096;
+	s->hash = srch_alloc(s->hash, s->hsize, sizeof(int));
+	memset(s->hash, 0, s->hsize * sizeof(int));
+	for (i = 0; i < s->nterms; i++) {
+		for (h = srch_hash(s->terms[i].word) & (s->hsize - 1); s->hash[h] != 0;
+		    h = (h + 1) & (s->hsize - 1))
+			;
+		s->hash[h] = i + 1;
+	}
+}
+
+static struct srch_term *
+srch_term(struct srch *s, const char *word)
+{
+	struct srch_term	*t;
+	uint32_t			h;
+
+	if (s->nterms * 2 >= s->hsize)
+		srch_rehash(s);
+
+	for (h = srch_hash(word) & (s->hsize - 1); s->hash[h] != 0;
+	    h = (h + 1) & (s->hsize - 1)) {
+		t = &s->terms[s->hash[h] - 1];
+		if (strcmp(t->word, word) == 0)
+			return t;
+	}
+
+	if (s->nterms == s->tsize) {
+		s->tsize = s->tsize ? s->tsize * 2 : 1024;
+		s->terms = srch_alloc(s->terms, s->tsize, sizeof(struct srch_term));
+	}
+	t = &s->terms[s->nterms++];
+	memset(t, 0, sizeof(struct srch_term));
+	t->word = strdup(word);
+	s->hash[h] = s->nterms;
+
+	return t;
+}
+
+/* index the words of text for post, posts being indexed in order */
+static void
+srch_index(struct srch *s, uint32_t post, const char *text, uint32_t weight)
+{
+	struct srch_term	*t;
+	char				word[SEARCH_WORD_MAX + 1];
+
+	if (text == NULL)
+		return;
+
+	while (search_word(&text, word) > 0) {
+		t = srch_term(s, word);
+		s->lengths[post] += weight;
+		if (t->nposts > 0 && t->posts[2 * (t->nposts - 1)] == post) {
+			t->posts[2 * (t->nposts - 1) + 1] += weight;
+			continue;
+		}
+		if (t->nposts == t->asize) {
+			t->asize = t->asize ? t->asize * 2 : 4;
+			t->posts = srch_alloc(t->posts, t->asize, 2 * sizeof(uint32_t));
+		}
+		t->posts[2 * t->nposts] = post;
+		t->posts[2 * t->nposts++ + 1] = weight;
+	}
+}
+
+/* index the title, tags and source of post i */
+static void
+srch_index_post(struct srch *s, int i)
+{
+	struct store_overlay_post	*p = s->posts[i].post;
+	struct store_post			post;
+	char						*source = NULL;
+
+	srch_index(s, i, p->title, SEARCH_WEIGHT_TITLE);
+	srch_index(s, i, p->tags, SEARCH_WEIGHT_TAGS);
+	if ((p->changed & STORE_OVERLAY_SOURCE) == 0) {
+		post.name = p->name;
+		post.ctime = p->ctime;
+		post.part = p->part;
+		source = store_get(s->st, &post, "source");
+	}
+	srch_index(s, i, source ? source : p->source, 1);
+	free(source);
+}
+
+/*
+ * Number in the index of st of the posts the batch leaves the indexed
+ * fields of, then add their postings, renumbered, and their lengths
+ * instead of reading and splitting their text again. Returns false if
+ * st has no index.
+ */
+static bool
+srch_reuse(struct srch *s)
+{
+	struct search_docs	*docs;
+	struct srch_old		*old, *found, key;
+	struct srch_term	*t;
+	char				k[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char				*terms, *word, *next, *val, *entry, *end;
+	uint32_t			doc, weight;
+	int					*renum, i, n;
+
+	if ((docs = search_docs(s->st)) == NULL)
+		return false;
+
+	old = srch_alloc(NULL, docs->ndocs, sizeof(struct srch_old));
+	for (i = n = 0; i < docs->ndocs; i++) {
+		if (docs->docs[i].name[0] == '\0')
+			continue;
+		old[n].name = docs->docs[i].name;
+		old[n++].doc = i;
+	}
+	if (n > 0)
+		qsort(old, n, sizeof(struct srch_old), srch_cmp_old);
+
+	renum = srch_alloc(NULL, docs->ndocs, sizeof(int));
+	for (i = 0; i < docs->ndocs; i++)
+		renum[i] = -1;
+	for (i = 0; i < s->nposts; i++) {
+		s->posts[i].old = -1;
+		key.name = s->posts[i].post->name;
+		if ((s->posts[i].post->changed & SRCH_INDEXED) != 0 || n == 0 ||
+		    (found = bsearch(&key, old, n, sizeof(struct srch_old),
+		    srch_cmp_old)) == NULL)
+			continue;
+		s->posts[i].old = found->doc;
+		s->lengths[i] = docs->docs[found->doc].length;
+		renum[found->doc] = i;
+	}
+	free(old);
+
+	if ((terms = store_meta(s->st, SEARCH_TERMS_KEY)) == NULL)
+		terms = strdup("");
+	for (word = terms; *word != '\0'; word = next) {
+		if ((next = strchr(word, '\n')) != NULL)
+			*next++ = '\0';
+		else
+			next = word + strlen(word);
+
+		snprintf(k, sizeof(k), SEARCH_TERM_PREFIX "%s", word);
+		if (*word == '\0' || (val = store_meta(s->st, k)) == NULL)
+			continue;
+
+		/* "delta[:weight]" entries, numbered from the previous one */
+		for (t = NULL, doc = 0, entry = val; *entry != '\0';) {
+			doc += strtoul(entry, &end, 10);
+			if (end == entry)
+				break;
+			weight = *end == ':' ? strtoul(end + 1, &end, 10) : 1;
+			for (entry = end; *entry == ' '; entry++)
+				;
+			if (doc >= (uint32_t)docs->ndocs || renum[doc] < 0)
+				continue;
+
+			if (t == NULL)
+				t = srch_term(s, word);
+			if (t->nposts == t->asize) {
+				t->asize = t->asize ? t->asize * 2 : 4;
+				t->posts = srch_alloc(t->posts, t->asize, 2 * sizeof(uint32_t));
+			}
+			t->posts[2 * t->nposts] = renum[doc];
+			t->posts[2 * t->nposts++ + 1] = weight;
+		}
+		if (t != NULL)
+			t->old = val;
+		else
+			free(val);
+	}
+	free(terms);
+	free(renum);
+	search_docs_free(docs);
+
+	return true;
+}
+
+/* posting list of t as "delta[:weight]" */
+static char *
+srch_postings(struct srch_term *t)
+{
+	char		*val;
+	size_t		len = 0, size = t->nposts * 22 + 1;
+	uint32_t	prev = 0;
+	int			i;
+
+	val = srch_alloc(NULL, size, 1);
+	val[0] = '\0';
+	for (i = 0; i < t->nposts; i++) {
+		if (t->posts[2 * i + 1] == 1)
+			len += snprintf(val + len, size - len, "%s%u", i ? " " : "",
+			    t->posts[2 * i] - prev);
+		else
+			len += snprintf(val + len, size - len, "%s%u:%u", i ? " " : "",
+			    t->posts[2 * i] - prev, t->posts[2 * i + 1]);
+		prev = t->posts[2 * i];
+	}
+
+	return val;
+}
+
+/* put key to val in batch unless it is already its value in st */
+static void
+srch_put(struct store *st, struct store_batch *batch, const char *key,
+    const char *val)
+{
+	char	*old;
+
+	old = store_meta(st, key);
+	if (old == NULL ? *val != '\0' : strcmp(old, val) != 0)
+		store_batch_meta(batch, key, val);
+	free(old);
+}
+
+/* the words of SEARCH_TERMS_KEY no longer indexed are emptied */
+static void
+srch_drop_old(struct srch *s, struct store_batch *batch)
+{
+	struct srch_term	key;
+	char				k[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char				*old, *word, *next;
+
+	if ((old = store_meta(s->st, SEARCH_TERMS_KEY)) == NULL)
+		return;
+
+	for (word = old; *word != '\0'; word = next) {
+		if ((next = strchr(word, '\n')) != NULL)
+			*next++ = '\0';
+		else
+			next = word + strlen(word);
+
+		key.word = word;
+		if (*word == '\0' || (s->nterms > 0 && bsearch(&key, s->terms,
+		    s->nterms, sizeof(struct srch_term), srch_cmp_word) != NULL))
+			continue;
+		snprintf(k, sizeof(k), SEARCH_TERM_PREFIX "%s", word);
+		srch_put(s->st, batch, k, "");
+	}
+	free(old);
+}
+
+static int
+srch_cmp_completion(const void *a, const void *b)
+{
+	const struct srch_completion	*ca = a;
+	const struct srch_completion	*cb = b;
+	int								ret;
+
+	if ((ret = strcmp(ca->key, cb->key)) != 0)
+		return ret;
+	if (ca->tag != cb->tag)
+		return ca->tag ? -1 : 1;
+	if (ca->rank != cb->rank)
+		return ca->rank > cb->rank ? -1 : 1;
+	if (ca->post != cb->post)
+		return ca->post - cb->post;
+
+	return strcmp(ca->name, cb->name);
+}
+
+static struct srch_completion *
+srch_completion(struct srch_completion **c, int *n, int *asize,
+    const char *text, bool tag)
+{
+	struct srch_completion	*cur;
+	char					key[SEARCH_SUGGEST_MAX + 1];
+
+	if (search_normalize(text, key) == 0)
+		return NULL;
+
+	if (*n == *asize) {
+		*asize = *asize ? *asize * 2 : 256;
+		*c = srch_alloc(*c, *asize, sizeof(struct srch_completion));
+	}
+	cur = &(*c)[(*n)++];
+	memset(cur, 0, sizeof(struct srch_completion));
+	cur->key = strdup(key);
+	cur->tag = tag;
+
+	return cur;
+}
+
+/* tabs and newlines of str, modified, as spaces */
+static const char *
+srch_clean(char *str)
+{
+	char	*p;
+
+	for (p = str; p != NULL && *p != '\0'; p++) {
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	}
+
+	return str ? str : "";
+}
+
+/*
+ * Put SEARCH_SUGGEST_KEY: the normalized titles of the posts and names
+ * of the tags, sorted, one per line as "shared\tsuffix\tkind\trank\tname\t
+ * title" where shared is the length of the prefix shared with the key of
+ * the line before, kind t for a tag ranked by its number of posts and p
+ * for a post ranked by its date.
+ */
+static void
+srch_suggest(struct srch *s, struct store_batch *batch)
+{
+	struct srch_completion	*tags = NULL, *c = NULL, *cur;
+	char					*tag, *val;
+	const char				*prev = "";
+	size_t					len, size = 1, next;
+	int						i, j, k, ntags = 0, tsize = 0, n = 0, asize = 0;
+	int						nbel;
+
+	/* a tag listed twice by a post counts once */
+	for (i = 0; i < s->nposts; i++) {
+		if ((tag = s->posts[i].tags) == NULL)
+			continue;
+
+		nbel = splitchr(tag, ',');
+		for (j = 0; j <= nbel; j++) {
+			next = strlen(tag);
+			if ((cur = srch_completion(&tags, &ntags, &tsize, tag, true)) != NULL) {
+				cur->post = i;
+				cur->name = srch_clean(trimspace(tag));
+			}
+			tag += next + 1;
+		}
+	}
+	if (ntags > 0)
+		qsort(tags, ntags, sizeof(struct srch_completion), srch_cmp_completion);
+	for (i = 0; i < ntags; i = j) {
+		for (j = i, k = 0; j < ntags &&
+		    strcmp(tags[i].key, tags[j].key) == 0; j++) {
+			if (j == i || tags[j].post != tags[j - 1].post)
+				k++;
+		}
+		cur = srch_completion(&c, &n, &asize, tags[i].key, true);
+		cur->rank = k;
+		cur->post = -1;
+		cur->name = tags[i].name;
+	}
+
+	for (i = 0; i < s->nposts; i++) {
+		if (s->posts[i].title == NULL || (cur = srch_completion(&c, &n,
+		    &asize, s->posts[i].title, false)) == NULL)
+			continue;
+		cur->rank = s->posts[i].post->ctime;
+		cur->post = i;
+		cur->name = s->posts[i].post->name;
+		cur->title = srch_clean(s->posts[i].title);
+	}
+	if (n > 0)
+		qsort(c, n, sizeof(struct srch_completion), srch_cmp_completion);
+
+	/* the shared prefix and rank take 32 bytes at most */
+	for (i = 0; i < n; i++)
+		size += strlen(c[i].key) + strlen(c[i].name) +
+		    (c[i].title ? strlen(c[i].title) : 0) + 36;
+	val = srch_alloc(NULL, size, 1);
+	val[0] = '\0';
+	for (i = 0, len = 0; i < n; prev = c[i++].key) {
+		for (k = 0; prev[k] != '\0' && prev[k] == c[i].key[k]; k++)
+			;
+		len += snprintf(val + len, size - len, "%d\t%s\t%c\t%lld\t%s\t%s\n",
+		    k, c[i].key + k, c[i].tag ? 't' : 'p', c[i].rank, c[i].name,
+		    c[i].title ? c[i].title : "");
+	}
+	srch_put(s->st, batch, SEARCH_SUGGEST_KEY, val);
+	free(val);
+
+	for (i = 0; i < ntags; i++)
+		free(tags[i].key);
+	free(tags);
+	for (i = 0; i < n; i++)
+		free(c[i].key);
+	free(c);
+}
+
+static void
+srch_free(struct srch *s)
+{
+	int	i;
+
+	for (i = 0; i < s->nposts; i++)
+		srch_free_post(&s->posts[i]);
+	free(s->posts);
+	for (i = 0; i < s->nterms; i++) {
+		free(s->terms[i].word);
+		free(s->terms[i].posts);
+		free(s->terms[i].old);
+	}
+	free(s->terms);
+	free(s->hash);
+	free(s->lengths);
+}
+
+/*
+ * Add to batch the keys of the search index which change once batch is
+ * committed, ov holding the posts of st as batch leaves them. Posts are
+ * numbered oldest first so that publishing a new post only changes the
+ * posting lists of its words, and only the posts whose title, tags or
+ * source change are split in words again.
+ */
+int
+search_update(struct store *st, struct store_overlay *ov,
+    struct store_batch *batch)
+{
+	struct srch					s;
+	struct store_overlay_post	*p;
+	struct srch_term			*t;
+	char		key[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char		*val;
+	size_t		len, size;
+	int			i;
+	bool		reused;
+
+	memset(&s, 0, sizeof(struct srch));
+	s.st = st;
+	s.posts = srch_alloc(NULL, ov->nposts, sizeof(struct srch_post));
+	for (i = 0; i < ov->nposts; i++) {
+		p = STORE_OVERLAY_POST(ov, i);
+		if (p->deleted || p->draft)
+			continue;
+		s.posts[s.nposts].post = p;
+		s.posts[s.nposts].old = -1;
+		s.posts[s.nposts].title = p->title ? strdup(p->title) : NULL;
+		s.posts[s.nposts++].tags = p->tags ? strdup(p->tags) : NULL;
+	}
+	if (s.nposts > 0)
+		qsort(s.posts, s.nposts, sizeof(struct srch_post), srch_cmp_ctime);
+
+	s.lengths = srch_alloc(NULL, s.nposts, sizeof(uint32_t));
+	memset(s.lengths, 0, s.nposts * sizeof(uint32_t));
+	reused = srch_reuse(&s);
+	for (i = 0, size = 1; i < s.nposts; i++) {
+		if (s.posts[i].old < 0)
+			srch_index_post(&s, i);
+		size += strlen(s.posts[i].post->name) + 34;
+	}
+
+	/* the reused postings keep the order of the old numbers */
+	for (i = 0; reused && i < s.nterms; i++) {
+		t = &s.terms[i];
+		if (t->nposts > 1)
+			qsort(t->posts, t->nposts, 2 * sizeof(uint32_t), srch_cmp_posting);
+	}
+
+	/* "ctime length name\n", ctime and length taking 32 bytes at most */
+	val = srch_alloc(NULL, size, 1);
+	val[0] = '\0';
+	for (i = 0, len = 0; i < s.nposts; i++)
+		len += snprintf(val + len, size - len, "%lld %u %s\n",
+		    (long long)s.posts[i].post->ctime, s.lengths[i],
+		    s.posts[i].post->name);
+	srch_put(st, batch, SEARCH_DOCS_KEY, val);
+	free(val);
+
+	if (s.nterms > 0)
+		qsort(s.terms, s.nterms, sizeof(struct srch_term), srch_cmp_word);
+	srch_drop_old(&s, batch);
+
+	for (i = 0, size = 1; i < s.nterms; i++) {
+		t = &s.terms[i];
+		snprintf(key, sizeof(key), SEARCH_TERM_PREFIX "%s", t->word);
+		val = srch_postings(t);
+		if (t->old == NULL)
+			srch_put(st, batch, key, val);
+		else if (strcmp(t->old, val) != 0)
+			store_batch_meta(batch, key, val);
+		free(val);
+		size += strlen(t->word) + 1;
+	}
+
+	val = srch_alloc(NULL, size, 1);
+	val[0] = '\0';
+	for (i = 0, len = 0; i < s.nterms; i++)
+		len += snprintf(val + len, size - len, "%s\n", s.terms[i].word);
+	srch_put(st, batch, SEARCH_TERMS_KEY, val);
+	free(val);
+
+	srch_suggest(&s, batch);
+	srch_free(&s);
+
+	return 0;
+}
+
+/* copy the search index of src to dst, as the memory backend loads it */
+int
+search_copy(struct store *dst, struct store *src)
+{
+	struct store_batch	batch;
+	char				key[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char				*docs, *terms, *word, *next, *val;
+	int					ret;
+
+	if ((docs = store_meta(src, SEARCH_DOCS_KEY)) == NULL)
+		return 0;
+
+	store_batch_init(&batch);
+	store_batch_meta(&batch, SEARCH_DOCS_KEY, docs);
+	free(docs);
+	if ((val = store_meta(src, SEARCH_SUGGEST_KEY)) != NULL) {
+		store_batch_meta(&batch, SEARCH_SUGGEST_KEY, val);
+		free(val);
+	}
+
+	if ((terms = store_meta(src, SEARCH_TERMS_KEY)) != NULL) {
+		store_batch_meta(&batch, SEARCH_TERMS_KEY, terms);
+		for (word = terms; *word != '\0'; word = next) {
+			if ((next = strchr(word, '\n')) != NULL)
+				*next++ = '\0';
+			else
+				next = word + strlen(word);
+
+			snprintf(key, sizeof(key), SEARCH_TERM_PREFIX "%s", word);
+			if ((val = store_meta(src, key)) != NULL) {
+				store_batch_meta(&batch, key, val);
+				free(val);
+			}
+		}
+		free(terms);
+	}
+
+	ret = store_commit(dst, &batch);
+	store_batch_free(&batch);
+
+	return ret;
+}
+
+/* posts of the search index of st, NULL if the database has none */
+struct search_docs *
+search_docs(struct store *st)
+{
+	struct search_docs	*docs;
+	struct search_doc	*doc;
+	char				*line, *next, *end;
+	double				total = 0;
+	int					n = 1;
+
+	if ((docs = calloc(1, sizeof(struct search_docs))) == NULL)
+		return NULL;
+	if ((docs->buf = store_meta(st, SEARCH_DOCS_KEY)) == NULL) {
+		free(docs);
+		return NULL;
+	}
+
+	docs->size = sizeof(struct search_docs) + strlen(docs->buf) + 1;
+	for (line = docs->buf; (line = strchr(line, '\n')) != NULL; line++)
+		n++;
+	docs->size += n * sizeof(struct search_doc);
+	if ((docs->docs = malloc(n * sizeof(struct search_doc))) == NULL) {
+		search_docs_free(docs);
+		return NULL;
+	}
+
+	/* a malformed line keeps its number but matches nothing */
+	for (line = docs->buf; *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+
+		doc = &docs->docs[docs->ndocs++];
+		doc->ctime = strtoll(line, &end, 10);
+		doc->length = strtoul(end, &end, 10);
+		doc->name = *end == ' ' ? end + 1 : "";
+		total += doc->length;
+	}
+	docs->avglength = docs->ndocs > 0 && total > 0 ? total / docs->ndocs : 1;
+
+	return docs;
+}
+
+void
+search_docs_free(struct search_docs *docs)
+{
+	if (docs == NULL)
+		return;
+
+	free(docs->docs);
+	free(docs->buf);
+	free(docs);
+}
+
+/* posting list of a search:WORD value, returns its length */
+static int
+srch_decode(const char *val, struct srch_list *list)
+{
+	const char	*p;
+	char		*end;
+	uint32_t	post = 0;
+	int			size = 1;
+
+	for (p = val; (p = strchr(p, ' ')) != NULL; p++)
+		size++;
+	list->posts = srch_alloc(NULL, size, 2 * sizeof(uint32_t));
+	list->n = 0;
+	list->pos = 0;
+
+	while (*val != '\0' && list->n < size) {
+		post += strtoul(val, &end, 10);
+		if (end == val)
+			break;
+		list->posts[2 * list->n] = post;
+		list->posts[2 * list->n + 1] = 1;
+		if (*end == ':')
+			list->posts[2 * list->n + 1] = strtoul(end + 1, &end, 10);
+		list->n++;
+		for (val = end; *val == ' '; val++)
+			;
+	}
+
+	return list->n;
+}
+
+static double
+srch_score(struct search_docs *docs, struct srch_list *list, uint32_t post)
+{
+	double	w = list->posts[2 * list->pos + 1];
+
+	return list->idf * w * (SEARCH_BM25_K1 + 1) / (w + SEARCH_BM25_K1 *
+	    (1 - SEARCH_BM25_B + SEARCH_BM25_B * docs->docs[post].length /
+	    docs->avglength));
+}
+
+/*
+ * Posts of docs holding every word of query and dated until at the
+ * latest, ranked by BM25: the nhits best ones are set in hits, the newest
+ * first on ties. Only the posting lists of the words are read. Sets
+ * *nmatch to the number of matching posts and returns the number of hits.
+ */
+int
+search_query(struct store *st, struct search_docs *docs, const char *query,
+    time_t until, struct search_hit *hits, int nhits, int *nmatch)
+{
+	struct srch_list	lists[SEARCH_QUERY_WORDS];
+	struct search_hit	cur;
+	char				words[SEARCH_QUERY_WORDS][SEARCH_WORD_MAX + 1];
+	char				key[sizeof(SEARCH_TERM_PREFIX) + SEARCH_WORD_MAX];
+	char				*val;
+	uint32_t			post;
+	int					i, j, q, nwords = 0, nlists = 0, nbest = 0;
+
+	*nmatch = 0;
+	if (docs == NULL || docs->ndocs == 0 || query == NULL)
+		return 0;
+
+	while (nwords < SEARCH_QUERY_WORDS && search_word(&query, words[nwords]) > 0) {
+		for (i = 0; i < nwords && strcmp(words[i], words[nwords]) != 0; i++)
+			;
+		if (i == nwords)
+			nwords++;
+	}
+
+	for (i = 0; i < nwords; i++) {
+		snprintf(key, sizeof(key), SEARCH_TERM_PREFIX "%s", words[i]);
+		if ((val = store_meta(st, key)) == NULL)
+			break;
+		srch_decode(val, &lists[nlists]);
+		free(val);
+		if (lists[nlists++].n == 0)
+			break;
+		lists[nlists - 1].idf = log(1 + (docs->ndocs - lists[nlists - 1].n + 0.5) /
+		    (lists[nlists - 1].n + 0.5));
+	}
+	if (nwords == 0 || i < nwords) {
+		for (i = 0; i < nlists; i++)
+			free(lists[i].posts);
+		return 0;
+	}
+
+	/* the rarest word drives the intersection */
+	qsort(lists, nlists, sizeof(struct srch_list), srch_cmp_list);
+
+	for (lists[0].pos = 0; lists[0].pos < lists[0].n; lists[0].pos++) {
+		post = lists[0].posts[2 * lists[0].pos];
+		if (post >= (uint32_t)docs->ndocs)
+			break;
+
+		for (j = 1; j < nlists; j++) {
+			while (lists[j].pos < lists[j].n &&
+			    lists[j].posts[2 * lists[j].pos] < post)
+				lists[j].pos++;
+			if (lists[j].pos == lists[j].n ||
+			    lists[j].posts[2 * lists[j].pos] != post)
+				break;
+		}
+		if (j < nlists) {
+			if (lists[j].pos == lists[j].n)
+				break;
+			continue;
+		}
+		if (docs->docs[post].name[0] == '\0' || docs->docs[post].ctime > until)
+			continue;
+
+		(*nmatch)++;
+		cur.doc = post;
+		for (cur.score = 0, j = 0; j < nlists; j++)
+			cur.score += srch_score(docs, &lists[j], post);
+
+		/* posts come oldest first, ties go to the current one */
+		if (nbest == nhits && (nhits == 0 || hits[nhits - 1].score > cur.score))
+			continue;
+		for (q = nbest; q > 0 && hits[q - 1].score <= cur.score; q--) {
+			if (q < nhits)
+				hits[q] = hits[q - 1];
+		}
+		if (q < nhits) {
+			hits[q] = cur;
+			if (nbest < nhits)
+				nbest++;
+		}
+	}
+
+	for (i = 0; i < nlists; i++)
+		free(lists[i].posts);
+
+	return nbest;
+}
+
+/* completions of SEARCH_SUGGEST_KEY in st, NULL if the database has none */
+struct search_suggest *
+search_suggest(struct store *st)
+{
+	struct search_suggest		*sugg;
+	struct search_completion	*c;
+	char						*line, *next, *f[6];
+	size_t						*shared, size = 1, plen = 0, len;
+	int							i, j, n = 1;
+
+	if ((sugg = calloc(1, sizeof(struct search_suggest))) == NULL)
+		return NULL;
+	if ((sugg->buf = store_meta(st, SEARCH_SUGGEST_KEY)) == NULL) {
+		free(sugg);
+		return NULL;
+	}
+
+	sugg->size = sizeof(struct search_suggest) + strlen(sugg->buf) + 1;
+	for (line = sugg->buf; (line = strchr(line, '\n')) != NULL; line++)
+		n++;
+	sugg->completions = malloc(n * sizeof(struct search_completion));
+	shared = malloc(n * sizeof(size_t));
+	if (sugg->completions == NULL || shared == NULL) {
+		free(shared);
+		search_suggest_free(sugg);
+		return NULL;
+	}
+
+	/* split the lines, then rebuild the keys from the shared prefixes */
+	for (line = sugg->buf; *line != '\0'; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+
+		for (f[0] = line, j = 1; j < 6 &&
+		    (f[j] = strchr(f[j - 1], '\t')) != NULL; j++)
+			*f[j]++ = '\0';
+		if (j < 6)
+			continue;
+
+		c = &sugg->completions[sugg->n];
+		len = strtoul(f[0], NULL, 10);
+		shared[sugg->n++] = len = len > plen ? plen : len;
+		c->key = f[1];
+		c->tag = *f[2] == 't';
+		c->rank = strtoll(f[3], NULL, 10);
+		c->name = f[4];
+		c->title = c->tag ? NULL : f[5];
+		size += (plen = len + strlen(f[1])) + 1;
+	}
+
+	sugg->size += n * sizeof(struct search_completion) + size;
+	if ((sugg->keys = malloc(size)) == NULL) {
+		free(shared);
+		search_suggest_free(sugg);
+		return NULL;
+	}
+	for (i = 0, line = sugg->keys; i < sugg->n; i++) {
+		c = &sugg->completions[i];
+		if (i > 0)
+			memcpy(line, sugg->completions[i - 1].key, shared[i]);
+		strcpy(line + shared[i], c->key);
+		c->key = line;
+		line += strlen(line) + 1;
+	}
+	free(shared);
+
+	return sugg;
+}
+
+void
+search_suggest_free(struct search_suggest *sugg)
+{
+	if (sugg == NULL)
+		return;
+
+	free(sugg->completions);
+	free(sugg->keys);
+	free(sugg->buf);
+	free(sugg);
+}
+
+/* insert c in the n first of best, by rank */
+static void
+srch_best(const struct search_completion **best, int *nbest, int n,
+    const struct search_completion *c)
+{
+	int	q;
+
+	if (*nbest == n && best[n - 1]->rank >= c->rank)
+		return;
+
+	for (q = *nbest; q > 0 && best[q - 1]->rank < c->rank; q--) {
+		if (q < n)
+			best[q] = best[q - 1];
+	}
+	best[q] = c;
+	if (*nbest < n)
+		(*nbest)++;
+}
+
+/*
+ * The n best completions of sugg starting with query once normalized in
+ * out: the tags with the most posts, then the newest posts dated until at
+ * the latest, the tags taking half of out at most unless posts are
+ * missing. Returns their number.
+ */
+int
+search_complete(struct search_suggest *sugg, const char *query, time_t until,
+    const struct search_completion **out, int n)
+{
+	const struct search_completion	**tags, **posts;
+	char							prefix[SEARCH_SUGGEST_MAX + 1];
+	size_t							plen;
+	int								lo, hi, mid, i, ntags = 0, nposts = 0;
+
+	if (sugg == NULL || query == NULL || n <= 0 ||
+	    (plen = search_normalize(query, prefix)) == 0)
+		return 0;
+
+	tags = malloc(n * sizeof(struct search_completion *));
+	posts = malloc(n * sizeof(struct search_completion *));
+	if (tags == NULL || posts == NULL) {
+		free(tags);
+		free(posts);
+		return 0;
+	}
+
+	/* the first key not before prefix */
+	for (lo = 0, hi = sugg->n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (strcmp(sugg->completions[mid].key, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < sugg->n &&
+	    strncmp(sugg->completions[i].key, prefix, plen) == 0; i++) {
+		if (sugg->completions[i].tag)
+			srch_best(tags, &ntags, n, &sugg->completions[i]);
+		else if (sugg->completions[i].rank <= until)
+			srch_best(posts, &nposts, n, &sugg->completions[i]);
+	}
+
+	if (ntags > (n + 1) / 2 && ntags > n - nposts)
+		ntags = n - nposts > (n + 1) / 2 ? n - nposts : (n + 1) / 2;
+	if (nposts > n - ntags)
+		nposts = n - ntags;
+	memcpy(out, tags, ntags * sizeof(struct search_completion *));
+	memcpy(out + ntags, posts, nposts * sizeof(struct search_completion *));
+	free(tags);
+	free(posts);
+
+	return ntags + nposts;
+}
@@ -0,0 +1,242 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cblog_utils.h"
+
+/*
+ * A database is either a plain cblog.cdb holding every post, or a
+ * manifest (recognized by its "sharding" key) listing per year shards
+ * stored next to it as cblog-YYYY.cdb. For each shard the manifest keeps
+ * a summary (ctime range, post count and tag counts, drafts left out of
+ * the latter) so that readers can skip the shards which cannot match a
+ * query, and a <post>_shard key telling in which shard each post lives.
+ */
+
+/* /path/cblog.cdb -> /path/cblog-2009.cdb */
+void
+db_shard_path(const char *path, const char *shard, char *dest, size_t size)
+{
+	size_t	len = strlen(path);
+
+	if (len > 4 && EQUALS(path + len - 4, ".cdb"))
+		len -= 4;
+
+	snprintf(dest, size, "%.*s-%s.cdb", (int)len, path, shard);
+}
+
+/* value of key or NULL, to be freed by the caller */
+char *
+db_find_get(struct cdb *cdb, const char *key)
+{
+	if (cdb_find(cdb, key, strlen(key)) <= 0)
+		return NULL;
+
+	return db_get(cdb);
+}
+
+static void
+cblogdb_load_summary(struct cblogdb *db, struct db_shard *shard)
+{
+	char	key[BUFSIZ];
+	char	*val;
+
+	snprintf(key, BUFSIZ, "shard_%s_first", shard->name);
+	if ((val = db_find_get(&db->cdb, key)) == NULL)
+		return;
+	shard->first = (time_t)strtoll(val, NULL, 10);
+	free(val);
+
+	snprintf(key, BUFSIZ, "shard_%s_last", shard->name);
+	if ((val = db_find_get(&db->cdb, key)) == NULL)
+		return;
+	shard->last = (time_t)strtoll(val, NULL, 10);
+	free(val);
+
+	snprintf(key, BUFSIZ, "shard_%s_count", shard->name);
+	if ((val = db_find_get(&db->cdb, key)) != NULL) {
+		shard->count = (int)strtol(val, NULL, 10);
+		free(val);
+	}
+
+	snprintf(key, BUFSIZ, "shard_%s_tags", shard->name);
+	shard->tags = db_find_get(&db->cdb, key);
+	shard->summary = (shard->tags != NULL);
+}
+
+int
+cblogdb_open(struct cblogdb *db, const char *path)
+{
+	struct cdb_find	cdbf;
+	struct db_shard	*shard;
+	char			*val;
+	int				asize = 0;
+
+	memset(db, 0, sizeof(struct cblogdb));
+	snprintf(db->path, sizeof(db->path), "%s", path);
+
+	if ((db->fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	if (cdb_init(&db->cdb, db->fd) < 0) {
+		close(db->fd);
+		db->fd = -1;
+		return -1;
+	}
+
+	if (cdb_find(&db->cdb, "sharding", 8) <= 0) {
+		db->nshards = 1;
+		return 0;
+	}
+
+	db->sharded = true;
+	cdb_findinit(&cdbf, &db->cdb, "shards", 6);
+	while (cdb_findnext(&cdbf) > 0) {
+		if (db->nshards == asize) {
+			asize = asize ? asize * 2 : 16;
+			db->shards = realloc(db->shards, asize * sizeof(struct db_shard));
+			if (db->shards == NULL) {
+				cblogdb_close(db);
+				return -1;
+			}
+		}
+		shard = &db->shards[db->nshards++];
+		memset(shard, 0, sizeof(struct db_shard));
+		shard->fd = -1;
+
+		val = db_get(&db->cdb);
+		snprintf(shard->name, sizeof(shard->name), "%s", val);
+		free(val);
+	}
+
+	for (shard = db->shards; shard < db->shards + db->nshards; shard++)
+		cblogdb_load_summary(db, shard);
+
+	return 0;
+}
+
+void
+cblogdb_close(struct cblogdb *db)
+{
+	int	i;
+
+	for (i = 0; db->sharded && i < db->nshards; i++) {
+		if (db->shards[i].fd >= 0) {
+			cdb_free(&db->shards[i].cdb);
+			close(db->shards[i].fd);
+		}
+		free(db->shards[i].tags);
+	}
+	free(db->shards);
+	db->shards = NULL;
+	db->nshards = 0;
+	free(db->dict);
+	db->dict = NULL;
+	db->dict_read = false;
+
+	if (db->fd >= 0) {
+		cdb_free(&db->cdb);
+		close(db->fd);
+		db->fd = -1;
+	}
+}
+
+/* the nth shard, opened on first use */
+struct cdb *
+cblogdb_shard(struct cblogdb *db, int n)
+{
+	struct db_shard	*shard;
+	char			path[PATH_MAX];
+
+	if (!db->sharded)
+		return &db->cdb;
+
+	if (n < 0 || n >= db->nshards)
+		return NULL;
+
+	shard = &db->shards[n];
+	if (shard->fd >= 0)
+		return &shard->cdb;
+
+	db_shard_path(db->path, shard->name, path, sizeof(path));
+	if ((shard->fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (cdb_init(&shard->cdb, shard->fd) < 0) {
+		close(shard->fd);
+		shard->fd = -1;
+		return NULL;
+	}
+
+	return &shard->cdb;
+}
+
+/* index of the shard holding the post named name, -1 if unknown */
+int
+cblogdb_post_shard(struct cblogdb *db, const char *name)
+{
+	char	key[BUFSIZ];
+	char	*val;
+	int		i;
+
+	if (!db->sharded)
+		return 0;
+
+	snprintf(key, BUFSIZ, "%s_shard", name);
+	if ((val = db_find_get(&db->cdb, key)) == NULL)
+		return -1;
+
+	for (i = 0; i < db->nshards; i++) {
+		if (EQUALS(db->shards[i].name, val))
+			break;
+	}
+	free(val);
+
+	return i < db->nshards ? i : -1;
+}
+
+/* can the nth shard hold posts created between start and end */
+bool
+cblogdb_shard_in_range(struct cblogdb *db, int n, time_t start, time_t end)
+{
+	struct db_shard	*shard;
+
+	if (!db->sharded)
+		return true;
+
+	shard = &db->shards[n];
+	if (!shard->summary)
+		return true;
+
+	return shard->last >= start && shard->first <= end;
+}
+
+/* can the nth shard hold posts tagged with tag */
+bool
+cblogdb_shard_has_tag(struct cblogdb *db, int n, const char *tag)
+{
+	struct db_shard	*shard;
+	const char		*tags, *sep;
+	size_t			len = strlen(tag);
+
+	if (!db->sharded)
+		return true;
+
+	shard = &db->shards[n];
+	if (!shard->summary)
+		return true;
+
+	/* tags are stored as name:count,name:count */
+	for (tags = shard->tags; *tags != '\0'; tags = sep + 1) {
+		if ((sep = strchr(tags, ',')) == NULL)
+			sep = tags + strlen(tags) - 1;
+		if (strncasecmp(tags, tag, len) == 0 && tags[len] == ':')
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,348 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cblog_utils.h"
+#include "cblog_snapshot.h"
+
+/* a post while the snapshot is being built */
+struct snap_post {
+	time_t		ctime;
+	int			part;
+	uint32_t	name;
+	uint32_t	title;
+	char		*tags;
+};
+
+/* one tag of one post */
+struct snap_posting {
+	char		*name;
+	uint32_t	tag;
+	int			post;
+};
+
+struct snap_build {
+	struct store		*st;
+	struct snapshot		*snap;
+	int					nposts;
+	int					asize;
+	struct snap_post	*posts;
+};
+
+static struct snapshot	*sort_snap;
+
+static void *
+snap_alloc(void *ptr, size_t nmemb, size_t size)
+{
+	if ((ptr = realloc(ptr, (nmemb ? nmemb : 1) * size)) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	return ptr;
+}
+
+static uint32_t
+snap_intern(struct snapshot *snap, const char *str)
+{
+	size_t		len = strlen(str) + 1;
+	uint32_t	off;
+
+	if (snap->arena_len + len > snap->arena_size) {
+		while (snap->arena_len + len > snap->arena_size)
+			snap->arena_size = snap->arena_size ? snap->arena_size * 2 : 4096;
+		snap->arena = snap_alloc(snap->arena, snap->arena_size, 1);
+	}
+
+	off = snap->arena_len;
+	memcpy(snap->arena + off, str, len);
+	snap->arena_len += len;
+
+	return off;
+}
+
+static int
+snap_add(struct store_post *post, void *arg)
+{
+	struct snap_build	*build = arg;
+	struct snap_post	*p;
+	char				*title, *published;
+	bool				draft;
+
+	/* drafts are never listed */
+	published = store_get(build->st, post, "published");
+	draft = store_post_draft(published);
+	free(published);
+	if (draft)
+		return 0;
+
+	if (build->nposts == build->asize) {
+		build->asize = build->asize ? build->asize * 2 : 256;
+		build->posts = snap_alloc(build->posts, build->asize, sizeof(struct snap_post));
+	}
+
+	p = &build->posts[build->nposts++];
+	p->ctime = post->ctime;
+	p->part = post->part;
+	p->name = snap_intern(build->snap, post->name);
+	p->title = 0;
+	if ((title = store_get(build->st, post, "title")) != NULL) {
+		p->title = snap_intern(build->snap, title);
+		free(title);
+	}
+	p->tags = store_get(build->st, post, "tags");
+
+	return 0;
+}
+
+static int
+snap_cmp_post(const void *a, const void *b)
+{
+	const struct snap_post	*pa = a;
+	const struct snap_post	*pb = b;
+
+	if (pa->ctime != pb->ctime)
+		return pa->ctime < pb->ctime ? 1 : -1;
+
+	return strcmp(sort_snap->arena + pa->name, sort_snap->arena + pb->name);
+}
+
+static int
+snap_cmp_tag(const void *a, const void *b)
+{
+	const struct snap_posting	*pa = a;
+	const struct snap_posting	*pb = b;
+	int							ret;
+
+	if ((ret = strcasecmp(pa->name, pb->name)) != 0)
+		return ret;
+
+	return pa->post - pb->post;
+}
+
+static int
+snap_cmp_post_tag(const void *a, const void *b)
+{
+	const struct snap_posting	*pa = a;
+	const struct snap_posting	*pb = b;
+
+	if (pa->post != pb->post)
+		return pa->post - pb->post;
+
+	return (int)pa->tag - (int)pb->tag;
+}
+
+/*
+ * Read the metadata of every post of st but the drafts. Tags are matched
+ * without case and a tag listed twice by a post counts once.
+ */
+struct snapshot *
+snapshot_build(struct store *st)
+{
+	struct snapshot		*snap;
+	struct snap_build	build;
+	struct snap_posting	*postings = NULL;
+	char				*name;
+	size_t				next;
+	int					i, j, k, n, nbel, npostings = 0;
+
+	if ((snap = calloc(1, sizeof(struct snapshot))) == NULL)
+		return NULL;
+
+	memset(&build, 0, sizeof(struct snap_build));
+	build.st = st;
+	build.snap = snap;
+
+	/* offset 0 is the empty string of the posts without title */
+	snap_intern(snap, "");
+
+	if (store_posts(st, snap_add, &build) != 0) {
+		for (i = 0; i < build.nposts; i++)
+			free(build.posts[i].tags);
+		free(build.posts);
+		snapshot_free(snap);
+		return NULL;
+	}
+
+	sort_snap = snap;
+	if (build.nposts > 0)
+		qsort(build.posts, build.nposts, sizeof(struct snap_post), snap_cmp_post);
+
+	n = snap->nposts = build.nposts;
+	snap->ctime = snap_alloc(NULL, n, sizeof(time_t));
+	snap->part = snap_alloc(NULL, n, sizeof(int));
+	snap->name = snap_alloc(NULL, n, sizeof(uint32_t));
+	snap->title = snap_alloc(NULL, n, sizeof(uint32_t));
+	snap->tags = snap_alloc(NULL, n + 1, sizeof(uint32_t));
+	snap->comments = snap_alloc(NULL, n, sizeof(int32_t));
+	snap->comments_size = snap_alloc(NULL, n, sizeof(int64_t));
+
+	for (i = 0; i < n; i++) {
+		snap->ctime[i] = build.posts[i].ctime;
+		snap->part[i] = build.posts[i].part;
+		snap->name[i] = build.posts[i].name;
+		snap->title[i] = build.posts[i].title;
+		snap->comments[i] = -1;
+		snap->comments_size[i] = -1;
+
+		if ((name = build.posts[i].tags) == NULL)
+			continue;
+
+		nbel = splitchr(name, ',');
+		for (j = 0; j <= nbel; j++) {
+			next = strlen(name);
+			if (*trimspace(name) != '\0') {
+				postings = snap_alloc(postings, npostings + 1,
+				    sizeof(struct snap_posting));
+				postings[npostings].name = strdup(trimspace(name));
+				postings[npostings++].post = i;
+			}
+			name += next + 1;
+		}
+		free(build.posts[i].tags);
+	}
+	free(build.posts);
+
+	/* number the tags in name order, the first spelling names the tag */
+	if (npostings > 0)
+		qsort(postings, npostings, sizeof(struct snap_posting), snap_cmp_tag);
+
+	snap->tag_name = snap_alloc(NULL, npostings, sizeof(uint32_t));
+	snap->tag_count = snap_alloc(NULL, npostings, sizeof(uint32_t));
+	for (i = 0; i < npostings; i = j) {
+		snap->tag_name[snap->ntags] = snap_intern(snap, postings[i].name);
+		snap->tag_count[snap->ntags] = 0;
+		for (j = i; j < npostings &&
+		    strcasecmp(postings[i].name, postings[j].name) == 0; j++) {
+			if (j == i || postings[j].post != postings[j - 1].post)
+				snap->tag_count[snap->ntags]++;
+			postings[j].tag = snap->ntags;
+		}
+		snap->ntags++;
+	}
+	for (i = 0; i < npostings; i++)
+		free(postings[i].name);
+	snap->tag_name = snap_alloc(snap->tag_name, snap->ntags, sizeof(uint32_t));
+	snap->tag_count = snap_alloc(snap->tag_count, snap->ntags, sizeof(uint32_t));
+
+	/* then list the tag ids of each post */
+	if (npostings > 0)
+		qsort(postings, npostings, sizeof(struct snap_posting), snap_cmp_post_tag);
+
+	snap->tag_ids = snap_alloc(NULL, npostings, sizeof(uint32_t));
+	for (i = k = 0, j = 0; i < n; i++) {
+		snap->tags[i] = k;
+		for (; j < npostings && postings[j].post == i; j++) {
+			if (k == (int)snap->tags[i] || snap->tag_ids[k - 1] != postings[j].tag)
+				snap->tag_ids[k++] = postings[j].tag;
+		}
+	}
+	snap->tags[n] = k;
+	free(postings);
+
+	snap->arena = snap_alloc(snap->arena, snap->arena_len, 1);
+	snap->arena_size = snap->arena_len;
+
+	return snap;
+}
+
+void
+snapshot_free(struct snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+
+	free(snap->ctime);
+	free(snap->part);
+	free(snap->name);
+	free(snap->title);
+	free(snap->tags);
+	free(snap->tag_ids);
+	free(snap->comments);
+	free(snap->comments_size);
+	free(snap->tag_name);
+	free(snap->tag_count);
+	free(snap->arena);
+	free(snap);
+}
+
+/* bytes used by the columns and the arena */
+size_t
+snapshot_size(struct snapshot *snap)
+{
+	size_t	n = snap->nposts;
+
+	return sizeof(struct snapshot) +
+	    n * (sizeof(time_t) + sizeof(int) + 3 * sizeof(uint32_t) +
+	    sizeof(int32_t) + sizeof(int64_t)) + sizeof(uint32_t) +
+	    snap->tags[n] * sizeof(uint32_t) +
+	    snap->ntags * 2 * sizeof(uint32_t) +
+	    snap->arena_len;
+}
+
+/* id of the tag named name, -1 if no post uses it */
+int
+snapshot_find_tag(struct snapshot *snap, const char *name)
+{
+	int	lo = 0, hi = snap->ntags - 1, mid, ret;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		ret = strcasecmp(name, snapshot_tag_name(snap, mid));
+		if (ret == 0)
+			return mid;
+		if (ret < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+/*
+ * Store in out the indexes of at most limit posts matching query, newest
+ * first, skipping the first offset ones. Returns the number of matching
+ * posts.
+ */
+int
+snapshot_select(struct snapshot *snap, struct snapshot_query *query,
+    int offset, int limit, int *out)
+{
+	int			lo = 0, hi = snap->nposts, mid, i, total = 0;
+	uint32_t	t;
+	time_t		end = query->until;
+
+	if (query->bounded && query->end < end)
+		end = query->end;
+
+	/* posts are sorted by decreasing ctime */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (snap->ctime[mid] > end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	hi = snap->nposts;
+	if (query->bounded) {
+		for (hi = lo; hi < snap->nposts && snap->ctime[hi] >= query->start; hi++)
+			;
+	}
+
+	for (i = lo; i < hi; i++) {
+		if (query->tag >= 0) {
+			for (t = snap->tags[i]; t < snap->tags[i + 1]; t++) {
+				if (snap->tag_ids[t] == (uint32_t)query->tag)
+					break;
+			}
+			if (t == snap->tags[i + 1])
+				continue;
+		}
+
+		if (total >= offset && total - offset < limit)
+			out[total - offset] = i;
+		total++;
+	}
+
+	return total;
+}
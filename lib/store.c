@@ -0,0 +1,459 @@
+#include <ctype.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_common.h"
+
+static const struct store_ops *backends[] = {
+	&store_cdb,
+	&store_mem,
+	NULL
+};
+
+/* backend by name, NULL or "" being the default cdb one */
+const struct store_ops *
+store_backend(const char *name)
+{
+	int	i;
+
+	if (name == NULL || *name == '\0')
+		return &store_cdb;
+
+	for (i = 0; backends[i] != NULL; i++) {
+		if (EQUALS(backends[i]->name, name))
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+int
+store_create(const struct store_ops *ops, const char *path, bool sharded)
+{
+	return ops->create(path, sharded);
+}
+
+int
+store_open(struct store *st, const struct store_ops *ops, const char *path)
+{
+	st->ops = ops;
+	st->priv = NULL;
+
+	if (ops->open(st, path) < 0) {
+		st->ops = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+store_close(struct store *st)
+{
+	if (st->ops == NULL)
+		return;
+
+	st->ops->close(st);
+	st->ops = NULL;
+	st->priv = NULL;
+}
+
+/* calls to the store, read by the benchmarks */
+struct store_stats	store_stats;
+
+/* counts the posts a scan goes through before calling back the caller */
+struct store_scan {
+	store_post_cb	cb;
+	void			*arg;
+};
+
+static int
+store_scan_post(struct store_post *post, void *arg)
+{
+	struct store_scan	*scan = arg;
+
+	store_stats.scanned++;
+	return scan->cb(post, scan->arg);
+}
+
+/* fill post, returns 0 if name exists, -1 otherwise */
+int
+store_find(struct store *st, const char *name, struct store_post *post)
+{
+	store_stats.finds++;
+	return st->ops->find(st, name, post);
+}
+
+/* value of a field of post or NULL, to be freed by the caller */
+char *
+store_get(struct store *st, struct store_post *post, const char *field)
+{
+	store_stats.gets++;
+	return st->ops->get(st, post, field);
+}
+
+char *
+store_meta(struct store *st, const char *key)
+{
+	store_stats.metas++;
+	return st->ops->meta(st, key);
+}
+
+int
+store_posts(struct store *st, store_post_cb cb, void *arg)
+{
+	struct store_scan	scan = { cb, arg };
+
+	store_stats.scans++;
+	return st->ops->each(st, store_scan_post, &scan);
+}
+
+/* posts created between start and end, both included */
+int
+store_range(struct store *st, time_t start, time_t end, store_post_cb cb,
+    void *arg)
+{
+	struct store_scan	scan = { cb, arg };
+
+	store_stats.scans++;
+	return st->ops->range(st, start, end, store_scan_post, &scan);
+}
+
+int
+store_tagged(struct store *st, const char *tag, store_post_cb cb, void *arg)
+{
+	struct store_scan	scan = { cb, arg };
+
+	store_stats.scans++;
+	return st->ops->tagged(st, tag, store_scan_post, &scan);
+}
+
+/* every tag with the number of published posts using it, in no order */
+int
+store_tags(struct store *st, store_tag_cb cb, void *arg)
+{
+	return st->ops->tags(st, cb, arg);
+}
+
+int
+store_commit(struct store *st, struct store_batch *batch)
+{
+	return st->ops->commit(st, batch);
+}
+
+/* does the comma separated list of tags contain tag */
+bool
+store_post_has_tag(const char *tags, const char *tag)
+{
+	const char	*end;
+	size_t		len = strlen(tag);
+
+	while (*tags != '\0') {
+		while (*tags == ',' || isspace((unsigned char)*tags))
+			tags++;
+		if ((end = strchr(tags, ',')) == NULL)
+			end = tags + strlen(tags);
+
+		if (strncasecmp(tags, tag, len) == 0) {
+			tags += len;
+			while (tags < end && isspace((unsigned char)*tags))
+				tags++;
+			if (tags == end)
+				return true;
+		}
+		tags = end;
+	}
+
+	return false;
+}
+
+/* is a post whose "published" field is published a draft, never listed */
+bool
+store_post_draft(const char *published)
+{
+	return published != NULL && (EQUALS(published, "false") ||
+	    EQUALS(published, "no") || EQUALS(published, "0"));
+}
+
+struct store_overlay_load {
+	struct store_overlay	*ov;
+	struct store			*st;
+};
+
+static struct store_overlay_post *
+store_overlay_new(struct store_overlay *ov, const char *name)
+{
+	struct store_overlay_post	*p;
+
+	if (ov->nposts == ov->asize) {
+		ov->asize = ov->asize ? ov->asize * 2 : 256;
+		ov->posts = realloc(ov->posts,
+		    ov->asize * sizeof(struct store_overlay_post));
+		if (ov->posts == NULL)
+			errx(1, "Unable to allocate memory");
+	}
+	p = &ov->posts[ov->nposts++];
+	memset(p, 0, sizeof(struct store_overlay_post));
+	p->name = strdup(name);
+	p->ctime = -1;
+	p->part = -1;
+
+	return p;
+}
+
+static int
+store_overlay_load(struct store_post *post, void *arg)
+{
+	struct store_overlay_load	*load = arg;
+	struct store_overlay_post	*p;
+	char						*published;
+
+	p = store_overlay_new(load->ov, post->name);
+	p->ctime = post->ctime;
+	p->part = post->part;
+	published = store_get(load->st, post, "published");
+	p->draft = store_post_draft(published);
+	free(published);
+	p->title = store_get(load->st, post, "title");
+	p->tags = store_get(load->st, post, "tags");
+
+	return 0;
+}
+
+static int
+store_overlay_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct store_overlay_post *)a)->name,
+	    ((const struct store_overlay_post *)b)->name);
+}
+
+/* post name among the first n posts of ov, NULL if none */
+static struct store_overlay_post *
+store_overlay_find(struct store_overlay *ov, const char *name, int n)
+{
+	struct store_overlay_post	key;
+
+	if (n == 0)
+		return NULL;
+
+	key.name = (char *)name;
+	return bsearch(&key, ov->posts, n, sizeof(struct store_overlay_post),
+	    store_overlay_cmp);
+}
+
+static void
+store_overlay_set(char **dst, const char *val)
+{
+	free(*dst);
+	*dst = val ? strdup(val) : NULL;
+}
+
+/*
+ * Load every post of st in ov with its title and tags, then apply the
+ * puts and deletions of batch on them unless it is NULL: a deleted post
+ * is kept with deleted set, for the updaters to tell what changes.
+ * Returns -1 if st cannot be read, ov holding the posts loaded so far, to
+ * be freed by store_overlay_free as well.
+ */
+int
+store_overlay(struct store_overlay *ov, struct store *st,
+    struct store_batch *batch)
+{
+	struct store_overlay_load	load;
+	struct store_overlay_post	*p;
+	struct store_op				*op;
+	int							i, j, nloaded;
+
+	ov->nposts = ov->asize = 0;
+	ov->posts = NULL;
+	load.ov = ov;
+	load.st = st;
+	if (store_posts(st, store_overlay_load, &load) != 0)
+		return -1;
+
+	if (ov->nposts > 0)
+		qsort(ov->posts, ov->nposts, sizeof(struct store_overlay_post),
+		    store_overlay_cmp);
+	if (batch == NULL)
+		return 0;
+
+	/* add the new posts first, sorting once however many the batch adds */
+	nloaded = ov->nposts;
+	for (i = 0; i < batch->nops; i++) {
+		if (batch->ops[i].type == STORE_PUT &&
+		    store_overlay_find(ov, batch->ops[i].post, nloaded) == NULL)
+			store_overlay_new(ov, batch->ops[i].post);
+	}
+	if (ov->nposts > nloaded) {
+		qsort(ov->posts, ov->nposts, sizeof(struct store_overlay_post),
+		    store_overlay_cmp);
+		for (i = j = 0; i < ov->nposts; i++) {
+			if (j > 0 && strcmp(ov->posts[j - 1].name, ov->posts[i].name) == 0)
+				free(ov->posts[i].name);
+			else
+				ov->posts[j++] = ov->posts[i];
+		}
+		ov->nposts = j;
+	}
+
+	for (i = 0; i < batch->nops; i++) {
+		op = &batch->ops[i];
+		if (op->type == STORE_META)
+			continue;
+
+		p = store_overlay_find(ov, op->post, ov->nposts);
+		if (op->type == STORE_DEL) {
+			if (p != NULL) {
+				p->deleted = true;
+				p->changed = STORE_OVERLAY_TITLE | STORE_OVERLAY_TAGS |
+				    STORE_OVERLAY_SOURCE;
+				store_overlay_set(&p->title, NULL);
+				store_overlay_set(&p->tags, NULL);
+				store_overlay_set(&p->source, NULL);
+			}
+			continue;
+		}
+		p->deleted = false;
+
+		if (EQUALS(op->field, "ctime"))
+			p->ctime = strtoll(op->value, NULL, 10);
+		else if (EQUALS(op->field, "published"))
+			p->draft = store_post_draft(op->value);
+		else if (EQUALS(op->field, "title")) {
+			store_overlay_set(&p->title, op->value);
+			p->changed |= STORE_OVERLAY_TITLE;
+		} else if (EQUALS(op->field, "tags")) {
+			store_overlay_set(&p->tags, op->value);
+			p->changed |= STORE_OVERLAY_TAGS;
+		} else if (EQUALS(op->field, "source")) {
+			store_overlay_set(&p->source, op->value);
+			p->changed |= STORE_OVERLAY_SOURCE;
+		}
+	}
+
+	return 0;
+}
+
+/* free the posts of ov and their fields */
+void
+store_overlay_free(struct store_overlay *ov)
+{
+	struct store_overlay_post	*p;
+	int							i;
+
+	for (i = 0; i < ov->nposts; i++) {
+		p = &ov->posts[i];
+		free(p->name);
+		free(p->title);
+		free(p->tags);
+		free(p->source);
+	}
+	free(ov->posts);
+	ov->posts = NULL;
+	ov->nposts = ov->asize = 0;
+}
+
+struct store_copy_arg {
+	struct store		*src;
+	struct store_batch	*batch;
+};
+
+static int
+store_copy_post(struct store_post *post, void *arg)
+{
+	struct store_copy_arg	*copy = arg;
+	char					*val;
+	int						i;
+
+	for (i = 0; field[i] != NULL; i++) {
+		if ((val = store_get(copy->src, post, field[i])) == NULL)
+			continue;
+		store_batch_put(copy->batch, post->name, field[i], val);
+		free(val);
+	}
+
+	return 0;
+}
+
+/* add every post of src to dst */
+int
+store_copy(struct store *dst, struct store *src)
+{
+	struct store_batch		batch;
+	struct store_copy_arg	copy;
+	int						ret;
+
+	store_batch_init(&batch);
+	copy.src = src;
+	copy.batch = &batch;
+
+	if ((ret = store_posts(src, store_copy_post, &copy)) == 0)
+		ret = store_commit(dst, &batch);
+
+	store_batch_free(&batch);
+
+	return ret;
+}
+
+void
+store_batch_init(struct store_batch *batch)
+{
+	memset(batch, 0, sizeof(struct store_batch));
+}
+
+static void
+store_batch_add(struct store_batch *batch, int type, const char *post,
+    const char *field, const char *value)
+{
+	struct store_op	*op;
+
+	if (batch->nops == batch->asize) {
+		batch->asize = batch->asize ? batch->asize * 2 : 16;
+		batch->ops = realloc(batch->ops, batch->asize * sizeof(struct store_op));
+		if (batch->ops == NULL)
+			errx(1, "Unable to allocate memory");
+	}
+
+	op = &batch->ops[batch->nops++];
+	op->type = type;
+	op->post = post ? strdup(post) : NULL;
+	op->field = field ? strdup(field) : NULL;
+	op->value = value ? strdup(value) : NULL;
+}
+
+void
+store_batch_put(struct store_batch *batch, const char *post, const char *field,
+    const char *value)
+{
+	store_batch_add(batch, STORE_PUT, post, field, value);
+}
+
+void
+store_batch_del(struct store_batch *batch, const char *post)
+{
+	store_batch_add(batch, STORE_DEL, post, NULL, NULL);
+}
+
+void
+store_batch_meta(struct store_batch *batch, const char *key, const char *value)
+{
+	store_batch_add(batch, STORE_META, NULL, key, value);
+}
+
+void
+store_batch_free(struct store_batch *batch)
+{
+	int	i;
+
+	for (i = 0; i < batch->nops; i++) {
+		free(batch->ops[i].post);
+		free(batch->ops[i].field);
+		free(batch->ops[i].value);
+	}
+	free(batch->ops);
+	store_batch_init(batch);
+}
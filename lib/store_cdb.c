@@ -0,0 +1,998 @@
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <cdb.h>
+#include <err.h>
+
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_common.h"
+#include "cblog_compress.h"
+
+/*
+ * CDB backend: a plain cblog.cdb or a manifest and its yearly shards (see
+ * shards.c). A commit rewrites each modified file to path.tmp and renames
+ * it over the original, readers keeping the file they opened. The fields
+ * listed in COMPRESS_KEY are written compressed and decompressed by
+ * cdbst_get, only when a field is read.
+ */
+
+/* keys of the shard summaries in the manifest */
+static const char *shard_summary[] = {
+	"first",
+	"last",
+	"count",
+	"tags",
+	NULL
+};
+
+#define RAW_SET		0	/* replace every value of key */
+#define RAW_DROP	1	/* remove every value of key */
+#define RAW_ADD		2	/* add value to key unless already there */
+#define RAW_DROPVAL	3	/* remove value from key */
+
+/* a change to the records of one cdb file */
+struct rawop {
+	int		type;
+	int		seq;		/* insertion order, the last RAW_SET wins */
+	int		first;		/* ops on the same key, once sorted */
+	int		end;
+	bool	seen;		/* RAW_ADD value already in the file */
+	char	*key;
+	char	*value;
+	size_t	vlen;
+};
+
+struct rawops {
+	int				nops;
+	int				asize;
+	struct rawop	*ops;
+};
+
+struct tagcount {
+	char	*name;
+	int		count;
+	SLIST_ENTRY(tagcount) next;
+};
+
+SLIST_HEAD(tagcounts, tagcount);
+
+/* how the fields of a commit are written */
+struct rawzip {
+	char	*fields;	/* compressed, NULL if none */
+	char	*dict;
+	size_t	dictlen;
+};
+
+/* add an op whose value is the len bytes of value */
+static void
+raw_addn(struct rawops *ro, int type, const char *key, const char *value,
+    size_t len)
+{
+	struct rawop	*op;
+
+	if (ro->nops == ro->asize) {
+		ro->asize = ro->asize ? ro->asize * 2 : 16;
+		ro->ops = realloc(ro->ops, ro->asize * sizeof(struct rawop));
+		if (ro->ops == NULL)
+			errx(1, "Unable to allocate memory");
+	}
+
+	op = &ro->ops[ro->nops];
+	op->type = type;
+	op->seq = ro->nops++;
+	op->seen = false;
+	op->key = strdup(key);
+	op->value = NULL;
+	op->vlen = len;
+	if (value != NULL) {
+		if ((op->value = malloc(len + 1)) == NULL)
+			errx(1, "Unable to allocate memory");
+		memcpy(op->value, value, len);
+		op->value[len] = '\0';
+	}
+}
+
+static void
+raw_add(struct rawops *ro, int type, const char *key, const char *value)
+{
+	raw_addn(ro, type, key, value, value ? strlen(value) : 0);
+}
+
+static void
+raw_free(struct rawops *ro)
+{
+	int	i;
+
+	for (i = 0; i < ro->nops; i++) {
+		free(ro->ops[i].key);
+		free(ro->ops[i].value);
+	}
+	free(ro->ops);
+	memset(ro, 0, sizeof(struct rawops));
+}
+
+/*
+ * By key, then the RAW_ADD ops last and by value so that the values added
+ * to a key are found by bisection, the other ops in insertion order.
+ */
+static int
+raw_cmp(const void *a, const void *b)
+{
+	const struct rawop	*oa = a;
+	const struct rawop	*ob = b;
+	int					ret;
+
+	if ((ret = strcmp(oa->key, ob->key)) != 0)
+		return ret;
+
+	if ((oa->type == RAW_ADD) != (ob->type == RAW_ADD))
+		return oa->type == RAW_ADD ? 1 : -1;
+
+	if (oa->type == RAW_ADD && (ret = strcmp(oa->value, ob->value)) != 0)
+		return ret;
+
+	return oa->seq - ob->seq;
+}
+
+static int
+raw_cmp_key(const void *key, const void *b)
+{
+	return strcmp(key, ((const struct rawop *)b)->key);
+}
+
+/* sort the ops and note the bounds of the ops of each key */
+static void
+raw_sort(struct rawops *ro)
+{
+	int	i, j, k;
+
+	if (ro->nops > 0)
+		qsort(ro->ops, ro->nops, sizeof(struct rawop), raw_cmp);
+
+	for (i = 0; i < ro->nops; i = j) {
+		for (j = i + 1; j < ro->nops && strcmp(ro->ops[j].key, ro->ops[i].key) == 0; j++)
+			;
+		for (k = i; k < j; k++) {
+			ro->ops[k].first = i;
+			ro->ops[k].end = j;
+		}
+	}
+}
+
+/* first op on key, -1 if none */
+static int
+raw_lookup(struct rawops *ro, const char *key)
+{
+	struct rawop	*op;
+
+	if (ro->nops == 0)
+		return -1;
+
+	op = bsearch(key, ro->ops, ro->nops, sizeof(struct rawop), raw_cmp_key);
+	if (op == NULL)
+		return -1;
+
+	return op->first;
+}
+
+/* mark the RAW_ADD ops of val on the key of first as already in the file */
+static void
+raw_seen(struct rawops *ro, int first, const char *val)
+{
+	int	lo = first, hi, mid;
+
+	if (first < 0)
+		return;
+
+	hi = ro->ops[first].end;
+	while (lo < hi && ro->ops[lo].type != RAW_ADD)
+		lo++;
+
+	/* lowest RAW_ADD op whose value is not below val */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(ro->ops[mid].value, val) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < ro->ops[first].end && strcmp(ro->ops[lo].value, val) == 0; lo++)
+		ro->ops[lo].seen = true;
+}
+
+/* should the record key=val be left out of the new file */
+static bool
+raw_drops(struct rawops *ro, int first, const char *key, const char *val)
+{
+	int	i;
+
+	if (first < 0)
+		return false;
+
+	for (i = first; i < ro->ops[first].end && ro->ops[i].type != RAW_ADD; i++) {
+		switch (ro->ops[i].type) {
+			case RAW_SET:
+			case RAW_DROP:
+				return true;
+			case RAW_DROPVAL:
+				if (strcmp(ro->ops[i].value, val) == 0)
+					return true;
+				break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Write path again with the changes of ro applied, records which are not
+ * changed keep their order. A missing path is handled as an empty file.
+ */
+static int
+cdb_rewrite(const char *path, struct rawops *ro)
+{
+	int					olddb, db, i, j, first;
+	unsigned			pos, klen;
+	struct cdb			cdb;
+	struct cdb_make		cdb_make;
+	struct rawop		*op;
+	char				tmp[PATH_MAX];
+	char				*k, *v;
+
+	if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	raw_sort(ro);
+
+	if ((olddb = open(path, O_RDONLY)) < 0 && errno != ENOENT)
+		return -1;
+	if ((db = open(tmp, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0) {
+		if (olddb >= 0)
+			close(olddb);
+		return -1;
+	}
+
+	cdb_make_start(&cdb_make, db);
+
+	if (olddb >= 0) {
+		cdb_init(&cdb, olddb);
+		cdb_seqinit(&pos, &cdb);
+		while (cdb_seqnext(&pos, &cdb) > 0) {
+			klen = cdb_keylen(&cdb);
+			if ((k = malloc(klen + 1)) == NULL)
+				errx(1, "Unable to allocate memory");
+			cdb_read(&cdb, k, klen, cdb_keypos(&cdb));
+			k[klen] = '\0';
+			v = db_get(&cdb);
+
+			first = raw_lookup(ro, k);
+			if (!raw_drops(ro, first, k, v)) {
+				cdb_make_add(&cdb_make, k, klen, v, cdb_datalen(&cdb));
+				raw_seen(ro, first, v);
+			}
+			free(k);
+			free(v);
+		}
+		cdb_free(&cdb);
+		close(olddb);
+	}
+
+	for (i = 0; i < ro->nops; i++) {
+		op = &ro->ops[i];
+		if (op->type == RAW_SET) {
+			for (j = i + 1; j < op->end && ro->ops[j].type != RAW_ADD &&
+			    ro->ops[j].type != RAW_SET; j++)
+				;
+			if (j < op->end && ro->ops[j].type == RAW_SET)
+				continue;
+		} else if (op->type != RAW_ADD || op->seen)
+			continue;
+
+		cdb_make_add(&cdb_make, op->key, strlen(op->key), op->value,
+		    op->vlen);
+
+		/* the same value added again follows */
+		for (j = i + 1; op->type == RAW_ADD && j < op->end &&
+		    strcmp(ro->ops[j].value, op->value) == 0; j++)
+			ro->ops[j].seen = true;
+	}
+
+	if (cdb_make_finish(&cdb_make) < 0) {
+		close(db);
+		unlink(tmp);
+		return -1;
+	}
+	close(db);
+
+	return rename(tmp, path);
+}
+
+/* changes of a post operation to the file holding the post */
+static void
+raw_post_ops(struct rawops *ro, struct store_op *op, struct rawzip *zip)
+{
+	char	key[BUFSIZ];
+	char	*val;
+	size_t	len;
+	int		i;
+
+	switch (op->type) {
+		case STORE_PUT:
+			snprintf(key, BUFSIZ, "%s_%s", op->post, op->field);
+			/* decoded when read even if not compressed, see cdbst_get */
+			if (compress_field(COMPRESS_FIELDS, op->field)) {
+				val = compress_encode(op->value,
+				    compress_field(zip->fields, op->field), zip->dict,
+				    zip->dictlen, &len);
+				raw_addn(ro, RAW_SET, key, val, len);
+				free(val);
+			} else
+				raw_add(ro, RAW_SET, key, op->value);
+			raw_add(ro, RAW_ADD, "posts", op->post);
+			break;
+		case STORE_DEL:
+			for (i = 0; field[i] != NULL; i++) {
+				snprintf(key, BUFSIZ, "%s_%s", op->post, field[i]);
+				raw_add(ro, RAW_DROP, key, NULL);
+			}
+			raw_add(ro, RAW_DROPVAL, "posts", op->post);
+			break;
+		case STORE_META:
+			raw_add(ro, RAW_SET, op->field, op->value);
+			break;
+	}
+}
+
+static int
+tagcount_add(struct tagcounts *head, const char *name, int count)
+{
+	struct tagcount	*tag;
+
+	SLIST_FOREACH(tag, head, next) {
+		if (EQUALS(name, tag->name)) {
+			tag->count += count;
+			return 0;
+		}
+	}
+
+	if ((tag = malloc(sizeof(struct tagcount))) == NULL)
+		errx(1, "Unable to allocate memory");
+	tag->name = strdup(name);
+	tag->count = count;
+	SLIST_INSERT_HEAD(head, tag, next);
+
+	return 1;
+}
+
+/* count every tag of the comma separated list tags, which is modified */
+static void
+tagcount_add_list(struct tagcounts *head, char *tags)
+{
+	int		i, nbel;
+	size_t	next;
+	char	*name;
+
+	nbel = splitchr(tags, ',');
+	for (i = 0; i <= nbel; i++) {
+		next = strlen(tags);
+		name = trimspace(tags);
+		if (*name != '\0')
+			tagcount_add(head, name, 1);
+		tags += next + 1;
+	}
+}
+
+/* is the post name of cdb a draft */
+static bool
+cdb_post_draft(struct cdb *cdb, const char *name)
+{
+	char	key[BUFSIZ], *published;
+	bool	draft;
+
+	snprintf(key, BUFSIZ, "%s_published", name);
+	published = db_find_get(cdb, key);
+	draft = store_post_draft(published);
+	free(published);
+
+	return draft;
+}
+
+static void
+tagcount_free(struct tagcounts *head)
+{
+	struct tagcount	*tag;
+
+	while (!SLIST_EMPTY(head)) {
+		tag = SLIST_FIRST(head);
+		SLIST_REMOVE_HEAD(head, next);
+		free(tag->name);
+		free(tag);
+	}
+}
+
+static int
+cdbst_create(const char *path, bool sharded)
+{
+	int					db;
+	struct cdb_make		cdb_make;
+
+	if ((db = open(path, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0)
+		return -1;
+
+	cdb_make_start(&cdb_make, db);
+	if (sharded)
+		cdb_make_add(&cdb_make, "sharding", 8, "year", 4);
+	if (cdb_make_finish(&cdb_make) < 0) {
+		close(db);
+		return -1;
+	}
+
+	return close(db);
+}
+
+static int
+cdbst_open(struct store *st, const char *path)
+{
+	struct cblogdb	*db;
+
+	if ((db = malloc(sizeof(struct cblogdb))) == NULL)
+		return -1;
+
+	if (cblogdb_open(db, path) < 0) {
+		free(db);
+		return -1;
+	}
+	st->priv = db;
+
+	return 0;
+}
+
+static void
+cdbst_close(struct store *st)
+{
+	cblogdb_close(st->priv);
+	free(st->priv);
+}
+
+static int
+cdbst_find(struct store *st, const char *name, struct store_post *post)
+{
+	struct cblogdb	*db = st->priv;
+	struct cdb		*cdb;
+	char			key[BUFSIZ];
+	char			*val;
+
+	post->name = name;
+	post->ctime = 0;
+
+	if ((post->part = cblogdb_post_shard(db, name)) < 0 ||
+	    (cdb = cblogdb_shard(db, post->part)) == NULL)
+		return -1;
+
+	snprintf(key, BUFSIZ, "%s_ctime", name);
+	if ((val = db_find_get(cdb, key)) == NULL)
+		return -1;
+
+	post->ctime = (time_t)strtoll(val, NULL, 10);
+	free(val);
+
+	return 0;
+}
+
+static char *
+cdbst_get(struct store *st, struct store_post *post, const char *field)
+{
+	struct cblogdb	*db = st->priv;
+	struct cdb		*cdb;
+	char			key[BUFSIZ];
+	char			*val, *text;
+	unsigned		len;
+
+	if (post->part < 0)
+		post->part = cblogdb_post_shard(db, post->name);
+
+	if ((cdb = cblogdb_shard(db, post->part)) == NULL)
+		return NULL;
+
+	snprintf(key, BUFSIZ, "%s_%s", post->name, field);
+
+	if (!compress_field(COMPRESS_FIELDS, field))
+		return db_find_get(cdb, key);
+
+	if (cdb_find(cdb, key, strlen(key)) <= 0)
+		return NULL;
+	len = cdb_datalen(cdb);
+	val = db_get(cdb);
+	if (len == 0 || (val[0] != COMPRESS_RAW && val[0] != COMPRESS_DEFLATE))
+		return val;
+
+	if (val[0] == COMPRESS_DEFLATE && !db->dict_read) {
+		db->dict = db_find_get(&db->cdb, COMPRESS_DICT_KEY);
+		db->dictlen = db->dict != NULL ? strlen(db->dict) : 0;
+		db->dict_read = true;
+	}
+	text = compress_decode(val, len, db->dict, db->dictlen);
+	free(val);
+
+	return text;
+}
+
+static char *
+cdbst_meta(struct store *st, const char *key)
+{
+	struct cblogdb	*db = st->priv;
+
+	return db_find_get(&db->cdb, key);
+}
+
+/* walk the posts of the shards which can match the range and the tag */
+static int
+cdbst_scan(struct store *st, bool bounded, time_t start, time_t end,
+    const char *tag, store_post_cb cb, void *arg)
+{
+	struct cblogdb		*db = st->priv;
+	struct cdb			*cdb;
+	struct cdb_find		cdbf;
+	struct store_post	post;
+	char				key[BUFSIZ];
+	char				*name, *val;
+	bool				match;
+	int					n, ret;
+
+	for (n = 0; n < db->nshards; n++) {
+		if (bounded && !cblogdb_shard_in_range(db, n, start, end))
+			continue;
+		if (tag != NULL && !cblogdb_shard_has_tag(db, n, tag))
+			continue;
+
+		if ((cdb = cblogdb_shard(db, n)) == NULL)
+			continue;
+
+		cdb_findinit(&cdbf, cdb, "posts", 5);
+		while (cdb_findnext(&cdbf) > 0) {
+			name = db_get(cdb);
+			post.name = name;
+			post.part = n;
+
+			snprintf(key, BUFSIZ, "%s_ctime", name);
+			if ((val = db_find_get(cdb, key)) != NULL) {
+				post.ctime = (time_t)strtoll(val, NULL, 10);
+				free(val);
+			} else
+				post.ctime = time(NULL);
+
+			match = !bounded || (post.ctime >= start && post.ctime <= end);
+			if (match && tag != NULL) {
+				snprintf(key, BUFSIZ, "%s_tags", name);
+				val = db_find_get(cdb, key);
+				match = (val != NULL && store_post_has_tag(val, tag));
+				free(val);
+			}
+
+			ret = match ? cb(&post, arg) : 0;
+			free(name);
+			if (ret != 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int
+cdbst_each(struct store *st, store_post_cb cb, void *arg)
+{
+	return cdbst_scan(st, false, 0, 0, NULL, cb, arg);
+}
+
+static int
+cdbst_range(struct store *st, time_t start, time_t end, store_post_cb cb,
+    void *arg)
+{
+	return cdbst_scan(st, true, start, end, NULL, cb, arg);
+}
+
+static int
+cdbst_tagged(struct store *st, const char *tag, store_post_cb cb, void *arg)
+{
+	return cdbst_scan(st, false, 0, 0, tag, cb, arg);
+}
+
+/*
+ * tags of the posts but the drafts: shard summaries are used when present,
+ * other databases are scanned
+ */
+static int
+cdbst_tags(struct store *st, store_tag_cb cb, void *arg)
+{
+	struct cblogdb		*db = st->priv;
+	struct cdb			*cdb;
+	struct cdb_find		cdbf;
+	struct tagcounts	head;
+	struct tagcount		*tag;
+	char				key[BUFSIZ];
+	char				*name, *val, *list, *count;
+	int					i, n, nbel, ret = 0;
+	size_t				next;
+
+	SLIST_INIT(&head);
+
+	for (n = 0; n < db->nshards; n++) {
+		if (db->sharded && db->shards[n].summary) {
+			list = val = strdup(db->shards[n].tags);
+			nbel = splitchr(val, ',');
+			for (i = 0; i <= nbel; i++) {
+				next = strlen(val);
+				if ((count = strrchr(val, ':')) != NULL) {
+					*count++ = '\0';
+					tagcount_add(&head, val, (int)strtol(count, NULL, 10));
+				}
+				val += next + 1;
+			}
+			free(list);
+			continue;
+		}
+
+		if ((cdb = cblogdb_shard(db, n)) == NULL)
+			continue;
+
+		cdb_findinit(&cdbf, cdb, "posts", 5);
+		while (cdb_findnext(&cdbf) > 0) {
+			name = db_get(cdb);
+			if (!cdb_post_draft(cdb, name)) {
+				snprintf(key, BUFSIZ, "%s_tags", name);
+				if ((val = db_find_get(cdb, key)) != NULL) {
+					tagcount_add_list(&head, val);
+					free(val);
+				}
+			}
+			free(name);
+		}
+	}
+
+	SLIST_FOREACH(tag, &head, next) {
+		if ((ret = cb(tag->name, tag->count, arg)) != 0)
+			break;
+	}
+	tagcount_free(&head);
+
+	return ret;
+}
+
+/* summary of a shard file as manifest changes, returns its post count */
+static int
+shard_summary_ops(const char *path, const char *shard, struct rawops *manifest)
+{
+	int					fd, i, count = 0;
+	struct cdb			cdb;
+	struct cdb_find		cdbf;
+	struct tagcounts	head;
+	struct tagcount		*tag;
+	char				key[BUFSIZ], num[32];
+	char				*name, *val, *tags;
+	size_t				len, size;
+	time_t				ctime, first = 0, last = 0;
+
+	SLIST_INIT(&head);
+
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		cdb_init(&cdb, fd);
+		cdb_findinit(&cdbf, &cdb, "posts", 5);
+		while (cdb_findnext(&cdbf) > 0) {
+			name = db_get(&cdb);
+			count++;
+
+			snprintf(key, BUFSIZ, "%s_ctime", name);
+			if ((val = db_find_get(&cdb, key)) != NULL) {
+				ctime = (time_t)strtoll(val, NULL, 10);
+				if (count == 1 || ctime < first)
+					first = ctime;
+				if (count == 1 || ctime > last)
+					last = ctime;
+				free(val);
+			}
+
+			/* drafts are read but not listed, their tags are not counted */
+			snprintf(key, BUFSIZ, "%s_tags", name);
+			if (!cdb_post_draft(&cdb, name) &&
+			    (val = db_find_get(&cdb, key)) != NULL) {
+				tagcount_add_list(&head, val);
+				free(val);
+			}
+			free(name);
+		}
+		cdb_free(&cdb);
+		close(fd);
+	}
+
+	if (count == 0) {
+		raw_add(manifest, RAW_DROPVAL, "shards", shard);
+		for (i = 0; shard_summary[i] != NULL; i++) {
+			snprintf(key, BUFSIZ, "shard_%s_%s", shard, shard_summary[i]);
+			raw_add(manifest, RAW_DROP, key, NULL);
+		}
+		return 0;
+	}
+
+	raw_add(manifest, RAW_ADD, "shards", shard);
+
+	snprintf(key, BUFSIZ, "shard_%s_first", shard);
+	snprintf(num, sizeof(num), "%lld", (long long int)first);
+	raw_add(manifest, RAW_SET, key, num);
+
+	snprintf(key, BUFSIZ, "shard_%s_last", shard);
+	snprintf(num, sizeof(num), "%lld", (long long int)last);
+	raw_add(manifest, RAW_SET, key, num);
+
+	snprintf(key, BUFSIZ, "shard_%s_count", shard);
+	snprintf(num, sizeof(num), "%d", count);
+	raw_add(manifest, RAW_SET, key, num);
+
+	/* name:count,name:count */
+	len = 1;
+	SLIST_FOREACH(tag, &head, next)
+		len += strlen(tag->name) + sizeof(num) + 2;
+	if ((tags = malloc(len)) == NULL)
+		errx(1, "Unable to allocate memory");
+	size = 0;
+	tags[0] = '\0';
+	SLIST_FOREACH(tag, &head, next)
+		size += snprintf(tags + size, len - size, "%s%s:%d", size ? "," : "",
+		    tag->name, tag->count);
+	snprintf(key, BUFSIZ, "shard_%s_tags", shard);
+	raw_add(manifest, RAW_SET, key, tags);
+	free(tags);
+	tagcount_free(&head);
+
+	return count;
+}
+
+/* date given to a post by a batch, the last one wins */
+struct batch_ctime {
+	const char	*post;
+	time_t		ctime;
+	int			seq;
+};
+
+static int
+batch_ctime_cmp(const void *a, const void *b)
+{
+	const struct batch_ctime	*ca = a;
+	const struct batch_ctime	*cb = b;
+	int							ret;
+
+	if ((ret = strcmp(ca->post, cb->post)) != 0)
+		return ret;
+
+	return ca->seq - cb->seq;
+}
+
+/* dates set by batch sorted by post, one per post, *n set to their number */
+static struct batch_ctime *
+batch_ctimes(struct store_batch *batch, int *n)
+{
+	struct batch_ctime	*ctimes;
+	int					i, j;
+
+	if ((ctimes = malloc((batch->nops + 1) * sizeof(struct batch_ctime))) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	for (i = j = 0; i < batch->nops; i++) {
+		if (batch->ops[i].type == STORE_PUT && EQUALS(batch->ops[i].field, "ctime")) {
+			ctimes[j].post = batch->ops[i].post;
+			ctimes[j].ctime = (time_t)strtoll(batch->ops[i].value, NULL, 10);
+			ctimes[j].seq = i;
+			j++;
+		}
+	}
+	if (j > 0)
+		qsort(ctimes, j, sizeof(struct batch_ctime), batch_ctime_cmp);
+
+	for (i = *n = 0; i < j; i++) {
+		if (i + 1 < j && strcmp(ctimes[i].post, ctimes[i + 1].post) == 0)
+			continue;
+		ctimes[(*n)++] = ctimes[i];
+	}
+
+	return ctimes;
+}
+
+static int
+batch_ctime_find(const void *key, const void *b)
+{
+	return strcmp(key, ((const struct batch_ctime *)b)->post);
+}
+
+/* shard of a post: where it already is, or the year it has been created */
+static void
+shard_of_op(struct cblogdb *db, struct batch_ctime *ctimes, int nctimes,
+    struct store_op *op, char *shard, size_t size)
+{
+	struct batch_ctime	*found;
+	char				key[BUFSIZ];
+	char				*val;
+	time_t				ctime = time(NULL);
+
+	snprintf(key, BUFSIZ, "%s_shard", op->post);
+	if ((val = db_find_get(&db->cdb, key)) != NULL) {
+		snprintf(shard, size, "%s", val);
+		free(val);
+		return;
+	}
+
+	if (nctimes > 0 && (found = bsearch(op->post, ctimes, nctimes,
+	    sizeof(struct batch_ctime), batch_ctime_find)) != NULL)
+		ctime = found->ctime;
+
+	time_to_str(ctime, "%Y", shard, size);
+}
+
+struct shard_change {
+	char			name[16];
+	struct rawops	ops;
+};
+
+/*
+ * Rewrite the shards touched by the batch, then the manifest with the
+ * new post to shard mapping and the recomputed summaries of these shards.
+ * Shards left empty are removed.
+ */
+static int
+cdbst_commit_sharded(struct cblogdb *db, struct store_batch *batch,
+    struct rawzip *zip)
+{
+	struct shard_change	*changes = NULL;
+	struct rawops		manifest;
+	struct store_op		*op;
+	struct batch_ctime	*ctimes;
+	char				shard[16], key[BUFSIZ];
+	char				path[PATH_MAX];
+	int					i, n, nchanges = 0, nctimes, ret = 0;
+	bool				*empty;
+
+	memset(&manifest, 0, sizeof(struct rawops));
+	ctimes = batch_ctimes(batch, &nctimes);
+
+	for (i = 0; i < batch->nops; i++) {
+		op = &batch->ops[i];
+		if (op->type == STORE_META) {
+			raw_post_ops(&manifest, op, zip);
+			continue;
+		}
+
+		snprintf(key, BUFSIZ, "%s_shard", op->post);
+		if (op->type == STORE_DEL) {
+			if (cblogdb_post_shard(db, op->post) < 0)
+				continue;
+			raw_add(&manifest, RAW_DROP, key, NULL);
+		}
+		shard_of_op(db, ctimes, nctimes, op, shard, sizeof(shard));
+		if (op->type == STORE_PUT)
+			raw_add(&manifest, RAW_SET, key, shard);
+
+		for (n = 0; n < nchanges; n++) {
+			if (strcmp(changes[n].name, shard) == 0)
+				break;
+		}
+		if (n == nchanges) {
+			changes = realloc(changes, ++nchanges * sizeof(struct shard_change));
+			if (changes == NULL)
+				errx(1, "Unable to allocate memory");
+			memset(&changes[n], 0, sizeof(struct shard_change));
+			snprintf(changes[n].name, sizeof(changes[n].name), "%s", shard);
+		}
+		raw_post_ops(&changes[n].ops, op, zip);
+	}
+
+	if ((empty = calloc(nchanges + 1, sizeof(bool))) == NULL)
+		errx(1, "Unable to allocate memory");
+
+	for (n = 0; n < nchanges && ret == 0; n++) {
+		db_shard_path(db->path, changes[n].name, path, PATH_MAX);
+		if ((ret = cdb_rewrite(path, &changes[n].ops)) == 0)
+			empty[n] = shard_summary_ops(path, changes[n].name, &manifest) == 0;
+	}
+
+	if (ret == 0)
+		ret = cdb_rewrite(db->path, &manifest);
+
+	for (n = 0; n < nchanges; n++) {
+		if (ret == 0 && empty[n]) {
+			db_shard_path(db->path, changes[n].name, path, PATH_MAX);
+			unlink(path);
+		}
+		raw_free(&changes[n].ops);
+	}
+	free(changes);
+	free(empty);
+	free(ctimes);
+	raw_free(&manifest);
+
+	return ret;
+}
+
+/* compressed fields and dictionary once batch is committed */
+static void
+cdbst_zip(struct cblogdb *db, struct store_batch *batch, struct rawzip *zip)
+{
+	struct store_op	*op;
+	char			**val;
+	int				i;
+
+	zip->fields = db_find_get(&db->cdb, COMPRESS_KEY);
+	zip->dict = db_find_get(&db->cdb, COMPRESS_DICT_KEY);
+	for (i = 0; i < batch->nops; i++) {
+		op = &batch->ops[i];
+		if (op->type != STORE_META)
+			continue;
+		if (EQUALS(op->field, COMPRESS_KEY))
+			val = &zip->fields;
+		else if (EQUALS(op->field, COMPRESS_DICT_KEY))
+			val = &zip->dict;
+		else
+			continue;
+		free(*val);
+		*val = strdup(op->value);
+	}
+	if (zip->dict != NULL && *zip->dict == '\0') {
+		free(zip->dict);
+		zip->dict = NULL;
+	}
+	zip->dictlen = zip->dict != NULL ? strlen(zip->dict) : 0;
+}
+
+static int
+cdbst_commit(struct store *st, struct store_batch *batch)
+{
+	struct cblogdb	*db = st->priv;
+	struct rawops	ro;
+	struct rawzip	zip;
+	char			path[PATH_MAX];
+	int				i, ret;
+
+	cdbst_zip(db, batch, &zip);
+	if (db->sharded)
+		ret = cdbst_commit_sharded(db, batch, &zip);
+	else {
+		memset(&ro, 0, sizeof(struct rawops));
+		for (i = 0; i < batch->nops; i++)
+			raw_post_ops(&ro, &batch->ops[i], &zip);
+		ret = cdb_rewrite(db->path, &ro);
+		raw_free(&ro);
+	}
+	free(zip.fields);
+	free(zip.dict);
+
+	/* the files just written replace the ones still opened */
+	snprintf(path, PATH_MAX, "%s", db->path);
+	cblogdb_close(db);
+	if (cblogdb_open(db, path) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+const struct store_ops store_cdb = {
+	"cdb",
+	cdbst_create,
+	cdbst_open,
+	cdbst_close,
+	cdbst_find,
+	cdbst_get,
+	cdbst_meta,
+	cdbst_each,
+	cdbst_range,
+	cdbst_tagged,
+	cdbst_tags,
+	cdbst_commit,
+};
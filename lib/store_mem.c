@@ -0,0 +1,603 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cblog_utils.h"
+#include "cblog_store.h"
+#include "cblog_search.h"
+#include "cblog_bloom.h"
+
+/*
+ * In-memory backend: posts are kept sorted by ctime, newest first, with
+ * an index by name and the list of posts of each tag. Opened with a path
+ * it loads that cdb database, otherwise it starts empty; commits only
+ * change the memory copy.
+ */
+
+struct mem_field {
+	char	*name;
+	char	*value;
+};
+
+struct mem_post {
+	char				*name;
+	time_t				ctime;
+	int					nfields;
+	struct mem_field	*fields;
+};
+
+struct mem_tag {
+	char	*name;
+	int		nposts;
+	int		npublished;	/* posts but the drafts */
+	int		*posts;		/* indexes in posts, newest first */
+};
+
+struct mem_store {
+	int					nposts;
+	struct mem_post		*posts;
+	int					nindexed;	/* posts covered by byname */
+	int					*byname;	/* indexes in posts sorted by name */
+	int					ntags;
+	struct mem_tag		*tags;		/* sorted by name */
+	int					nmeta;
+	struct mem_field	*meta;
+};
+
+/* a (tag, post) pair while building the tag lists */
+struct mem_posting {
+	const char	*tag;
+	int			post;
+};
+
+static struct mem_store	*sort_ctx;
+
+static void *
+mem_realloc(void *ptr, size_t nmemb, size_t size)
+{
+	if ((ptr = realloc(ptr, nmemb * size)) == NULL && nmemb > 0)
+		errx(1, "Unable to allocate memory");
+
+	return ptr;
+}
+
+static void
+mem_set(struct mem_field **fields, int *nfields, const char *name,
+    const char *value)
+{
+	int	i;
+
+	for (i = 0; i < *nfields; i++) {
+		if (strcmp((*fields)[i].name, name) == 0) {
+			free((*fields)[i].value);
+			(*fields)[i].value = strdup(value);
+			return;
+		}
+	}
+
+	*fields = mem_realloc(*fields, *nfields + 1, sizeof(struct mem_field));
+	(*fields)[*nfields].name = strdup(name);
+	(*fields)[*nfields].value = strdup(value);
+	(*nfields)++;
+}
+
+static const char *
+mem_value(struct mem_field *fields, int nfields, const char *name)
+{
+	int	i;
+
+	for (i = 0; i < nfields; i++) {
+		if (strcmp(fields[i].name, name) == 0)
+			return fields[i].value;
+	}
+
+	return NULL;
+}
+
+static int
+mem_cmp_field(const void *a, const void *b)
+{
+	return strcmp(((const struct mem_field *)a)->name,
+	    ((const struct mem_field *)b)->name);
+}
+
+static void
+mem_free_fields(struct mem_field *fields, int nfields)
+{
+	int	i;
+
+	for (i = 0; i < nfields; i++) {
+		free(fields[i].name);
+		free(fields[i].value);
+	}
+	free(fields);
+}
+
+static void
+mem_free_post(struct mem_post *post)
+{
+	free(post->name);
+	mem_free_fields(post->fields, post->nfields);
+}
+
+static void
+mem_free_tags(struct mem_store *mem)
+{
+	int	i;
+
+	for (i = 0; i < mem->ntags; i++) {
+		free(mem->tags[i].name);
+		free(mem->tags[i].posts);
+	}
+	free(mem->tags);
+	mem->tags = NULL;
+	mem->ntags = 0;
+}
+
+static int
+mem_cmp_ctime(const void *a, const void *b)
+{
+	const struct mem_post	*pa = a;
+	const struct mem_post	*pb = b;
+
+	if (pa->ctime != pb->ctime)
+		return pa->ctime < pb->ctime ? 1 : -1;
+
+	return strcmp(pa->name, pb->name);
+}
+
+static int
+mem_cmp_name(const void *a, const void *b)
+{
+	return strcmp(sort_ctx->posts[*(const int *)a].name,
+	    sort_ctx->posts[*(const int *)b].name);
+}
+
+static int
+mem_cmp_posting(const void *a, const void *b)
+{
+	const struct mem_posting	*pa = a;
+	const struct mem_posting	*pb = b;
+	int							ret;
+
+	if ((ret = strcasecmp(pa->tag, pb->tag)) != 0)
+		return ret;
+
+	return pa->post - pb->post;
+}
+
+/* index of the post named name, -1 if unknown */
+static int
+mem_lookup(struct mem_store *mem, const char *name)
+{
+	int	lo = 0, hi = mem->nindexed - 1, mid, ret;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		ret = strcmp(name, mem->posts[mem->byname[mid]].name);
+		if (ret == 0)
+			return mem->byname[mid];
+		if (ret < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+/* sort the posts again and rebuild the name index and the tag lists */
+static void
+mem_reindex(struct mem_store *mem)
+{
+	struct mem_posting	*postings = NULL;
+	struct mem_tag		*tag;
+	const char			*tags;
+	char				*list, *name;
+	int					i, j, k, post, nbel, npostings = 0;
+	size_t				next;
+
+	if (mem->nposts > 0)
+		qsort(mem->posts, mem->nposts, sizeof(struct mem_post), mem_cmp_ctime);
+
+	mem->byname = mem_realloc(mem->byname, mem->nposts, sizeof(int));
+	for (i = 0; i < mem->nposts; i++)
+		mem->byname[i] = i;
+	sort_ctx = mem;
+	if (mem->nposts > 0)
+		qsort(mem->byname, mem->nposts, sizeof(int), mem_cmp_name);
+	mem->nindexed = mem->nposts;
+
+	mem_free_tags(mem);
+	for (i = 0; i < mem->nposts; i++) {
+		tags = mem_value(mem->posts[i].fields, mem->posts[i].nfields, "tags");
+		if (tags == NULL)
+			continue;
+
+		list = name = strdup(tags);
+		nbel = splitchr(list, ',');
+		for (j = 0; j <= nbel; j++) {
+			next = strlen(name);
+			if (*trimspace(name) != '\0') {
+				postings = mem_realloc(postings, npostings + 1,
+				    sizeof(struct mem_posting));
+				postings[npostings].tag = strdup(trimspace(name));
+				postings[npostings++].post = i;
+			}
+			name += next + 1;
+		}
+		free(list);
+	}
+
+	if (npostings > 0)
+		qsort(postings, npostings, sizeof(struct mem_posting), mem_cmp_posting);
+
+	for (i = 0; i < npostings; i = j) {
+		for (j = i + 1; j < npostings &&
+		    strcasecmp(postings[i].tag, postings[j].tag) == 0; j++)
+			;
+
+		mem->tags = mem_realloc(mem->tags, mem->ntags + 1, sizeof(struct mem_tag));
+		tag = &mem->tags[mem->ntags++];
+		tag->name = strdup(postings[i].tag);
+		tag->nposts = tag->npublished = 0;
+		tag->posts = mem_realloc(NULL, j - i, sizeof(int));
+		for (k = i; k < j; k++) {
+			/* a post listing the same tag twice counts once */
+			post = postings[k].post;
+			if (tag->nposts > 0 && tag->posts[tag->nposts - 1] == post)
+				continue;
+			tag->posts[tag->nposts++] = post;
+			if (!store_post_draft(mem_value(mem->posts[post].fields,
+			    mem->posts[post].nfields, "published")))
+				tag->npublished++;
+		}
+	}
+
+	for (i = 0; i < npostings; i++)
+		free((char *)postings[i].tag);
+	free(postings);
+}
+
+static int
+memst_create(const char *path, bool sharded)
+{
+	return 0;
+}
+
+static int
+memst_open(struct store *st, const char *path)
+{
+	struct mem_store	*mem;
+	struct store		src;
+	int					ret = 0;
+
+	if ((mem = calloc(1, sizeof(struct mem_store))) == NULL)
+		return -1;
+	st->priv = mem;
+
+	if (path == NULL || *path == '\0')
+		return 0;
+
+	if (store_open(&src, &store_cdb, path) < 0) {
+		st->ops->close(st);
+		return -1;
+	}
+	if ((ret = store_copy(st, &src)) != 0 ||
+	    (ret = search_copy(st, &src)) != 0 ||
+	    (ret = bloom_copy(st, &src)) != 0)
+		st->ops->close(st);
+	store_close(&src);
+
+	return ret;
+}
+
+static void
+memst_close(struct store *st)
+{
+	struct mem_store	*mem = st->priv;
+	int					i;
+
+	for (i = 0; i < mem->nposts; i++)
+		mem_free_post(&mem->posts[i]);
+	free(mem->posts);
+	free(mem->byname);
+	mem_free_tags(mem);
+	mem_free_fields(mem->meta, mem->nmeta);
+	free(mem);
+}
+
+static int
+memst_find(struct store *st, const char *name, struct store_post *post)
+{
+	struct mem_store	*mem = st->priv;
+
+	post->name = name;
+	post->ctime = 0;
+	if ((post->part = mem_lookup(mem, name)) < 0)
+		return -1;
+
+	post->ctime = mem->posts[post->part].ctime;
+
+	return 0;
+}
+
+static char *
+memst_get(struct store *st, struct store_post *post, const char *field)
+{
+	struct mem_store	*mem = st->priv;
+	struct mem_post		*p;
+	const char			*val;
+
+	if (post->part < 0 || post->part >= mem->nposts ||
+	    strcmp(mem->posts[post->part].name, post->name) != 0)
+		post->part = mem_lookup(mem, post->name);
+
+	if (post->part < 0)
+		return NULL;
+
+	p = &mem->posts[post->part];
+	if ((val = mem_value(p->fields, p->nfields, field)) == NULL)
+		return NULL;
+
+	return strdup(val);
+}
+
+static char *
+memst_meta(struct store *st, const char *key)
+{
+	struct mem_store	*mem = st->priv;
+	struct mem_field	k, *f;
+
+	k.name = (char *)key;
+	if (mem->nmeta == 0 || (f = bsearch(&k, mem->meta, mem->nmeta,
+	    sizeof(struct mem_field), mem_cmp_field)) == NULL)
+		return NULL;
+
+	return strdup(f->value);
+}
+
+static int
+mem_call(struct mem_store *mem, int i, store_post_cb cb, void *arg)
+{
+	struct store_post	post;
+
+	post.name = mem->posts[i].name;
+	post.ctime = mem->posts[i].ctime;
+	post.part = i;
+
+	return cb(&post, arg);
+}
+
+static int
+memst_each(struct store *st, store_post_cb cb, void *arg)
+{
+	struct mem_store	*mem = st->priv;
+	int					i, ret;
+
+	for (i = 0; i < mem->nposts; i++) {
+		if ((ret = mem_call(mem, i, cb, arg)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+memst_range(struct store *st, time_t start, time_t end, store_post_cb cb,
+    void *arg)
+{
+	struct mem_store	*mem = st->priv;
+	int					lo = 0, hi = mem->nposts, mid, i, ret;
+
+	/* first post not newer than end */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (mem->posts[mid].ctime > end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < mem->nposts && mem->posts[i].ctime >= start; i++) {
+		if ((ret = mem_call(mem, i, cb, arg)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+memst_tagged(struct store *st, const char *tag, store_post_cb cb, void *arg)
+{
+	struct mem_store	*mem = st->priv;
+	int					lo = 0, hi = mem->ntags - 1, mid, i, cmp, ret;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if ((cmp = strcasecmp(tag, mem->tags[mid].name)) == 0) {
+			for (i = 0; i < mem->tags[mid].nposts; i++) {
+				ret = mem_call(mem, mem->tags[mid].posts[i], cb, arg);
+				if (ret != 0)
+					return ret;
+			}
+			return 0;
+		}
+		if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return 0;
+}
+
+static int
+memst_tags(struct store *st, store_tag_cb cb, void *arg)
+{
+	struct mem_store	*mem = st->priv;
+	int					i, ret;
+
+	for (i = 0; i < mem->ntags; i++) {
+		if (mem->tags[i].npublished == 0)
+			continue;
+		if ((ret = cb(mem->tags[i].name, mem->tags[i].npublished, arg)) != 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int
+mem_cmp_op(const void *a, const void *b)
+{
+	const struct store_op	*oa = *(const struct store_op **)a;
+	const struct store_op	*ob = *(const struct store_op **)b;
+	int						ret;
+
+	if ((ret = strcmp(oa->post, ob->post)) != 0)
+		return ret;
+
+	return oa < ob ? -1 : oa > ob;
+}
+
+static int
+mem_cmp_meta(const void *a, const void *b)
+{
+	const struct store_op	*oa = *(const struct store_op **)a;
+	const struct store_op	*ob = *(const struct store_op **)b;
+	int						ret;
+
+	if ((ret = strcmp(oa->field, ob->field)) != 0)
+		return ret;
+
+	return oa < ob ? -1 : oa > ob;
+}
+
+/*
+ * Set the database wide keys of batch. They are kept sorted by name, a
+ * search index having one per word.
+ */
+static void
+mem_commit_meta(struct mem_store *mem, struct store_batch *batch)
+{
+	struct store_op		**metas;
+	struct mem_field	key, *f;
+	int					i, n = 0, nsorted = mem->nmeta;
+
+	metas = mem_realloc(NULL, batch->nops, sizeof(struct store_op *));
+	for (i = 0; i < batch->nops; i++) {
+		if (batch->ops[i].type == STORE_META)
+			metas[n++] = &batch->ops[i];
+	}
+	if (n == 0) {
+		free(metas);
+		return;
+	}
+	qsort(metas, n, sizeof(struct store_op *), mem_cmp_meta);
+	mem->meta = mem_realloc(mem->meta, mem->nmeta + n, sizeof(struct mem_field));
+
+	for (i = 0; i < n; i++) {
+		/* the last value set wins */
+		if (i + 1 < n && strcmp(metas[i]->field, metas[i + 1]->field) == 0)
+			continue;
+
+		key.name = metas[i]->field;
+		f = nsorted > 0 ? bsearch(&key, mem->meta, nsorted,
+		    sizeof(struct mem_field), mem_cmp_field) : NULL;
+		if (f != NULL) {
+			free(f->value);
+			f->value = strdup(metas[i]->value);
+			continue;
+		}
+		mem->meta[mem->nmeta].name = strdup(metas[i]->field);
+		mem->meta[mem->nmeta++].value = strdup(metas[i]->value);
+	}
+	if (mem->nmeta > nsorted)
+		qsort(mem->meta, mem->nmeta, sizeof(struct mem_field), mem_cmp_field);
+	free(metas);
+}
+
+static int
+memst_commit(struct store *st, struct store_batch *batch)
+{
+	struct mem_store	*mem = st->priv;
+	struct store_op		**puts;
+	struct store_op		*op;
+	struct mem_post		*post = NULL;
+	int					i, n, nputs = 0;
+
+	mem_commit_meta(mem, batch);
+
+	/* deletions first, then the puts grouped by post */
+	for (i = 0; i < batch->nops; i++) {
+		op = &batch->ops[i];
+		if (op->type == STORE_DEL && (n = mem_lookup(mem, op->post)) >= 0 &&
+		    mem->posts[n].nfields >= 0)
+			mem->posts[n].nfields = -1 - mem->posts[n].nfields;
+		else if (op->type == STORE_PUT)
+			nputs++;
+	}
+
+	for (i = n = 0; i < mem->nposts; i++) {
+		if (mem->posts[i].nfields < 0) {
+			mem->posts[i].nfields = -1 - mem->posts[i].nfields;
+			mem_free_post(&mem->posts[i]);
+			continue;
+		}
+		mem->posts[n++] = mem->posts[i];
+	}
+	mem->nposts = n;
+	mem_reindex(mem);
+
+	puts = mem_realloc(NULL, nputs, sizeof(struct store_op *));
+	for (i = n = 0; i < batch->nops; i++) {
+		if (batch->ops[i].type == STORE_PUT)
+			puts[n++] = &batch->ops[i];
+	}
+	if (nputs > 0)
+		qsort(puts, nputs, sizeof(struct store_op *), mem_cmp_op);
+
+	/* new posts are appended, so that the name index stays valid */
+	n = mem->nposts;
+	for (i = 0; i < nputs; i++) {
+		op = puts[i];
+		if (i == 0 || strcmp(puts[i - 1]->post, op->post) != 0) {
+			if ((n = mem_lookup(mem, op->post)) < 0) {
+				mem->posts = mem_realloc(mem->posts, mem->nposts + 1,
+				    sizeof(struct mem_post));
+				n = mem->nposts++;
+				memset(&mem->posts[n], 0, sizeof(struct mem_post));
+				mem->posts[n].name = strdup(op->post);
+				mem->posts[n].ctime = time(NULL);
+			}
+			post = &mem->posts[n];
+		}
+
+		mem_set(&post->fields, &post->nfields, op->field, op->value);
+		if (EQUALS(op->field, "ctime"))
+			post->ctime = (time_t)strtoll(op->value, NULL, 10);
+	}
+	free(puts);
+
+	mem_reindex(mem);
+
+	return 0;
+}
+
+const struct store_ops store_mem = {
+	"memory",
+	memst_create,
+	memst_open,
+	memst_close,
+	memst_find,
+	memst_get,
+	memst_meta,
+	memst_each,
+	memst_range,
+	memst_tagged,
+	memst_tags,
+	memst_commit,
+};
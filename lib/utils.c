@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <ctype.h>
 
 int
 splitchr(char *str, char sep)
@@ -20,6 +21,23 @@ splitchr(char *str, char sep)
 	return nbel;
 }
 
+/* strip the leading and trailing spaces of str, which is modified */
+char *
+trimspace(char *str)
+{
+	char	*line = str;
+	size_t	len;
+
+	while (isspace((unsigned char)line[0]))
+		line++;
+
+	len = strlen(line);
+	while (len > 0 && isspace((unsigned char)line[len - 1]))
+		line[--len] = '\0';
+
+	return line;
+}
+
 void
 time_to_str(time_t source, const char *format, char *dest, size_t size)
 {
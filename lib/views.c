@@ -0,0 +1,322 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cblog_views.h"
+
+#define VIEWS_MAGIC		0x63626c76	/* "cblv" */
+
+struct views_header {
+	uint32_t	magic;		/* set once the table is loaded */
+	uint32_t	nslots;
+	int64_t		flushed;	/* last save, the process moving it saves */
+};
+
+/* 128 bytes, slots are claimed by setting key and never freed */
+struct views_slot {
+	uint64_t	key;		/* hash of the name, 0 when free */
+	uint64_t	count;
+	uint32_t	ready;		/* name is set */
+	char		name[VIEWS_NAME_MAX];
+};
+
+struct views {
+	struct views_header	*header;
+	struct views_slot	*slots;
+	char				path[MAXPATHLEN];
+	int					interval;
+	struct views		*next;
+};
+
+/* tables stay mapped until exit, the flusher thread walks them */
+static struct views		*tables;
+static pthread_mutex_t	tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t		flusher;
+static bool				flusher_started;
+
+static uint64_t
+views_hash(const char *name)
+{
+	uint64_t	h = 14695981039346656037ULL;
+
+	while (*name != '\0') {
+		h ^= (unsigned char)*name++;
+		h *= 1099511628211ULL;
+	}
+
+	return h ? h : 1;
+}
+
+static struct views_slot *
+views_slot(struct views *v, const char *name, bool create)
+{
+	struct views_slot	*slot;
+	uint64_t			h, key, expected;
+	uint32_t			i, n = v->header->nslots;
+
+	if (strlen(name) >= VIEWS_NAME_MAX)
+		return NULL;
+
+	h = views_hash(name);
+	for (i = 0; i < n; i++) {
+		slot = &v->slots[(h + i) % n];
+		key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if (key == h)
+			return slot;
+		if (key != 0)
+			continue;
+		if (!create)
+			return NULL;
+
+		expected = 0;
+		if (__atomic_compare_exchange_n(&slot->key, &expected, h, false,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			snprintf(slot->name, VIEWS_NAME_MAX, "%s", name);
+			__atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+			return slot;
+		}
+		if (expected == h)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/* read back the counts saved in path */
+static void
+views_load(struct views *v)
+{
+	struct views_slot	*slot;
+	FILE				*f;
+	char				line[VIEWS_NAME_MAX + 32], *name;
+	unsigned long long	count;
+
+	if ((f = fopen(v->path, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		count = strtoull(line, &name, 10);
+		if (*name++ != ' ')
+			continue;
+		if ((slot = views_slot(v, name, true)) != NULL)
+			slot->count = count;
+	}
+	fclose(f);
+}
+
+/*
+ * Save the table if interval seconds went by since the last save. Returns
+ * 1 if saved, 0 if not due or saved by another process, -1 on error.
+ */
+static int
+views_flush(struct views *v)
+{
+	struct views_slot	*slot;
+	FILE				*f;
+	char				tmp[MAXPATHLEN];
+	int64_t				last, now = time(NULL);
+	uint32_t			i;
+
+	last = __atomic_load_n(&v->header->flushed, __ATOMIC_RELAXED);
+	if (now - last < v->interval)
+		return 0;
+	if (!__atomic_compare_exchange_n(&v->header->flushed, &last, now, false,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", v->path, (int)getpid());
+	if ((f = fopen(tmp, "w")) == NULL)
+		return -1;
+
+	for (i = 0; i < v->header->nslots; i++) {
+		slot = &v->slots[i];
+		if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			continue;
+		fprintf(f, "%llu %s\n", (unsigned long long)
+		    __atomic_load_n(&slot->count, __ATOMIC_RELAXED), slot->name);
+	}
+
+	if (fclose(f) != 0 || rename(tmp, v->path) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 1;
+}
+
+static void *
+views_flusher(void *arg)
+{
+	struct views	*v;
+
+	for (;;) {
+		sleep(1);
+		for (v = __atomic_load_n(&tables, __ATOMIC_ACQUIRE); v != NULL; v = v->next)
+			views_flush(v);
+	}
+
+	return NULL;
+}
+
+/*
+ * Map the table of the counts saved in path, creating it with nslots
+ * slots if no process did, and save it every interval seconds
+ */
+struct views *
+views_open(const char *path, int nslots, int interval)
+{
+	struct views		*v;
+	struct stat			st;
+	char				shm[64];
+	size_t				size;
+	void				*map;
+	int					fd, tries;
+	bool				created = false;
+
+	pthread_mutex_lock(&tables_lock);
+	for (v = tables; v != NULL; v = v->next) {
+		if (strcmp(v->path, path) == 0) {
+			pthread_mutex_unlock(&tables_lock);
+			return v;
+		}
+	}
+
+	snprintf(shm, sizeof(shm), "/cblog-views-%016llx",
+	    (unsigned long long)views_hash(path));
+	size = sizeof(struct views_header) + nslots * sizeof(struct views_slot);
+
+	if ((fd = shm_open(shm, O_RDWR | O_CREAT | O_EXCL, 0600)) != -1) {
+		created = true;
+		if (ftruncate(fd, size) == -1) {
+			close(fd);
+			shm_unlink(shm);
+			fd = -1;
+		}
+	} else if (errno == EEXIST) {
+		fd = shm_open(shm, O_RDWR, 0600);
+	}
+
+	/* another process is creating it, wait for its size */
+	for (tries = 0; fd != -1 && !created; tries++) {
+		if (fstat(fd, &st) == -1 || tries == 100) {
+			close(fd);
+			fd = -1;
+		} else if ((size_t)st.st_size > sizeof(struct views_header)) {
+			size = st.st_size;
+			break;
+		} else
+			usleep(10000);
+	}
+
+	if (fd == -1 || (v = calloc(1, sizeof(struct views))) == NULL) {
+		if (fd != -1)
+			close(fd);
+		pthread_mutex_unlock(&tables_lock);
+		return NULL;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(v);
+		pthread_mutex_unlock(&tables_lock);
+		return NULL;
+	}
+
+	v->header = map;
+	v->slots = (struct views_slot *)(v->header + 1);
+	v->interval = interval > 0 ? interval : 1;
+	snprintf(v->path, sizeof(v->path), "%s", path);
+
+	if (created) {
+		v->header->nslots = nslots;
+		v->header->flushed = time(NULL);
+		views_load(v);
+		__atomic_store_n(&v->header->magic, VIEWS_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		for (tries = 0; tries < 100 &&
+		    __atomic_load_n(&v->header->magic, __ATOMIC_ACQUIRE) != VIEWS_MAGIC; tries++)
+			usleep(10000);
+		if (v->header->magic != VIEWS_MAGIC ||
+		    sizeof(struct views_header) + v->header->nslots *
+		    sizeof(struct views_slot) > size) {
+			munmap(map, size);
+			free(v);
+			pthread_mutex_unlock(&tables_lock);
+			return NULL;
+		}
+	}
+
+	v->next = tables;
+	__atomic_store_n(&tables, v, __ATOMIC_RELEASE);
+
+	if (!flusher_started &&
+	    pthread_create(&flusher, NULL, views_flusher, NULL) == 0) {
+		pthread_detach(flusher);
+		flusher_started = true;
+	}
+	pthread_mutex_unlock(&tables_lock);
+
+	return v;
+}
+
+void
+views_hit(struct views *v, const char *name)
+{
+	struct views_slot	*slot;
+
+	if ((slot = views_slot(v, name, true)) != NULL)
+		__atomic_fetch_add(&slot->count, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+views_count(struct views *v, const char *name)
+{
+	struct views_slot	*slot;
+
+	if ((slot = views_slot(v, name, false)) == NULL)
+		return 0;
+
+	return __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+}
+
+/* the n most viewed posts in out, most viewed first, returns their number */
+int
+views_top(struct views *v, struct views_entry *out, int n)
+{
+	struct views_slot	*slot;
+	uint64_t			count;
+	uint32_t			i;
+	int					j, nout = 0;
+
+	for (i = 0; i < v->header->nslots; i++) {
+		slot = &v->slots[i];
+		if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE))
+			continue;
+		if ((count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED)) == 0)
+			continue;
+
+		for (j = nout; j > 0 && out[j - 1].count < count; j--) {
+			if (j < n)
+				out[j] = out[j - 1];
+		}
+		if (j < n) {
+			snprintf(out[j].name, VIEWS_NAME_MAX, "%s", slot->name);
+			out[j].count = count;
+			if (nout < n)
+				nout++;
+		}
+	}
+
+	return nout;
+}
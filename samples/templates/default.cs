@@ -19,8 +19,17 @@
 <a href="<?cs var:url ?>"><?cs var:title ?></a> 
 </div>
 <div id="menu">
+<form method="get" action="<?cs var:root ?>/search"><p><input type="text" name="q" value="<?cs var:html_escape(Query.q) ?>" /></p></form>
 <div class="menutitle">TAGS</div>
 <p class="tagcloud"><?cs each:tag = Tags ?><a href="<?cs var:root ?>/tag/<?cs var:tag.name ?>" rel="tag" style="white-space: nowrap;font-size: <?cs set:num = #79 + #5 * #tag.count ?><?cs var:num ?>%;"> <?cs var:tag.name ?></a> <?cs /each ?></p>
+<?cs if:subcount(Popular) ?>
+<div class="menutitle">Les plus lus</div>
+<ul><?cs each:popular = Popular ?><li><a href="<?cs var:root ?>/post/<?cs var:popular.name ?>"><?cs var:popular.title ?></a> (<?cs var:popular.views ?>)</li><?cs /each ?></ul>
+<?cs /if ?>
+<?cs if:subcount(Archives) ?>
+<div class="menutitle"><a href="<?cs var:root ?>/archives">Archives</a></div>
+<ul><?cs each:year = Archives ?><li><a href="<?cs var:root ?>/<?cs var:year.year ?>"><?cs var:year.year ?></a> (<?cs var:year.count ?>)</li><?cs /each ?></ul>
+<?cs /if ?>
 <div class="menutitle">flux</div>
 <ul>
 <li class="syndicate"><a class="feed" href="<?cs var:CGI.ScriptName ?>?feed=rss">RSS 2.0</a></li>
@@ -43,6 +52,13 @@
 </div><!-- div id menu -->
 <div id="content">
 <?cs if:err_msg ?><h1 class="error">Error: <?cs var:err_msg ?></h1><hr /><?cs /if ?>
+<?cs if:Search.count ?><h1>Search: <?cs var:html_escape(Query.q) ?> (<?cs var:Search.count ?>)</h1><hr /><?cs /if ?>
+<?cs if:archives_page ?>
+<?cs each:year = Archives ?>
+<h2 class="storytitle"><a href="<?cs var:root ?>/<?cs var:year.year ?>"><?cs var:year.year ?></a> (<?cs var:year.count ?>)</h2>
+<ul><?cs each:month = year.months ?><li><a href="<?cs var:root ?>/<?cs var:year.year ?>/<?cs var:month.month ?>"><?cs var:year.year ?>/<?cs var:month.month ?></a> (<?cs var:month.count ?>)</li><?cs /each ?></ul>
+<?cs /each ?>
+<?cs /if ?>
 <?cs each:post = Posts ?>
 <div class="date"><?cs var:post.date ?></div>
 <!--<h2 class="storytitle"><a href="<?cs var:root ?>/post/<?cs var:string.slice(post.filename,0,string.find(post.filename,".txt")) ?>"><?cs var:post.title ?></a></h2>-->
@@ -51,6 +67,15 @@
 <?cs if:Query.source ?><pre><?cs var:post.source ?></pre><?cs else ?><?cs var:post.html ?><?cs /if ?>
 <div class="comments"><a href="<?cs var:root ?>/post/<?cs var:post.filename ?>#comments"><?cs alt:post.nb_comments ?>0<?cs /alt ?> commentaire(s)</a></div>
 <?cs if:subcount(Posts) == 1 ?>
+<?cs if:post.prev.name || post.next.name ?>
+<div class="navigation"><?cs if:post.prev.name ?><a href="<?cs var:root ?>/post/<?cs var:post.prev.name ?>" rel="prev">&laquo; <?cs var:post.prev.title ?></a><?cs /if ?>
+<?cs if:post.next.name ?><a href="<?cs var:root ?>/post/<?cs var:post.next.name ?>" rel="next"><?cs var:post.next.title ?> &raquo;</a><?cs /if ?></div>
+<?cs /if ?>
+<?cs if:subcount(post.related) ?>
+<div class="related">Sur le même sujet :<ul>
+<?cs each:related = post.related ?><li><a href="<?cs var:root ?>/post/<?cs var:related.name ?>"><?cs var:related.title ?></a></li><?cs /each ?>
+</ul></div>
+<?cs /if ?>
 <p id="comments" class="separator-story" />
 <?cs each:comment = post.comments ?>
 <?cs if:comment.url ?><a href="<?cs var:comment.url ?>"><?cs /if ?><?cs var:comment.author ?><?cs if:comment.url ?></a><?cs /if ?> a écrit le <?cs var:comment.date ?> : <br />
@@ -80,7 +105,7 @@ No comments allowed
 <?cs if:subcount(Posts) != 1 ?>
 <div class="paging">
 <?cs if:nbpages ?>
-<p>Page<?cs if:(#nbpages >= 0) ?>s<?cs /if ?> : <?cs if:Query.page ?><?cs set:page = Query.page ?><?cs else ?><?cs set:page = #1 ?><?cs /if ?><?cs loop:x = #1, #nbpages, #1 ?> <?cs if:(#page == #x) ?><strong><?cs var:x ?></strong><?cs else ?> <a href="<?cs var:string.slice(CGI.RequestURI,0,string.find(CGI.RequestURI,"?")+1) ?>?page=<?cs var:x ?>"><?cs var:x ?></a><?cs /if ?><?cs /loop ?></p>
+<p>Page<?cs if:(#nbpages >= 0) ?>s<?cs /if ?> : <?cs if:Query.page ?><?cs set:page = Query.page ?><?cs else ?><?cs set:page = #1 ?><?cs /if ?><?cs loop:x = #1, #nbpages, #1 ?> <?cs if:(#page == #x) ?><strong><?cs var:x ?></strong><?cs else ?> <a href="<?cs var:string.slice(CGI.RequestURI,0,string.find(CGI.RequestURI,"?")+1) ?>?page=<?cs var:x ?><?cs if:Query.q ?>&amp;q=<?cs var:url_escape(Query.q) ?><?cs /if ?>"><?cs var:x ?></a><?cs /if ?><?cs /loop ?></p>
 <?cs /if ?>
 </div>
 <?cs /if ?>